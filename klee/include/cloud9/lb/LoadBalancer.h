@@ -76,6 +76,13 @@ private:
       std::map<worker_id_t, transfer_t> &xfers, unsigned balanceThreshold,
       unsigned minTransfer);
   void analyzeAggregateBalance();
+  void getClusterHomes(
+      std::map<uint64_t, std::pair<worker_id_t, uint64_t> > &homes);
+  void convertWeightedTransfers(std::map<worker_id_t, transfer_t> &xfers,
+      std::map<worker_id_t, std::vector<uint64_t> > &xferClusters);
+  void addColocationTransfers(std::map<worker_id_t, unsigned> &load,
+      std::map<worker_id_t, transfer_t> &xfers,
+      std::map<worker_id_t, std::vector<uint64_t> > &xferClusters);
   bool analyzePartitionBalance();
 
   void displayStatistics();
@@ -109,6 +116,9 @@ public:
 
   void updatePartitioningData(worker_id_t id, const part_stat_t &stats);
 
+  void updateWorkerLoad(worker_id_t id, uint64_t paths,
+      const cluster_stat_t &clusters);
+
   Worker* getWorker(worker_id_t id) {
     std::map<worker_id_t, Worker*>::iterator it = workers.find(id);
     if (it == workers.end())
@@ -128,7 +138,7 @@ public:
   void getAndResetCoverageUpdates(worker_id_t id, cov_update_t &data);
 
   bool requestAndResetTransfer(worker_id_t id, transfer_t &globalTrans,
-      part_transfers_t &partTrans);
+      part_transfers_t &partTrans, std::vector<uint64_t> &clusters);
 };
 
 }
@@ -37,6 +37,7 @@
 
 #include <vector>
 #include <map>
+#include <stdint.h>
 
 namespace cloud9 {
 
@@ -46,6 +47,8 @@ typedef unsigned int worker_id_t;
 typedef unsigned int part_id_t;
 
 typedef std::map<part_id_t, std::pair<unsigned, unsigned> > part_stat_t;
+// Merge index -> (jobs, paths)
+typedef std::map<uint64_t, std::pair<unsigned, uint64_t> > cluster_stat_t;
 
 typedef std::pair<worker_id_t, unsigned> transfer_t;
 typedef std::map<part_id_t, transfer_t> part_transfers_t;
@@ -67,6 +70,11 @@ private:
 
   unsigned int totalJobs;
 
+  // The paths the jobs stand for, counting merged states as many
+  bool hasLoadData;
+  uint64_t totalPaths;
+  cluster_stat_t mergeClusters;
+
   part_stat_t statePartitions;
   std::set<part_id_t> activePartitions;
 
@@ -75,9 +83,11 @@ private:
   bool transferReq;
   transfer_t globalTransfer;
   part_transfers_t partTransfers;
+  std::vector<uint64_t> transferClusters;
 
   Worker() : _wantsUpdates(false), _hasPartitions(false), nodesRevision(1),
-      totalJobs(0), lastReportTime(0), transferReq(false) {
+      totalJobs(0), hasLoadData(false), totalPaths(0), lastReportTime(0),
+      transferReq(false) {
   }
 public:
   virtual ~Worker() {
@@ -72,6 +72,7 @@ private:
   bool processNodeDataUpdate(const WorkerReportMessage &message);
   bool processStatisticsUpdates(const WorkerReportMessage &message);
   bool processPartitionUpdates(const WorkerReportMessage &message);
+  bool processLoadUpdate(const WorkerReportMessage &message);
 
   void sendJobTransfers(LBResponseMessage &response);
   void sendStatisticsUpdates(LBResponseMessage &response);
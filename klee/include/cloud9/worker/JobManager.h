@@ -45,6 +45,7 @@
 
 #include <boost/thread.hpp>
 #include <list>
+#include <map>
 #include <set>
 #include <string>
 
@@ -68,12 +69,15 @@ class SymbolicState;
 class ExecutionJob;
 class OracleStrategy;
 
+// Merge index -> (jobs, paths)
+typedef std::map<uint64_t, std::pair<unsigned, uint64_t> > merge_clusters_t;
+
 class JobManager: public StateEventHandler {
 private:
   /***************************************************************************
    * Initialization
    **************************************************************************/
-  void initialize(llvm::Module *module, llvm::Function *mainFn, int argc,
+  void initialize(klee::KModule *kmodule, std::string mainFnName, int argc,
       char **argv, char **envp);
 
   void initKlee();
@@ -121,6 +125,23 @@ private:
   std::set<SymbolicState*> pendingDeletions;
   std::set<WorkerTree::NodePin> zombieNodes;
 
+  // The executor thread steps states without holding the jobs lock. Job
+  // exports and load reports, which read states, wait for the step to
+  // finish and hold off the next one.
+  bool stepping;
+  unsigned int pauseRequests;
+  boost::condition_variable stepDone;
+
+  void pauseStepping(boost::unique_lock<boost::mutex> &lock) {
+    pauseRequests++;
+    while (stepping)
+      stepDone.wait(lock);
+  }
+  void resumeStepping() {
+    pauseRequests--;
+    stepDone.notify_all();
+  }
+
   /*
    * Statistics
    */
@@ -203,6 +224,9 @@ private:
 
   void runJobReconstruction(boost::unique_lock<boost::mutex> &lock,
       JobReconstruction* job);
+  bool adoptJobState(JobReconstruction *job);
+  void exportJobStates(std::vector<ExecutionJob*> &jobs,
+      std::map<WorkerTree::Node*, JobReconstruction*> &nodeReconMap);
 
   void processLoop(bool allowGrowth, bool blocking, unsigned int timeOut);
 
@@ -211,6 +235,9 @@ private:
 
   void selectJobs(WorkerTree::Node *root, std::vector<ExecutionJob*> &jobSet,
       int maxCount);
+  void selectClusteredJobs(WorkerTree::Node *root,
+      std::vector<ExecutionJob*> &jobSet, int maxCount,
+      const std::set<uint64_t> &preferred);
 
   unsigned int countJobs(WorkerTree::Node *root);
 
@@ -230,7 +257,11 @@ private:
   void setCodeBreakpoint(int assemblyLine);
   void setPathBreakpoint(ExecutionPathPin path);
 public:
-  JobManager(llvm::Module *module, std::string mainFnName, int argc,
+  /// Prepare \a module for the job manager to execute. This can be done
+  /// before forking workers, which then share the prepared module.
+  static klee::KModule *prepareModule(llvm::Module *module);
+
+  JobManager(klee::KModule *kmodule, std::string mainFnName, int argc,
       char **argv, char **envp);
   virtual ~JobManager();
 
@@ -286,6 +317,8 @@ public:
 
   void getStatisticsData(std::vector<int> &data, ExecutionPathSetPin &paths,
       bool onlyChanged);
+  void getLoadData(uint64_t &paths, merge_clusters_t &clusters,
+      unsigned maxClusters);
 
   unsigned int getJobCount() const { return jobCount; }
 
@@ -313,9 +346,12 @@ public:
   void importJobs(ExecutionPathSetPin paths,
       std::map<unsigned,JobReconstruction*> &reconstruct);
 
+  // If mergeIndexes is set, jobs are exported by merge cluster, starting
+  // with the given clusters
   ExecutionPathSetPin exportJobs(ExecutionPathSetPin seeds,
       std::vector<int> &counts,
-      std::map<unsigned,JobReconstruction*> &reconstruct);
+      std::map<unsigned,JobReconstruction*> &reconstruct,
+      const std::set<uint64_t> *mergeIndexes = NULL);
 
   void dumpStateTrace(WorkerTree::Node *node);
   void dumpInstructionTrace(WorkerTree::Node *node);
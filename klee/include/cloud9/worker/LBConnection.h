@@ -61,7 +61,8 @@ private:
 	void transferJobs(std::string &destAddr, int destPort,
 			ExecutionPathSetPin paths,
 			std::vector<int> counts,
-			part_select_t &partHints);
+			part_select_t &partHints,
+			const std::set<uint64_t> *mergeIndexes);
 
 	PartitioningStrategy *getPartitioningStrategy();
 
@@ -70,6 +71,7 @@ private:
 	void updateLogPrefix();
 
 	void sendJobStatistics(WorkerReportMessage &message);
+	void sendLoadStatistics(WorkerReportMessage &message);
 	void sendCoverageUpdates(WorkerReportMessage &message);
 	void sendPartitionStatistics(WorkerReportMessage &message);
 
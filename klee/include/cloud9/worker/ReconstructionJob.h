@@ -11,8 +11,16 @@
 #include "cloud9/worker/TreeNodeInfo.h"
 #include "cloud9/ExecutionPath.h"
 
+#include <boost/shared_ptr.hpp>
+
 #include <list>
 #include <map>
+#include <string>
+#include <vector>
+
+namespace klee {
+class ExecutionState;
+}
 
 namespace cloud9 {
 
@@ -46,13 +54,33 @@ struct ReconstructionTask {
       node2(WORKER_LAYER_SKELETON), node2index(_node2index) { }
 };
 
+/*
+ * The encoded states of a job transfer, shared by the jobs they belong to.
+ * The states are decoded when the first job needs them, and each job
+ * claims its own state. States nobody claims are deleted with the bundle.
+ */
+struct StateBundle {
+  std::string data;
+  bool decoded;
+  std::vector<klee::ExecutionState*> states;
+
+  StateBundle() : decoded(false) { }
+  ~StateBundle();
+};
+
 class JobReconstruction {
 public:
-  JobReconstruction() { };
+  JobReconstruction() : stateIndex(0), instrSinceFork(0) { };
   virtual ~JobReconstruction() { };
 
   std::list<ReconstructionTask> tasks;
 
+  // If set, the job state is transferred and the tasks are only used if it
+  // cannot be decoded
+  boost::shared_ptr<StateBundle> stateBundle;
+  unsigned stateIndex;
+  unsigned long instrSinceFork;
+
   void appendNodes(std::set<WorkerTree::Node*> &nodes) {
     for (std::list<ReconstructionTask>::iterator it = tasks.begin();
         it != tasks.end(); it++) {
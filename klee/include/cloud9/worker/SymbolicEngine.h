@@ -37,6 +37,7 @@
 
 #include <set>
 #include <string>
+#include <vector>
 
 namespace klee {
 class ExecutionState;
@@ -125,6 +126,17 @@ public:
 	virtual klee::ExecutionState* merge(klee::ExecutionState &current,
 	    klee::ExecutionState &other) = 0;
 
+	/// Encode the given states, so that another engine running the same
+	/// module can resume them. Return false if they cannot be encoded.
+	virtual bool serializeStates(const std::vector<klee::ExecutionState*> &states,
+	    std::string &data) = 0;
+	/// Decode states encoded by serializeStates(). The states are not part
+	/// of the engine until adopted.
+	virtual bool deserializeStates(const std::string &data,
+	    std::vector<klee::ExecutionState*> &states) = 0;
+	/// Make a decoded state part of the engine, as if it had been forked.
+	virtual void adoptState(klee::ExecutionState *state) = 0;
+
 	void registerStateEventHandler(StateEventHandler *handler);
 	void deregisterStateEventHandler(StateEventHandler *handler);
 
@@ -41,6 +41,7 @@
 namespace klee {
 
 class AddressPool {
+  friend class StateSerializer;
 private:
   uint64_t startAddress;
   uint64_t size;
@@ -11,7 +11,11 @@
 #define KLEE_CONSTRAINTS_H
 
 #include "klee/Expr.h"
-#include <map>
+#include "klee/Internal/ADT/ImmutableMap.h"
+#include "klee/Internal/ADT/PersistentList.h"
+
+#include <climits>
+#include <pthread.h>
 
 // FIXME: Currently we use ConstraintManager for two things: to pass
 // sets of constraints around, and to optimize constraints. We should
@@ -24,20 +28,34 @@ class ExprVisitor;
 class ConstraintManager {
 public:
   typedef std::vector< ref<Expr> > constraints_ty;
-  typedef constraints_ty::iterator iterator;
-  typedef constraints_ty::const_iterator const_iterator;
 
-  ConstraintManager() {}
+  // Constraints are kept in a persistent list, so that copies of a
+  // constraint manager (e.g., in forked states) share their common prefix
+  typedef PersistentList< ref<Expr>,
+                          AccountingAllocator<ref<Expr>,
+                                              MemoryAccounting::Constraints> >
+    constraint_list_ty;
+  typedef constraint_list_ty::iterator iterator;
+  typedef constraint_list_ty::iterator const_iterator;
+
+  ConstraintManager() : hashValue(hashInit()), hashStale(false) {}
 
   // create from constraints with no optimization
   explicit
   ConstraintManager(const std::vector< ref<Expr> > &_constraints);
 
+  // create from a list, sharing it, with no optimization
+  explicit
+  ConstraintManager(const constraint_list_ty &_constraints);
+
   ConstraintManager(const ConstraintManager &cs)
       : constraints(cs.constraints),
-        ranges(cs.ranges) {}
+        ranges(cs.ranges),
+        solverCache(cs.solverCache),
+        hashValue(cs.hashValue),
+        hashStale(false) {}
 
-  typedef std::vector< ref<Expr> >::const_iterator constraint_iterator;
+  typedef constraint_list_ty::iterator constraint_iterator;
 
   // given a constraint which is known to be valid, attempt to 
   // simplify the existing constraint set
@@ -72,9 +90,76 @@ public:
   bool operator==(const ConstraintManager &other) const {
     return constraints == other.constraints;
   }
+
+  /// Return the number of leading constraints shared with \a other. This
+  /// only compares the underlying lists by identity, so it is cheap.
+  size_t commonPrefix(const ConstraintManager &other) const {
+    return constraints.commonPrefix(other.constraints);
+  }
+
+  /// Drop all but the first \a n constraints.
+  void truncate(size_t n);
+
+  /// Return a hash of the constraints, in order. It is updated as
+  /// constraints get appended, so it comes for free.
+  uint64_t hash() const {
+    return hashValue;
+  }
+
+  /// The underlying list, which is cheap to copy (e.g., to key a cache).
+  const constraint_list_ty &getList() const {
+    return constraints;
+  }
+
+  /// Data a solver derives from the constraints and keeps across queries,
+  /// i.e., the independence partition. Copies of the manager share it.
+  class SolverCache {
+  public:
+    uint32_t refCount;
+    /// The constraints the cache was computed for.
+    constraint_list_ty constraints;
+
+    SolverCache() : refCount(0) {}
+    virtual ~SolverCache() {}
+  };
+
+  /// Serializes the solvers that bring solver caches up to date and read
+  /// them, which may run on several threads over the same manager (e.g.,
+  /// the chains of a parallel solver). It must be held around
+  /// getSolverCache(), setSolverCache() and every use of the cache.
+  class SolverCacheLock {
+    static pthread_mutex_t mutex;
+
+  public:
+    SolverCacheLock() { pthread_mutex_lock(&mutex); }
+    ~SolverCacheLock() { pthread_mutex_unlock(&mutex); }
+  };
+
+  /// Return the attached solver cache, if any, and set \a covered to the
+  /// number of leading constraints it still describes.
+  SolverCache *getSolverCache(size_t &covered) const {
+    if (solverCache.isNull())
+      return 0;
+    covered = constraints.commonPrefix(solverCache->constraints);
+    return solverCache.get();
+  }
+
+  /// Attach \a cache, which must describe the current constraints. The
+  /// manager may be shared between threads, so this must hold a
+  /// SolverCacheLock.
+  void setSolverCache(SolverCache *cache) const {
+    cache->constraints = constraints;
+    solverCache = cache;
+  }
+
+  /// Detach the solver cache, so that this copy no longer shares it with
+  /// the manager it was copied from.
+  void clearSolverCache() {
+    solverCache = 0;
+  }
   
 private:
-  std::vector< ref<Expr> > constraints;
+  constraint_list_ty constraints;
 
 public:
 
@@ -142,16 +227,28 @@ public:
     bool operator!=(const SRange& o) { return !(*this == o); }
   };
 
-  typedef std::map<ref<Expr>, SRange> ranges_ty;
+  typedef ImmutableMap<ref<Expr>, SRange> ranges_ty;
 
   ConstraintManager(const constraints_ty &_constraints,
                     const ranges_ty &_ranges)
-    : constraints(_constraints),
-      ranges(_ranges) {}
+    : constraints(_constraints.begin(), _constraints.end()),
+      ranges(_ranges) {
+    rehash();
+  }
 
   ranges_ty ranges;
 
 private:
+  mutable ref<SolverCache> solverCache;
+
+  uint64_t hashValue;
+  // Set while existing constraints are rewritten, which invalidates the
+  // incremental hash until the next rehash()
+  bool hashStale;
+
+  void pushConstraint(ref<Expr> e);
+  void rehash();
+
   // returns true iff the constraints were modified
   bool rewriteConstraints(ExprVisitor &visitor, bool canBeFalse, bool *ok);
 
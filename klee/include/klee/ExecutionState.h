@@ -12,6 +12,7 @@
 
 #include "klee/Constraints.h"
 #include "klee/Expr.h"
+#include "klee/Internal/ADT/CoverageBitmap.h"
 #include "klee/Internal/ADT/TreeStream.h"
 
 // FIXME: We do not want to be exposing these? :(
@@ -106,6 +107,7 @@ struct StackFrame {
 
 class ExecutionState {
 	friend class ObjectState;
+	friend class StateSerializer;
 
 public:
   typedef std::vector<StackFrame> stack_ty;
@@ -124,6 +126,9 @@ private:
   void setupMain(KFunction *kf);
   void setupTime();
   void setupAddressPool();
+
+  // Used by StateSerializer, which sets up the threads and processes
+  explicit ExecutionState(Executor *_executor);
 public:
   /* System-level parameters */
   Executor *executor;
@@ -152,12 +157,20 @@ public:
   bool coveredNew;
   sys::TimeValue lastCoveredTime;
 
+  /// The instruction count when the state last ran, to spill the coldest
+  /// states first at the memory cap.
+  uint64_t lastRunInstruction;
+  /// Whether the address spaces and constraints are in the spill file.
+  bool spilled;
+
   void setCoveredNew() {
 	  coveredNew = true;
 	  lastCoveredTime = sys::TimeValue::now();
   }
 
-  std::map<const std::string*, std::set<unsigned> > coveredLines;
+  /// The instructions this state was the first to cover, by their
+  /// InstructionInfo id.
+  CoverageBitmap coveredInstructions;
 
   PTreeNode *ptreeNode;
 
@@ -168,7 +181,7 @@ public:
   /// ordered list of symbolics: used to generate test cases. 
   //
   // FIXME: Move to a shared list structure (not critical).
-  std::vector< std::pair<const MemoryObject*, const Array*> > symbolics;
+  std::vector< std::pair<ref<const MemoryObject>, const Array*> > symbolics;
   uint64_t symbolicsHash;
 
   ConstraintManager globalConstraints;
@@ -257,11 +270,25 @@ public:
   bool isPCCompatible(const ExecutionState &b) const;
   bool areQCEMemoryTrackMapsCompatible(const ExecutionState &b) const;
 
+  /// Return a hash of the state parts that must be identical for two
+  /// states to merge: the symbolics, the call stacks, the sets of bound
+  /// objects and the QCE track hashes. It is assembled from hashes that are
+  /// maintained incrementally, so states with different fingerprints can
+  /// be rejected without running the full compatibility checks.
+  uint64_t getMergeFingerprint() const;
+
+  /// Return the heap bytes held by the QCE maps of the stack frames and
+  /// of the memory track maps of all threads.
+  size_t getQCEMapsFootprint() const;
+
   /* Duplicate states management */
   std::set<ExecutionState*> duplicates;
   bool isDuplicate;
 
-  const MemoryObject* lastResolveResult;
+  /// The object the last memory access of the current instruction
+  /// resolved to, held so that it cannot be confused with a later object
+  /// at the same address.
+  ref<const MemoryObject> lastResolveResult;
 
 public:
   ExecutionState(Executor *_executor, KFunction *kf);
@@ -285,9 +312,9 @@ public:
 
   void popFrame(Thread &t) {
     StackFrame &sf = t.stack.back();
-    for (std::vector<const MemoryObject*>::iterator it = sf.allocas.begin(),
-           ie = sf.allocas.end(); it != ie; ++it) {
-      processes.find(t.getPid())->second.addressSpace.unbindObject(*it);
+    for (std::vector< ref<const MemoryObject> >::iterator
+           it = sf.allocas.begin(), ie = sf.allocas.end(); it != ie; ++it) {
+      processes.find(t.getPid())->second.addressSpace.unbindObject(it->get());
     }
     t.stack.pop_back();
     t.topoIndex.pop_back();
@@ -296,10 +323,7 @@ public:
     popFrame(crtThread());
   }
 
-  void addSymbolic(const MemoryObject *mo, const Array *array) { 
-    symbolics.push_back(std::make_pair(mo, array));
-    symbolicsHash = hashUpdate(symbolicsHash, (uintptr_t) mo);
-  }
+  void addSymbolic(const MemoryObject *mo, const Array *array);
   void addConstraint(ref<Expr> e) { 
     constraints().addConstraint(e);
   }
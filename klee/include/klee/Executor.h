@@ -31,6 +31,8 @@
 #include <map>
 #include <set>
 
+#include <pthread.h>
+
 //#define VERIFY_QCE_MAPS
 
 struct KTest;
@@ -68,6 +70,8 @@ namespace klee {
   class SeedInfo;
   class SpecialFunctionHandler;
   struct StackFrame;
+  class StateSerializer;
+  class StateSpiller;
   class StatsTracker;
   class TimingSolver;
   class Solver;
@@ -90,6 +94,7 @@ class Executor : public Interpreter, public ::cloud9::worker::SymbolicEngine {
   friend class ForkCapSearcher;
   friend class SpecialFunctionHandler;
   friend class StatsTracker;
+  friend class StateSerializer;
 
   friend class ObjectState;
 
@@ -115,6 +120,11 @@ private:
   ExternalDispatcher *externalDispatcher;
   TimingSolver *solver;
   std::vector<Solver*> loggingSolvers;
+
+  /// Idle solvers for solving snapshots, off the interpreter thread. They
+  /// only use forked STP, so any number of them can run concurrently.
+  std::vector<Solver*> snapshotSolvers;
+  pthread_mutex_t snapshotSolversLock;
   MemoryManager *memory;
   std::set<ExecutionState*> states;
   StatsTracker *statsTracker;
@@ -122,6 +132,10 @@ private:
   SpecialFunctionHandler *specialFunctionHandler;
   std::vector<TimerInfo*> timers;
   PTree *processTree;
+  /// Created on first use, only Cloud9 workers move states around.
+  StateSerializer *stateSerializer;
+  /// Created when states are first spilled at the memory cap.
+  StateSpiller *stateSpiller;
 
   /// Used to track states that have been added during the current
   /// instructions step. 
@@ -221,7 +235,7 @@ private:
                           const MemoryObject *mo, KInstruction *ki = NULL);
 
   bool modifyQceMemoryTrackMap(ExecutionState &state, const HotValue &hotValue,
-                               int vnumber, bool inVhAdd,
+                               QCEFrameInfo &frame, int vnumber, bool inVhAdd,
                                const char *reason = NULL,
                                KInstruction *ki = NULL);
 
@@ -413,6 +427,14 @@ private:
   /// Get textual information regarding a memory address.
   std::string getAddressInfo(ExecutionState &state, ref<Expr> address) const;
 
+  /// Move the memory of the coldest states to disk, to get from \a mbs
+  /// back under the memory cap. Return the number of bytes this freed,
+  /// which leaves out what the spilled states shared with the others.
+  uint64_t spillColdStates(ExecutionState *current, unsigned mbs);
+
+  /// Bring back the memory of \a state if it was spilled.
+  void restoreSpilledState(ExecutionState &state);
+
   // remove state from queue and delete
   bool terminateState(ExecutionState &state, bool silenced);
   // call exit handler and terminate state
@@ -524,6 +546,8 @@ public:
 
   virtual const llvm::Module *
   setModule(llvm::Module *module, const ModuleOptions &opts);
+
+  virtual const llvm::Module *setModule(KModule *kmodule);
   
   const KModule* getKModule() const {return kmodule;} 
 
@@ -562,6 +586,15 @@ public:
                                    std::vector<unsigned char> > >
                                    &res);
 
+  virtual void getSymbolicSnapshot(const ExecutionState &state,
+                                   SymbolicSnapshot &res);
+
+  virtual bool getSymbolicSolution(const SymbolicSnapshot &snapshot,
+                                   std::vector< 
+                                   std::pair<std::string,
+                                   std::vector<unsigned char> > >
+                                   &res);
+
   virtual void getCoveredLines(const ExecutionState &state,
                                std::map<const std::string*, std::set<unsigned> > &res);
 
@@ -586,6 +619,14 @@ public:
 
   virtual ExecutionState* merge(ExecutionState &current, ExecutionState &other);
 
+  virtual bool serializeStates(const std::vector<ExecutionState*> &states,
+                               std::string &data);
+
+  virtual bool deserializeStates(const std::string &data,
+                                 std::vector<ExecutionState*> &states);
+
+  virtual void adoptState(ExecutionState *state);
+
   //Hack for dynamic cast in CoreStrategies, TODO Solve it as soon as possible
   static bool classof(const SymbolicEngine* engine){ return true; }
 };
@@ -12,6 +12,7 @@
 
 #include "klee/util/Bits.h"
 #include "klee/util/Ref.h"
+#include "klee/Internal/Support/MemoryAccounting.h"
 
 #include "llvm/ADT/APInt.h"
 #include "llvm/ADT/APFloat.h"
@@ -136,6 +137,12 @@ Todo: Shouldn't bool \c Xor just be written as not equal?
 class Expr {
 public:
   static unsigned count;
+
+  /// Share structurally equal expressions (hash-consing), so that they
+  /// are also pointer-equal. Set by -hash-cons-exprs; it must not change
+  /// while expressions built with it enabled are alive.
+  static bool hashConsing;
+
   static const unsigned MAGIC_HASH_CONSTANT = 39;
 
   /// The type of an expression is simply its width, in bits. 
@@ -223,7 +230,16 @@ protected:
   
 public:
   Expr() : refCount(0) { Expr::count++; }
-  virtual ~Expr() { Expr::count--; } 
+  virtual ~Expr();
+
+  static void *operator new(size_t size) {
+    MemoryAccounting::allocate(MemoryAccounting::Exprs, size);
+    return ::operator new(size);
+  }
+  static void operator delete(void *p, size_t size) {
+    MemoryAccounting::release(MemoryAccounting::Exprs, size);
+    ::operator delete(p);
+  }
 
   virtual Kind getKind() const = 0;
   virtual Width getWidth() const = 0;
@@ -242,6 +258,11 @@ public:
   /// (Re)computes the hash of the current expression.
   /// Returns the hash value. 
   virtual unsigned computeHash();
+
+  /// Compute the hash of the freshly allocated \a e and return it. With
+  /// hash-consing enabled, an existing expression equal to \a e is returned
+  /// instead and \a e is deleted. \a size is the size of \a e in bytes.
+  static ref<Expr> createCachedExpr(Expr *e, size_t size);
   
   /// Returns 0 iff b is structuraly equivalent to *this
   int compare(const Expr &b) const;
@@ -413,9 +434,8 @@ public:
   void toMemory(void *address);
 
   static ref<ConstantExpr> alloc(const llvm::APInt &v) {
-    ref<ConstantExpr> r(new ConstantExpr(v));
-    r->computeHash();
-    return r;
+    return cast<ConstantExpr>(createCachedExpr(new ConstantExpr(v),
+                                               sizeof(ConstantExpr)));
   }
 
   static ref<ConstantExpr> alloc(const llvm::APFloat &f) {
@@ -562,9 +582,8 @@ public:
   ref<Expr> src;
 
   static ref<Expr> alloc(const ref<Expr> &src) {
-    ref<Expr> r(new NotOptimizedExpr(src));
-    r->computeHash();
-    return r;
+    return createCachedExpr(new NotOptimizedExpr(src),
+                            sizeof(NotOptimizedExpr));
   }
   
   static ref<Expr> create(ref<Expr> src);
@@ -612,6 +631,15 @@ public:
              const ref<Expr> &_index, 
              const ref<Expr> &_value);
 
+  static void *operator new(size_t size) {
+    MemoryAccounting::allocate(MemoryAccounting::Exprs, size);
+    return ::operator new(size);
+  }
+  static void operator delete(void *p, size_t size) {
+    MemoryAccounting::release(MemoryAccounting::Exprs, size);
+    ::operator delete(p);
+  }
+
   unsigned getSize() const { return size; }
 
   int compare(const UpdateNode &b) const;  
@@ -697,6 +725,9 @@ public:
 
   int compare(const UpdateList &b) const;
   unsigned hash() const;
+
+private:
+  static void release(const UpdateNode *head);
 };
 
 /// Class representing a one byte read from an array. 
@@ -711,9 +742,7 @@ public:
 
 public:
   static ref<Expr> alloc(const UpdateList &updates, const ref<Expr> &index) {
-    ref<Expr> r(new ReadExpr(updates, index));
-    r->computeHash();
-    return r;
+    return createCachedExpr(new ReadExpr(updates, index), sizeof(ReadExpr));
   }
   
   static ref<Expr> create(const UpdateList &updates, ref<Expr> i);
@@ -756,9 +785,7 @@ public:
 public:
   static ref<Expr> alloc(const ref<Expr> &c, const ref<Expr> &t, 
                          const ref<Expr> &f) {
-    ref<Expr> r(new SelectExpr(c, t, f));
-    r->computeHash();
-    return r;
+    return createCachedExpr(new SelectExpr(c, t, f), sizeof(SelectExpr));
   }
   
   static ref<Expr> create(ref<Expr> c, ref<Expr> t, ref<Expr> f);
@@ -855,9 +882,7 @@ private:
 
 public:
   static ref<Expr> alloc(const ref<Expr> &l, const ref<Expr> &r) {
-    ref<Expr> c(new ConcatExpr(l, r));
-    c->computeHash();
-    return c;
+    return createCachedExpr(new ConcatExpr(l, r), sizeof(ConcatExpr));
   }
   
   static ref<Expr> create(const ref<Expr> &l, const ref<Expr> &r);
@@ -914,9 +939,7 @@ public:
 
 public:  
   static ref<Expr> alloc(const ref<Expr> &e, unsigned o, Width w) {
-    ref<Expr> r(new ExtractExpr(e, o, w));
-    r->computeHash();
-    return r;
+    return createCachedExpr(new ExtractExpr(e, o, w), sizeof(ExtractExpr));
   }
   
   /// Creates an ExtractExpr with the given bit offset and width
@@ -965,9 +988,7 @@ public:
 
 public:  
   static ref<Expr> alloc(const ref<Expr> &e) {
-    ref<Expr> r(new NotExpr(e));
-    r->computeHash();
-    return r;
+    return createCachedExpr(new NotExpr(e), sizeof(NotExpr));
   }
   
   static ref<Expr> create(const ref<Expr> &e);
@@ -1042,9 +1063,8 @@ public:                                                          \
 public:                                                          \
     _class_kind ## Expr(ref<Expr> e, Width w) : CastExpr(e,w) {} \
     static ref<Expr> alloc(const ref<Expr> &e, Width w) {        \
-      ref<Expr> r(new _class_kind ## Expr(e, w));                \
-      r->computeHash();                                          \
-      return r;                                                  \
+      return createCachedExpr(new _class_kind ## Expr(e, w),     \
+                              sizeof(_class_kind ## Expr));      \
     }                                                            \
     static ref<Expr> create(const ref<Expr> &e, Width w);        \
     Kind getKind() const { return _class_kind; }                 \
@@ -1074,9 +1094,8 @@ public:                                                              \
     _class_kind ## Expr(const ref<Expr> &l,                          \
                         const ref<Expr> &r) : BinaryExpr(l,r) {}     \
     static ref<Expr> alloc(const ref<Expr> &l, const ref<Expr> &r) { \
-      ref<Expr> res(new _class_kind ## Expr (l, r));                 \
-      res->computeHash();                                            \
-      return res;                                                    \
+      return createCachedExpr(new _class_kind ## Expr (l, r),        \
+                              sizeof(_class_kind ## Expr));          \
     }                                                                \
     static ref<Expr> create(const ref<Expr> &l, const ref<Expr> &r); \
     Width getWidth() const { return left->getWidth(); }              \
@@ -1118,9 +1137,8 @@ public:                                                              \
     _class_kind ## Expr(const ref<Expr> &l,                          \
                         const ref<Expr> &r) : CmpExpr(l,r) {}        \
     static ref<Expr> alloc(const ref<Expr> &l, const ref<Expr> &r) { \
-      ref<Expr> res(new _class_kind ## Expr (l, r));                 \
-      res->computeHash();                                            \
-      return res;                                                    \
+      return createCachedExpr(new _class_kind ## Expr (l, r),        \
+                              sizeof(_class_kind ## Expr));          \
     }                                                                \
     static ref<Expr> create(const ref<Expr> &l, const ref<Expr> &r); \
     Kind getKind() const { return _class_kind; }                     \
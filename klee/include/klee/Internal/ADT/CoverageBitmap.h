@@ -0,0 +1,127 @@
+//===-- CoverageBitmap.h ----------------------------------------*- C++ -*-===//
+//
+//                     The KLEE Symbolic Virtual Machine
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef KLEE_COVERAGEBITMAP_H
+#define KLEE_COVERAGEBITMAP_H
+
+#include <algorithm>
+#include <vector>
+#include <stdint.h>
+
+namespace klee {
+  /// A set of instruction ids, stored as a bitmap shared copy-on-write
+  /// between the states that copied it. An empty set takes no storage.
+  class CoverageBitmap {
+    struct Words {
+      unsigned refCount;
+      std::vector<uint64_t> bits;
+
+      Words() : refCount(1) {}
+    };
+
+    Words *words;
+
+    void release() {
+      if (words && --words->refCount == 0)
+        delete words;
+      words = 0;
+    }
+
+    /// Make the words private to this set, with room for \a size words.
+    void makeUnique(unsigned size) {
+      if (!words) {
+        words = new Words();
+      } else if (words->refCount > 1) {
+        Words *copy = new Words();
+        copy->bits = words->bits;
+        --words->refCount;
+        words = copy;
+      }
+      if (words->bits.size() < size)
+        words->bits.resize(size, 0);
+    }
+
+  public:
+    CoverageBitmap() : words(0) {}
+    CoverageBitmap(const CoverageBitmap &b) : words(b.words) {
+      if (words)
+        ++words->refCount;
+    }
+    ~CoverageBitmap() { release(); }
+
+    CoverageBitmap &operator=(const CoverageBitmap &b) {
+      if (b.words)
+        ++b.words->refCount;
+      release();
+      words = b.words;
+      return *this;
+    }
+
+    bool empty() const { return !words; }
+
+    bool test(unsigned id) const {
+      return words && id / 64 < words->bits.size() &&
+        ((words->bits[id / 64] >> (id % 64)) & 1);
+    }
+
+    /// Add \a id to the set, return false if it was already there.
+    bool set(unsigned id) {
+      if (test(id))
+        return false;
+      makeUnique(id / 64 + 1);
+      words->bits[id / 64] |= (uint64_t) 1 << (id % 64);
+      return true;
+    }
+
+    /// Add the ids of \a b to the set.
+    void merge(const CoverageBitmap &b) {
+      if (!b.words || b.words == words)
+        return;
+      if (!words) {
+        *this = b;
+        return;
+      }
+
+      // Keep sharing the words if b brings nothing new
+      const std::vector<uint64_t> &other = b.words->bits;
+      unsigned i = 0, e = other.size();
+      for (; i != e; ++i)
+        if (other[i] & ~(i < words->bits.size() ? words->bits[i] : 0))
+          break;
+      if (i == e)
+        return;
+
+      makeUnique(e);
+      for (; i != e; ++i)
+        words->bits[i] |= other[i];
+    }
+
+    void clear() { release(); }
+
+    void swap(CoverageBitmap &b) { std::swap(words, b.words); }
+
+    /// The raw words of the bitmap, id i being bit i % 64 of word i / 64.
+    unsigned getNumWords() const { return words ? words->bits.size() : 0; }
+    uint64_t getWord(unsigned i) const { return words->bits[i]; }
+
+    void setWord(unsigned i, uint64_t word) {
+      makeUnique(i + 1);
+      words->bits[i] = word;
+    }
+
+    /// Append the ids of the set to \a ids, in increasing order.
+    void getIDs(std::vector<unsigned> &ids) const {
+      for (unsigned i = 0, e = getNumWords(); i != e; ++i)
+        for (uint64_t word = words->bits[i]; word; word &= word - 1)
+          ids.push_back(i * 64 + __builtin_ctzll(word));
+    }
+  };
+}
+
+#endif
@@ -55,6 +55,42 @@ extern "C" {
 
   void  kTest_free(KTest *);
 
+  /* A test bundle packs the files of many test cases (the .ktest file and
+     the other files written with it, e.g. .pc or .err) into a single file.
+     Entries are appended as they are written, and an index of them is
+     added when the bundle is closed. A bundle left without an index (e.g.,
+     after a crash) can still be read by scanning its entries. */
+  typedef struct KTestBundle KTestBundle;
+
+  /* return true iff file at path matches KTestBundle header */
+  int   kTestBundle_isBundleFile(const char *path);
+
+  /* create a bundle for writing, returns NULL on error */
+  KTestBundle* kTestBundle_create(const char *path);
+
+  /* open a bundle for reading, returns NULL on error */
+  KTestBundle* kTestBundle_open(const char *path);
+
+  /* returns 1 on success, 0 on (unspecified) error */
+  int   kTestBundle_addTest(KTestBundle *, unsigned id, KTest *);
+  int   kTestBundle_addFile(KTestBundle *, unsigned id, const char *suffix,
+                            const void *data, unsigned size);
+
+  unsigned kTestBundle_numEntries(KTestBundle *);
+  unsigned kTestBundle_getEntryID(KTestBundle *, unsigned index);
+  const char *kTestBundle_getEntrySuffix(KTestBundle *, unsigned index);
+
+  /* returns the (malloc'ed) contents of the entry, NULL on error */
+  void* kTestBundle_getEntryData(KTestBundle *, unsigned index,
+                                 unsigned *size_out);
+
+  /* returns NULL if the entry is not a valid .ktest file */
+  KTest* kTestBundle_getTest(KTestBundle *, unsigned index);
+
+  /* writes the index of a bundle created for writing, returns 1 on
+     success, 0 on (unspecified) error */
+  int   kTestBundle_close(KTestBundle *);
+
 #ifdef __cplusplus
 }
 #endif
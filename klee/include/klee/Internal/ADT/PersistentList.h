@@ -0,0 +1,285 @@
+//===-- PersistentList.h ----------------------------------------*- C++ -*-===//
+//
+//                     The KLEE Symbolic Virtual Machine
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef __UTIL_PERSISTENTLIST_H__
+#define __UTIL_PERSISTENTLIST_H__
+
+#include "klee/util/Ref.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace klee {
+  /// An append-only list with value semantics whose copies share their
+  /// common prefix. The list is stored as a chain of nodes, each holding the
+  /// items appended after the point where its parent got shared. A node is
+  /// only appended to in place while it is referenced by a single list.
+  /// The nodes and their items are allocated with \a A.
+  ///
+  /// A node iterated for the first time caches the chain of its ancestors,
+  /// so that iterators do not walk or copy it.
+  template<class T, class A = std::allocator<T> >
+  class PersistentList {
+  public:
+    class iterator;
+
+    typedef T value_type;
+
+  private:
+    class Node {
+    public:
+      typedef std::vector<const Node*,
+                          typename A::template rebind<const Node*>::other>
+        Chain;
+
+      Node *parent;
+      /// Number of items taken from the parent chain.
+      size_t prefix;
+      std::vector<T, A> items;
+      /// Updated through RefCountPolicy, since lists get copied by several
+      /// threads (e.g., into solver caches).
+      uint32_t references;
+      /// The node and its ancestors, root first, once it was iterated.
+      mutable Chain *chain;
+
+      Node(Node *_parent, size_t _prefix)
+        : parent(_parent), prefix(_prefix), references(1), chain(0) {
+        if (parent)
+          RefCountPolicy::inc(&parent->references);
+      }
+      ~Node() {
+        delete chain;
+      }
+
+      size_t size() const { return prefix + items.size(); }
+
+      const Chain &getChain() const {
+        Chain *c = chain;
+        if (c)
+          return *c;
+
+        size_t depth = 0;
+        for (const Node *n = this; n; n = n->parent)
+          ++depth;
+        c = new Chain(depth);
+        for (const Node *n = this; n; n = n->parent)
+          (*c)[--depth] = n;
+
+        // Other threads may iterate the same node, the first chain wins
+        if (!__sync_bool_compare_and_swap(&chain, (Chain*) 0, c)) {
+          delete c;
+          c = chain;
+        }
+        return *c;
+      }
+    };
+
+    typedef typename A::template rebind<Node>::other NodeAllocator;
+
+    static Node *newNode(Node *parent, size_t prefix) {
+      Node *n = NodeAllocator().allocate(1);
+      new (n) Node(parent, prefix);
+      return n;
+    }
+
+    static void deleteNode(Node *n) {
+      n->~Node();
+      NodeAllocator().deallocate(n, 1);
+    }
+
+    Node *tip;
+    size_t count;
+
+    static void decref(Node *n) {
+      while (n && RefCountPolicy::dec(&n->references)) {
+        Node *parent = n->parent;
+        deleteNode(n);
+        n = parent;
+      }
+    }
+
+    /// Make the tip the last node that holds items of this list.
+    void normalize() {
+      while (tip && count <= tip->prefix) {
+        Node *parent = tip->parent;
+        if (parent)
+          RefCountPolicy::inc(&parent->references);
+        decref(tip);
+        tip = parent;
+      }
+    }
+
+  public:
+    PersistentList() : tip(0), count(0) {}
+    PersistentList(const PersistentList &b) : tip(b.tip), count(b.count) {
+      if (tip)
+        RefCountPolicy::inc(&tip->references);
+    }
+    template<class InputIterator>
+    PersistentList(InputIterator begin, InputIterator end)
+      : tip(0), count(0) {
+      for (; begin != end; ++begin)
+        push_back(*begin);
+    }
+    ~PersistentList() {
+      decref(tip);
+    }
+
+    PersistentList &operator=(const PersistentList &b) {
+      if (b.tip)
+        RefCountPolicy::inc(&b.tip->references);
+      decref(tip);
+      tip = b.tip;
+      count = b.count;
+      return *this;
+    }
+
+    void swap(PersistentList &b) {
+      std::swap(tip, b.tip);
+      std::swap(count, b.count);
+    }
+
+    bool empty() const { return count == 0; }
+    size_t size() const { return count; }
+
+    const T &back() const {
+      assert(count > 0 && "back() of empty list");
+      return tip->items[count - tip->prefix - 1];
+    }
+
+    void push_back(const T &value) {
+      if (!tip || tip->references > 1 || count != tip->size()) {
+        // The tip is shared (or only partially ours), start a new node
+        Node *n = newNode(tip, count);
+        decref(tip);
+        tip = n;
+      }
+      tip->items.push_back(value);
+      ++count;
+    }
+
+    void clear() {
+      decref(tip);
+      tip = 0;
+      count = 0;
+    }
+
+    /// Return the list made of the first \a n items.
+    PersistentList prefix(size_t n) const {
+      assert(n <= count && "prefix longer than the list");
+      PersistentList result(*this);
+      result.count = n;
+      result.normalize();
+      return result;
+    }
+
+    /// Return the number of leading items shared with \a b by identity.
+    size_t commonPrefix(const PersistentList &b) const {
+      const Node *an = tip, *bn = b.tip;
+      size_t al = count, bl = b.count;
+
+      // Ancestors have strictly smaller prefixes than their descendants
+      while (an && bn && an != bn) {
+        if (an->prefix >= bn->prefix) {
+          al = std::min(al, an->prefix);
+          an = an->parent;
+        } else {
+          bl = std::min(bl, bn->prefix);
+          bn = bn->parent;
+        }
+      }
+
+      return (an && an == bn) ? std::min(al, bl) : 0;
+    }
+
+    bool operator==(const PersistentList &b) const {
+      if (count != b.count)
+        return false;
+      if (commonPrefix(b) == count)
+        return true;
+
+      for (iterator ai = begin(), bi = b.begin(), ae = end(); ai != ae;
+           ++ai, ++bi) {
+        if (!(*ai == *bi))
+          return false;
+      }
+      return true;
+    }
+    bool operator!=(const PersistentList &b) const { return !(*this == b); }
+
+    iterator begin() const { return iterator(tip, count); }
+    iterator end() const { return iterator(count); }
+  };
+
+  template<class T, class A>
+  class PersistentList<T, A>::iterator {
+    friend class PersistentList<T, A>;
+  public:
+    typedef std::forward_iterator_tag iterator_category;
+    typedef T value_type;
+    typedef ptrdiff_t difference_type;
+    typedef const T *pointer;
+    typedef const T &reference;
+
+  private:
+    // The chain of the tip, root first. Each node holds the items from its
+    // prefix up to the prefix of the next one (or the end of the list).
+    const Node *const *nodes;
+    size_t last, segment, position;
+
+    iterator(const Node *tip, size_t count)
+      : nodes(0), last(0), segment(0), position(0) {
+      if (tip) {
+        const typename Node::Chain &chain = tip->getChain();
+        nodes = &chain[0];
+        last = chain.size() - 1;
+      }
+    }
+
+    explicit iterator(size_t count)
+      : nodes(0), last(0), segment(0), position(count) {}
+
+  public:
+    const T &operator*() const {
+      const Node *n = nodes[segment];
+      return n->items[position - n->prefix];
+    }
+    const T *operator->() const {
+      return &**this;
+    }
+
+    bool operator==(const iterator &b) const {
+      return position == b.position;
+    }
+    bool operator!=(const iterator &b) const {
+      return position != b.position;
+    }
+
+    iterator &operator++() {
+      ++position;
+      if (segment < last && position == nodes[segment + 1]->prefix)
+        ++segment;
+      return *this;
+    }
+    iterator operator++(int) {
+      iterator old(*this);
+      ++*this;
+      return old;
+    }
+  };
+
+}
+
+#endif
@@ -13,6 +13,7 @@
 #include <map>
 #include <string>
 #include <set>
+#include <vector>
 
 namespace llvm {
   class Function;
@@ -55,6 +56,7 @@ namespace klee {
     std::string dummyString;
     InstructionInfo dummyInfo;
     std::map<const llvm::Instruction*, InstructionInfo> infos;
+    std::vector<const InstructionInfo*> infosByID;
     std::set<const std::string *, ltstr> internedStrings;
 
   private:
@@ -63,12 +65,21 @@ namespace klee {
                                  const std::string *&File, unsigned &Line);
 
   public:
-    InstructionInfoTable(llvm::Module *m);
+    /// Build the table of module \a m. The assembly lines of the
+    /// instructions are found by printing the module, unless they are given
+    /// in \a assemblyLines, in module order.
+    InstructionInfoTable(llvm::Module *m,
+                         const std::vector<unsigned> *assemblyLines = 0);
     ~InstructionInfoTable();
 
+    /// Store the assembly lines of the instructions of \a m in \a lines, in
+    /// module order.
+    void getAssemblyLines(llvm::Module *m, std::vector<unsigned> &lines) const;
+
     unsigned getMaxID() const;
     const InstructionInfo &getInfo(const llvm::Instruction*) const;
     const InstructionInfo &getFunctionInfo(const llvm::Function*) const;
+    const InstructionInfo &getInfoByID(unsigned id) const;
   };
 
 }
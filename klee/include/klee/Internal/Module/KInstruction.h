@@ -44,6 +44,16 @@ namespace klee {
   struct KQCEInfo {
     double total;
     std::vector<KQCEInfoItem> vars;
+
+    /// The annotation of the previous annotated instruction of the basic
+    /// block, if any.
+    KQCEInfo *prev;
+    /// The items of vars that a frame last updated at prev must look at:
+    /// those whose estimate differs from prev, or all of them if the total
+    /// differs.
+    std::vector<KQCEInfoItem*> changed;
+
+    KQCEInfo() : total(0), prev(0) {}
   };
 
   typedef llvm::DenseMap<HotValue, llvm::SmallVector<HotValue, 2> >
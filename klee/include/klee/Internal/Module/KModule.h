@@ -124,17 +124,21 @@ namespace klee {
 
     void readInitialCoverage(std::istream &is);
 
+    /// Run the instrumentation and optimization passes over the module.
+    void transform(const Interpreter::ModuleOptions &opts);
+
   public:
     KModule(llvm::Module *_module);
     ~KModule();
 
     /// Initialize local data structures.
-    //
-    // FIXME: ihandler should not be here
-    void prepare(const Interpreter::ModuleOptions &opts, 
-                 InterpreterHandler *ihandler,
+    void prepare(const Interpreter::ModuleOptions &opts,
                  bool requireMergeAnalysis);
 
+    /// Write the prepared module out (assembly.ll, final.bc), as requested
+    /// by the options.
+    void writeOutputs(InterpreterHandler *ihandler);
+
     /// Return an id for the given constant, creating a new one if necessary.
     unsigned getConstantID(llvm::Constant *c, KInstruction* ki);
   };
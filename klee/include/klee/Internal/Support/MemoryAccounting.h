@@ -0,0 +1,91 @@
+//===-- MemoryAccounting.h --------------------------------------*- C++ -*-===//
+//
+//                     The KLEE Symbolic Virtual Machine
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef KLEE_MEMORYACCOUNTING_H
+#define KLEE_MEMORYACCOUNTING_H
+
+#include <cstddef>
+#include <memory>
+#include <stdint.h>
+
+namespace klee {
+  /// The live heap bytes of each executor subsystem. The counters are
+  /// maintained by the allocating classes, or by AccountingAllocator for
+  /// containers, and may be updated from the solver threads.
+  class MemoryAccounting {
+  public:
+    enum Category {
+      /// Expression nodes and array update nodes.
+      Exprs,
+      /// Object states and their pages, with the byte masks.
+      ObjectStates,
+      /// The path constraint lists.
+      Constraints,
+      /// The QCE maps of the stack frames and threads. These are LLVM
+      /// DenseMaps, which take no allocator, so they are measured by
+      /// walking the states rather than maintained.
+      QCEMaps,
+      /// The query and counterexample caches of the solver chain.
+      SolverCaches,
+      /// The process tree nodes.
+      ProcessTree,
+      NumCategories
+    };
+
+  private:
+    static volatile int64_t bytes[NumCategories];
+
+  public:
+    static void allocate(Category category, size_t n) {
+      __sync_fetch_and_add(&bytes[category], (int64_t) n);
+    }
+    static void release(Category category, size_t n) {
+      __sync_fetch_and_sub(&bytes[category], (int64_t) n);
+    }
+    /// For the categories that are measured instead of maintained.
+    static void set(Category category, size_t n) {
+      bytes[category] = n;
+    }
+
+    static uint64_t getBytes(Category category) {
+      int64_t n = bytes[category];
+      return n > 0 ? n : 0;
+    }
+
+    /// The name of the category in the statistics files.
+    static const char *getName(Category category);
+  };
+
+  /// An STL allocator charging its allocations to a memory category.
+  template<class T, MemoryAccounting::Category C>
+  class AccountingAllocator : public std::allocator<T> {
+  public:
+    template<class U> struct rebind {
+      typedef AccountingAllocator<U, C> other;
+    };
+
+    AccountingAllocator() {}
+    AccountingAllocator(const AccountingAllocator &a)
+      : std::allocator<T>(a) {}
+    template<class U>
+    AccountingAllocator(const AccountingAllocator<U, C> &) {}
+
+    T *allocate(size_t n, const void * = 0) {
+      MemoryAccounting::allocate(C, n * sizeof(T));
+      return std::allocator<T>::allocate(n);
+    }
+
+    void deallocate(T *p, size_t n) {
+      MemoryAccounting::release(C, n * sizeof(T));
+      std::allocator<T>::deallocate(p, n);
+    }
+  };
+}
+
+#endif
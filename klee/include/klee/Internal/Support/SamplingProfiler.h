@@ -0,0 +1,73 @@
+//===-- SamplingProfiler.h --------------------------------------*- C++ -*-===//
+//
+//                     The KLEE Symbolic Virtual Machine
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef KLEE_SAMPLINGPROFILER_H
+#define KLEE_SAMPLINGPROFILER_H
+
+#include <signal.h>
+#include <stdint.h>
+
+namespace klee {
+  /// A statistical CPU time profiler. A profiling timer signal counts a
+  /// tick against the current activity every interval; the interpreter
+  /// takes the samples at its next instruction step and charges them to
+  /// the instruction (and call path) it was executing. This costs one
+  /// memory read per instruction, instead of a system call.
+  class SamplingProfiler {
+  public:
+    enum Activity {
+      Interpretation,
+      Solver,
+      Merge,
+      Searcher,
+      NumActivities
+    };
+
+    /// Marks the activity the process is busy with, for its lifetime.
+    class ActivityScope {
+      sig_atomic_t previous;
+
+    public:
+      explicit ActivityScope(Activity activity) : previous(current) {
+        current = activity;
+      }
+      ~ActivityScope() { current = previous; }
+    };
+
+  private:
+    static volatile sig_atomic_t current;
+    static volatile sig_atomic_t pending;
+    static uint64_t interval;
+    static uint64_t lastUserTime;
+
+    static void handleTick(int signal);
+
+  public:
+    /// Start sampling every \a microseconds of CPU time. Return false if
+    /// the timer could not be set up.
+    static bool start(uint64_t microseconds);
+    static void stop();
+
+    static bool isRunning() { return interval != 0; }
+
+    /// The sampling interval, in microseconds.
+    static uint64_t getInterval() { return interval; }
+
+    /// Return whether ticks arrived since the last takeSamples().
+    static bool hasTicks() { return pending != 0; }
+
+    /// Return the user time since the last call, in microseconds, and
+    /// split it in \a times by activity, in proportion to their ticks.
+    /// The timer resolution of the kernel may be coarser than the
+    /// interval, so the ticks only weigh the measured time.
+    static uint64_t takeSamples(uint64_t times[NumActivities]);
+  };
+}
+
+#endif
@@ -9,6 +9,8 @@
 #ifndef KLEE_INTERPRETER_H
 #define KLEE_INTERPRETER_H
 
+#include "klee/Constraints.h"
+
 #include <vector>
 #include <string>
 #include <map>
@@ -24,8 +26,19 @@ class Module;
 namespace klee {
 class ExecutionState;
 class Interpreter;
+class KModule;
 class TreeStreamWriter;
 
+/// SymbolicSnapshot - What it takes to solve for the inputs of a state
+/// after the state itself is gone: its path constraints and its symbolic
+/// objects, with the values they should preferably take.
+struct SymbolicSnapshot {
+  ConstraintManager constraints;
+  std::vector<std::string> names;
+  std::vector<const Array*> objects;
+  std::vector< std::vector< ref<Expr> > > preferences;
+};
+
 class InterpreterHandler {
 public:
   InterpreterHandler() {}
@@ -92,6 +105,15 @@ public:
   setModule(llvm::Module *module, 
             const ModuleOptions &opts) = 0;
 
+  /// Prepare \a module for execution the way setModule() does, before any
+  /// interpreter exists (e.g., so that forked workers share the result).
+  static KModule *prepareModule(llvm::Module *module,
+                                const ModuleOptions &opts);
+
+  /// Register a module returned by prepareModule(), which the interpreter
+  /// takes over.
+  virtual const llvm::Module *setModule(KModule *kmodule) = 0;
+
   // supply a tree stream writer which the interpreter will use
   // to record the concrete path (as a stream of '0' and '1' bytes).
   virtual void setPathWriter(TreeStreamWriter *tsw) = 0;
@@ -140,6 +162,17 @@ public:
                                    std::vector<unsigned char> > >
                                    &res) = 0;
 
+  virtual void getSymbolicSnapshot(const ExecutionState &state,
+                                   SymbolicSnapshot &res) = 0;
+
+  /// Unlike the other accessors, this one may be called from any thread,
+  /// concurrently with the interpretation.
+  virtual bool getSymbolicSolution(const SymbolicSnapshot &snapshot,
+                                   std::vector< 
+                                   std::pair<std::string,
+                                   std::vector<unsigned char> > >
+                                   &res) = 0;
+
   virtual void getCoveredLines(const ExecutionState &state,
                                std::map<const std::string*, std::set<unsigned> > &res) = 0;
 };
@@ -36,14 +36,36 @@
 #include "klee/Interpreter.h"
 #include "klee/Internal/ADT/TreeStream.h"
 
+#include <pthread.h>
+
+#include <deque>
+
+struct KTestBundle;
+
 namespace klee {
 
 class KleeHandler : public InterpreterHandler {
 private:
+  struct TestCase;
+
   Interpreter *m_interpreter;
   TreeStreamWriter *m_pathWriter, *m_symPathWriter;
   std::ostream *m_infoFile;
 
+  // Test cases waiting to be solved and written out by the emission
+  // threads, if any
+  std::vector<pthread_t> m_emissionThreads;
+  std::deque<TestCase*> m_pendingTests;
+  unsigned m_activeTests;
+  bool m_shutdown;
+  pthread_mutex_t m_lock;
+  pthread_cond_t m_testReadyCond, m_testDoneCond;
+
+  // The test bundle, when all the test files go to a single file
+  KTestBundle *m_bundle;
+  // Serializes the writes to the bundle and the instrumentation events
+  pthread_mutex_t m_outputLock;
+
   char m_outputDirectory[1024];
   unsigned m_testIndex;  // number of tests written so far
   unsigned m_pathsExplored; // number of paths explored so far
@@ -54,7 +76,18 @@ private:
 
   void initCloud9Instrumentation();
 
+  static void *emissionThread(void *handler);
+  void emitTestCase(TestCase *tc);
+
+  static unsigned siblingIndex;
+
 public:
+  /// Set the index of this process among the workers forked from the same
+  /// parent. Siblings other than the first write to their own output
+  /// directory (the given one, suffixed with the index) and leave
+  /// klee-last alone.
+  static void setSiblingIndex(unsigned index) { siblingIndex = index; }
+
   KleeHandler(int argc, char **argv);
   ~KleeHandler();
 
@@ -78,6 +111,18 @@ public:
     return openTestFile(suffix, m_testIndex);
   }
 
+  /// Write a file of a test case, either on its own or into the test
+  /// bundle. Can be called from any thread.
+  void writeTestFile(const std::string &suffix, unsigned id,
+                     const std::string &contents);
+  void writeTestFile(const std::string &suffix, const std::string &contents) {
+    writeTestFile(suffix, m_testIndex, contents);
+  }
+
+  /// Wait until all the test cases passed to processTestCase() so far are
+  /// written out. Must be called before the interpreter is destroyed.
+  void flushTestCases();
+
   // load a .out file
   static void loadOutFile(std::string name,
                           std::vector<unsigned char> &buffer);
@@ -53,6 +53,7 @@ class Process {
   friend class Thread;
   friend class ExecutionState;
   friend class Executor;
+  friend class StateSerializer;
 private:
 
   std::vector<unsigned int> forkPath; // 0 - parent, 1 - child
@@ -13,6 +13,7 @@
 #include <vector>
 #include <set>
 #include <map>
+#include <deque>
 #include <queue>
 #include <functional>
 
@@ -260,8 +261,20 @@ namespace klee {
     struct StateIndexes;
     typedef llvm::DenseMap<ExecutionState*, StateIndexes*> StatesIndexesMap;
 
+    // A state being fast-forwarded, filed under its merge index
+    struct ForwardEntry {
+      uint64_t mergeIndex;
+      unsigned candidates;
+    };
+    typedef llvm::DenseMap<ExecutionState*, ForwardEntry> StatesToForward;
+    // Orders states being fast-forwarded by their number of merge candidates
+    typedef std::set<std::pair<unsigned, ExecutionState*> > ForwardQueue;
+
     StatesTrace statesTrace;
-    StatesSet statesToForward;
+
+    StatesToForward statesToForward;
+    ForwardQueue forwardQueue;
+    StatesTrace forwardTrace;
 
     StatesIndexesMap statesIndexesMap;
     unsigned stateIndexesSize;
@@ -270,6 +283,15 @@ namespace klee {
     void removeStateFromTraces(ExecutionState* state);
     void mergeStateTraces(ExecutionState* merged, ExecutionState* other);
 
+    void insertIntoTrace(uint64_t mergeIndex, ExecutionState* state);
+    void eraseFromTrace(uint64_t mergeIndex, ExecutionState* state);
+
+    unsigned countCandidates(ExecutionState* state, uint64_t mergeIndex) const;
+    void addStateToForward(ExecutionState* state);
+    bool removeStateToForward(ExecutionState* state);
+    void refileStateToForward(ExecutionState* state);
+    void updateForwardCandidates(uint64_t mergeIndex);
+
     bool canFastForwardState(const ExecutionState* state) const;
 
     void verifyMaps();
@@ -286,6 +308,12 @@ namespace klee {
     void printName(std::ostream &os) {
       os << "LazyMergingSearcher\n";
     }
+
+    /// Recount the merge candidates of the states being fast-forwarded, and
+    /// return whether the queue agrees, i.e., whether the state it forwards
+    /// next has the most candidates. This is linear in the number of states,
+    /// for tests.
+    bool checkForwardCandidates() const;
   };
 
   class BatchingSearcher : public Searcher {
@@ -445,6 +473,52 @@ namespace klee {
     }
   };
 
+  /// Splits the states in shards that take turns at each selection, as if
+  /// each was explored by its own thread. A shard keeps the states forked
+  /// from its own and runs them depth-first (or weighted at random); a
+  /// shard that runs out steals the oldest state of the largest one.
+  class WorkStealingSearcher : public Searcher {
+    struct Shard {
+      /// In order of arrival: selected from the back, stolen from the front.
+      std::deque<ExecutionState*> states;
+      WeightedRandomSearcher *weighted;
+
+      Shard() : weighted(0) {}
+    };
+
+    std::vector<Shard> shards;
+    std::map<ExecutionState*, unsigned> owners;
+    unsigned turn;
+
+    unsigned getSmallestShard() const;
+    void steal(unsigned thief);
+    void removeFromShard(Shard &shard, ExecutionState *es);
+
+  public:
+    /// If \a weighted, select in each shard like a WeightedRandomSearcher
+    /// of the given type, instead of depth-first.
+    WorkStealingSearcher(Executor &executor, unsigned shardCount,
+                         bool weighted,
+                         WeightedRandomSearcher::WeightType type);
+    ~WorkStealingSearcher();
+
+    ExecutionState &selectState();
+    void update(ExecutionState *current,
+                const std::set<ExecutionState*> &addedStates,
+                const std::set<ExecutionState*> &removedStates);
+    bool empty() { return owners.empty(); }
+    void printName(std::ostream &os) {
+      os << "<WorkStealingSearcher> with " << shards.size() << " shards";
+      if (!shards.empty() && shards[0].weighted) {
+        os << " of:\n";
+        shards[0].weighted->printName(os);
+        os << "</WorkStealingSearcher>\n";
+      } else {
+        os << "\n";
+      }
+    }
+  };
+
 }
 
 #endif
@@ -245,12 +245,23 @@ namespace klee {
   void setPCLoggingSolverStateID(Solver *s, ExecutionState* stateID);
 
   /// createParallelSolver - Create a solver which will solve high-level
-  /// disjunctions in parallel.
-  Solver *createParallelSolver(unsigned solverCount, unsigned mainSolverTimeout, bool optimizeDivides, STPSolver *solver);
+  /// disjunctions in parallel, once the query alone did not answer within
+  /// \a mainSolverTimeout milliseconds. The subqueries are solved by \a
+  /// solver, with its own options (e.g., the optimization of divisions).
+  Solver *createParallelSolver(unsigned solverCount, unsigned mainSolverTimeout, STPSolver *solver);
 
   /// createHLParallelSolver - Create a solver which will solve high-level
-  /// disjunctions in parallel.
-  Solver *createHLParallelSolver(Solver *solver, unsigned threadCount = 0);
+  /// disjunctions in parallel. A pool of threads races the query against its
+  /// independent factors or its case splits on select conditions.
+  ///
+  /// \param solver - The underlying solver to use, which must be a forked
+  /// STP solver.
+  /// \param threadCount - The number of worker threads, or zero to use one
+  /// per CPU.
+  /// \param subqueryDelay - The milliseconds the query runs alone before the
+  /// subqueries join it, or zero to start them all at once.
+  Solver *createHLParallelSolver(Solver *solver, unsigned threadCount = 0,
+                                 unsigned subqueryDelay = 0);
 
   /// createDummySolver - Create a dummy solver implementation which always
   /// fails.
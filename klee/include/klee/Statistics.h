@@ -52,6 +52,10 @@ namespace klee {
     StatisticRecord *contextStats;
     unsigned index;
 
+    /// The record collecting the increments of the calling thread, when it
+    /// is not the thread owning the statistics.
+    static __thread StatisticRecord *threadStats;
+
     inline void recordChange(unsigned id, unsigned index) {
     	if (changedIdxStats[id].first) {
     		changedIdxStats[id].second[index] = 1;
@@ -85,6 +89,12 @@ namespace klee {
     int getStatisticID(const std::string &name) const;
     Statistic *getStatisticByName(const std::string &name) const;
 
+    /// Collect the increments of the calling thread in \a sr, or apply
+    /// them directly again if \a sr is null. Helper threads use this so
+    /// that the owning thread can add their counts up with addStatistics.
+    void setThreadRecord(StatisticRecord *sr) { threadStats = sr; }
+    void addStatistics(const StatisticRecord &sr);
+
     void trackChanges(const Statistic &s);
     void resetChanges(const Statistic &s);
     void collectChanges(const Statistic &s, std::vector<std::pair<uint32_t, uint64_t> > &changes);
@@ -94,7 +104,9 @@ namespace klee {
 
   inline void StatisticManager::incrementStatistic(Statistic &s, 
                                                    uint64_t addend) {
-    if (enabled) {
+    if (threadStats) {
+      threadStats->data[s.id] += addend;
+    } else if (enabled) {
       globalStats[s.id] += addend;
       if (indexedStats) {
         indexedStats[index*stats.size() + s.id] += addend;
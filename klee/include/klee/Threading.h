@@ -56,6 +56,7 @@ namespace klee {
 
 class KFunction;
 class KInstruction;
+struct KQCEInfo;
 class ExecutionState;
 class Process;
 class CallPathNode;
@@ -81,9 +82,17 @@ struct QCEFrameInfo {
   float qce;
   float qceBase;
 
-  QCEFrameInfo(int _stackFrame = NULL, int _vnumber = 0)
-    : stackFrame(_stackFrame), vnumber(_vnumber), inVhAdd(false),
-      qce(0), qceBase(0) {}
+  /// The object and offset a tracked pointer item was resolved to when it
+  /// was added, so that removing it does not resolve it again. The item
+  /// keeps the object alive, so that its address is not reused meanwhile.
+  ref<const MemoryObject> trackedObject;
+  uint64_t trackedOffset;
+
+  // Out of line, where MemoryObject is complete
+  QCEFrameInfo(int _stackFrame = NULL, int _vnumber = 0);
+  QCEFrameInfo(const QCEFrameInfo &info);
+  QCEFrameInfo &operator=(const QCEFrameInfo &info);
+  ~QCEFrameInfo();
 };
 
 typedef llvm::DenseMap<HotValue, QCEFrameInfo> QCEMap;
@@ -103,7 +112,8 @@ struct StackFrame {
   KFunction *kf;
   CallPathNode *callPathNode;
 
-  std::vector<const MemoryObject*> allocas;
+  /// The frame keeps its local objects alive until it is popped.
+  std::vector< ref<const MemoryObject> > allocas;
   Cell *locals;
 
   /// Minimum distance to an uncovered instruction once the function
@@ -130,10 +140,18 @@ struct StackFrame {
   float qceTotal;
   float qceTotalBase;
   QCEMap qceMap;
+  /// The annotation qceMap was last brought up to date with, if nothing
+  /// else touched it since. The next annotated instruction of the same
+  /// basic block then only needs to apply its changes.
+  const KQCEInfo *qceLastInfo;
 
   BitArray      qceLocalsTrackMap;
   SimpleIncHash qceLocalsTrackHash;
 
+  /// Hash of the (caller, kf) pairs of this frame and all the frames below
+  /// it. Frames with different hashes belong to incompatible call stacks.
+  uint64_t stackHash;
+
   StackFrame(KInstIterator caller, uint64_t _callerExecIndex,
              KFunction *kf, StackFrame *parentFrame);
   StackFrame(const StackFrame &s);
@@ -142,7 +160,9 @@ struct StackFrame {
   ~StackFrame();
 };
 
-typedef std::pair<const MemoryObject*, uint64_t> QCEMemoryTrackIndex;
+/// A tracked byte, as the id of its memory object and its offset. Ids are
+/// never reused, unlike the addresses of freed objects.
+typedef std::pair<unsigned, uint64_t> QCEMemoryTrackIndex;
 typedef llvm::DenseSet<HotValue> QCEMemoryTrackSet;
 typedef llvm::DenseMap<QCEMemoryTrackIndex, QCEMemoryTrackSet>
                   QCEMemoryTrackMap;
@@ -152,6 +172,7 @@ class Thread {
   friend class ExecutionState;
   friend class Process;
   friend class SpecialFunctionHandler;
+  friend class StateSerializer;
 private:
 
   KInstIterator pc, prevPC;
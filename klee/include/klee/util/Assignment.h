@@ -25,14 +25,25 @@ namespace klee {
 
     bool allowFreeValues;
     bindings_ty bindings;
+
+    /// For ref<Assignment>, e.g., to share cached solutions.
+    uint32_t refCount;
     
   public:
     Assignment(bool _allowFreeValues=false) 
-      : allowFreeValues(_allowFreeValues) {}
+      : allowFreeValues(_allowFreeValues), refCount(0) {}
+    Assignment(const Assignment &a)
+      : allowFreeValues(a.allowFreeValues), bindings(a.bindings),
+        refCount(0) {}
+    Assignment &operator=(const Assignment &a) {
+      allowFreeValues = a.allowFreeValues;
+      bindings = a.bindings;
+      return *this;
+    }
     Assignment(const std::vector<const Array*> &objects,
                const std::vector< std::vector<unsigned char> > &values,
                bool _allowFreeValues=false) 
-      : allowFreeValues(_allowFreeValues){
+      : allowFreeValues(_allowFreeValues), refCount(0) {
       std::vector< std::vector<unsigned char> >::const_iterator valIt =
         values.begin();
       for (std::vector<const Array*>::const_iterator it = objects.begin(),
@@ -56,6 +56,10 @@ public:
   void set(unsigned idx) { bits[idx/32] |= 1<<(idx&0x1F); }
   void unset(unsigned idx) { bits[idx/32] &= ~(1<<(idx&0x1F)); }
   void set(unsigned idx, bool value) { if (value) set(idx); else unset(idx); }
+
+  /// Return the 32-bit word holding bits [32*idx, 32*idx+32).
+  uint32_t getWord(unsigned idx) const { assert(idx < length); return bits[idx]; }
+  void setWord(unsigned idx, uint32_t word) { assert(idx < length); bits[idx] = word; }
 };
 
 } // End klee namespace
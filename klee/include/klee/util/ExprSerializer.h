@@ -0,0 +1,157 @@
+//===-- ExprSerializer.h ----------------------------------------*- C++ -*-===//
+//
+//                     The KLEE Symbolic Virtual Machine
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef KLEE_EXPRSERIALIZER_H
+#define KLEE_EXPRSERIALIZER_H
+
+#include "klee/Expr.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+namespace llvm {
+  class APInt;
+}
+
+namespace klee {
+  /// A growable buffer of binary data, in host byte order.
+  class SerialWriter {
+  public:
+    std::vector<unsigned char> data;
+
+    void write(const void *p, size_t n) {
+      const unsigned char *bytes = (const unsigned char*) p;
+      data.insert(data.end(), bytes, bytes + n);
+    }
+
+    void write8(uint8_t v) { data.push_back(v); }
+    void write32(uint32_t v) { write(&v, sizeof(v)); }
+    void write64(uint64_t v) { write(&v, sizeof(v)); }
+
+    void writeString(const std::string &s) {
+      write32(s.size());
+      write(s.data(), s.size());
+    }
+  };
+
+  /// Reads back the data of a SerialWriter. Reading past the end of the
+  /// data sets the error flag and yields zeros, so that truncated messages
+  /// can be checked for once, after decoding.
+  class SerialReader {
+    const unsigned char *pos, *end;
+    bool failed;
+
+  public:
+    SerialReader(const unsigned char *_pos, size_t length)
+      : pos(_pos), end(_pos + length), failed(false) {}
+
+    bool error() const { return failed; }
+    void setError() { failed = true; }
+    size_t remaining() const { return end - pos; }
+
+    void read(void *p, size_t n);
+
+    uint8_t read8() { uint8_t v; read(&v, sizeof(v)); return v; }
+    uint32_t read32() { uint32_t v; read(&v, sizeof(v)); return v; }
+    uint64_t read64() { uint64_t v; read(&v, sizeof(v)); return v; }
+
+    std::string readString();
+  };
+
+  /// Writes expressions as a table of records (arrays, update nodes and
+  /// expressions, each kind numbered in order of appearance), in which every
+  /// record only refers to records before it. Each node of the expression
+  /// DAG is written once, however many times it is encoded.
+  class ExprEncoder {
+    SerialWriter &out;
+    std::map<const Array*, uint32_t> arrays;
+    std::map<const UpdateNode*, uint32_t> updates;
+    std::map<const Expr*, uint32_t> exprs;
+
+  public:
+    /// The id of a null array, update node or expression.
+    static const uint32_t NoRecord = ~0U;
+
+    ExprEncoder(SerialWriter &_out) : out(_out) {}
+
+    uint32_t encode(const Array *array);
+    uint32_t encode(const UpdateNode *head);
+    uint32_t encode(const ref<Expr> &e);
+
+    /// Terminate the record table.
+    void finish();
+
+    /// The arrays written so far, with their ids.
+    const std::map<const Array*, uint32_t> &getArrays() const {
+      return arrays;
+    }
+  };
+
+  /// Reads a record table written by an ExprEncoder. Only truncated tables
+  /// and references to missing records are detected, the records themselves
+  /// are trusted to be well formed.
+  class ExprDecoder {
+    SerialReader &in;
+    /// The arrays decoded so far, by their address in the encoder.
+    std::map<uint64_t, const Array*> &knownArrays;
+
+    std::vector<const Array*> arrays;
+    // Only the heads matter, the lists keep the nodes alive
+    std::vector<UpdateList> updates;
+    std::vector< ref<Expr> > exprs;
+
+    bool decodeArray();
+    bool decodeUpdate();
+    bool decodeExpr();
+
+  protected:
+    /// Create a constant of the table. Decoders may override this to
+    /// translate values that do not mean the same on both ends (e.g.,
+    /// host addresses).
+    virtual ref<Expr> createConstant(const llvm::APInt &value);
+
+  public:
+    /// Arrays in \a knownArrays are reused, new arrays are added to it. A
+    /// decoded array that does not match the known one at its address makes
+    /// the table malformed.
+    ExprDecoder(SerialReader &_in,
+                std::map<uint64_t, const Array*> &_knownArrays)
+      : in(_in), knownArrays(_knownArrays) {}
+    virtual ~ExprDecoder() {}
+
+    /// Decode the table up to its end, return false if it is malformed.
+    bool decodeRecords();
+
+    /// Return whether the given id is NoRecord or the id of a decoded
+    /// record of that kind.
+    bool isValidArray(uint32_t id) const {
+      return id == ExprEncoder::NoRecord || id < arrays.size();
+    }
+    bool isValidUpdate(uint32_t id) const {
+      return id == ExprEncoder::NoRecord || id < updates.size();
+    }
+    bool isValidExpr(uint32_t id) const {
+      return id == ExprEncoder::NoRecord || id < exprs.size();
+    }
+
+    /// Return the decoded records, or null for NoRecord and invalid ids.
+    const Array *getArray(uint32_t id) const {
+      return id < arrays.size() ? arrays[id] : 0;
+    }
+    const UpdateNode *getUpdate(uint32_t id) const {
+      return id < updates.size() ? updates[id].head : 0;
+    }
+    ref<Expr> getExpr(uint32_t id) const {
+      return id < exprs.size() ? exprs[id] : ref<Expr>();
+    }
+  };
+}
+
+#endif
@@ -22,8 +22,46 @@ using llvm::dyn_cast_or_null;
 
 #include <boost/interprocess/detail/atomic.hpp>
 
+#include <stdint.h>
+
 namespace klee {
 
+/// Selects how ref<> updates reference counts. Atomic updates are only
+/// needed while referenced objects are shared between threads that do not
+/// otherwise synchronize (e.g., the parallel solvers); the interpreter
+/// itself uses plain updates by default. Defining KLEE_REFCOUNT_ATOMIC or
+/// KLEE_REFCOUNT_PLAIN fixes the policy at build time.
+class RefCountPolicy {
+public:
+  /// Use atomic updates (-atomic-refcounts). Only change it while no other
+  /// thread holds references.
+  static bool atomic;
+
+  static bool isAtomic() {
+#if defined(KLEE_REFCOUNT_ATOMIC)
+    return true;
+#elif defined(KLEE_REFCOUNT_PLAIN)
+    return false;
+#else
+    return atomic;
+#endif
+  }
+
+  static void inc(uint32_t *count) {
+    if (isAtomic())
+      boost::interprocess::detail::atomic_inc32(count);
+    else
+      ++*count;
+  }
+
+  /// Decrement \a count and return true if it dropped to zero.
+  static bool dec(uint32_t *count) {
+    if (isAtomic())
+      return 1 == boost::interprocess::detail::atomic_dec32(count);
+    return --*count == 0;
+  }
+};
+
 template<class T>
 class ref {
   T *ptr;
@@ -36,17 +74,12 @@ public:
 private:
   void inc() {
     if (ptr)
-      boost::interprocess::detail::atomic_inc32(&ptr->refCount);
-      //++ptr->refCount;
+      RefCountPolicy::inc(&ptr->refCount);
   }
   
   void dec() {
-    //if (ptr && --ptr->refCount == 0)
-    //  delete ptr;
-    if (ptr) {
-      if (1 == boost::interprocess::detail::atomic_dec32(&ptr->refCount))
-        delete ptr;
-    }
+    if (ptr && RefCountPolicy::dec(&ptr->refCount))
+      delete ptr;
   }  
 
 public:
@@ -39,12 +39,12 @@ public:
 #endif
   }
 
-  void addValueAt(APInt value, const void *obj, unsigned offset) {
-    addValueAt(value, uintptr_t(obj) + offset);
+  void addValueAt(APInt value, unsigned objectId, unsigned offset) {
+    addValueAt(value, objectId + offset);
   }
 
-  void removeValueAt(APInt value, const void *obj, unsigned offset) {
-    removeValueAt(value, uintptr_t(obj) + offset);
+  void removeValueAt(APInt value, unsigned objectId, unsigned offset) {
+    removeValueAt(value, objectId + offset);
   }
 };
 
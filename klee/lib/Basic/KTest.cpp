@@ -12,6 +12,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdint.h>
 
 #define KTEST_VERSION 3
 #define KTEST_MAGIC_SIZE 5
@@ -20,6 +21,11 @@
 // for compatibility reasons
 #define BOUT_MAGIC "BOUT\n"
 
+#define KTEST_BUNDLE_VERSION 1
+#define KTEST_BUNDLE_MAGIC_SIZE 5
+#define KTEST_BUNDLE_MAGIC "KTBDL"
+#define KTEST_BUNDLE_INDEX_MAGIC "KTIDX"
+
 /***/
 
 static int read_uint32(FILE *f, unsigned *value_out) {
@@ -91,13 +97,10 @@ int kTest_isKTestFile(const char *path) {
   return res;
 }
 
-KTest *kTest_fromFile(const char *path) {
-  FILE *f = fopen(path, "rb");
+static KTest *kTest_read(FILE *f) {
   KTest *res = 0;
   unsigned i, version;
 
-  if (!f) 
-    goto error;
   if (!kTest_checkHeader(f)) 
     goto error;
 
@@ -146,8 +149,6 @@ KTest *kTest_fromFile(const char *path) {
       goto error;
   }
 
-  fclose(f);
-
   return res;
  error:
   if (res) {
@@ -170,53 +171,77 @@ KTest *kTest_fromFile(const char *path) {
     free(res);
   }
 
-  if (f) fclose(f);
-
   return 0;
 }
 
-int kTest_toFile(KTest *bo, const char *path) {
-  FILE *f = fopen(path, "wb");
-  unsigned i;
+KTest *kTest_fromFile(const char *path) {
+  FILE *f = fopen(path, "rb");
+  KTest *res;
 
   if (!f) 
-    goto error;
+    return 0;
+  res = kTest_read(f);
+  fclose(f);
+
+  return res;
+}
+
+static int kTest_write(KTest *bo, FILE *f) {
+  unsigned i;
+
   if (fwrite(KTEST_MAGIC, strlen(KTEST_MAGIC), 1, f)!=1)
-    goto error;
+    return 0;
   if (!write_uint32(f, KTEST_VERSION))
-    goto error;
+    return 0;
       
   if (!write_uint32(f, bo->numArgs))
-    goto error;
+    return 0;
   for (i=0; i<bo->numArgs; i++) {
     if (!write_string(f, bo->args[i]))
-      goto error;
+      return 0;
   }
 
   if (!write_uint32(f, bo->symArgvs))
-    goto error;
+    return 0;
   if (!write_uint32(f, bo->symArgvLen))
-    goto error;
+    return 0;
   
   if (!write_uint32(f, bo->numObjects))
-    goto error;
+    return 0;
   for (i=0; i<bo->numObjects; i++) {
     KTestObject *o = &bo->objects[i];
     if (!write_string(f, o->name))
-      goto error;
+      return 0;
     if (!write_uint32(f, o->numBytes))
-      goto error;
+      return 0;
     if (fwrite(o->bytes, o->numBytes, 1, f)!=1)
-      goto error;
+      return 0;
   }
 
-  fclose(f);
-
   return 1;
- error:
-  if (f) fclose(f);
-  
-  return 0;
+}
+
+/* number of bytes written by kTest_write */
+static unsigned kTest_size(KTest *bo) {
+  unsigned i, res = KTEST_MAGIC_SIZE + 4 + 4 + 4 + 4 + 4;
+  for (i=0; i<bo->numArgs; i++)
+    res += 4 + strlen(bo->args[i]);
+  for (i=0; i<bo->numObjects; i++)
+    res += 4 + strlen(bo->objects[i].name) + 4 + bo->objects[i].numBytes;
+  return res;
+}
+
+int kTest_toFile(KTest *bo, const char *path) {
+  FILE *f = fopen(path, "wb");
+
+  if (!f) 
+    return 0;
+  if (!kTest_write(bo, f)) {
+    fclose(f);
+    return 0;
+  }
+
+  return fclose(f) == 0;
 }
 
 unsigned kTest_numBytes(KTest *bo) {
@@ -238,3 +263,303 @@ void kTest_free(KTest *bo) {
   free(bo->objects);
   free(bo);
 }
+
+/***/
+
+struct KTestBundleEntry {
+  unsigned id;
+  char *suffix;
+  /* position of the contents of the entry in the bundle */
+  uint64_t offset;
+  unsigned size;
+};
+
+struct KTestBundle {
+  FILE *f;
+  int writing;
+  unsigned numEntries, capacity;
+  struct KTestBundleEntry *entries;
+};
+
+static int write_uint64(FILE *f, uint64_t value) {
+  return write_uint32(f, value >> 32) && write_uint32(f, value);
+}
+
+static int read_uint64(FILE *f, uint64_t *value_out) {
+  unsigned hi, lo;
+  if (!read_uint32(f, &hi) || !read_uint32(f, &lo))
+    return 0;
+  *value_out = ((uint64_t) hi << 32) | lo;
+  return 1;
+}
+
+static int kTestBundle_checkHeader(FILE *f) {
+  char header[KTEST_BUNDLE_MAGIC_SIZE];
+  unsigned version;
+  if (fread(header, KTEST_BUNDLE_MAGIC_SIZE, 1, f)!=1)
+    return 0;
+  if (memcmp(header, KTEST_BUNDLE_MAGIC, KTEST_BUNDLE_MAGIC_SIZE))
+    return 0;
+  if (!read_uint32(f, &version) || version > KTEST_BUNDLE_VERSION)
+    return 0;
+  return 1;
+}
+
+static int kTestBundle_addEntry(KTestBundle *b, unsigned id, char *suffix,
+                                uint64_t offset, unsigned size) {
+  struct KTestBundleEntry *e;
+
+  if (b->numEntries == b->capacity) {
+    unsigned capacity = b->capacity ? 2 * b->capacity : 64;
+    e = (struct KTestBundleEntry*) realloc(b->entries,
+                                           capacity * sizeof(*e));
+    if (!e)
+      return 0;
+    b->entries = e;
+    b->capacity = capacity;
+  }
+
+  e = &b->entries[b->numEntries++];
+  e->id = id;
+  e->suffix = suffix;
+  e->offset = offset;
+  e->size = size;
+  return 1;
+}
+
+/* appends the header of an entry and records it in the index */
+static int kTestBundle_beginEntry(KTestBundle *b, unsigned id,
+                                  const char *suffix, unsigned size) {
+  char *s;
+  long pos;
+
+  if (!b->writing)
+    return 0;
+  if (!write_uint32(b->f, id) || !write_string(b->f, suffix) ||
+      !write_uint32(b->f, size))
+    return 0;
+  if ((pos = ftell(b->f)) < 0)
+    return 0;
+
+  s = strdup(suffix);
+  if (!s)
+    return 0;
+  if (!kTestBundle_addEntry(b, id, s, pos, size)) {
+    free(s);
+    return 0;
+  }
+  return 1;
+}
+
+/* reads the index written by kTestBundle_close, if any */
+static int kTestBundle_readIndex(KTestBundle *b) {
+  char magic[KTEST_BUNDLE_MAGIC_SIZE];
+  uint64_t indexOffset;
+  unsigned i, n;
+
+  if (fseek(b->f, -(long) (8 + KTEST_BUNDLE_MAGIC_SIZE), SEEK_END))
+    return 0;
+  if (!read_uint64(b->f, &indexOffset))
+    return 0;
+  if (fread(magic, KTEST_BUNDLE_MAGIC_SIZE, 1, b->f)!=1 ||
+      memcmp(magic, KTEST_BUNDLE_INDEX_MAGIC, KTEST_BUNDLE_MAGIC_SIZE))
+    return 0;
+
+  if (fseek(b->f, indexOffset, SEEK_SET))
+    return 0;
+  if (!read_uint32(b->f, &n))
+    return 0;
+  for (i=0; i<n; i++) {
+    unsigned id, size;
+    uint64_t offset;
+    char *suffix;
+    if (!read_uint32(b->f, &id) || !read_string(b->f, &suffix))
+      return 0;
+    if (!read_uint64(b->f, &offset) || !read_uint32(b->f, &size) ||
+        !kTestBundle_addEntry(b, id, suffix, offset, size)) {
+      free(suffix);
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* rebuilds the index from the entries themselves */
+static int kTestBundle_scan(KTestBundle *b) {
+  long end;
+
+  if (fseek(b->f, 0, SEEK_END) || (end = ftell(b->f)) < 0)
+    return 0;
+  if (fseek(b->f, KTEST_BUNDLE_MAGIC_SIZE + 4, SEEK_SET))
+    return 0;
+
+  for (;;) {
+    unsigned id, size;
+    char *suffix;
+    long pos;
+    if (!read_uint32(b->f, &id))
+      return 1;
+    if (!read_string(b->f, &suffix))
+      return 1;
+    /* a truncated entry ends the bundle */
+    if (!read_uint32(b->f, &size) || (pos = ftell(b->f)) < 0 ||
+        size > end - pos || fseek(b->f, size, SEEK_CUR)) {
+      free(suffix);
+      return 1;
+    }
+    if (!kTestBundle_addEntry(b, id, suffix, pos, size)) {
+      free(suffix);
+      return 0;
+    }
+  }
+}
+
+static void kTestBundle_free(KTestBundle *b) {
+  unsigned i;
+  for (i=0; i<b->numEntries; i++)
+    free(b->entries[i].suffix);
+  free(b->entries);
+  free(b);
+}
+
+int kTestBundle_isBundleFile(const char *path) {
+  FILE *f = fopen(path, "rb");
+  int res;
+
+  if (!f)
+    return 0;
+  res = kTestBundle_checkHeader(f);
+  fclose(f);
+
+  return res;
+}
+
+KTestBundle *kTestBundle_create(const char *path) {
+  KTestBundle *b = (KTestBundle*) calloc(1, sizeof(*b));
+
+  if (!b)
+    return 0;
+  b->writing = 1;
+  b->f = fopen(path, "wb");
+  if (!b->f)
+    goto error;
+  /* entries are small, write them out in large batches */
+  setvbuf(b->f, NULL, _IOFBF, 1 << 20);
+
+  if (fwrite(KTEST_BUNDLE_MAGIC, KTEST_BUNDLE_MAGIC_SIZE, 1, b->f)!=1)
+    goto error;
+  if (!write_uint32(b->f, KTEST_BUNDLE_VERSION))
+    goto error;
+
+  return b;
+ error:
+  if (b->f) fclose(b->f);
+  kTestBundle_free(b);
+
+  return 0;
+}
+
+KTestBundle *kTestBundle_open(const char *path) {
+  KTestBundle *b = (KTestBundle*) calloc(1, sizeof(*b));
+
+  if (!b)
+    return 0;
+  b->f = fopen(path, "rb");
+  if (!b->f)
+    goto error;
+  if (!kTestBundle_checkHeader(b->f))
+    goto error;
+
+  if (!kTestBundle_readIndex(b)) {
+    unsigned i;
+    for (i=0; i<b->numEntries; i++)
+      free(b->entries[i].suffix);
+    b->numEntries = 0;
+    if (!kTestBundle_scan(b))
+      goto error;
+  }
+
+  return b;
+ error:
+  if (b->f) fclose(b->f);
+  kTestBundle_free(b);
+
+  return 0;
+}
+
+int kTestBundle_addTest(KTestBundle *b, unsigned id, KTest *bo) {
+  return kTestBundle_beginEntry(b, id, "ktest", kTest_size(bo)) &&
+    kTest_write(bo, b->f);
+}
+
+int kTestBundle_addFile(KTestBundle *b, unsigned id, const char *suffix,
+                        const void *data, unsigned size) {
+  if (!kTestBundle_beginEntry(b, id, suffix, size))
+    return 0;
+  return size == 0 || fwrite(data, size, 1, b->f)==1;
+}
+
+unsigned kTestBundle_numEntries(KTestBundle *b) {
+  return b->numEntries;
+}
+
+unsigned kTestBundle_getEntryID(KTestBundle *b, unsigned index) {
+  return b->entries[index].id;
+}
+
+const char *kTestBundle_getEntrySuffix(KTestBundle *b, unsigned index) {
+  return b->entries[index].suffix;
+}
+
+void *kTestBundle_getEntryData(KTestBundle *b, unsigned index,
+                               unsigned *size_out) {
+  struct KTestBundleEntry *e = &b->entries[index];
+  void *res;
+
+  if (b->writing || fseek(b->f, e->offset, SEEK_SET))
+    return 0;
+  res = malloc(e->size ? e->size : 1);
+  if (!res)
+    return 0;
+  if (e->size && fread(res, e->size, 1, b->f)!=1) {
+    free(res);
+    return 0;
+  }
+
+  *size_out = e->size;
+  return res;
+}
+
+KTest *kTestBundle_getTest(KTestBundle *b, unsigned index) {
+  struct KTestBundleEntry *e = &b->entries[index];
+
+  if (b->writing || strcmp(e->suffix, "ktest"))
+    return 0;
+  if (fseek(b->f, e->offset, SEEK_SET))
+    return 0;
+  return kTest_read(b->f);
+}
+
+int kTestBundle_close(KTestBundle *b) {
+  int res = 1;
+
+  if (b->writing) {
+    long indexOffset = ftell(b->f);
+    unsigned i;
+
+    res = indexOffset >= 0 && write_uint32(b->f, b->numEntries);
+    for (i=0; res && i<b->numEntries; i++) {
+      struct KTestBundleEntry *e = &b->entries[i];
+      res = write_uint32(b->f, e->id) && write_string(b->f, e->suffix) &&
+        write_uint64(b->f, e->offset) && write_uint32(b->f, e->size);
+    }
+    res = res && write_uint64(b->f, indexOffset) &&
+      fwrite(KTEST_BUNDLE_INDEX_MAGIC, KTEST_BUNDLE_MAGIC_SIZE, 1, b->f)==1;
+  }
+
+  if (fclose(b->f))
+    res = 0;
+  kTestBundle_free(b);
+
+  return res;
+}
@@ -49,6 +49,14 @@ void StatisticManager::registerStatistic(Statistic &s) {
   memset(globalStats, 0, sizeof(*globalStats)*stats.size());
 }
 
+__thread StatisticRecord *StatisticManager::threadStats = 0;
+
+void StatisticManager::addStatistics(const StatisticRecord &sr) {
+  for (unsigned i=0; i<stats.size(); i++)
+    if (sr.data[i])
+      incrementStatistic(*stats[i], sr.data[i]);
+}
+
 int StatisticManager::getStatisticID(const std::string &name) const {
   for (unsigned i=0; i<stats.size(); i++)
     if (stats[i]->getName() == name)
@@ -37,6 +37,7 @@
 #include "llvm/Support/CommandLine.h"
 
 #include <cassert>
+#include <climits>
 #include <algorithm>
 #include <boost/asio.hpp>
 #include <boost/bind.hpp>
@@ -60,6 +61,10 @@ cl::opt<unsigned int> WorkerWorry("worker-worry",
 
 cl::opt<unsigned int> WorryRate("worry-rate",
     cl::desc("Worry advertising rate"), cl::init(10));
+
+cl::opt<unsigned int> MergeColocationSlack("merge-colocation-slack",
+    cl::desc("How far above the average load (in percent) a worker may get "
+        "by gathering the states of a merge cluster"), cl::init(10));
 }
 
 cl::opt<unsigned int> BalanceTimeOut("balance-tout",
@@ -151,6 +156,7 @@ void LoadBalancer::deregisterWorker(worker_id_t id) {
 
     if (worker->transferReq && worker->globalTransfer.first == id) {
       worker->transferReq = false;
+      worker->transferClusters.clear();
     }
     if (worker->partTransfers.size() > 0) {
       for (part_transfers_t::iterator pIt = worker->partTransfers.begin();
@@ -263,18 +269,25 @@ void LoadBalancer::analyze(worker_id_t id) {
 
 void LoadBalancer::displayStatistics() {
   unsigned int totalJobs = 0;
+  uint64_t totalPaths = 0;
 
   CLOUD9_INFO("================================================================");
   for (std::map<worker_id_t, Worker*>::iterator wIt = workers.begin();
       wIt != workers.end(); wIt++) {
     Worker *worker = wIt->second;
 
-    CLOUD9_INFO("[" << worker->getTotalJobs() << "] for worker " << worker->id);
+    if (worker->hasLoadData) {
+      CLOUD9_INFO("[" << worker->getTotalJobs() << "] for worker " << worker->id
+          << " (" << worker->totalPaths << " paths)");
+    } else {
+      CLOUD9_INFO("[" << worker->getTotalJobs() << "] for worker " << worker->id);
+    }
 
     totalJobs += worker->getTotalJobs();
+    totalPaths += worker->totalPaths;
   }
   CLOUD9_INFO("----------------------------------------------------------------");
-  CLOUD9_INFO("[" << totalJobs << "] IN TOTAL");
+  CLOUD9_INFO("[" << totalJobs << "] IN TOTAL (" << totalPaths << " paths)");
   CLOUD9_INFO("================================================================");
 }
 
@@ -356,6 +369,16 @@ void LoadBalancer::updatePartitioningData(worker_id_t id, const part_stat_t &sta
   worker->statePartitions = stats;
 }
 
+void LoadBalancer::updateWorkerLoad(worker_id_t id, uint64_t paths,
+    const cluster_stat_t &clusters) {
+  Worker *worker = workers[id];
+  assert(worker);
+
+  worker->hasLoadData = true;
+  worker->totalPaths = paths;
+  worker->mergeClusters = clusters;
+}
+
 void LoadBalancer::getAndResetCoverageUpdates(worker_id_t id,
     cov_update_t &data) {
   Worker *w = workers[id];
@@ -369,19 +392,22 @@ void LoadBalancer::getAndResetCoverageUpdates(worker_id_t id,
 }
 
 bool LoadBalancer::requestAndResetTransfer(worker_id_t id, transfer_t &globalTrans,
-      part_transfers_t &partTrans) {
+      part_transfers_t &partTrans, std::vector<uint64_t> &clusters) {
   Worker *w = workers[id];
 
   if (!w->transferReq && w->partTransfers.empty()) {
     return false;
   }
 
-  if (w->transferReq)
+  if (w->transferReq) {
     globalTrans = w->globalTransfer;
+    clusters = w->transferClusters;
+  }
   if (!w->partTransfers.empty())
     partTrans = w->partTransfers;
 
   w->transferReq = false;
+  w->transferClusters.clear();
   w->partTransfers.clear();
 
   return true;
@@ -423,7 +449,9 @@ bool LoadBalancer::analyzeBalance(std::map<worker_id_t, unsigned> &load,
 
   while (lowLoadIt < highLoadIt) {
     unsigned xferCount = (highLoadIt->second - lowLoadIt->second) / 2;
-    if (lowLoadIt->second * balanceThreshold <= loadAvg && xferCount >= minTransfer) {
+    // Merged loads count paths, which can overflow once scaled
+    if ((uint64_t) lowLoadIt->second * balanceThreshold <= loadAvg &&
+        xferCount >= minTransfer) {
       xfers[highLoadIt->first] = std::make_pair(lowLoadIt->first, xferCount);
       highLoadIt--;
       lowLoadIt++;
@@ -442,10 +470,24 @@ void LoadBalancer::analyzeAggregateBalance() {
 
   std::map<worker_id_t, unsigned> load;
   std::map<worker_id_t, transfer_t> xfers;
+  std::map<worker_id_t, std::vector<uint64_t> > xferClusters;
+
+  // Merged states stand for many paths, so balance on paths when all the
+  // workers report them
+  bool weighted = true;
 
   for (std::map<worker_id_t, Worker*>::iterator it = workers.begin(); it
       != workers.end(); it++) {
-    load[it->first] = it->second->totalJobs;
+    weighted &= it->second->hasLoadData;
+  }
+
+  for (std::map<worker_id_t, Worker*>::iterator it = workers.begin(); it
+      != workers.end(); it++) {
+    if (weighted)
+      load[it->first] = (unsigned) std::min(it->second->totalPaths,
+          (uint64_t) (UINT_MAX / workers.size()));
+    else
+      load[it->first] = it->second->totalJobs;
   }
 
   bool result = analyzeBalance(load, xfers, 10, 1);
@@ -455,6 +497,11 @@ void LoadBalancer::analyzeAggregateBalance() {
     return;
   }
 
+  if (weighted) {
+    convertWeightedTransfers(xfers, xferClusters);
+    addColocationTransfers(load, xfers, xferClusters);
+  }
+
   CLOUD9_INFO("Performing load balancing");
 
   if (xfers.size() > 0) {
@@ -468,6 +515,7 @@ void LoadBalancer::analyzeAggregateBalance() {
 
       worker->transferReq = true;
       worker->globalTransfer = it->second;
+      worker->transferClusters = xferClusters[it->first];
 
       CLOUD9_DEBUG("Created transfer request from " << it->first << " to " <<
             it->second.first << " for " << it->second.second << " states");
@@ -475,6 +523,117 @@ void LoadBalancer::analyzeAggregateBalance() {
   }
 }
 
+void LoadBalancer::getClusterHomes(
+    std::map<uint64_t, std::pair<worker_id_t, uint64_t> > &homes) {
+  // A cluster is home on the worker holding most of its paths
+  for (std::map<worker_id_t, Worker*>::iterator wit = workers.begin();
+      wit != workers.end(); wit++) {
+    cluster_stat_t &clusters = wit->second->mergeClusters;
+
+    for (cluster_stat_t::iterator cit = clusters.begin();
+        cit != clusters.end(); cit++) {
+      std::pair<worker_id_t, uint64_t> &home = homes[cit->first];
+      if (home.first == 0 || cit->second.second > home.second)
+        home = std::make_pair(wit->first, cit->second.second);
+    }
+  }
+}
+
+void LoadBalancer::convertWeightedTransfers(
+    std::map<worker_id_t, transfer_t> &xfers,
+    std::map<worker_id_t, std::vector<uint64_t> > &xferClusters) {
+  std::map<uint64_t, std::pair<worker_id_t, uint64_t> > homes;
+  getClusterHomes(homes);
+
+  for (std::map<worker_id_t, transfer_t>::iterator it = xfers.begin();
+      it != xfers.end(); it++) {
+    Worker *worker = workers[it->first];
+    worker_id_t destination = it->second.first;
+
+    // The workers move jobs, assume they stand for the same number of
+    // paths each
+    if (worker->totalPaths > 0) {
+      uint64_t jobs = ((uint64_t) it->second.second * worker->totalJobs +
+          worker->totalPaths - 1) / worker->totalPaths;
+      it->second.second = (unsigned) std::max((uint64_t) 1,
+          std::min(jobs, (uint64_t) worker->totalJobs));
+    }
+
+    // Prefer the clusters that would join their siblings
+    cluster_stat_t &clusters = worker->mergeClusters;
+    for (cluster_stat_t::iterator cit = clusters.begin();
+        cit != clusters.end(); cit++) {
+      if (homes[cit->first].first == destination)
+        xferClusters[it->first].push_back(cit->first);
+    }
+  }
+}
+
+void LoadBalancer::addColocationTransfers(
+    std::map<worker_id_t, unsigned> &load,
+    std::map<worker_id_t, transfer_t> &xfers,
+    std::map<worker_id_t, std::vector<uint64_t> > &xferClusters) {
+  std::map<uint64_t, std::pair<worker_id_t, uint64_t> > homes;
+  getClusterHomes(homes);
+
+  uint64_t loadAvg = 0;
+  for (std::map<worker_id_t, unsigned>::iterator it = load.begin();
+      it != load.end(); it++) {
+    loadAvg += it->second;
+  }
+  loadAvg /= load.size();
+
+  uint64_t maxLoad = loadAvg * (100 + MergeColocationSlack) / 100;
+  uint64_t minLoad = loadAvg * (100 - std::min(100U,
+      (unsigned) MergeColocationSlack)) / 100;
+
+  std::set<worker_id_t> busy;
+  for (std::map<worker_id_t, transfer_t>::iterator it = xfers.begin();
+      it != xfers.end(); it++) {
+    busy.insert(it->first);
+    busy.insert(it->second.first);
+  }
+
+  // Send the stray parts of the merge clusters to their homes, as long as
+  // this keeps the load even
+  for (std::map<worker_id_t, Worker*>::iterator wit = workers.begin();
+      wit != workers.end(); wit++) {
+    if (busy.count(wit->first))
+      continue;
+
+    cluster_stat_t &clusters = wit->second->mergeClusters;
+    cluster_stat_t::iterator best = clusters.end();
+
+    for (cluster_stat_t::iterator cit = clusters.begin();
+        cit != clusters.end(); cit++) {
+      worker_id_t home = homes[cit->first].first;
+      if (home == wit->first || busy.count(home))
+        continue;
+
+      if (load[home] + cit->second.second > maxLoad ||
+          load[wit->first] < minLoad + cit->second.second)
+        continue;
+
+      if (best == clusters.end() || cit->second.second > best->second.second)
+        best = cit;
+    }
+
+    if (best == clusters.end())
+      continue;
+
+    worker_id_t home = homes[best->first].first;
+
+    xfers[wit->first] = std::make_pair(home, best->second.first);
+    xferClusters[wit->first].push_back(best->first);
+
+    load[home] += best->second.second;
+    load[wit->first] -= best->second.second;
+
+    busy.insert(wit->first);
+    busy.insert(home);
+  }
+}
+
 bool LoadBalancer::analyzePartitionBalance() {
   // Compute the aggregate situation
   if (workers.size() < 2) {
@@ -139,6 +139,7 @@ void WorkerConnection::handleMessageReceived(std::string &msgString,
     //processNodeSetUpdate(message); // XXX We disable this for now, it's useless
     processNodeDataUpdate(message);
     processStatisticsUpdates(message);
+    processLoadUpdate(message);
 
     if (worker->hasPartitions())
       processPartitionUpdates(message);
@@ -169,9 +170,10 @@ void WorkerConnection::sendJobTransfers(LBResponseMessage &response) {
 
   transfer_t globalTrans;
   part_transfers_t partTrans;
+  std::vector<uint64_t> clusters;
 
   bool result = lb->requestAndResetTransfer(id, globalTrans,
-      partTrans);
+      partTrans, clusters);
 
   if (result) {
     if (partTrans.empty()) {
@@ -182,6 +184,9 @@ void WorkerConnection::sendJobTransfers(LBResponseMessage &response) {
       transMsg->set_dest_address(destination->getAddress());
       transMsg->set_dest_port(destination->getPort());
       transMsg->set_count(globalTrans.second);
+
+      for (unsigned i = 0; i < clusters.size(); i++)
+        transMsg->add_merge_indexes(clusters[i]);
     } else {
       // Fill in the partitioning structures
       std::map<worker_id_t, LBResponseMessage_JobTransfer*> destinations;
@@ -278,6 +283,27 @@ bool WorkerConnection::processPartitionUpdates(const WorkerReportMessage &messag
   return true;
 }
 
+bool WorkerConnection::processLoadUpdate(const WorkerReportMessage &message) {
+  if (!message.has_loadupdate())
+    return false;
+
+  worker_id_t id = message.id();
+  const WorkerReportMessage_LoadUpdate &loadUpdateMsg = message.loadupdate();
+
+  cluster_stat_t clusters;
+
+  for (int i = 0; i < loadUpdateMsg.clusters_size(); i++) {
+    const MergeCluster &cluster = loadUpdateMsg.clusters(i);
+
+    clusters.insert(std::make_pair(cluster.merge_index(),
+        std::make_pair(cluster.jobs(), cluster.paths())));
+  }
+
+  lb->updateWorkerLoad(id, loadUpdateMsg.paths(), clusters);
+
+  return true;
+}
+
 bool WorkerConnection::processNodeSetUpdate(const WorkerReportMessage &message) {
   if (!message.has_nodesetupdate())
     return false;
@@ -88,6 +88,7 @@
 #include "klee/Internal/Module/KModule.h"
 #include "klee/Internal/System/Time.h"
 #include "klee/Internal/ADT/RNG.h"
+#include "klee/Internal/Support/SamplingProfiler.h"
 #include "klee/util/ExprPPrinter.h"
 #include "klee/KleeHandler.h"
 #include "klee/Init.h"
@@ -99,11 +100,13 @@
 #include <boost/crc.hpp>
 #include <boost/bind.hpp>
 #include <stack>
+#include <algorithm>
 #include <map>
 #include <set>
 #include <fstream>
 #include <iostream>
 #include <iomanip>
+#include <sstream>
 
 using llvm::sys::TimeValue;
 using cloud9::instrum::Timer;
@@ -175,6 +178,13 @@ cl::opt<bool>
 
 cl::opt<unsigned> FlowSizeLimit("flow-size-limit", cl::init(10));
 
+cl::opt<bool>
+  TransferStates("transfer-states",
+      cl::desc("Send the states of exported jobs along with their paths, "
+          "instead of having the receiver replay them. The workers must run "
+          "the same binary without address space randomization."),
+      cl::init(false));
+
 }
 
 using namespace klee;
@@ -187,6 +197,17 @@ namespace worker {
  * HELPER FUNCTIONS FOR THE JOB MANAGER
  ******************************************************************************/
 
+static bool isSmallerCluster(const std::vector<ExecutionJob*> &a,
+    const std::vector<ExecutionJob*> &b) {
+  return a.size() < b.size();
+}
+
+static bool isLargerCluster(const std::pair<uint64_t,
+    std::pair<unsigned, uint64_t> > &a, const std::pair<uint64_t,
+    std::pair<unsigned, uint64_t> > &b) {
+  return a.second.first > b.second.first;
+}
+
 StateSelectionStrategy *JobManager::createCoverageOptimizedStrat(StateSelectionStrategy *base) {
   std::vector<StateSelectionStrategy*> strategies;
 
@@ -383,18 +404,15 @@ void JobManager::processTestCase(SymbolicState *state) {
   if (eventEntries.size() == 0)
     return;
 
-  std::ostream *f = kleeHandler->openTestFile("events");
-
-  if (f) {
-    for (std::vector<EventEntry*>::iterator it = eventEntries.begin();
-        it != eventEntries.end(); it++) {
-      EventEntry *event = *it;
-      *f << "Event: " << event->getType() << " Value: " << event->getValue() << std::endl;
-      event->getStackTrace().dump(*f);
-      *f << std::endl;
-    }
-    delete f;
+  std::ostringstream f;
+  for (std::vector<EventEntry*>::iterator it = eventEntries.begin();
+      it != eventEntries.end(); it++) {
+    EventEntry *event = *it;
+    f << "Event: " << event->getType() << " Value: " << event->getValue() << std::endl;
+    event->getStackTrace().dump(f);
+    f << std::endl;
   }
+  kleeHandler->writeTestFile("events", f.str());
 }
 
 /*******************************************************************************
@@ -403,43 +421,47 @@ void JobManager::processTestCase(SymbolicState *state) {
 
 /* Initialization Methods *****************************************************/
 
-JobManager::JobManager(llvm::Module *module, std::string mainFnName, int argc,
-    char **argv, char **envp) :
+JobManager::JobManager(klee::KModule *kmodule, std::string mainFnName,
+    int argc, char **argv, char **envp) :
   terminationRequest(false), jobCount(0), currentJob(NULL), currentState(NULL),
-  replaying(false), batching(true), traceCounter(0) {
+  replaying(false), batching(true), stepping(false), pauseRequests(0),
+  traceCounter(0) {
 
   tree = new WorkerTree();
 
-  llvm::Function *mainFn = module->getFunction(mainFnName);
-
   collectTraces = DumpStateTraces || DumpInstrTraces;
 
-  initialize(module, mainFn, argc, argv, envp);
+  initialize(kmodule, mainFnName, argc, argv, envp);
 }
 
-void JobManager::initialize(llvm::Module *module, llvm::Function *_mainFn,
-    int argc, char **argv, char **envp) {
-  mainFn = _mainFn;
-  assert(mainFn);
-
-  klee::Interpreter::InterpreterOptions iOpts;
-  iOpts.MakeConcreteSymbolic = MakeConcreteSymbolic;
-
+klee::KModule *JobManager::prepareModule(llvm::Module *module) {
   llvm::sys::Path libraryPath(getKleeLibraryPath());
 
   klee::Interpreter::ModuleOptions mOpts(libraryPath.c_str(),
   /*Optimize=*/OptimizeModule,
   /*CheckDivZero=*/CheckDivZero);
 
+  return klee::Interpreter::prepareModule(module, mOpts);
+}
+
+void JobManager::initialize(klee::KModule *kmodule, std::string mainFnName,
+    int argc, char **argv, char **envp) {
+  klee::Interpreter::InterpreterOptions iOpts;
+  iOpts.MakeConcreteSymbolic = MakeConcreteSymbolic;
+
   kleeHandler = new klee::KleeHandler(argc, argv);
   interpreter = klee::Interpreter::create(iOpts, kleeHandler);
   kleeHandler->setInterpreter(interpreter);
 
   symbEngine = dyn_cast<SymbolicEngine> (interpreter);
-  interpreter->setModule(module, mOpts);
+  interpreter->setModule(kmodule);
 
   kleeModule = symbEngine->getModule();
 
+  // The module may have been replaced by a cached one
+  mainFn = kleeModule->module->getFunction(mainFnName);
+  assert(mainFn);
+
   klee::externalsAndGlobalsCheck(kleeModule->module);
 
   symbEngine->registerStateEventHandler(this);
@@ -543,6 +565,7 @@ void JobManager::finalize() {
   dumpSymbolicTree(NULL, WorkerNodeDecorator(NULL));
   symbEngine->deregisterStateEventHandler(this);
   symbEngine->destroyStates();
+  kleeHandler->flushTestCases();
 
   CLOUD9_INFO("Finalized job execution.");
 }
@@ -679,6 +702,8 @@ ExecutionJob* JobManager::selectNextJob(boost::unique_lock<boost::mutex> &lock,
 
 
 ExecutionJob* JobManager::selectNextJob(bool &canBatch, uint32_t &batchDest) {
+  klee::SamplingProfiler::ActivityScope activity(
+      klee::SamplingProfiler::Searcher);
   ExecutionJob *job = selStrategy->onNextJobSelectionEx(canBatch, batchDest);
 
   if (!StratOracle)
@@ -766,6 +791,59 @@ void JobManager::selectJobs(WorkerTree::Node *root,
   }
 }
 
+void JobManager::selectClusteredJobs(WorkerTree::Node *root,
+    std::vector<ExecutionJob*> &jobSet, int maxCount,
+    const std::set<uint64_t> &preferred) {
+  std::vector<WorkerTree::Node*> nodes;
+
+  tree->getLeaves(WORKER_LAYER_JOBS, root, boost::bind(
+      &JobManager::isExportableJob, this, _1), 0, nodes);
+
+  // Group the jobs sitting on their states by merge index, the others
+  // cannot be merged before they are replayed anyway
+  std::map<uint64_t, std::vector<ExecutionJob*> > clusters;
+  std::vector<std::vector<ExecutionJob*> > groups;
+
+  for (std::vector<WorkerTree::Node*>::iterator it = nodes.begin(); it
+      != nodes.end(); it++) {
+    ExecutionJob *job = (**(*it)).getJob();
+    SymbolicState *state = (**(*it)).getSymbolicState();
+
+    if (state && !job->reconstruct)
+      clusters[(**state).getMergeIndex()].push_back(job);
+    else
+      groups.push_back(std::vector<ExecutionJob*>(1, job));
+  }
+
+  // Requested clusters go first, then the smallest ones, so that the
+  // large clusters stay together
+  std::vector<std::vector<ExecutionJob*> > requested;
+  for (std::map<uint64_t, std::vector<ExecutionJob*> >::iterator it =
+      clusters.begin(); it != clusters.end(); it++) {
+    if (preferred.count(it->first))
+      requested.push_back(it->second);
+    else
+      groups.push_back(it->second);
+  }
+
+  std::stable_sort(groups.begin(), groups.end(), isSmallerCluster);
+  groups.insert(groups.begin(), requested.begin(), requested.end());
+
+  unsigned limit = (maxCount > 0) ? maxCount : nodes.size();
+  unsigned count = 0;
+
+  for (unsigned i = 0; i < groups.size() && count < limit; i++) {
+    std::vector<ExecutionJob*> &group = groups[i];
+
+    // Split a cluster only if nothing was selected otherwise
+    if (count + group.size() > limit && count > 0)
+      continue;
+
+    for (unsigned j = 0; j < group.size() && count < limit; j++, count++)
+      jobSet.push_back(group[j]);
+  }
+}
+
 unsigned int JobManager::countJobs(WorkerTree::Node *root) {
   return tree->countLeaves(WORKER_LAYER_JOBS, root, &isJob);
 }
@@ -801,7 +879,7 @@ void JobManager::importJobs(ExecutionPathSetPin paths,
     ExecutionJob *job = new ExecutionJob(tree->getNode(WORKER_LAYER_JOBS, crtNode));
     job->reconstruct = it->second;
 
-    if (!isValidJob(crtNode)) {
+    if (!isValidJob(crtNode) && !job->reconstruct->stateBundle) {
       droppedCount++;
 
       delete job;
@@ -824,10 +902,14 @@ void JobManager::importJobs(ExecutionPathSetPin paths,
 
 ExecutionPathSetPin JobManager::exportJobs(ExecutionPathSetPin seeds,
     std::vector<int> &counts,
-    std::map<unsigned,JobReconstruction*> &reconstruct) {
+    std::map<unsigned,JobReconstruction*> &reconstruct,
+    const std::set<uint64_t> *mergeIndexes) {
 
   boost::unique_lock<boost::mutex> lock(jobsMutex);
 
+  // Keep the states still while we look at them
+  pauseStepping(lock);
+
   std::vector<WorkerTree::Node*> roots;
   std::vector<ExecutionJob*> jobs;
   std::map<WorkerTree::Node*, JobReconstruction*> nodeReconMap;
@@ -838,7 +920,11 @@ ExecutionPathSetPin JobManager::exportJobs(ExecutionPathSetPin seeds,
   tree->getNodes(WORKER_LAYER_JOBS, seeds, roots, (std::map<unsigned,WorkerTree::Node*>*)NULL);
 
   for (unsigned int i = 0; i < seeds->count(); i++) {
-    selectJobs(roots[i], jobs, (counts.size() > 0) ? counts[i] : 0);
+    int count = (counts.size() > 0) ? counts[i] : 0;
+    if (mergeIndexes)
+      selectClusteredJobs(roots[i], jobs, count, *mergeIndexes);
+    else
+      selectJobs(roots[i], jobs, count);
   }
 
   for (std::vector<ExecutionJob*>::iterator it = jobs.begin(); it != jobs.end(); it++) {
@@ -850,6 +936,9 @@ ExecutionPathSetPin JobManager::exportJobs(ExecutionPathSetPin seeds,
     reconJob->appendNodes(nodeSet);
   }
 
+  if (TransferStates)
+    exportJobStates(jobs, nodeReconMap);
+
   // Do this before de-registering the jobs, in order to keep the nodes pinned
   ExecutionPathSetPin paths = tree->buildPathSet(nodeSet.begin(),
       nodeSet.end(), &encodeMap);
@@ -876,9 +965,51 @@ ExecutionPathSetPin JobManager::exportJobs(ExecutionPathSetPin seeds,
   cloud9::instrum::theInstrManager.decStatistic(
       cloud9::instrum::TotalTreePaths, paths->count());
 
+  resumeStepping();
+
   return paths;
 }
 
+void JobManager::exportJobStates(std::vector<ExecutionJob*> &jobs,
+    std::map<WorkerTree::Node*, JobReconstruction*> &nodeReconMap) {
+  std::vector<klee::ExecutionState*> kStates;
+  std::vector<JobReconstruction*> reconJobs;
+  std::vector<unsigned long> instrCounts;
+
+  for (std::vector<ExecutionJob*>::iterator it = jobs.begin(); it != jobs.end(); it++) {
+    ExecutionJob *job = *it;
+    WorkerTree::Node *node = job->getNode().get();
+    SymbolicState *state = (**node).getSymbolicState();
+
+    // Only jobs sitting on their own state, the others are replayed
+    if (job->reconstruct || !state || state == currentState ||
+        pendingDeletions.count(state))
+      continue;
+
+    kStates.push_back(&(**state));
+    reconJobs.push_back(nodeReconMap[node]);
+    instrCounts.push_back(state->_instrSinceFork);
+  }
+
+  if (kStates.empty())
+    return;
+
+  boost::shared_ptr<StateBundle> bundle(new StateBundle());
+  if (!symbEngine->serializeStates(kStates, bundle->data)) {
+    CLOUD9_DEBUG("Could not encode the exported states, they will be replayed");
+    return;
+  }
+
+  for (unsigned i = 0; i < reconJobs.size(); i++) {
+    reconJobs[i]->stateBundle = bundle;
+    reconJobs[i]->stateIndex = i;
+    reconJobs[i]->instrSinceFork = instrCounts[i];
+  }
+
+  CLOUD9_DEBUG("Exporting " << kStates.size() << " states (" <<
+      bundle->data.size() << " bytes)");
+}
+
 /* Strategy Handler Triggers *************************************************/
 
 void JobManager::fireActivateState(SymbolicState *state) {
@@ -1084,8 +1215,12 @@ void JobManager::getReconstructionTasks(WorkerTree::Node *node,
 }
 
 JobReconstruction *JobManager::getJobReconstruction(ExecutionJob *job) {
-  if (job->reconstruct) // The job is not yet reconstructed
-    return new JobReconstruction(*job->reconstruct);
+  if (job->reconstruct) { // The job is not yet reconstructed
+    JobReconstruction *reconstruct = new JobReconstruction(*job->reconstruct);
+    // The bundle is only decoded here, the replay tasks go along
+    reconstruct->stateBundle.reset();
+    return reconstruct;
+  }
 
   WorkerTree::Node *node = job->getNode().get();
 
@@ -1109,6 +1244,9 @@ void JobManager::runJobReconstruction(boost::unique_lock<boost::mutex> &lock,
   if (DebugJobReconstruction)
     CLOUD9_DEBUG("Running job reconstruction " << job);
 
+  if (job->stateBundle && adoptJobState(job))
+    return;
+
   for (std::list<ReconstructionTask>::iterator it = job->tasks.begin();
       it != job->tasks.end(); it++) {
     if (it->isMerge) {
@@ -1138,6 +1276,44 @@ void JobManager::runJobReconstruction(boost::unique_lock<boost::mutex> &lock,
   }
 }
 
+bool JobManager::adoptJobState(JobReconstruction *job) {
+  StateBundle &bundle = *job->stateBundle;
+
+  if (!bundle.decoded) {
+    bundle.decoded = true;
+    if (!symbEngine->deserializeStates(bundle.data, bundle.states)) {
+      CLOUD9_DEBUG("Could not decode the transferred states, replaying them instead");
+    }
+    bundle.data.clear();
+  }
+
+  if (job->stateIndex >= bundle.states.size() ||
+      bundle.states[job->stateIndex] == NULL)
+    return false;
+
+  if (currentJob == NULL)
+    return false;
+
+  WorkerTree::Node *node = currentJob->getNode().get();
+  if ((**node).getSymbolicState() != NULL)
+    return false; // Already there, the transferred state is dropped
+
+  klee::ExecutionState *kState = bundle.states[job->stateIndex];
+  bundle.states[job->stateIndex] = NULL;
+
+  SymbolicState *state = new SymbolicState(kState, NULL);
+  state->rebindToNode(tree->getNode(WORKER_LAYER_STATES, node));
+  state->_instrSinceFork = job->instrSinceFork;
+
+  symbEngine->adoptState(kState);
+  fireActivateState(state);
+
+  if (DebugJobReconstruction)
+    CLOUD9_DEBUG("Adopted a transferred state at " << *node);
+
+  return true;
+}
+
 void JobManager::requestStateDestroy(SymbolicState *state) {
   pendingDeletions.insert(state);
 }
@@ -1186,6 +1362,9 @@ long JobManager::stepInNode(boost::unique_lock<boost::mutex> &lock,
 
     // Execute the instruction
     state->_instrSinceFork++;
+    while (pauseRequests > 0)
+      stepDone.wait(lock);
+    stepping = true;
     lock.unlock();
 
     processPendingDeletions();
@@ -1194,6 +1373,8 @@ long JobManager::stepInNode(boost::unique_lock<boost::mutex> &lock,
     }
 
     lock.lock();
+    stepping = false;
+    stepDone.notify_all();
 
     if (currentState) {
       totalExec++;
@@ -1701,6 +1882,54 @@ void JobManager::getStatisticsData(std::vector<int> &data,
 }
 #endif
 
+void JobManager::getLoadData(uint64_t &paths, merge_clusters_t &clusters,
+    unsigned maxClusters) {
+  boost::unique_lock<boost::mutex> lock(jobsMutex);
+
+  // The multiplicities change as the states step and merge
+  pauseStepping(lock);
+
+  std::vector<WorkerTree::Node*> nodes;
+  tree->getLeaves(WORKER_LAYER_JOBS, tree->getRoot(), nodes);
+
+  paths = 0;
+  clusters.clear();
+
+  for (std::vector<WorkerTree::Node*>::iterator it = nodes.begin(); it
+      != nodes.end(); it++) {
+    ExecutionJob *job = (**(*it)).getJob();
+    SymbolicState *state = (**(*it)).getSymbolicState();
+
+    // Jobs still to be replayed stand for a single path
+    if (!job || job->reconstruct || !state) {
+      paths++;
+      continue;
+    }
+
+    uint64_t multiplicity = std::max((**state).multiplicity, (uint64_t) 1);
+    paths += multiplicity;
+
+    std::pair<unsigned, uint64_t> &cluster =
+        clusters[(**state).getMergeIndex()];
+    cluster.first++;
+    cluster.second += multiplicity;
+  }
+
+  resumeStepping();
+
+  if (clusters.size() <= maxClusters)
+    return;
+
+  // Only the largest clusters are worth keeping together
+  std::vector<std::pair<uint64_t, std::pair<unsigned, uint64_t> > >
+      sorted(clusters.begin(), clusters.end());
+  std::nth_element(sorted.begin(), sorted.begin() + maxClusters,
+      sorted.end(), isLargerCluster);
+
+  clusters.clear();
+  clusters.insert(sorted.begin(), sorted.begin() + maxClusters);
+}
+
 /* Coverage Management ********************************************************/
 
 void JobManager::getUpdatedLocalCoverage(cov_update_t &data) {
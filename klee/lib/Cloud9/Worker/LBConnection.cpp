@@ -44,6 +44,7 @@
 #include "llvm/Support/Path.h"
 #endif
 
+#include <set>
 #include <string>
 
 using namespace llvm;
@@ -52,6 +53,13 @@ using namespace cloud9::data;
 namespace {
   cl::opt<bool>
   DebugLBCommuncation("debug-lb-communication", cl::init(false));
+
+  cl::opt<unsigned>
+  ReportedMergeClusters("lb-merge-clusters",
+      cl::desc("The number of merge clusters reported to the load balancer, "
+          "which keeps them together on transfers (0 = report job counts "
+          "only)"),
+      cl::init(32));
 }
 
 namespace cloud9 {
@@ -171,7 +179,29 @@ void LBConnection::sendJobStatistics(WorkerReportMessage &message) {
   }
 }
 
+void LBConnection::sendLoadStatistics(WorkerReportMessage &message) {
+  if (ReportedMergeClusters == 0)
+    return;
+
+  uint64_t paths;
+  merge_clusters_t clusters;
+
+  jobManager->getLoadData(paths, clusters, ReportedMergeClusters);
+
+  WorkerReportMessage_LoadUpdate *loadUpdate = message.mutable_loadupdate();
+  loadUpdate->set_paths(paths);
+
+  for (merge_clusters_t::iterator it = clusters.begin(); it != clusters.end();
+      it++) {
+    MergeCluster *cluster = loadUpdate->add_clusters();
+    cluster->set_merge_index(it->first);
+    cluster->set_jobs(it->second.first);
+    cluster->set_paths(it->second.second);
+  }
 
+  CLOUD9_DEBUG("[" << paths << "] paths in " << clusters.size() <<
+      " merge clusters reported to the load balancer");
+}
 
 void LBConnection::sendCoverageUpdates(WorkerReportMessage &message) {
   cov_update_t data;
@@ -212,6 +242,8 @@ void LBConnection::sendUpdates() {
 
   sendJobStatistics(message);
 
+  sendLoadStatistics(message);
+
   sendCoverageUpdates(message);
 
   sendPartitionStatistics(message);
@@ -265,7 +297,11 @@ void LBConnection::processResponse(LBResponseMessage &response) {
         }
       }
 
-      transferJobs(destAddress, destPort, paths, counts, partSelect);
+      std::set<uint64_t> mergeIndexes(transDetails.merge_indexes().begin(),
+          transDetails.merge_indexes().end());
+
+      transferJobs(destAddress, destPort, paths, counts, partSelect,
+          (ReportedMergeClusters > 0) ? &mergeIndexes : NULL);
 
     }
   }
@@ -313,7 +349,7 @@ void LBConnection::processResponse(LBResponseMessage &response) {
 
 void LBConnection::transferJobs(std::string &destAddr, int destPort,
     ExecutionPathSetPin paths, std::vector<int> counts,
-    part_select_t &partHints) {
+    part_select_t &partHints, const std::set<uint64_t> *mergeIndexes) {
 
   ExecutionPathSetPin jobPaths;
   std::map<unsigned,JobReconstruction*> reconstructions;
@@ -326,7 +362,8 @@ void LBConnection::transferJobs(std::string &destAddr, int destPort,
     std::vector<int> emptyCounts;
     jobPaths = jobManager->exportJobs(stateRoots, emptyCounts, reconstructions);
   } else {
-    jobPaths = jobManager->exportJobs(paths, counts, reconstructions);
+    jobPaths = jobManager->exportJobs(paths, counts, reconstructions,
+        mergeIndexes);
   }
 
   tcp::socket peerSocket(service);
@@ -349,6 +386,14 @@ void LBConnection::transferJobs(std::string &destAddr, int destPort,
     cloud9::data::ReconstructionJob *recJobData = message.add_reconstructionjobs();
     recJobData->set_id(it->first);
 
+    if (it->second->stateBundle) {
+      // All the transferred states come in the same bundle
+      if (!message.has_states())
+        message.set_states(it->second->stateBundle->data);
+      recJobData->set_stateindex(it->second->stateIndex);
+      recJobData->set_instrsincefork(it->second->instrSinceFork);
+    }
+
     for (std::list<ReconstructionTask>::iterator it2 = it->second->tasks.begin();
         it2 != it->second->tasks.end(); it2++) {
       cloud9::data::ReconstructionTask *recTaskData = recJobData->add_tasks();
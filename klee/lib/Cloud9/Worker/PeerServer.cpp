@@ -72,10 +72,23 @@ void PeerConnection::handleMessageReceived(std::string &msgString,
 		ExecutionPathSetPin paths = parseExecutionPathSet(pathSet);
 		std::map<unsigned,JobReconstruction*> reconstructions;
 
+		// The states are decoded by the executor, when it reaches the jobs
+		boost::shared_ptr<StateBundle> bundle;
+		if (message.has_states()) {
+		  bundle.reset(new StateBundle());
+		  bundle->data = message.states();
+		}
+
 		for (int i = 0; i < message.reconstructionjobs_size(); i++) {
 		  const cloud9::data::ReconstructionJob &recJobData = message.reconstructionjobs(i);
 		  cloud9::worker::JobReconstruction *recJob = new JobReconstruction();
 
+		  if (bundle && recJobData.has_stateindex()) {
+		    recJob->stateBundle = bundle;
+		    recJob->stateIndex = recJobData.stateindex();
+		    recJob->instrSinceFork = recJobData.instrsincefork();
+		  }
+
 		  for (int j = 0; j < recJobData.tasks_size(); j++) {
 		    const cloud9::data::ReconstructionTask &recTaskData = recJobData.tasks(j);
 		    recJob->tasks.push_back(ReconstructionTask(
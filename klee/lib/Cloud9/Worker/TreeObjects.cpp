@@ -41,6 +41,13 @@ std::ostream &operator<< (std::ostream &os, const SymbolicState &state) {
 	return os;
 }
 
+StateBundle::~StateBundle() {
+	for (std::vector<klee::ExecutionState*>::iterator it = states.begin();
+			it != states.end(); it++) {
+		delete *it;
+	}
+}
+
 }
 }
 
@@ -30,23 +30,27 @@ void AddressSpace::bindObject(const MemoryObject *mo, ObjectState *os) {
 
   const MemoryMap::value_type *prev = objects.lookup(mo);
   if (prev)
-    hash -= (uintptr_t) prev->first;
+    hash -= getObjectHash(prev->first);
 
   objects = objects.replace(std::make_pair(mo, os));
-  hash += (uintptr_t) mo;
+  hash += getObjectHash(mo);
 }
 
 void AddressSpace::bindSharedObject(const MemoryObject *mo, ObjectState *os) {
   assert(os->isShared);
   assert(os->copyOnWriteOwner > 0);
 
+  // Keep the hash a function of the set of bound objects only
+  if (!objects.lookup(mo))
+    hash += getObjectHash(mo);
+
   objects = objects.insert(std::make_pair(mo, os));
 }
 
 void AddressSpace::unbindObject(const MemoryObject *mo) {
   const MemoryMap::value_type *prev = objects.lookup(mo);
   if (prev) {
-    hash -= (uintptr_t) prev->first;
+    hash -= getObjectHash(prev->first);
     /*
     removeMergeBlacklistItemHash(mo, prev->second);
     for (MergeBlacklist::iterator it = mergeBlacklist.begin(),
@@ -70,6 +74,17 @@ const ObjectState *AddressSpace::findObject(const MemoryObject *mo) const {
   return res ? res->second : 0;
 }
 
+void AddressSpace::getObjectsById(std::map<unsigned, ObjectPair> &result)
+  const {
+  for (MemoryMap::iterator it = objects.begin(), ie = objects.end();
+       it != ie; ++it)
+    result[it->first->id] = ObjectPair(it->first, it->second);
+}
+
+uint64_t AddressSpace::getObjectHash(const MemoryObject *mo) {
+  return hashUpdate(hashInit(), (uint32_t) mo->id);
+}
+
 ObjectState *AddressSpace::getWriteable(const MemoryObject *mo,
                                         const ObjectState *os) {
   assert(!os->readOnly);
@@ -375,7 +390,7 @@ void AddressSpace::copyOutConcretes(AddressPool *pool) {
       uint8_t *address = (uint8_t*) (unsigned long) mo->address;
 
       if (!os->readOnly)
-        memcpy(address, os->concreteStore, mo->size);
+        os->copyOutConcreteStore(address);
     }
   }
 }
@@ -389,12 +404,12 @@ bool AddressSpace::copyInConcretes(AddressPool *pool) {
       const ObjectState *os = it->second;
       uint8_t *address = (uint8_t*) (unsigned long) mo->address;
 
-      if (memcmp(address, os->concreteStore, mo->size)!=0) {
+      if (!os->equalsConcreteStore(address)) {
         if (os->readOnly) {
           return false;
         } else {
           ObjectState *wos = getWriteable(mo, os);
-          memcpy(wos->concreteStore, address, mo->size);
+          wos->copyInConcreteStore(address);
         }
       }
     }
@@ -17,6 +17,8 @@
 
 #include "llvm/ADT/DenseMap.h"
 
+#include <map>
+
 namespace klee {
   class ExecutionState;
   class MemoryObject;
@@ -40,6 +42,7 @@ namespace klee {
   class AddressSpace {
 	  friend class ObjectState;
 	  friend class ExecutionState;
+	  friend class StateSerializer;
   private:
 	  typedef std::vector<AddressSpace*> cow_domain_t;
 
@@ -131,6 +134,13 @@ namespace klee {
     /// Lookup a binding from a MemoryObject.
     const ObjectState *findObject(const MemoryObject *mo) const;
 
+    /// Collect the bindings by object id, for the maps keyed by id.
+    void getObjectsById(std::map<unsigned, ObjectPair> &result) const;
+
+    /// The contribution of a bound object to the hash. It depends on the
+    /// id of the object, which unlike its address is never reused.
+    static uint64_t getObjectHash(const MemoryObject *mo);
+
     /// \brief Obtain an ObjectState suitable for writing.
     ///
     /// This returns a writeable object state, creating a new copy of
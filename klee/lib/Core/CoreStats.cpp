@@ -12,6 +12,7 @@
 using namespace klee;
 
 Statistic stats::allocations("Allocations", "Alloc");
+Statistic stats::deallocations("Deallocations", "Dealloc");
 Statistic stats::locallyCoveredInstructions("LocallyCoveredInstructions", "LIcov");
 Statistic stats::globallyCoveredInstructions("GloballyCoveredInstructions", "GIcov");
 Statistic stats::falseBranches("FalseBranches", "Bf");
@@ -23,6 +24,7 @@ Statistic stats::mergeSuccessTime("MergeSuccessTime", "MStime", true);
 Statistic stats::mergeFailTime("MergeFailTime", "MFtime", true);
 Statistic stats::mergesSuccess("MergesSuccess", "MergesS");
 Statistic stats::mergesFail("MergesFail", "MergesF");
+Statistic stats::mergesFiltered("MergesFiltered", "MergesFl");
 Statistic stats::fastForwardsStart("FastForwardStart", "FFForwardT");
 Statistic stats::fastForwardsFail("FastForwardFail", "FForwardF");
 Statistic stats::instructionRealTime("InstructionRealTimes", "Ireal", true);
@@ -49,3 +51,18 @@ Statistic stats::pathsMult("PathsMult", "PathsMult");
 Statistic stats::pathsMultExact("PathsMultExact", "PathsMultExact");
 
 Statistic stats::searcherTime("SearcherTime", "SearcherTime", true);
+
+Statistic stats::sampledInterpretationTime("SampledInterpretationTime",
+                                           "SItime", true);
+Statistic stats::sampledSolverTime("SampledSolverTime", "SStime", true);
+Statistic stats::sampledMergeTime("SampledMergeTime", "SMtime", true);
+Statistic stats::sampledSearcherTime("SampledSearcherTime", "SSEtime", true);
+
+Statistic stats::statesSpilled("StatesSpilled", "Spilled");
+Statistic stats::statesRestored("StatesRestored", "Restored");
+Statistic stats::spilledBytes("SpilledBytes", "SpilledB");
+Statistic stats::restoredBytes("RestoredBytes", "RestoredB");
+Statistic stats::spillTime("SpillTime", "SpillTime", true);
+Statistic stats::restoreTime("RestoreTime", "RestoreTime", true);
+
+Statistic stats::qceItemUpdates("QceItemUpdates", "QceUpd");
@@ -16,6 +16,7 @@ namespace klee {
 namespace stats {
 
   extern Statistic allocations;
+  extern Statistic deallocations;
   extern Statistic resolveTime;
   extern Statistic instructions;
   extern Statistic instructionsMult;
@@ -55,6 +56,10 @@ namespace stats {
   /// The number of failed merge attempts.
   extern Statistic mergesFail;
 
+  /// The number of failed merge attempts rejected by the merge fingerprint,
+  /// without running the full compatibility checks.
+  extern Statistic mergesFiltered;
+
   /// Number of states, this is a "fake" statistic used by istats, it
   /// isn't normally up-to-date.
   extern Statistic states;
@@ -77,6 +82,24 @@ namespace stats {
   extern Statistic duplicatesExecutionTime;
 
   extern Statistic searcherTime;
+
+  /// The CPU time spent in each activity, as estimated by the sampling
+  /// instruction profiler.
+  extern Statistic sampledInterpretationTime;
+  extern Statistic sampledSolverTime;
+  extern Statistic sampledMergeTime;
+  extern Statistic sampledSearcherTime;
+
+  /// The states whose memory was moved to the spill file and back.
+  extern Statistic statesSpilled;
+  extern Statistic statesRestored;
+  extern Statistic spilledBytes;
+  extern Statistic restoredBytes;
+  extern Statistic spillTime;
+  extern Statistic restoreTime;
+
+  /// The QCE items looked at after annotated instructions.
+  extern Statistic qceItemUpdates;
 }
 }
 
@@ -52,6 +52,11 @@ using namespace klee;
 namespace { 
   cl::opt<bool>
   DebugLogStateMerge("debug-log-state-merge");
+
+  cl::opt<bool>
+  MergeWideSelects("merge-wide-selects",
+      cl::desc("Merge contiguous memory differences using word-sized selects"),
+      cl::init(true));
 }
 
 /***/
@@ -73,6 +78,8 @@ ExecutionState::ExecutionState(Executor *_executor, KFunction *kf)
     instsTotal(0),
     coveredNew(false),
     lastCoveredTime(sys::TimeValue::now()),
+    lastRunInstruction(0),
+    spilled(false),
     ptreeNode(0),
     crtForkReason(KLEE_FORK_DEFAULT),
     crtSpecialFork(NULL),
@@ -93,6 +100,8 @@ ExecutionState::ExecutionState(Executor *_executor, const std::vector<ref<Expr>
     fakeState(true),
     queryCost(0.),
     lastCoveredTime(sys::TimeValue::now()),
+    lastRunInstruction(0),
+    spilled(false),
     ptreeNode(0),
     globalConstraints(assumptions),
     wlistCounter(1),
@@ -103,6 +112,33 @@ ExecutionState::ExecutionState(Executor *_executor, const std::vector<ref<Expr>
   setupMain(NULL);
 }
 
+ExecutionState::ExecutionState(Executor *_executor)
+  : c9State(NULL),
+    executor(_executor),
+    fakeState(false),
+    depth(0),
+    multiplicity(1),
+    multiplicityExact(1),
+    forkDisabled(false),
+    queryCost(0.),
+    weight(1),
+    instsSinceCovNew(0),
+    instsSinceFork(0),
+    instsTotal(0),
+    coveredNew(false),
+    lastCoveredTime(sys::TimeValue::now()),
+    lastRunInstruction(0),
+    spilled(false),
+    ptreeNode(0),
+    crtForkReason(KLEE_FORK_DEFAULT),
+    crtSpecialFork(NULL),
+    symbolicsHash(hashInit()),
+    wlistCounter(1),
+    preemptions(0),
+    interleavedMergeIndex(0),
+    isDuplicate(false) {
+}
+
 void ExecutionState::setupTime() {
   stateTime = 1284138206L * 1000000L; // Yeah, ugly, but what else? :)
 }
@@ -335,6 +371,11 @@ ExecutionState::~ExecutionState() {
   }
 }
 
+void ExecutionState::addSymbolic(const MemoryObject *mo, const Array *array) {
+  symbolics.push_back(std::make_pair(mo, array));
+  symbolicsHash = hashUpdate(symbolicsHash, (uint32_t) mo->id);
+}
+
 ExecutionState *ExecutionState::branch(bool copy) {
   if (!copy)
     depth++;
@@ -349,7 +390,7 @@ ExecutionState *ExecutionState::branch(bool copy) {
 
   if (!copy) {
     falseState->coveredNew = false;
-    falseState->coveredLines.clear();
+    falseState->coveredInstructions.clear();
 
     falseState->instsSinceFork = 0;
     instsSinceFork = 0;
@@ -488,6 +529,67 @@ std::ostream &operator<<(std::ostream &os, const ExecutionState &state) {
 	return os;
 }
 
+uint64_t ExecutionState::getMergeFingerprint() const {
+  uint64_t fingerprint = hashUpdate(hashInit(), symbolicsHash);
+
+  for (threads_ty::const_iterator it = threads.begin(), ie = threads.end();
+       it != ie; ++it) {
+    const Thread &t = it->second;
+    fingerprint = hashUpdate(fingerprint, (uint64_t) t.getTid());
+    fingerprint = hashUpdate(fingerprint,
+                             t.qceMemoryTrackHash.getHashValue());
+    if (!t.stack.empty()) {
+      fingerprint = hashUpdate(fingerprint, t.stack.back().stackHash);
+      fingerprint = hashUpdate(fingerprint,
+                        t.stack.back().qceLocalsTrackHash.getHashValue());
+    }
+  }
+
+  for (processes_ty::const_iterator it = processes.begin(),
+       ie = processes.end(); it != ie; ++it) {
+    fingerprint = hashUpdate(fingerprint, (uint64_t) it->first);
+    fingerprint = hashUpdate(fingerprint, it->second.addressSpace.hash);
+  }
+
+  return fingerprint;
+}
+
+/// The bytes of the bucket array of \a m.
+template<class Map>
+static size_t getBucketBytes(const Map &m) {
+  return (const char*) m.end().operator->() -
+         (const char*) m.getPointerIntoBucketsArray();
+}
+
+/// DenseSet hides its map, so the bucket array of \a s is sized the way
+/// DenseMap grows it: from 64 buckets, doubling past 3/4 full. Copies keep
+/// the bucket count of their source, which this does not follow.
+static size_t getBucketBytes(const QCEMemoryTrackSet &s) {
+  size_t buckets = 64;
+  while (s.size() * 4 >= buckets * 3)
+    buckets *= 2;
+  return buckets * sizeof(std::pair<HotValue, char>);
+}
+
+size_t ExecutionState::getQCEMapsFootprint() const {
+  size_t bytes = 0;
+
+  for (threads_ty::const_iterator it = threads.begin(), ie = threads.end();
+       it != ie; ++it) {
+    const Thread &t = it->second;
+    bytes += getBucketBytes(t.qceMemoryTrackMap);
+    for (QCEMemoryTrackMap::const_iterator mit = t.qceMemoryTrackMap.begin(),
+           mie = t.qceMemoryTrackMap.end(); mit != mie; ++mit)
+      bytes += getBucketBytes(mit->second);
+
+    for (stack_ty::const_iterator sit = t.stack.begin(),
+           sie = t.stack.end(); sit != sie; ++sit)
+      bytes += getBucketBytes(sit->qceMap);
+  }
+
+  return bytes;
+}
+
 bool ExecutionState::isPCCompatible(const ExecutionState &b) const {
   // Take the shortcut...
   if (pc() != b.pc()) {
@@ -569,6 +671,13 @@ bool ExecutionState::areQCEMemoryTrackMapsCompatible(const ExecutionState &b) co
     const AddressSpace &bAddressSpace =
         b.processes.find(bThread.getPid())->second.addressSpace;
 
+    // The track maps are keyed by object ids
+    std::map<unsigned, ObjectPair> aObjects, bObjects;
+    if (!aThread.qceMemoryTrackMap.empty()) {
+      aAddressSpace.getObjectsById(aObjects);
+      bAddressSpace.getObjectsById(bObjects);
+    }
+
     if (DebugLogStateMerge) {
       std::cerr << "Comparing " << aThread.qceMemoryTrackMap.size()
                 << " QCE tracked items" << std::endl;
@@ -585,10 +694,9 @@ bool ExecutionState::areQCEMemoryTrackMapsCompatible(const ExecutionState &b) co
         return false;
       }
 
-      const MemoryObject *mo = mi->first.first;
       unsigned offset = mi->first.second;
-      unsigned aValue = aAddressSpace.findObject(mo)->read8c(offset);
-      unsigned bValue = bAddressSpace.findObject(mo)->read8c(offset);
+      unsigned aValue = aObjects[mi->first.first].second->read8c(offset);
+      unsigned bValue = bObjects[mi->first.first].second->read8c(offset);
       if (aValue != bValue) {
 #warning XXX?
         // XXX: try different heuristics here
@@ -684,19 +792,33 @@ static void mergeAddressSpaces(AddressSpace &a, const AddressSpace &b,
     }
 
     memObjects += mo->size;
-    ObjectState *wos = NULL; //a.getWriteable(mo, os);
-
-    for (unsigned i=0; i<mo->size; i++) {
-      ref<Expr> av = os->read8(i);
-      ref<Expr> bv = otherOS->read8(i);
-      if(av != bv) {
-          if (!wos) {
-            wos = a.getWriteable(mo, os);
-            os = wos;
-          }
-          memDifference += 1;
-          wos->write(i, useInA ? SelectExpr::create(inA, av, bv)
-                               : SelectExpr::create(inB, bv, av));
+
+    std::vector<std::pair<unsigned, unsigned> > ranges;
+    os->getDifferentRanges(*otherOS, ranges);
+    if (ranges.empty())
+      continue;
+
+    ObjectState *wos = a.getWriteable(mo, os);
+
+    for (std::vector<std::pair<unsigned, unsigned> >::iterator
+         rit = ranges.begin(), rie = ranges.end(); rit != rie; ++rit) {
+      unsigned i = rit->first;
+      while (i < rit->second) {
+        // Cover contiguous differences with the widest select that fits
+        unsigned bytes = 1;
+        if (MergeWideSelects) {
+          unsigned left = rit->second - i;
+          bytes = left >= 8 ? 8 : (left >= 4 ? 4 : (left >= 2 ? 2 : 1));
+        }
+        Expr::Width width = bytes * 8;
+
+        ref<Expr> av = wos->read(i, width);
+        ref<Expr> bv = otherOS->read(i, width);
+        wos->write(i, useInA ? SelectExpr::create(inA, av, bv)
+                             : SelectExpr::create(inB, bv, av));
+
+        memDifference += bytes;
+        i += bytes;
       }
     }
   }
@@ -934,24 +1056,30 @@ ExecutionState* ExecutionState::merge(const ExecutionState &b, bool copy) {
     aPtr = this->branch(true);
   ExecutionState &a = *aPtr;
 
-  // Merge the path constraints
-  std::set< ref<Expr> > aConstraints(a.constraints().begin(),
-                                     a.constraints().end());
-  std::set< ref<Expr> > bConstraints(b.constraints().begin(),
-                                     b.constraints().end());
-  std::set< ref<Expr> > commonConstraints, aSuffix, bSuffix;
-  std::set_intersection(aConstraints.begin(), aConstraints.end(),
-                        bConstraints.begin(), bConstraints.end(),
-                        std::inserter(commonConstraints, commonConstraints.begin()));
-  std::set_difference(aConstraints.begin(), aConstraints.end(),
-                      commonConstraints.begin(), commonConstraints.end(),
-                      std::inserter(aSuffix, aSuffix.end()));
-  std::set_difference(bConstraints.begin(), bConstraints.end(),
-                      commonConstraints.begin(), commonConstraints.end(),
-                      std::inserter(bSuffix, bSuffix.end()));
+  // Merge the path constraints. Forked states share the prefix of their
+  // constraint lists, so the common prefix is found by identity. Only the
+  // suffixes need to be compared by value.
+  size_t prefixSize = a.constraints().commonPrefix(b.constraints());
+
+  ConstraintManager::const_iterator aIt = a.constraints().begin();
+  ConstraintManager::const_iterator bIt = b.constraints().begin();
+  for (size_t i = 0; i < prefixSize; ++i, ++aIt, ++bIt) ;
+
+  std::set< ref<Expr> > bConstraints(bIt, b.constraints().end());
+  std::vector< ref<Expr> > commonConstraints;
+  std::set< ref<Expr> > aSuffix, bSuffix;
+  for (ConstraintManager::const_iterator ie = a.constraints().end();
+       aIt != ie; ++aIt) {
+    if (bConstraints.erase(*aIt))
+      commonConstraints.push_back(*aIt);
+    else
+      aSuffix.insert(*aIt);
+  }
+  bSuffix.swap(bConstraints);
+
   if (DebugLogStateMerge) {
-    std::cerr << "\tconstraint prefix: [";
-    for (std::set< ref<Expr> >::iterator it = commonConstraints.begin(), 
+    std::cerr << "\tconstraint prefix: " << prefixSize << " shared, [";
+    for (std::vector< ref<Expr> >::iterator it = commonConstraints.begin(),
            ie = commonConstraints.end(); it != ie; ++it)
       std::cerr << *it << ", ";
     std::cerr << "]\n";
@@ -1000,9 +1128,9 @@ ExecutionState* ExecutionState::merge(const ExecutionState &b, bool copy) {
         mutated[it->first], inA, inB, useInA);
   }
 
-  a.constraints() = ConstraintManager();
+  a.constraints().truncate(prefixSize);
 
-  for (std::set< ref<Expr> >::iterator it = commonConstraints.begin(), 
+  for (std::vector< ref<Expr> >::iterator it = commonConstraints.begin(),
          ie = commonConstraints.end(); it != ie; ++it)
     a.constraints().addConstraint(*it);
 
@@ -1031,10 +1159,7 @@ ExecutionState* ExecutionState::merge(const ExecutionState &b, bool copy) {
   if (a.instsTotal < b.instsTotal)
     a.instsTotal = b.instsTotal;
 
-  for(std::map<const std::string*, std::set<unsigned> >::const_iterator
-          it = b.coveredLines.begin(), ie = b.coveredLines.end(); it != ie; ++it) {
-      a.coveredLines[it->first].insert(it->second.begin(), it->second.end());
-  }
+  a.coveredInstructions.merge(b.coveredInstructions);
 
   if (DebugLogStateMerge)
     std::cerr << "---- merged successfully\n";
@@ -20,6 +20,8 @@
 #include "PTree.h"
 #include "SeedInfo.h"
 #include "SpecialFunctionHandler.h"
+#include "StateSerializer.h"
+#include "StateSpiller.h"
 #include "StatsTracker.h"
 #include "TimingSolver.h"
 #include "UserSearcher.h"
@@ -42,6 +44,7 @@
 #include "klee/Internal/Module/KInstruction.h"
 #include "klee/Internal/Module/KModule.h"
 #include "klee/Internal/Support/FloatEvaluation.h"
+#include "klee/Internal/Support/SamplingProfiler.h"
 #include "klee/Internal/System/Time.h"
 
 #include "llvm/Attributes.h"
@@ -160,10 +163,20 @@ namespace {
   ParallelSubqueriesDelay("parallel-subq-delay",
       cl::init(100), cl::desc("The delay in millisecs before the subqueries start to be computed"));
 
+  cl::opt<unsigned>
+  ParallelSolverThreads("parallel-solver-threads",
+      cl::init(4), cl::desc("Number of threads of the parallel solver "
+                            "(default=4)"));
+
   cl::opt<bool>
   UseHLParallelSolver("use-hl-parallel-solver",
       cl::init(false), cl::desc("Use high-level parallel solver"));
 
+  cl::opt<unsigned>
+  HLParallelSolverThreads("hl-parallel-solver-threads",
+      cl::init(0), cl::desc("Number of threads of the high-level parallel "
+                            "solver (default=number of CPUs)"));
+
   cl::opt<bool>
   EmitAllErrors("emit-all-errors",
                 cl::init(false),
@@ -267,6 +280,16 @@ namespace {
             cl::desc("Inhibit forking at memory cap (vs. random terminate)"),
             cl::init(true));
 
+  cl::opt<bool>
+  SpillStates("spill-states",
+            cl::desc("Spill the memory of the coldest states to disk at memory cap, instead of terminating them (experimental)"),
+            cl::init(false));
+
+  cl::opt<unsigned>
+  SpillBatchSize("spill-batch-size",
+            cl::desc("Number of states spilled together, sharing their memory on disk (default=16)"),
+            cl::init(16));
+
   cl::opt<bool>
   UseForkedSTP("use-forked-stp",
                  cl::desc("Run STP in forked process"));
@@ -295,6 +318,12 @@ namespace {
   KeepMergedDuplicates("keep-merged-duplicates",
           cl::desc("Keep execuring merged states as duplicates"));
 
+  cl::opt<bool>
+  UseMergeFingerprint("use-merge-fingerprint",
+          cl::desc("Reject merges of states with different merge fingerprints "
+                   "before running the full compatibility checks (default=on)"),
+          cl::init(true));
+
   cl::opt<bool>
   OutputConstraints("output-constraints",
           cl::desc("Output path constratins for each explored state"),
@@ -339,13 +368,13 @@ Solver *Executor::constructSolverChain(STPSolver *stpSolver,
   if (UseParallelSolver) {
     assert(!UseHLParallelSolver);
     CLOUD9_DEBUG("Using the parallel solver...");
-    solver = createParallelSolver(4, ParallelSubqueriesDelay, STPOptimizeDivides, stpSolver);
+    solver = createParallelSolver(ParallelSolverThreads,
+                                  ParallelSubqueriesDelay, stpSolver);
   }
 
   if (UseHLParallelSolver) {
     assert(!UseParallelSolver);
-    assert(UseForkedSTP && "HLParallelSolver requires --use-forked-stp!");
-    solver = createHLParallelSolver(solver, 0);
+    solver = createHLParallelSolver(solver, HLParallelSolverThreads);
   }
 
 
@@ -393,6 +422,8 @@ Executor::Executor(const InterpreterOptions &opts,
     symPathWriter(0),
     specialFunctionHandler(0),
     processTree(0),
+    stateSerializer(0),
+    stateSpiller(0),
     replayOut(0),
     replayPath(0),    
     usingSeeds(0),
@@ -404,8 +435,13 @@ Executor::Executor(const InterpreterOptions &opts,
 	       ? std::min(MaxSTPTime,MaxInstructionTime)
 	       : std::max(MaxSTPTime,MaxInstructionTime)) {
 
-  STPSolver *stpSolver = new STPSolver(UseForkedSTP || UseParallelSolver, STPOptimizeDivides,
-      !UseParallelSolver);
+  // The parallel solvers run STP concurrently, which is only safe in
+  // forked processes
+  STPSolver *stpSolver = new STPSolver(UseForkedSTP || UseParallelSolver ||
+                                       UseHLParallelSolver,
+                                       STPOptimizeDivides,
+                                       !UseParallelSolver &&
+                                       !UseHLParallelSolver);
 
   Solver *solver = 
     constructSolverChain(stpSolver,
@@ -418,6 +454,8 @@ Executor::Executor(const InterpreterOptions &opts,
 
   memory = new MemoryManager();
 
+  pthread_mutex_init(&snapshotSolversLock, NULL);
+
   if (OutputConstraints) {
     constraintsLog = interpreterHandler->openOutputFile("constraints.log");
     assert(constraintsLog);
@@ -427,20 +465,16 @@ Executor::Executor(const InterpreterOptions &opts,
 
 const Module *Executor::setModule(llvm::Module *module, 
                                   const ModuleOptions &opts) {
-  assert(!kmodule && module && "can only register one module"); // XXX gross
-  
-  kmodule = new KModule(module);
+  return setModule(prepareModule(module, opts));
+}
 
-  // Initialize the context.
-  TargetData *TD = kmodule->targetData;
-  Context::initialize(TD->isLittleEndian(),
-                      (Expr::Width) TD->getPointerSizeInBits());
+const Module *Executor::setModule(KModule *_kmodule) {
+  assert(!kmodule && _kmodule && "can only register one module"); // XXX gross
 
-  specialFunctionHandler = new SpecialFunctionHandler(*this);
+  kmodule = _kmodule;
+  kmodule->writeOutputs(interpreterHandler);
 
-  specialFunctionHandler->prepare();
-  kmodule->prepare(opts, interpreterHandler,
-                   userSearcherRequiresMergeAnalysis());
+  specialFunctionHandler = new SpecialFunctionHandler(*this);
   specialFunctionHandler->bind();
 
   if (StatsTracker::useStatistics()) {
@@ -450,7 +484,7 @@ const Module *Executor::setModule(llvm::Module *module,
                        userSearcherRequiresMD2U());
   }
   
-  return module;
+  return kmodule->module;
 }
 
 Executor::~Executor() {
@@ -462,7 +496,12 @@ Executor::~Executor() {
     delete specialFunctionHandler;
   if (statsTracker)
     delete statsTracker;
+  delete stateSpiller;
+  delete stateSerializer;
   delete solver;
+  for (unsigned i = 0; i < snapshotSolvers.size(); ++i)
+    delete snapshotSolvers[i];
+  pthread_mutex_destroy(&snapshotSolversLock);
   delete kmodule;
 }
 
@@ -978,7 +1017,7 @@ Executor::fork(ExecutionState &current, ref<Expr> condition, bool isInternal,
       }
       if (swapInfo) {
         std::swap(trueState->coveredNew, falseState->coveredNew);
-        std::swap(trueState->coveredLines, falseState->coveredLines);
+        trueState->coveredInstructions.swap(falseState->coveredInstructions);
       }
     }
 
@@ -1087,8 +1126,19 @@ void Executor::addDuplicates(ExecutionState *main, ExecutionState *other) {
 }
 
 ExecutionState* Executor::merge(ExecutionState &current, ExecutionState &other) {
+    SamplingProfiler::ActivityScope activity(SamplingProfiler::Merge);
     WallTimer timer;
 
+    if (UseMergeFingerprint &&
+        current.getMergeFingerprint() != other.getMergeFingerprint()) {
+        stats::mergesFiltered += 1;
+        stats::mergesFail += 1;
+        stats::mergeFailTime += timer.check();
+        return NULL;
+    }
+
+    restoreSpilledState(current);
+    restoreSpilledState(other);
     ExecutionState *merged = current.merge(other, KeepMergedDuplicates);
     if (merged) {
         if (KeepMergedDuplicates) {
@@ -2758,6 +2808,10 @@ void Executor::verifyQceMap(ExecutionState &state) {
     }
   }
 
+  // The track map is keyed by object ids
+  std::map<unsigned, ObjectPair> objectsById;
+  state.addressSpace().getObjectsById(objectsById);
+
   SimpleIncHash hash;
   foreach (QCEMemoryTrackMap::value_type &p,
            state.crtThread().qceMemoryTrackMap) {
@@ -2766,12 +2820,13 @@ void Executor::verifyQceMap(ExecutionState &state) {
     foreach (const HotValue &hv, p.second)
       activeHotValues2.insert(hv);
 
-    const MemoryObject *mo = p.first.first;
-    const ObjectState *os = state.addressSpace().findObject(mo);
-    assert(os != NULL);
+    std::map<unsigned, ObjectPair>::iterator oit =
+      objectsById.find(p.first.first);
+    assert(oit != objectsById.end());
+    const ObjectState *os = oit->second.second;
 
     unsigned value = os->read8c(p.first.second);
-    hash.addValueAt(APInt(32, value), mo, p.first.second);
+    hash.addValueAt(APInt(32, value), p.first.first, p.first.second);
   }
 
   foreach (const HotValue &hv, activeHotValues1) {
@@ -2821,44 +2876,66 @@ void Executor::verifyQceMap(ExecutionState &state) {
 
 bool Executor::modifyQceMemoryTrackMap(ExecutionState &state,
                                        const HotValue &hotValue,
+                                       QCEFrameInfo &frame,
                                        int vnumber, bool inVhAdd,
                                        const char* reason,
                                        KInstruction *ki) {
-  // Try to get address
-  const Cell& cell = evalV(vnumber, state);
-  if (cell.value.isNull()) {
-    return false; // Not allocated yet
-  }
+  //Expr::Width width = getWidthForLLVMType(
+  //      cast<PointerType>(hotValue.getValue()->getType())->getElementType());
+  //uint64_t size = Expr::getMinBytesForWidth(width);
+  uint64_t size = hotValue.getSize();
 
-  ref<ConstantExpr> address = dyn_cast<ConstantExpr>(cell.value);
+  const MemoryObject *mo;
+  const ObjectState *os = NULL;
+  uint64_t offset;
 
-  if (address.isNull()) {
-    klee_warning("!!! XXX, qce tracked address is symbolic ?\n");
-    return false; // XXX: tracked address is symbolic ?
-  }
+  // An item is removed from the bytes it was added at. The object is looked
+  // up again in case it is no longer bound.
+  if (!inVhAdd && !frame.trackedObject.isNull())
+    os = state.addressSpace().findObject(frame.trackedObject.get());
 
-  address = address->Add(ConstantExpr::create(hotValue.getOffset(),
-                                              address->getWidth()));
+  if (os) {
+    mo = frame.trackedObject.get();
+    offset = frame.trackedOffset;
+  } else {
+    // Try to get address
+    const Cell& cell = evalV(vnumber, state);
+    if (cell.value.isNull()) {
+      return false; // Not allocated yet
+    }
 
-  // Resolve and check address
-  ObjectPair op;
-  bool ok = state.addressSpace().resolveOne(address, op);
-  if (!ok) {
-    klee_warning("!!! XXX: can not resolve qce track item address!\n");
-    return false; // XXX!
-  }
+    ref<ConstantExpr> address = dyn_cast<ConstantExpr>(cell.value);
 
-  const MemoryObject* mo = op.first;
+    if (address.isNull()) {
+      if (DebugQceMaps)
+        klee_warning_once(hotValue.getValue(),
+                          "qce tracked address is symbolic");
+      return false;
+    }
 
-  //Expr::Width width = getWidthForLLVMType(
-  //      cast<PointerType>(hotValue.getValue()->getType())->getElementType());
-  //uint64_t size = Expr::getMinBytesForWidth(width);
-  uint64_t size = hotValue.getSize();
+    address = address->Add(ConstantExpr::create(hotValue.getOffset(),
+                                                address->getWidth()));
+
+    // Resolve and check address
+    ObjectPair op;
+    bool ok = state.addressSpace().resolveOne(address, op);
+    if (!ok) {
+      if (DebugQceMaps)
+        klee_warning_once(hotValue.getValue(),
+                          "cannot resolve qce tracked address");
+      return false;
+    }
 
-  ref<Expr> chk = op.first->getBoundsCheckPointer(address, size);
-  assert(chk->isTrue() && "Invalid qce track item?");
+    ref<Expr> chk = op.first->getBoundsCheckPointer(address, size);
+    assert(chk->isTrue() && "Invalid qce track item?");
 
-  uint64_t offset = address->getZExtValue() - op.first->address;
+    mo = op.first;
+    os = op.second;
+    offset = address->getZExtValue() - op.first->address;
+  }
+
+  frame.trackedObject = inVhAdd ? mo : 0;
+  frame.trackedOffset = offset;
 
   if (DebugQceMaps) {
     std::string str;
@@ -2897,18 +2974,18 @@ bool Executor::modifyQceMemoryTrackMap(ExecutionState &state,
     for (; size; --size, ++offset) {
       std::pair<QCEMemoryTrackMap::iterator, bool> res =
        qceMemoryTrackMap.insert(
-            std::make_pair(QCEMemoryTrackIndex(mo, offset),
+            std::make_pair(QCEMemoryTrackIndex(mo->id, offset),
                            QCEMemoryTrackSet()));
       res.first->second.insert(hotValue);
       if (res.second) {
-        unsigned value = op.second->read8c(offset);
-        qceMemoryTrackHash.addValueAt(APInt(32, value), mo, offset);
+        unsigned value = os->read8c(offset);
+        qceMemoryTrackHash.addValueAt(APInt(32, value), mo->id, offset);
       }
     }
   } else {
     for (; size; --size, ++offset) {
       QCEMemoryTrackMap::iterator it = qceMemoryTrackMap.find(
-            QCEMemoryTrackIndex(mo, offset));
+            QCEMemoryTrackIndex(mo->id, offset));
       if (it == qceMemoryTrackMap.end()) {
         dumpQceMap(state);
         assert(false && "*** XXX: qce memory track item not found");
@@ -2925,8 +3002,8 @@ bool Executor::modifyQceMemoryTrackMap(ExecutionState &state,
       if (it->second.empty()) {
         qceMemoryTrackMap.erase(it);
 
-        unsigned value = op.second->read8c(offset);
-        qceMemoryTrackHash.removeValueAt(APInt(32, value), mo, offset);
+        unsigned value = os->read8c(offset);
+        qceMemoryTrackHash.removeValueAt(APInt(32, value), mo->id, offset);
       }
     }
   }
@@ -2948,6 +3025,7 @@ void Executor::updateQceMapBeforeCall(ExecutionState &state) {
 
     StackFrame &sf = state.stack().back();
     sf.qceTotal = sf.qceTotalBase + info->total;
+    sf.qceLastInfo = NULL;
 
 #warning Here we should walk ALL qceMap items!!!
 
@@ -2996,13 +3074,16 @@ void Executor::updateQceMapOnFramePop(ExecutionState &state) {
     if (tSf && t != tSf->qceMap.end()) {
       // Propagate current status to the parent
       t->second.inVhAdd = p.second.inVhAdd;
+      t->second.trackedObject = p.second.trackedObject;
+      t->second.trackedOffset = p.second.trackedOffset;
     } else {
       // Remove the track item
       assert(p.second.stackFrame == stackSize-1);
       if (p.second.inVhAdd) {
         bool ok;
         if (p.first.isPtr()) {
-          ok = modifyQceMemoryTrackMap(state, p.first, p.second.vnumber, false,
+          ok = modifyQceMemoryTrackMap(state, p.first, p.second,
+                                       p.second.vnumber, false,
                                        " on frame pop");
         } else {
           ok = modifyQceLocalsTrackMap(state, p.first, sf, p.second.vnumber,
@@ -3011,13 +3092,16 @@ void Executor::updateQceMapOnFramePop(ExecutionState &state) {
         if (ok) {
           p.second.inVhAdd = false;
         } else {
-          klee_warning("*** XXX: can not remove qce memory track item on frame pop\n");
+          klee_warning("cannot remove qce track item on frame pop");
           assert(false);
         }
       }
     }
   }
 
+  if (tSf)
+    tSf->qceLastInfo = NULL;
+
   verifyQceMap(state);
 
   if (stackSize == 1) {
@@ -3030,55 +3114,78 @@ void Executor::updateQceMapOnFree(ExecutionState &state, const MemoryObject *mo,
                                   KInstruction*) {
   verifyQceMap(state);
 
-  bool changed = false;
-  DenseSet<HotValue> removedValues;
-
-  QCEMemoryTrackMap &qceMemoryTrackMap = state.crtThread().qceMemoryTrackMap;
-  SimpleIncHash &qceMemoryTrackHash = state.crtThread().qceMemoryTrackHash;
-
   const ObjectState *os = state.addressSpace().findObject(mo);
   assert(os && "qce memory track item was freed before disabling it");
 
-  for (QCEMemoryTrackMap::iterator bi = qceMemoryTrackMap.begin(),
-                                   be = qceMemoryTrackMap.end(); bi != be;) {
-    if (bi->first.first != mo) {
-      ++bi;
+  // The threads of the process share the object, and any of them may track
+  // it, in any of its frames
+  process_id_t pid = state.crtThread().getPid();
+  for (ExecutionState::threads_ty::iterator ti = state.threads.begin(),
+         te = state.threads.end(); ti != te; ++ti) {
+    Thread &thread = ti->second;
+    if (thread.getPid() != pid || thread.stack.empty())
       continue;
-    }
 
-    foreach (const HotValue &hotValue, bi->second) {
-      QCEMap::iterator qceMapIt = state.stack().back().qceMap.find(hotValue);
-      assert(qceMapIt != state.stack().back().qceMap.end());
-
-      // Remove blacklist item
-      if (DebugQceMaps) {
-        if (removedValues.count(hotValue) == 0) {
-          assert(qceMapIt->second.inVhAdd);
-
-          std::string str;
-          raw_string_ostream ostr(str);
-          ostr << "Removing qce memory track item: ";
-          hotValue.print(ostr);
-          ostr << " on free";
-          fprintf(stderr, "%s\n", ostr.str().c_str());
-          removedValues.insert(hotValue);
+    bool changed = false;
+    DenseSet<HotValue> removedValues;
+
+    QCEMemoryTrackMap &qceMemoryTrackMap = thread.qceMemoryTrackMap;
+    SimpleIncHash &qceMemoryTrackHash = thread.qceMemoryTrackHash;
+    StackFrame &top = thread.stack.back();
+
+    for (QCEMemoryTrackMap::iterator bi = qceMemoryTrackMap.begin(),
+                                     be = qceMemoryTrackMap.end(); bi != be;) {
+      if (bi->first.first != mo->id) {
+        ++bi;
+        continue;
+      }
+
+      foreach (const HotValue &hotValue, bi->second) {
+        QCEMap::iterator qceMapIt = top.qceMap.find(hotValue);
+        assert(qceMapIt != top.qceMap.end());
+
+        // Remove blacklist item
+        if (DebugQceMaps) {
+          if (removedValues.count(hotValue) == 0) {
+            assert(qceMapIt->second.inVhAdd);
+
+            std::string str;
+            raw_string_ostream ostr(str);
+            ostr << "Removing qce memory track item: ";
+            hotValue.print(ostr);
+            ostr << " on free";
+            fprintf(stderr, "%s\n", ostr.str().c_str());
+            removedValues.insert(hotValue);
+          }
         }
+
+        qceMapIt->second.inVhAdd = false;
+        qceMapIt->second.trackedObject = 0;
+        changed = true;
       }
 
-      qceMapIt->second.inVhAdd = false;
-      changed = true;
+      // Remove value from the hash
+      unsigned value = os->read8c(bi->first.second);
+      qceMemoryTrackHash.removeValueAt(APInt(32, value), mo->id,
+                                       bi->first.second);
+
+      qceMemoryTrackMap.erase(bi++);
     }
 
-    // Remove value from the hash
-    unsigned value = os->read8c(bi->first.second);
-    qceMemoryTrackHash.removeValueAt(APInt(32, value), mo, bi->first.second);
+    // The callers only get the item back when the frames above return, by
+    // then the object must be resolved again
+    foreach (StackFrame &sf, thread.stack) {
+      foreach (QCEMap::value_type &p, sf.qceMap) {
+        if (p.second.trackedObject.get() == mo)
+          p.second.trackedObject = 0;
+      }
+    }
 
-    qceMemoryTrackMap.erase(bi++);
+    if (changed)
+      top.qceLastInfo = NULL;
   }
 
-  if (changed) {
-    verifyQceMap(state);
-  }
+  verifyQceMap(state);
 }
 
 bool Executor::modifyQceLocalsTrackMap(ExecutionState &state,
@@ -3166,9 +3273,28 @@ void Executor::updateQceMapOnExec(ExecutionState &state) {
     sf.qceTotal = sf.qceTotalBase + info->total;
     float threshold = sf.qceTotal * QceThreshold;
 
+    // If the frame is up to date with the previous annotated instruction of
+    // the block, the items whose estimate did not change since then would
+    // reach the same decisions again
+    unsigned count = info->vars.size();
+    bool incremental = false;
+    if (sf.qceLastInfo == info) {
+      count = 0;
+    } else if (sf.qceLastInfo && sf.qceLastInfo == info->prev) {
+      count = info->changed.size();
+      incremental = true;
+    }
+    stats::qceItemUpdates += count;
+
+    // Items whose track could not be updated are retried on the next
+    // annotated instruction, which has to look at all its items then
+    bool settled = true;
+
 #warning Here we should walk ALL qceMap items!!!
 
-    foreach (KQCEInfoItem &item, info->vars) {
+    for (unsigned i = 0; i < count; ++i) {
+      KQCEInfoItem &item = incremental ? *info->changed[i] : info->vars[i];
+
       // Update QCE estimation
       std::pair<QCEMap::iterator, bool> res = sf.qceMap.insert(
           std::make_pair(item.hotValue,
@@ -3214,7 +3340,7 @@ void Executor::updateQceMapOnExec(ExecutionState &state) {
       if (inVhAdd != frame.inVhAdd) {
         bool ok;
         if (item.hotValue.isPtr()) {
-          ok = modifyQceMemoryTrackMap(state, item.hotValue,
+          ok = modifyQceMemoryTrackMap(state, item.hotValue, frame,
                                        item.vnumber, inVhAdd, NULL, ki);
         } else {
           assert(frame.stackFrame < stackSize);
@@ -3227,6 +3353,7 @@ void Executor::updateQceMapOnExec(ExecutionState &state) {
           changed = true;
         } else {
           assert(!frame.inVhAdd); // XXX?
+          settled = false;
         }
       }
 
@@ -3244,6 +3371,8 @@ void Executor::updateQceMapOnExec(ExecutionState &state) {
       }
     }
 
+    sf.qceLastInfo = settled ? info : NULL;
+
     if (changed)
       verifyQceMap(state);
   }
@@ -3270,13 +3399,13 @@ void Executor::updateQceMemoryValue(ExecutionState &state,
 
     for (unsigned i = 0; i < size; ++i, ++oc) {
       // Do not update bytes that are not in blacklist
-      if (qceMemoryTrackMap.find(std::make_pair(mo, oc)) ==
+      if (qceMemoryTrackMap.find(std::make_pair(mo->id, oc)) ==
                 qceMemoryTrackMap.end())
         continue;
 
       // Remove the old value
       unsigned prevValueC = os->read8c(oc);
-      qceMemoryTrackHash.removeValueAt(APInt(32, prevValueC), mo, oc);
+      qceMemoryTrackHash.removeValueAt(APInt(32, prevValueC), mo->id, oc);
 
       // Add the new value
       unsigned newValueC = unsigned(-1);
@@ -3284,7 +3413,7 @@ void Executor::updateQceMemoryValue(ExecutionState &state,
       if (ConstantExpr *CV = dyn_cast<ConstantExpr>(V))
         newValueC = CV->getZExtValue() & 0xFF;
 
-      qceMemoryTrackHash.addValueAt(APInt(32, newValueC), mo, oc);
+      qceMemoryTrackHash.addValueAt(APInt(32, newValueC), mo->id, oc);
 
       //if (prevValueC != unsigned(-1) && !nextValueC == unsigned(-1))
       //  notify = true;
@@ -3293,16 +3422,16 @@ void Executor::updateQceMemoryValue(ExecutionState &state,
     // A write with symbolic address makes all bytes in array symbolic
     for (unsigned oc = 0; oc < os->size; ++oc) {
       // Do not update bytes that are not in blacklist
-      if (qceMemoryTrackMap.find(std::make_pair(mo, oc)) ==
+      if (qceMemoryTrackMap.find(std::make_pair(mo->id, oc)) ==
                 qceMemoryTrackMap.end())
         continue;
 
       // Remove the old value
       unsigned prevValueC = os->read8c(oc);
-      qceMemoryTrackHash.removeValueAt(APInt(32, prevValueC), mo, oc);
+      qceMemoryTrackHash.removeValueAt(APInt(32, prevValueC), mo->id, oc);
 
       // Add the new value (symbolic)
-      qceMemoryTrackHash.addValueAt(APInt(32, unsigned(-1)), mo, oc);
+      qceMemoryTrackHash.addValueAt(APInt(32, unsigned(-1)), mo->id, oc);
 
       //if (prevValueC != unsigned(-1))
       //  notify = true;
@@ -3365,6 +3494,7 @@ void Executor::updateQceLocalsValue(ExecutionState &state,
 
 void Executor::updateStates(ExecutionState *current) {
   if (searcher) {
+    SamplingProfiler::ActivityScope activity(SamplingProfiler::Searcher);
     WallTimer searcherTimer;
     searcher->update(current, addedStates, removedStates);
     stats::searcherTime += searcherTimer.check();
@@ -3463,6 +3593,9 @@ void Executor::stepInState(ExecutionState *state) {
   assert(addedStates.count(state) == 0);
   assert(state->duplicates.empty() || state->multiplicity > 1);
 
+  restoreSpilledState(*state);
+  state->lastRunInstruction = stats::instructions;
+
   std::set<ExecutionState*> duplicates;
   duplicates.swap(state->duplicates);
   state->multiplicityExact = std::max(duplicates.size(), 1ul);
@@ -3621,7 +3754,8 @@ void Executor::stepInState(ExecutionState *state) {
             bool match = false;
             if (nextStates.size() > 1 &&
                 nextMain->ptreeNode->parent->forkTag.forkClass == KLEE_FORK_RESOLVE) {
-              match = nextMain->lastResolveResult == addedState->lastResolveResult;
+              match = nextMain->lastResolveResult.get() ==
+                addedState->lastResolveResult.get();
             } else {
               match = nextMain->pc() == addedState->pc();
             }
@@ -3735,19 +3869,31 @@ void Executor::stepInState(ExecutionState *state) {
 			// to pummel the freelist once we hit the memory cap.
 			unsigned mbs = sys::Process::GetTotalMemoryUsage() >> 20;
 
+			if (mbs > MaxMemory && SpillStates) {
+				// Only what the spilled states held alone was freed, kill
+				// states as well if that was not enough
+				uint64_t freed = spillColdStates(state, mbs) >> 20;
+				mbs -= std::min<uint64_t>(mbs, freed);
+			}
+
 			if (mbs > MaxMemory) {
 				if (mbs > MaxMemory + 100) {
+					// Spilled states hold little memory, and terminating
+					// one would restore its whole batch
+					std::vector<ExecutionState*> arr;
+					for (std::set<ExecutionState*>::iterator it = states.begin(),
+							ie = states.end(); it != ie; ++it)
+						if (!(*it)->spilled)
+							arr.push_back(*it);
+
 					// just guess at how many to kill
-					unsigned numStates = states.size();
-					unsigned toKill = std::max(1U, numStates - numStates
-							* MaxMemory / mbs);
+					unsigned numStates = arr.size();
+					unsigned toKill = std::min(numStates, std::max(1U,
+							numStates - numStates * MaxMemory / mbs));
 
-					if (MaxMemoryInhibit)
+					if (MaxMemoryInhibit && toKill)
 						klee_warning("killing %d states (over memory cap)",
 								toKill);
-
-					std::vector<ExecutionState*> arr(states.begin(),
-							states.end());
 					for (unsigned i = 0, N = arr.size(); N && i < toKill; ++i, --N) {
 						unsigned idx = rand() % N;
 
@@ -3853,9 +3999,14 @@ void Executor::run(ExecutionState &initialState) {
   while (!searcher->empty() && !haltExecution) {
     assert(addedStates.empty() && removedStates.empty());
 
-    WallTimer searcherTimer;
-    ExecutionState &state = searcher->selectState();
-    stats::searcherTime += searcherTimer.check();
+    ExecutionState *selected;
+    {
+      SamplingProfiler::ActivityScope activity(SamplingProfiler::Searcher);
+      WallTimer searcherTimer;
+      selected = &searcher->selectState();
+      stats::searcherTime += searcherTimer.check();
+    }
+    ExecutionState &state = *selected;
 
     if (!addedStates.empty())
       updateStates(0);
@@ -3929,7 +4080,66 @@ std::string Executor::getAddressInfo(ExecutionState &state,
   return info.str();
 }
 
+/// The memory spilling states may give back.
+static uint64_t getSpillableBytes() {
+  return MemoryAccounting::getBytes(MemoryAccounting::ObjectStates) +
+         MemoryAccounting::getBytes(MemoryAccounting::Constraints) +
+         MemoryAccounting::getBytes(MemoryAccounting::Exprs);
+}
+
+uint64_t Executor::spillColdStates(ExecutionState *current, unsigned mbs) {
+  std::vector<ExecutionState*> candidates;
+  for (std::set<ExecutionState*>::iterator it = states.begin(),
+         ie = states.end(); it != ie; ++it) {
+    ExecutionState *es = *it;
+    if (es != current && !es->spilled && !addedStates.count(es) &&
+        !removedStates.count(es))
+      candidates.push_back(es);
+  }
+  if (candidates.empty())
+    return 0;
+
+  // Guess at how many to spill, as when terminating states
+  unsigned numStates = candidates.size() + 1;
+  unsigned toSpill = std::max(1U, numStates - numStates * MaxMemory / mbs);
+  toSpill = std::min<unsigned>(toSpill, candidates.size());
+
+  // The states that ran least recently go first
+  std::vector<std::pair<uint64_t, ExecutionState*> > coldest;
+  for (unsigned i = 0; i < candidates.size(); ++i)
+    coldest.push_back(std::make_pair(candidates[i]->lastRunInstruction,
+                                     candidates[i]));
+  std::partial_sort(coldest.begin(), coldest.begin() + toSpill,
+                    coldest.end());
+  candidates.clear();
+  for (unsigned i = 0; i < toSpill; ++i)
+    candidates.push_back(coldest[i].second);
+
+  if (!stateSerializer)
+    stateSerializer = new StateSerializer(*this);
+  if (!stateSpiller)
+    stateSpiller = new StateSpiller(*stateSerializer,
+        interpreterHandler->getOutputFilename("states.spill"));
+
+  unsigned spilled = stateSpiller->getNumSpilled();
+  uint64_t before = getSpillableBytes();
+  stateSpiller->spill(candidates, SpillBatchSize);
+  uint64_t after = getSpillableBytes();
+  spilled = stateSpiller->getNumSpilled() - spilled;
+  uint64_t freed = before > after ? before - after : 0;
+  if (spilled)
+    klee_message("spilled %u states to disk (over memory cap), freed %llu MB",
+                 spilled, (unsigned long long) (freed >> 20));
+  return freed;
+}
+
+void Executor::restoreSpilledState(ExecutionState &state) {
+  if (state.spilled)
+    stateSpiller->restore(state);
+}
+
 bool Executor::terminateState(ExecutionState &state, bool silenced) {
+	restoreSpilledState(state);
 	fireStateDestroy(&state, silenced);
 
 	if (replayOut && replayPosition != replayOut->numObjects) {
@@ -3987,6 +4197,7 @@ bool Executor::terminateState(ExecutionState &state, bool silenced) {
 
 void Executor::terminateStateEarly(ExecutionState &state, 
                                    const Twine &message) {
+  restoreSpilledState(state);
   if (!OnlyOutputStatesCoveringNew || state.coveredNew ||
       (AlwaysOutputSeeds && seedMap.count(&state))) {
     interpreterHandler->processTestCase(state, (message + "\n").str().c_str(),
@@ -4998,6 +5209,47 @@ void Executor::destroyState(ExecutionState *state) {
 	terminateState(*state, true);
 }
 
+bool Executor::serializeStates(const std::vector<ExecutionState*> &states,
+		std::string &data) {
+	if (!stateSerializer)
+		stateSerializer = new StateSerializer(*this);
+
+	for (unsigned i = 0; i < states.size(); ++i)
+		restoreSpilledState(*states[i]);
+
+	return stateSerializer->encode(states, data);
+}
+
+bool Executor::deserializeStates(const std::string &data,
+		std::vector<ExecutionState*> &states) {
+	if (!stateSerializer)
+		stateSerializer = new StateSerializer(*this);
+
+	return stateSerializer->decode(data, states);
+}
+
+void Executor::adoptState(ExecutionState *state) {
+	// The path streams of the sender are not transferred, so they start over
+	if (pathWriter)
+		state->pathOS = pathWriter->open();
+	if (symPathWriter)
+		state->symPathOS = symPathWriter->open();
+
+	state->ptreeNode = processTree->graft(state);
+
+	if (statsTracker) {
+		for (ExecutionState::threads_ty::iterator it = state->threads.begin(),
+				ie = state->threads.end(); it != ie; ++it) {
+			std::vector<StackFrame> &stack = it->second.stack;
+			for (unsigned i = 0; i < stack.size(); ++i)
+				statsTracker->framePushed(&stack[i], i ? &stack[i-1] : 0);
+		}
+	}
+
+	addedStates.insert(state);
+	updateStates(0);
+}
+
 void Executor::runFunctionAsMain(Function *f, int argc, char **argv,
 		char **envp) {
 
@@ -5048,7 +5300,7 @@ bool Executor::getSymbolicSolution(const ExecutionState &state,
   ExecutionState tmp(state);
   if (!NoPreferCex) {
     for (unsigned i = 0; i != state.symbolics.size(); ++i) {
-      const MemoryObject *mo = state.symbolics[i].first;
+      const MemoryObject *mo = state.symbolics[i].first.get();
       std::vector< ref<Expr> >::const_iterator pi =
         mo->cexPreferences.begin(), pie = mo->cexPreferences.end();
       for (; pi != pie; ++pi) {
@@ -5081,9 +5333,87 @@ bool Executor::getSymbolicSolution(const ExecutionState &state,
   return true;
 }
 
+void Executor::getSymbolicSnapshot(const ExecutionState &state,
+                                   SymbolicSnapshot &res) {
+  // The snapshot is solved on another thread, while the state keeps
+  // extending the cache it shares with its forks
+  res.constraints = state.constraints();
+  res.constraints.clearSolverCache();
+  for (unsigned i = 0; i != state.symbolics.size(); ++i) {
+    const MemoryObject *mo = state.symbolics[i].first.get();
+    res.names.push_back(mo->name);
+    res.objects.push_back(state.symbolics[i].second);
+    res.preferences.push_back(mo->cexPreferences);
+  }
+}
+
+bool Executor::getSymbolicSolution(const SymbolicSnapshot &snapshot,
+                                   std::vector< 
+                                   std::pair<std::string,
+                                   std::vector<unsigned char> > >
+                                   &res) {
+  // Each caller gets a solver of its own, so that the queries never touch
+  // the validity checker or the caches of the interpreter
+  Solver *snapshotSolver = 0;
+  pthread_mutex_lock(&snapshotSolversLock);
+  if (!snapshotSolvers.empty()) {
+    snapshotSolver = snapshotSolvers.back();
+    snapshotSolvers.pop_back();
+  }
+  pthread_mutex_unlock(&snapshotSolversLock);
+
+  if (!snapshotSolver) {
+    STPSolver *stpSolver = new STPSolver(true, STPOptimizeDivides, false);
+    stpSolver->setTimeout(stpTimeout);
+    snapshotSolver = createIndependentSolver(stpSolver);
+  }
+
+  ConstraintManager constraints(snapshot.constraints);
+  if (!NoPreferCex) {
+    for (unsigned i = 0; i != snapshot.preferences.size(); ++i) {
+      std::vector< ref<Expr> >::const_iterator pi =
+        snapshot.preferences[i].begin(), pie = snapshot.preferences[i].end();
+      for (; pi != pie; ++pi) {
+        bool mayBeTrue;
+        bool success = snapshotSolver->mayBeTrue(Query(constraints, *pi),
+                                                 mayBeTrue);
+        if (!success) break;
+        if (mayBeTrue) constraints.addConstraint(*pi);
+      }
+      if (pi!=pie) break;
+    }
+  }
+
+  std::vector< std::vector<unsigned char> > values;
+  Query query(constraints, ConstantExpr::alloc(0, Expr::Bool));
+  bool success = snapshotSolver->getInitialValues(query, snapshot.objects,
+                                                  values);
+
+  pthread_mutex_lock(&snapshotSolversLock);
+  snapshotSolvers.push_back(snapshotSolver);
+  pthread_mutex_unlock(&snapshotSolversLock);
+
+  if (!success) {
+    klee_warning("unable to compute initial values (invalid constraints?)!");
+    return false;
+  }
+
+  for (unsigned i = 0; i != snapshot.objects.size(); ++i)
+    res.push_back(std::make_pair(snapshot.names[i], values[i]));
+  return true;
+}
+
 void Executor::getCoveredLines(const ExecutionState &state,
                                std::map<const std::string*, std::set<unsigned> > &res) {
-  res = state.coveredLines;
+  std::vector<unsigned> ids;
+  state.coveredInstructions.getIDs(ids);
+
+  res.clear();
+  for (std::vector<unsigned>::iterator it = ids.begin(), ie = ids.end();
+       it != ie; ++it) {
+    const InstructionInfo &ii = kmodule->infos->getInfoByID(*it);
+    res[&ii.file].insert(ii.line);
+  }
 }
 
 void Executor::doImpliedValueConcretization(ExecutionState &state,
@@ -5142,5 +5472,22 @@ Interpreter *Interpreter::create(const InterpreterOptions &opts,
   return new Executor(opts, ih);
 }
 
+KModule *Interpreter::prepareModule(llvm::Module *module,
+                                    const ModuleOptions &opts) {
+  assert(module && "no module to prepare");
+
+  KModule *kmodule = new KModule(module);
+
+  // Initialize the context.
+  TargetData *TD = kmodule->targetData;
+  Context::initialize(TD->isLittleEndian(),
+                      (Expr::Width) TD->getPointerSizeInBits());
+
+  SpecialFunctionHandler::prepare(kmodule->module);
+  kmodule->prepare(opts, userSearcherRequiresMergeAnalysis());
+
+  return kmodule;
+}
+
 //}
 
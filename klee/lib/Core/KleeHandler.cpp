@@ -34,6 +34,7 @@
 
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <cerrno>
 
 #include <sys/types.h>
@@ -49,6 +50,7 @@
 #include "klee/Internal/System/Time.h"
 #include "klee/Internal/ADT/KTest.h"
 #include "klee/ExecutionState.h"
+#include "klee/util/ExprPPrinter.h"
 
 #include "llvm/Support/CommandLine.h"
 #if (LLVM_VERSION_MAJOR == 2 && LLVM_VERSION_MINOR < 9)
@@ -106,14 +108,58 @@ cl::opt<unsigned>
 StopAfterNTests("stop-after-n-tests",
 	     cl::desc("Stop execution after generating the given number of tests.  Extra tests corresponding to partially explored paths will also be dumped."),
 	     cl::init(0));
+
+cl::opt<unsigned>
+TestEmissionThreads("test-emission-threads",
+        cl::desc("Number of threads solving for and writing out the test "
+                 "cases in the background, 0 to write them out as the states "
+                 "terminate (default=0)"),
+        cl::init(0));
+
+cl::opt<unsigned>
+MaxPendingTests("max-pending-tests",
+        cl::desc("Number of test cases that can wait for the emission "
+                 "threads before the interpreter blocks, 0 for no limit "
+                 "(default=256)"),
+        cl::init(256));
+
+cl::opt<bool> WriteTestBundle("write-test-bundle", cl::desc(
+		"Pack the test files into a single indexed file (tests.bundle)"));
 }
 
 namespace klee {
 
+/// Everything needed to write out a test case, captured from the state
+/// when it terminates.
+struct KleeHandler::TestCase {
+	unsigned id;
+	bool isError;
+	std::string errorMessage, errorSuffix;
+
+	SymbolicSnapshot snapshot;
+	/// Whether the inputs were already solved for, on the interpreter thread.
+	bool solved;
+	bool success;
+	std::vector<std::pair<std::string, std::vector<unsigned char> > > solution;
+
+	std::vector<unsigned char> concreteBranches, symbolicBranches;
+	std::string cvc;
+	std::map<const std::string*, std::set<unsigned> > coverage;
+
+	double startTime;
+
+	TestCase() : id(0), isError(false), solved(false), success(false),
+			startTime(0) {}
+};
+
+unsigned KleeHandler::siblingIndex = 0;
+
 KleeHandler::KleeHandler(int argc, char **argv) :
 	m_interpreter(0), m_pathWriter(0), m_symPathWriter(0), m_infoFile(0),
+			m_activeTests(0), m_shutdown(false), m_bundle(0),
 			m_testIndex(0), m_pathsExplored(0), m_argc(argc), m_argv(argv) {
 	std::string theDir;
+	bool created = false;
 
 	if (OutputDir == "") {
 		llvm::sys::Path directory(InputFile);
@@ -132,9 +178,13 @@ KleeHandler::KleeHandler(int argc, char **argv) :
 
 			if (DIR *dir = opendir(theDir.c_str())) {
 				closedir(dir);
-			} else {
+			} else if (mkdir(theDir.c_str(), 0775) == 0) {
+				created = true;
+				break;
+			} else if (errno != EEXIST) {
 				break;
 			}
+			// Otherwise a sibling worker took it just now
 		}
 
 		std::cerr << "KLEE: output directory = \"" << dirname << "\"\n";
@@ -142,15 +192,21 @@ KleeHandler::KleeHandler(int argc, char **argv) :
 		llvm::sys::Path klee_last(directory);
 		klee_last.appendComponent("klee-last");
 
-		if ((unlink(klee_last.c_str()) < 0) && (errno != ENOENT)) {
-			perror("Cannot unlink klee-last");
-			assert(0 && "exiting.");
-		}
+		if (siblingIndex == 0) {
+			if ((unlink(klee_last.c_str()) < 0) && (errno != ENOENT)) {
+				perror("Cannot unlink klee-last");
+				assert(0 && "exiting.");
+			}
 
-		if (symlink(dirname.c_str(), klee_last.c_str()) < 0) {
-			perror("Cannot make symlink");
-			assert(0 && "exiting.");
+			if (symlink(dirname.c_str(), klee_last.c_str()) < 0) {
+				perror("Cannot make symlink");
+				assert(0 && "exiting.");
+			}
 		}
+	} else if (siblingIndex > 0) {
+		std::stringstream ss;
+		ss << OutputDir << "-" << siblingIndex;
+		theDir = ss.str();
 	} else {
 		theDir = OutputDir;
 	}
@@ -167,8 +223,8 @@ KleeHandler::KleeHandler(int argc, char **argv) :
 	}
 	strcpy(m_outputDirectory, p.c_str());
 
-    if (OutputDir == "" || CreateOutputDir) {
-      if (mkdir(m_outputDirectory, 0775) < 0) {
+    if (OutputDir == "" || CreateOutputDir || siblingIndex > 0) {
+      if (!created && mkdir(m_outputDirectory, 0775) < 0) {
           std::cerr << "KLEE: ERROR: Unable to make output directory: \""
                   << m_outputDirectory << "\", refusing to overwrite.\n";
           exit(1);
@@ -199,11 +255,61 @@ KleeHandler::KleeHandler(int argc, char **argv) :
 	*pidFile << getpid();
 	delete pidFile;
 
+	if (WriteTestBundle) {
+		m_bundle = kTestBundle_create(getOutputFilename("tests.bundle").c_str());
+		if (!m_bundle) {
+			std::cerr << "KLEE: ERROR: Unable to create the test bundle\n";
+			exit(1);
+		}
+	}
+
+	pthread_mutex_init(&m_lock, NULL);
+	pthread_mutex_init(&m_outputLock, NULL);
+	pthread_cond_init(&m_testReadyCond, NULL);
+	pthread_cond_init(&m_testDoneCond, NULL);
+
+	if (TestEmissionThreads) {
+		// The snapshots share their expressions and update lists with the
+		// interpreter
+		RefCountPolicy::atomic = true;
+		if (!RefCountPolicy::isAtomic()) {
+			std::cerr << "KLEE: ERROR: --test-emission-threads needs atomic "
+					"reference counts (built with KLEE_REFCOUNT_PLAIN)\n";
+			exit(1);
+		}
+
+		m_emissionThreads.resize(TestEmissionThreads);
+		for (unsigned i = 0; i < m_emissionThreads.size(); ++i) {
+			if (pthread_create(&m_emissionThreads[i], NULL, emissionThread, this)) {
+				perror("Cannot create test emission thread");
+				exit(1);
+			}
+		}
+	}
+
     // Init Cloud9 instrumentation
     initCloud9Instrumentation();
 }
 
 KleeHandler::~KleeHandler() {
+	flushTestCases();
+
+	pthread_mutex_lock(&m_lock);
+	m_shutdown = true;
+	pthread_cond_broadcast(&m_testReadyCond);
+	pthread_mutex_unlock(&m_lock);
+
+	for (unsigned i = 0; i < m_emissionThreads.size(); ++i)
+		pthread_join(m_emissionThreads[i], NULL);
+
+	pthread_cond_destroy(&m_testDoneCond);
+	pthread_cond_destroy(&m_testReadyCond);
+	pthread_mutex_destroy(&m_outputLock);
+	pthread_mutex_destroy(&m_lock);
+
+	if (m_bundle && !kTestBundle_close(m_bundle))
+		klee_warning("unable to write the test bundle index");
+
 	if (m_pathWriter)
 		delete m_pathWriter;
 	if (m_symPathWriter)
@@ -281,154 +387,232 @@ std::ostream *KleeHandler::openTestFile(const std::string &suffix, unsigned id)
 	return openOutputFile(filename);
 }
 
-/* Outputs all files (.ktest, .pc, .cov etc.) describing a test case */
+void KleeHandler::writeTestFile(const std::string &suffix, unsigned id,
+		const std::string &contents) {
+	if (m_bundle) {
+		pthread_mutex_lock(&m_outputLock);
+		bool success = kTestBundle_addFile(m_bundle, id, suffix.c_str(),
+				contents.data(), contents.size());
+		pthread_mutex_unlock(&m_outputLock);
+
+		if (!success)
+			klee_warning("unable to write output test case");
+		return;
+	}
+
+	std::ostream *f = openTestFile(suffix, id);
+	if (f) {
+		*f << contents;
+		delete f;
+	} else {
+		klee_warning("unable to write output test case");
+	}
+}
+
+/* Captures what is needed to write out a test case, and writes it out either
+ * right away or through the emission threads */
 void KleeHandler::processTestCase(const ExecutionState &state,
 		const char *errorMessage, const char *errorSuffix) {
 	if (errorMessage && ExitOnError) {
+		flushTestCases();
 		std::cerr << "EXITING ON ERROR:\n" << errorMessage << "\n";
 		exit(1);
 	}
 
   if (!NoOutput || (errorMessage && !ReallyNoOutput)) {
-		std::vector<std::pair<std::string, std::vector<unsigned char> > > out;
-		bool success = m_interpreter->getSymbolicSolution(state, out);
-
-		if (!success)
-			klee_warning("unable to get symbolic solution, losing test case");
-
-		double start_time = util::getWallTime();
-
-		unsigned id = ++m_testIndex;
-
-		if (success) {
-			KTest b;
-			b.numArgs = m_argc;
-			b.args = m_argv;
-			b.symArgvs = 0;
-			b.symArgvLen = 0;
-			b.numObjects = out.size();
-			b.objects = new KTestObject[b.numObjects];
-			assert(b.objects);
-			for (unsigned i = 0; i < b.numObjects; i++) {
-				KTestObject *o = &b.objects[i];
-				o->name = const_cast<char*> (out[i].first.c_str());
-				o->numBytes = out[i].second.size();
-				o->bytes = new unsigned char[o->numBytes];
-				assert(o->bytes);
-				std::copy(out[i].second.begin(), out[i].second.end(), o->bytes);
-			}
+		TestCase *tc = new TestCase();
+		tc->startTime = util::getWallTime();
+		tc->id = ++m_testIndex;
 
-			if (!kTest_toFile(&b, getTestFilename("ktest", id).c_str())) {
-				klee_warning("unable to write output test case, losing it");
-			}
-
-			for (unsigned i = 0; i < b.numObjects; i++)
-				delete[] b.objects[i].bytes;
-			delete[] b.objects;
+		if (errorMessage) {
+			tc->isError = true;
+			tc->errorMessage = errorMessage;
+			tc->errorSuffix = errorSuffix;
 		}
 
-		if (errorMessage) {
-			std::ostream *f = openTestFile(errorSuffix, id);
-			if(f) {
-			  *f << errorMessage;
-			  delete f;
-
-			  cloud9::instrum::theInstrManager.recordEvent(cloud9::instrum::ErrorCase,
-								       getTestFilename(errorSuffix, id));
-			} else {
-			  klee_warning("unable to write output test case");
-			}
-		     
+		m_interpreter->getSymbolicSnapshot(state, tc->snapshot);
+		if (m_emissionThreads.empty()) {
+			// Solving here benefits from the caches of the interpreter
+			tc->solved = true;
+			tc->success = m_interpreter->getSymbolicSolution(state, tc->solution);
 		}
 
-		if (m_pathWriter) {
-			std::vector<unsigned char> concreteBranches;
+		if (m_pathWriter)
 			m_pathWriter->readStream(m_interpreter->getPathStreamID(state),
-					concreteBranches);
-			std::ostream *f = openTestFile("path", id);
-			if(f) {
-			  std::copy(concreteBranches.begin(), concreteBranches.end(),
-				    std::ostream_iterator<unsigned char>(*f, "\n"));
-			  delete f;
-			} else {
-			  klee_warning("unable to write output test case");
-			}
+					tc->concreteBranches);
+
+		if (m_symPathWriter)
+			m_symPathWriter->readStream(m_interpreter->getSymbolicPathStreamID(
+					state), tc->symbolicBranches);
+
+		if (WriteCVCs)
+			m_interpreter->getConstraintLog(state, tc->cvc, true);
+
+		if (WriteCov)
+			m_interpreter->getCoveredLines(state, tc->coverage);
+
+		if (m_testIndex == StopAfterNTests)
+			m_interpreter->setHaltExecution(true);
+
+		if (m_emissionThreads.empty()) {
+			emitTestCase(tc);
+			return;
 		}
 
-		if (errorMessage || WritePCs) {
-			std::string constraints;
-			m_interpreter->getConstraintLog(state, constraints);
-			std::ostream *f = openTestFile("pc", id);
-			if(f) {
-			  *f << constraints;
-			  delete f;
-			} else {
-			  klee_warning("unable to write output test case");
-			}
+		pthread_mutex_lock(&m_lock);
+		while (MaxPendingTests && m_pendingTests.size() >= MaxPendingTests)
+			pthread_cond_wait(&m_testDoneCond, &m_lock);
+		m_pendingTests.push_back(tc);
+		pthread_cond_signal(&m_testReadyCond);
+		pthread_mutex_unlock(&m_lock);
+	}
+}
+
+void *KleeHandler::emissionThread(void *handler) {
+	KleeHandler *h = static_cast<KleeHandler*>(handler);
+
+	pthread_mutex_lock(&h->m_lock);
+	for (;;) {
+		while (h->m_pendingTests.empty() && !h->m_shutdown)
+			pthread_cond_wait(&h->m_testReadyCond, &h->m_lock);
+		if (h->m_pendingTests.empty())
+			break;
+
+		TestCase *tc = h->m_pendingTests.front();
+		h->m_pendingTests.pop_front();
+		++h->m_activeTests;
+		// There is room in the queue again
+		pthread_cond_broadcast(&h->m_testDoneCond);
+		pthread_mutex_unlock(&h->m_lock);
+
+		h->emitTestCase(tc);
+
+		pthread_mutex_lock(&h->m_lock);
+		--h->m_activeTests;
+		pthread_cond_broadcast(&h->m_testDoneCond);
+	}
+	pthread_mutex_unlock(&h->m_lock);
+
+	return NULL;
+}
+
+void KleeHandler::flushTestCases() {
+	pthread_mutex_lock(&m_lock);
+	while (!m_pendingTests.empty() || m_activeTests)
+		pthread_cond_wait(&m_testDoneCond, &m_lock);
+	pthread_mutex_unlock(&m_lock);
+}
+
+/* Outputs all files (.ktest, .pc, .cov etc.) describing a test case */
+void KleeHandler::emitTestCase(TestCase *tc) {
+	if (!tc->solved) {
+		tc->startTime = util::getWallTime();
+		tc->success = m_interpreter->getSymbolicSolution(tc->snapshot,
+				tc->solution);
+	}
+
+	if (!tc->success)
+		klee_warning("unable to get symbolic solution, losing test case");
+
+	unsigned id = tc->id;
+
+	if (tc->success) {
+		std::vector<std::pair<std::string, std::vector<unsigned char> > > &out =
+				tc->solution;
+
+		KTest b;
+		b.numArgs = m_argc;
+		b.args = m_argv;
+		b.symArgvs = 0;
+		b.symArgvLen = 0;
+		b.numObjects = out.size();
+		b.objects = new KTestObject[b.numObjects];
+		assert(b.objects);
+		for (unsigned i = 0; i < b.numObjects; i++) {
+			KTestObject *o = &b.objects[i];
+			o->name = const_cast<char*> (out[i].first.c_str());
+			o->numBytes = out[i].second.size();
+			o->bytes = new unsigned char[o->numBytes];
+			assert(o->bytes);
+			std::copy(out[i].second.begin(), out[i].second.end(), o->bytes);
 		}
 
-		if (WriteCVCs) {
-			std::string constraints;
-			m_interpreter->getConstraintLog(state, constraints, true);
-			std::ostream *f = openTestFile("cvc", id);
-			if(f) {
-			  *f << constraints;
-			  delete f;
-			} else {
-			  klee_warning("unable to write output test case");
-			}
+		bool written;
+		if (m_bundle) {
+			pthread_mutex_lock(&m_outputLock);
+			written = kTestBundle_addTest(m_bundle, id, &b);
+			pthread_mutex_unlock(&m_outputLock);
+		} else {
+			written = kTest_toFile(&b, getTestFilename("ktest", id).c_str());
 		}
+		if (!written)
+			klee_warning("unable to write output test case, losing it");
 
-		if (m_symPathWriter) {
-			std::vector<unsigned char> symbolicBranches;
-			m_symPathWriter->readStream(m_interpreter->getSymbolicPathStreamID(
-					state), symbolicBranches);
-			std::ostream *f = openTestFile("sym.path", id);
-			if(f) {
-			  std::copy(symbolicBranches.begin(), symbolicBranches.end(),
-				    std::ostream_iterator<unsigned char>(*f, "\n"));
-			  delete f;
-			}
-			else {
-			  klee_warning("unable to write output test case");
-			}
+		for (unsigned i = 0; i < b.numObjects; i++)
+			delete[] b.objects[i].bytes;
+		delete[] b.objects;
+	}
 
-		}
+	if (tc->isError) {
+		writeTestFile(tc->errorSuffix, id, tc->errorMessage);
 
-		if (WriteCov) {
-			std::map<const std::string*, std::set<unsigned> > cov;
-			m_interpreter->getCoveredLines(state, cov);
-			std::ostream *f = openTestFile("cov", id);
-			if(f) {
-			  for (std::map<const std::string*, std::set<unsigned> >::iterator
-				 it = cov.begin(), ie = cov.end(); it != ie; ++it) {
-			    for (std::set<unsigned>::iterator it2 = it->second.begin(), ie =
-				   it->second.end(); it2 != ie; ++it2)
-			      *f << *it->first << ":" << *it2 << "\n";
-			  }
-			  delete f;
-			} else {
-			  klee_warning("unable to write output test case");
-			}
+		pthread_mutex_lock(&m_outputLock);
+		cloud9::instrum::theInstrManager.recordEvent(cloud9::instrum::ErrorCase,
+				getTestFilename(tc->errorSuffix, id));
+		pthread_mutex_unlock(&m_outputLock);
+	}
+
+	if (m_pathWriter) {
+		std::string branches;
+		for (unsigned i = 0; i < tc->concreteBranches.size(); ++i) {
+			branches += tc->concreteBranches[i];
+			branches += '\n';
 		}
+		writeTestFile("path", id, branches);
+	}
 
-		if (m_testIndex == StopAfterNTests)
-			m_interpreter->setHaltExecution(true);
+	if (tc->isError || WritePCs) {
+		std::ostringstream constraints;
+		ExprPPrinter::printConstraints(constraints, tc->snapshot.constraints);
+		writeTestFile("pc", id, constraints.str());
+	}
 
-		if (WriteTestInfo) {
-			double elapsed_time = util::getWallTime() - start_time;
-			std::ostream *f = openTestFile("info", id);
-			if(f) {
-			  *f << "Time to generate test case: " << elapsed_time << "s\n";
-			  delete f;
-			} else {
-			  klee_warning("unable to write output test case");
-			}
+	if (WriteCVCs)
+		writeTestFile("cvc", id, tc->cvc);
+
+	if (m_symPathWriter) {
+		std::string branches;
+		for (unsigned i = 0; i < tc->symbolicBranches.size(); ++i) {
+			branches += tc->symbolicBranches[i];
+			branches += '\n';
 		}
+		writeTestFile("sym.path", id, branches);
+	}
 
-		cloud9::instrum::theInstrManager.recordEvent(cloud9::instrum::TestCase,
-                    getTestFilename("ktest", id));
+	if (WriteCov) {
+		std::ostringstream cov;
+		for (std::map<const std::string*, std::set<unsigned> >::iterator it =
+				tc->coverage.begin(), ie = tc->coverage.end(); it != ie; ++it) {
+			for (std::set<unsigned>::iterator it2 = it->second.begin(), ie =
+					it->second.end(); it2 != ie; ++it2)
+				cov << *it->first << ":" << *it2 << "\n";
+		}
+		writeTestFile("cov", id, cov.str());
+	}
+
+	if (WriteTestInfo) {
+		double elapsed_time = util::getWallTime() - tc->startTime;
+		std::ostringstream info;
+		info << "Time to generate test case: " << elapsed_time << "s\n";
+		writeTestFile("info", id, info.str());
 	}
+
+	pthread_mutex_lock(&m_outputLock);
+	cloud9::instrum::theInstrManager.recordEvent(cloud9::instrum::TestCase,
+			getTestFilename("ktest", id));
+	pthread_mutex_unlock(&m_outputLock);
+
+	delete tc;
 }
 
 // load a .path file
@@ -11,6 +11,9 @@
 
 #include "Memory.h"
 
+#include "CoreStats.h"
+#include "MemoryManager.h"
+
 #include "klee/Executor.h"
 #include "Context.h"
 #include "klee/Expr.h"
@@ -25,9 +28,11 @@
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/raw_ostream.h"
 
+#include <algorithm>
 #include <iostream>
 #include <sstream>
 #include <cassert>
+#include <cstring>
 #include <sstream>
 
 using namespace llvm;
@@ -85,6 +90,12 @@ std::ostream &klee::operator<<(std::ostream &os, const MemoryObject &obj) {
 int MemoryObject::counter = 0;
 
 MemoryObject::~MemoryObject() {
+  // Only the objects of the memory manager were counted as allocations,
+  // not, e.g., the lookup keys of the address spaces
+  if (parent) {
+    ++stats::deallocations;
+    parent->markFreed(this);
+  }
 }
 
 void MemoryObject::getAllocInfo(std::string &result) const {
@@ -97,24 +108,84 @@ void MemoryObject::getAllocInfo(std::string &result) const {
 
 /***/
 
+const unsigned ObjectPage::Size;
+
+ObjectPage::ObjectPage(unsigned _size)
+  : refCount(0),
+    size(_size),
+    concreteStore(new uint8_t[_size]),
+    concreteMask(0),
+    flushMask(0),
+    knownSymbolics(0),
+    footprint(0) {
+  updateFootprint();
+}
+
+ObjectPage::ObjectPage(const ObjectPage &p)
+  : refCount(0),
+    size(p.size),
+    concreteStore(new uint8_t[p.size]),
+    concreteMask(p.concreteMask ? new BitArray(*p.concreteMask, p.size) : 0),
+    flushMask(p.flushMask ? new BitArray(*p.flushMask, p.size) : 0),
+    knownSymbolics(0),
+    footprint(0) {
+  if (p.knownSymbolics) {
+    knownSymbolics = new ref<Expr>[size];
+    for (unsigned i=0; i<size; i++)
+      knownSymbolics[i] = p.knownSymbolics[i];
+  }
+
+  memcpy(concreteStore, p.concreteStore, size*sizeof(*concreteStore));
+  updateFootprint();
+}
+
+ObjectPage::~ObjectPage() {
+  if (concreteMask) delete concreteMask;
+  if (flushMask) delete flushMask;
+  if (knownSymbolics) delete[] knownSymbolics;
+  delete[] concreteStore;
+  MemoryAccounting::release(MemoryAccounting::ObjectStates, footprint);
+}
+
+void ObjectPage::updateFootprint() {
+  size_t maskBytes = sizeof(BitArray) + (size + 31) / 32 * sizeof(uint32_t);
+  size_t bytes = sizeof(*this) + size +
+    (concreteMask ? maskBytes : 0) +
+    (flushMask ? maskBytes : 0) +
+    (knownSymbolics ? size * sizeof(ref<Expr>) : 0);
+
+  if (bytes > footprint)
+    MemoryAccounting::allocate(MemoryAccounting::ObjectStates,
+                               bytes - footprint);
+  else if (bytes < footprint)
+    MemoryAccounting::release(MemoryAccounting::ObjectStates,
+                              footprint - bytes);
+  footprint = bytes;
+}
+
+/***/
+
 ObjectState::ObjectState(const MemoryObject *mo)
   : copyOnWriteOwner(0),
     refCount(0),
     object(mo),
-    concreteStore(new uint8_t[mo->size]),
-    concreteMask(0),
-    flushMask(0),
-    knownSymbolics(0),
     updates(0, 0),
     size(mo->size),
     readOnly(false),
     isShared(false) {
+  RefCountPolicy::inc(&mo->refCount);
+  for (unsigned base = 0; base < size; base += ObjectPage::Size) {
+    pages.push_back(new ObjectPage(std::min(size - base, ObjectPage::Size)));
+    RefCountPolicy::inc(&pages.back()->refCount);
+  }
   if (!UseConstantArrays) {
     // FIXME: Leaked.
     static unsigned id = 0;
     const Array *array = new Array("tmp_arr" + llvm::utostr(++id), size);
     updates = UpdateList(array, 0);
   }
+  MemoryAccounting::allocate(MemoryAccounting::ObjectStates,
+                             getOwnFootprint());
 }
 
 
@@ -122,45 +193,108 @@ ObjectState::ObjectState(const MemoryObject *mo, const Array *array)
   : copyOnWriteOwner(0),
     refCount(0),
     object(mo),
-    concreteStore(new uint8_t[mo->size]),
-    concreteMask(0),
-    flushMask(0),
-    knownSymbolics(0),
     updates(array, 0),
     size(mo->size),
     readOnly(false),
     isShared(false) {
+  RefCountPolicy::inc(&mo->refCount);
+  for (unsigned base = 0; base < size; base += ObjectPage::Size) {
+    pages.push_back(new ObjectPage(std::min(size - base, ObjectPage::Size)));
+    RefCountPolicy::inc(&pages.back()->refCount);
+  }
   makeSymbolic();
+  MemoryAccounting::allocate(MemoryAccounting::ObjectStates,
+                             getOwnFootprint());
 }
 
 ObjectState::ObjectState(const ObjectState &os) 
   : copyOnWriteOwner(0),
     refCount(0),
     object(os.object),
-    concreteStore(new uint8_t[os.size]),
-    concreteMask(os.concreteMask ? new BitArray(*os.concreteMask, os.size) : 0),
-    flushMask(os.flushMask ? new BitArray(*os.flushMask, os.size) : 0),
-    knownSymbolics(0),
+    pages(os.pages),
     updates(os.updates),
     size(os.size),
     readOnly(false),
     isShared(os.isShared) {
   assert(!os.readOnly && "no need to copy read only object?");
+  RefCountPolicy::inc(&object->refCount);
 
-  if (os.knownSymbolics) {
-    knownSymbolics = new ref<Expr>[size];
-    for (unsigned i=0; i<size; i++)
-      knownSymbolics[i] = os.knownSymbolics[i];
-  }
+  // The pages are copied lazily, when first written to
+  for (std::vector<ObjectPage*>::iterator it = pages.begin(),
+         ie = pages.end(); it != ie; ++it)
+    RefCountPolicy::inc(&(*it)->refCount);
+  MemoryAccounting::allocate(MemoryAccounting::ObjectStates,
+                             getOwnFootprint());
+}
 
-  memcpy(concreteStore, os.concreteStore, size*sizeof(*concreteStore));
+ObjectState::ObjectState(const MemoryObject *mo,
+                         const std::vector<ObjectPage*> &_pages,
+                         const UpdateList &_updates)
+  : copyOnWriteOwner(0),
+    refCount(0),
+    object(mo),
+    pages(_pages),
+    updates(_updates),
+    size(mo->size),
+    readOnly(false),
+    isShared(false) {
+  RefCountPolicy::inc(&object->refCount);
+  for (std::vector<ObjectPage*>::iterator it = pages.begin(),
+         ie = pages.end(); it != ie; ++it)
+    RefCountPolicy::inc(&(*it)->refCount);
+  MemoryAccounting::allocate(MemoryAccounting::ObjectStates,
+                             getOwnFootprint());
 }
 
 ObjectState::~ObjectState() {
-  if (concreteMask) delete concreteMask;
-  if (flushMask) delete flushMask;
-  if (knownSymbolics) delete[] knownSymbolics;
-  delete[] concreteStore;
+  MemoryAccounting::release(MemoryAccounting::ObjectStates,
+                            getOwnFootprint());
+  for (std::vector<ObjectPage*>::iterator it = pages.begin(),
+         ie = pages.end(); it != ie; ++it) {
+    if (RefCountPolicy::dec(&(*it)->refCount))
+      delete *it;
+  }
+
+  if (RefCountPolicy::dec(&object->refCount))
+    delete object;
+}
+
+ObjectPage *ObjectState::getWriteablePage(unsigned offset) const {
+  ObjectPage *&page = pages[offset / ObjectPage::Size];
+  if (page->refCount > 1) {
+    ObjectPage *copy = new ObjectPage(*page);
+    RefCountPolicy::inc(&copy->refCount);
+    if (RefCountPolicy::dec(&page->refCount))
+      delete page;
+    page = copy;
+  }
+  return page;
+}
+
+void ObjectState::copyOutConcreteStore(uint8_t *dst) const {
+  for (unsigned i = 0; i < pages.size(); ++i)
+    memcpy(dst + i * ObjectPage::Size, pages[i]->concreteStore,
+           pages[i]->size);
+}
+
+bool ObjectState::equalsConcreteStore(const uint8_t *src) const {
+  for (unsigned i = 0; i < pages.size(); ++i) {
+    if (memcmp(src + i * ObjectPage::Size, pages[i]->concreteStore,
+               pages[i]->size))
+      return false;
+  }
+  return true;
+}
+
+void ObjectState::copyInConcreteStore(const uint8_t *src) {
+  // Only unshare the pages that change
+  for (unsigned i = 0; i < pages.size(); ++i) {
+    const uint8_t *pageSrc = src + i * ObjectPage::Size;
+    if (memcmp(pageSrc, pages[i]->concreteStore, pages[i]->size)) {
+      ObjectPage *page = getWriteablePage(i * ObjectPage::Size);
+      memcpy(page->concreteStore, pageSrc, page->size);
+    }
+  }
 }
 
 /***/
@@ -228,12 +362,20 @@ const UpdateList &ObjectState::getUpdates() const {
 }
 
 void ObjectState::makeConcrete() {
-  if (concreteMask) delete concreteMask;
-  if (flushMask) delete flushMask;
-  if (knownSymbolics) delete[] knownSymbolics;
-  concreteMask = 0;
-  flushMask = 0;
-  knownSymbolics = 0;
+  for (unsigned base = 0; base < size; base += ObjectPage::Size) {
+    const ObjectPage *page = getPage(base);
+    if (!page->concreteMask && !page->flushMask && !page->knownSymbolics)
+      continue;
+
+    ObjectPage *wpage = getWriteablePage(base);
+    if (wpage->concreteMask) delete wpage->concreteMask;
+    if (wpage->flushMask) delete wpage->flushMask;
+    if (wpage->knownSymbolics) delete[] wpage->knownSymbolics;
+    wpage->concreteMask = 0;
+    wpage->flushMask = 0;
+    wpage->knownSymbolics = 0;
+    wpage->updateFootprint();
+  }
 }
 
 void ObjectState::makeSymbolic() {
@@ -250,14 +392,18 @@ void ObjectState::makeSymbolic() {
 
 void ObjectState::initializeToZero() {
   makeConcrete();
-  memset(concreteStore, 0, size);
+  for (unsigned base = 0; base < size; base += ObjectPage::Size) {
+    ObjectPage *page = getWriteablePage(base);
+    memset(page->concreteStore, 0, page->size);
+  }
 }
 
 void ObjectState::initializeToRandom() {  
   makeConcrete();
-  for (unsigned i=0; i<size; i++) {
+  for (unsigned base = 0; base < size; base += ObjectPage::Size) {
+    ObjectPage *page = getWriteablePage(base);
     // randomly selected by 256 sided die
-    concreteStore[i] = 0xAB;
+    memset(page->concreteStore, 0xAB, page->size);
   }
 }
 
@@ -278,42 +424,54 @@ void ObjectState::fastRangeCheckOffset(ref<Expr> offset,
 
 void ObjectState::flushRangeForRead(unsigned rangeBase, 
                                     unsigned rangeSize) const {
-  if (!flushMask) flushMask = new BitArray(size, true);
- 
   for (unsigned offset=rangeBase; offset<rangeBase+rangeSize; offset++) {
     if (!isByteFlushed(offset)) {
+      const ObjectPage *page = getPage(offset);
+      unsigned i = offset % ObjectPage::Size;
       if (isByteConcrete(offset)) {
         updates.extend(ConstantExpr::create(offset, Expr::Int32),
-                       ConstantExpr::create(concreteStore[offset], Expr::Int8));
+                       ConstantExpr::create(page->concreteStore[i],
+                                            Expr::Int8));
       } else {
         assert(isByteKnownSymbolic(offset) && "invalid bit set in flushMask");
         updates.extend(ConstantExpr::create(offset, Expr::Int32),
-                       knownSymbolics[offset]);
+                       page->knownSymbolics[i]);
       }
 
-      flushMask->unset(offset);
+      ObjectPage *wpage = getWriteablePage(offset);
+      if (!wpage->flushMask) {
+        wpage->flushMask = new BitArray(wpage->size, true);
+        wpage->updateFootprint();
+      }
+      wpage->flushMask->unset(i);
     }
   } 
 }
 
 void ObjectState::flushRangeForWrite(unsigned rangeBase, 
                                      unsigned rangeSize) {
-  if (!flushMask) flushMask = new BitArray(size, true);
-
   for (unsigned offset=rangeBase; offset<rangeBase+rangeSize; offset++) {
     if (!isByteFlushed(offset)) {
+      const ObjectPage *page = getPage(offset);
+      unsigned i = offset % ObjectPage::Size;
       if (isByteConcrete(offset)) {
         updates.extend(ConstantExpr::create(offset, Expr::Int32),
-                       ConstantExpr::create(concreteStore[offset], Expr::Int8));
+                       ConstantExpr::create(page->concreteStore[i],
+                                            Expr::Int8));
         markByteSymbolic(offset);
       } else {
         assert(isByteKnownSymbolic(offset) && "invalid bit set in flushMask");
         updates.extend(ConstantExpr::create(offset, Expr::Int32),
-                       knownSymbolics[offset]);
+                       page->knownSymbolics[i]);
         setKnownSymbolic(offset, 0);
       }
 
-      flushMask->unset(offset);
+      ObjectPage *wpage = getWriteablePage(offset);
+      if (!wpage->flushMask) {
+        wpage->flushMask = new BitArray(wpage->size, true);
+        wpage->updateFootprint();
+      }
+      wpage->flushMask->unset(i);
     } else {
       // flushed bytes that are written over still need
       // to be marked out
@@ -327,49 +485,80 @@ void ObjectState::flushRangeForWrite(unsigned rangeBase,
 }
 
 bool ObjectState::isByteConcrete(unsigned offset) const {
-  return !concreteMask || concreteMask->get(offset);
+  const ObjectPage *page = getPage(offset);
+  return !page->concreteMask ||
+    page->concreteMask->get(offset % ObjectPage::Size);
 }
 
 bool ObjectState::isByteFlushed(unsigned offset) const {
-  return flushMask && !flushMask->get(offset);
+  const ObjectPage *page = getPage(offset);
+  return page->flushMask && !page->flushMask->get(offset % ObjectPage::Size);
 }
 
 bool ObjectState::isByteKnownSymbolic(unsigned offset) const {
-  return knownSymbolics && knownSymbolics[offset].get();
+  const ObjectPage *page = getPage(offset);
+  return page->knownSymbolics &&
+    page->knownSymbolics[offset % ObjectPage::Size].get();
 }
 
+// The page is only unshared when the byte state actually changes
+
 void ObjectState::markByteConcrete(unsigned offset) {
-  if (concreteMask)
-    concreteMask->set(offset);
+  const ObjectPage *page = getPage(offset);
+  unsigned i = offset % ObjectPage::Size;
+  if (page->concreteMask && !page->concreteMask->get(i))
+    getWriteablePage(offset)->concreteMask->set(i);
 }
 
 void ObjectState::markByteSymbolic(unsigned offset) {
-  if (!concreteMask)
-    concreteMask = new BitArray(size, true);
-  concreteMask->unset(offset);
+  const ObjectPage *page = getPage(offset);
+  unsigned i = offset % ObjectPage::Size;
+  if (page->concreteMask && !page->concreteMask->get(i))
+    return;
+
+  ObjectPage *wpage = getWriteablePage(offset);
+  if (!wpage->concreteMask) {
+    wpage->concreteMask = new BitArray(wpage->size, true);
+    wpage->updateFootprint();
+  }
+  wpage->concreteMask->unset(i);
 }
 
 void ObjectState::markByteUnflushed(unsigned offset) {
-  if (flushMask)
-    flushMask->set(offset);
+  const ObjectPage *page = getPage(offset);
+  unsigned i = offset % ObjectPage::Size;
+  if (page->flushMask && !page->flushMask->get(i))
+    getWriteablePage(offset)->flushMask->set(i);
 }
 
 void ObjectState::markByteFlushed(unsigned offset) {
-  if (!flushMask) {
-    flushMask = new BitArray(size, false);
+  const ObjectPage *page = getPage(offset);
+  unsigned i = offset % ObjectPage::Size;
+  if (page->flushMask && !page->flushMask->get(i))
+    return;
+
+  ObjectPage *wpage = getWriteablePage(offset);
+  if (!wpage->flushMask) {
+    wpage->flushMask = new BitArray(wpage->size, false);
+    wpage->updateFootprint();
   } else {
-    flushMask->unset(offset);
+    wpage->flushMask->unset(i);
   }
 }
 
 void ObjectState::setKnownSymbolic(unsigned offset, 
                                    Expr *value /* can be null */) {
-  if (knownSymbolics) {
-    knownSymbolics[offset] = value;
+  const ObjectPage *page = getPage(offset);
+  unsigned i = offset % ObjectPage::Size;
+  if (page->knownSymbolics) {
+    if (page->knownSymbolics[i].get() != value)
+      getWriteablePage(offset)->knownSymbolics[i] = value;
   } else {
     if (value) {
-      knownSymbolics = new ref<Expr>[size];
-      knownSymbolics[offset] = value;
+      ObjectPage *wpage = getWriteablePage(offset);
+      wpage->knownSymbolics = new ref<Expr>[wpage->size];
+      wpage->knownSymbolics[i] = value;
+      wpage->updateFootprint();
     }
   }
 }
@@ -378,9 +567,11 @@ void ObjectState::setKnownSymbolic(unsigned offset,
 
 ref<Expr> ObjectState::read8(unsigned offset) const {
   if (isByteConcrete(offset)) {
-    return ConstantExpr::create(concreteStore[offset], Expr::Int8);
+    return ConstantExpr::create(getPage(offset)->
+                                concreteStore[offset % ObjectPage::Size],
+                                Expr::Int8);
   } else if (isByteKnownSymbolic(offset)) {
-    return knownSymbolics[offset];
+    return getPage(offset)->knownSymbolics[offset % ObjectPage::Size];
   } else {
     assert(isByteFlushed(offset) && "unflushed byte without cache value");
     
@@ -391,7 +582,7 @@ ref<Expr> ObjectState::read8(unsigned offset) const {
 
 unsigned ObjectState::read8c(unsigned offset) const {
   if (isByteConcrete(offset))
-    return concreteStore[offset];
+    return getPage(offset)->concreteStore[offset % ObjectPage::Size];
   return unsigned(-1);
 }
 
@@ -414,7 +605,10 @@ ref<Expr> ObjectState::read8(ref<Expr> offset) const {
 
 void ObjectState::write8(unsigned offset, uint8_t value) {
   //assert(read_only == false && "writing to read-only object!");
-  concreteStore[offset] = value;
+  const ObjectPage *page = getPage(offset);
+  unsigned i = offset % ObjectPage::Size;
+  if (page->concreteStore[i] != value)
+    getWriteablePage(offset)->concreteStore[i] = value;
   setKnownSymbolic(offset, 0);
 
   markByteConcrete(offset);
@@ -587,6 +781,80 @@ void ObjectState::write64(unsigned offset, uint64_t value) {
   }
 }
 
+void ObjectState::getDifferentRanges(const ObjectState &b,
+    std::vector<std::pair<unsigned, unsigned> > &ranges) const {
+  assert(size == b.size && "comparing objects of different sizes");
+
+  // Shared object states are trivially identical
+  if (this == &b)
+    return;
+
+  bool inRange = false;
+  unsigned rangeBegin = 0;
+
+  // The update lists are not part of the pages. Symbolic writes extend them
+  // without touching the pages once the object is flushed.
+  bool sameUpdates = updates.root == b.updates.root &&
+    updates.head == b.updates.head;
+
+  // Walk the object in blocks covered by a single concrete mask word. Pages
+  // are a multiple of the block size, so blocks never straddle them.
+  for (unsigned base = 0; base < size; base += 32) {
+    const ObjectPage *aPage = getPage(base), *bPage = b.getPage(base);
+    unsigned pageOffset = base % ObjectPage::Size;
+
+    if (aPage == bPage && (sameUpdates || !aPage->flushMask)) {
+      // Pages still shared since the fork are identical too, as long as
+      // none of their bytes is read from the update lists
+      if (inRange) {
+        ranges.push_back(std::make_pair(rangeBegin, base));
+        inRange = false;
+      }
+      base += aPage->size - pageOffset - 32;
+      continue;
+    }
+
+    unsigned end = std::min(base + 32, size);
+    uint32_t aMask = aPage->concreteMask ?
+      aPage->concreteMask->getWord(pageOffset / 32) : ~0U;
+    uint32_t bMask = bPage->concreteMask ?
+      bPage->concreteMask->getWord(pageOffset / 32) : ~0U;
+    const uint8_t *aStore = aPage->concreteStore + pageOffset;
+    const uint8_t *bStore = bPage->concreteStore + pageOffset;
+
+    if (aMask == ~0U && bMask == ~0U &&
+        !memcmp(aStore, bStore, end - base)) {
+      // Entire block is concrete and identical
+      if (inRange) {
+        ranges.push_back(std::make_pair(rangeBegin, base));
+        inRange = false;
+      }
+      continue;
+    }
+
+    for (unsigned i = base; i < end; i++) {
+      uint32_t bit = 1U << (i - base);
+      bool differs;
+
+      if ((aMask & bit) && (bMask & bit))
+        differs = aStore[i - base] != bStore[i - base];
+      else
+        differs = read8(i) != b.read8(i);
+
+      if (differs && !inRange) {
+        rangeBegin = i;
+        inRange = true;
+      } else if (!differs && inRange) {
+        ranges.push_back(std::make_pair(rangeBegin, i));
+        inRange = false;
+      }
+    }
+  }
+
+  if (inRange)
+    ranges.push_back(std::make_pair(rangeBegin, size));
+}
+
 void ObjectState::print() {
   std::cerr << "-- ObjectState --\n";
   std::cerr << "\tMemoryObject ID: " << object->id << "\n";
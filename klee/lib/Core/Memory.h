@@ -36,11 +36,19 @@ class KInstruction;
 
 class MemoryObject {
   friend class STPBuilder;
+  friend class MemoryManager;
 
 private:
   static int counter;
 
+  /// The manager that allocated this object, if it is still around.
+  MemoryManager *parent;
+
 public:
+  /// Number of object states, stack frames and symbolic lists holding this
+  /// object. It is deleted when the last of them lets go of it.
+  mutable uint32_t refCount;
+
   unsigned id;
   uint64_t address;
 
@@ -76,7 +84,9 @@ public:
   // XXX this is just a temp hack, should be removed
   explicit
   MemoryObject(uint64_t _address) 
-    : id(counter++),
+    : parent(0),
+      refCount(0),
+      id(counter++),
       address(_address),
       size(0),
       isFixed(true),
@@ -87,7 +97,9 @@ public:
   MemoryObject(uint64_t _address, unsigned _size, 
                bool _isLocal, bool _isGlobal, bool _isFixed,
                const llvm::Value *_allocSite) 
-    : id(counter++),
+    : parent(0),
+      refCount(0),
+      id(counter++),
       address(_address),
       size(_size),
       name("unnamed"),
@@ -101,6 +113,13 @@ public:
 
   ~MemoryObject();
 
+  /// Memory objects are compared by identity.
+  int compare(const MemoryObject &b) const {
+    if (id != b.id)
+      return id < b.id ? -1 : 1;
+    return 0;
+  }
+
   /// Get an identifying string for this allocation.
 	template<class OStream>
 	void getAllocInfo(OStream &info) const {
@@ -164,6 +183,39 @@ public:
 
 std::ostream &operator<<(std::ostream &os, const MemoryObject &obj);
 
+/// A fixed-size slice of the contents of an object state. Pages are shared
+/// by an object state and its copies until one of them modifies the page,
+/// so that forked states only duplicate the parts of an object they touch.
+class ObjectPage {
+public:
+  /// Size in bytes of all pages but the last one of an object.
+  static const unsigned Size = 4096;
+
+  uint32_t refCount;
+  unsigned size;
+
+  uint8_t *concreteStore;
+  // XXX cleanup name of flushMask (its backwards or something)
+  BitArray *concreteMask;
+  BitArray *flushMask;
+  ref<Expr> *knownSymbolics;
+
+  /// The bytes charged to MemoryAccounting::ObjectStates.
+  size_t footprint;
+
+  explicit ObjectPage(unsigned _size);
+  ObjectPage(const ObjectPage &p);
+  ~ObjectPage();
+
+  /// Charge the masks and known symbolics allocated or freed since the
+  /// last call.
+  void updateFootprint();
+
+private:
+  // DO NOT IMPLEMENT
+  ObjectPage &operator=(const ObjectPage &p);
+};
+
 class ObjectState {
 private:
   friend class AddressSpace;
@@ -172,20 +224,22 @@ private:
   friend class ObjectHolder;
   unsigned refCount;
 
-  const MemoryObject *object;
+  friend class StateSerializer;
 
-  uint8_t *concreteStore;
-  // XXX cleanup name of flushMask (its backwards or something)
-  BitArray *concreteMask;
+  const MemoryObject *object;
 
-  // mutable because may need flushed during read of const
-  mutable BitArray *flushMask;
-
-  ref<Expr> *knownSymbolics;
+  // mutable because pages may need to be unshared to flush them during
+  // read of const
+  mutable std::vector<ObjectPage*> pages;
 
   // mutable because we may need flush during read of const
   mutable UpdateList updates;
 
+  /// The bytes of the object state itself, without the pages.
+  size_t getOwnFootprint() const {
+    return sizeof(*this) + pages.capacity() * sizeof(ObjectPage*);
+  }
+
 public:
   unsigned size;
 
@@ -232,7 +286,31 @@ public:
   void write32(unsigned offset, uint32_t value);
   void write64(unsigned offset, uint64_t value);
 
+  /// Append to \a ranges the maximal [begin, end) byte ranges where the
+  /// contents of this object differ from those of \a b. Concrete bytes are
+  /// compared in bulk, expressions are only built for symbolic bytes.
+  void getDifferentRanges(const ObjectState &b,
+      std::vector<std::pair<unsigned, unsigned> > &ranges) const;
+
 private:
+  /// Create an object state made of existing pages, which it takes a
+  /// reference to (e.g., when decoding a serialized state).
+  ObjectState(const MemoryObject *mo, const std::vector<ObjectPage*> &_pages,
+              const UpdateList &_updates);
+
+  const ObjectPage *getPage(unsigned offset) const {
+    return pages[offset / ObjectPage::Size];
+  }
+  /// Return the page holding \a offset, after making sure it is not
+  /// shared with other object states.
+  ObjectPage *getWriteablePage(unsigned offset) const;
+
+  // Access to the concrete cache, for AddressSpace to pass memory to
+  // externals
+  void copyOutConcreteStore(uint8_t *dst) const;
+  bool equalsConcreteStore(const uint8_t *src) const;
+  void copyInConcreteStore(const uint8_t *src);
+
   const UpdateList &getUpdates() const;
 
   void makeConcrete();
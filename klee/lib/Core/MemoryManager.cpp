@@ -24,10 +24,13 @@ using namespace klee;
 /***/
 
 MemoryManager::~MemoryManager() { 
-  while (!objects.empty()) {
-    MemoryObject *mo = objects.back();
-    objects.pop_back();
-    delete mo;
+  // Objects still held somewhere are deleted by their last holder
+  for (objects_ty::iterator it = objects.begin(), ie = objects.end();
+       it != ie; ++it) {
+    MemoryObject *mo = *it;
+    mo->parent = 0;
+    if (mo->refCount == 0)
+      delete mo;
   }
 }
 
@@ -45,7 +48,8 @@ MemoryObject *MemoryManager::allocate(ExecutionState *state, uint64_t size, bool
   ++stats::allocations;
   MemoryObject *res = new MemoryObject(address, size, isLocal, isGlobal, false,
                                        allocSite);
-  objects.push_back(res);
+  res->parent = this;
+  objects.insert(res);
   return res;
 }
 
@@ -66,10 +70,27 @@ MemoryObject *MemoryManager::allocateFixed(uint64_t address, uint64_t size,
                                        allocSite);
   if (name)
     res->setName(name);
-  objects.push_back(res);
+  res->parent = this;
+  objects.insert(res);
+  return res;
+}
+
+MemoryObject *MemoryManager::allocateAt(uint64_t address, uint64_t size,
+                                        bool isLocal, bool isGlobal,
+                                        bool isFixed,
+                                        const llvm::Value *allocSite) {
+  ++stats::allocations;
+  MemoryObject *res = new MemoryObject(address, size, isLocal, isGlobal,
+                                       isFixed, allocSite);
+  res->parent = this;
+  objects.insert(res);
   return res;
 }
 
 void MemoryManager::deallocate(const MemoryObject *mo) {
   assert(0);
 }
+
+void MemoryManager::markFreed(MemoryObject *mo) {
+  objects.erase(mo);
+}
@@ -10,7 +10,7 @@
 #ifndef KLEE_MEMORYMANAGER_H
 #define KLEE_MEMORYMANAGER_H
 
-#include <vector>
+#include <set>
 #include <stdint.h>
 
 namespace llvm {
@@ -18,13 +18,21 @@ namespace llvm {
 }
 
 namespace klee {
+  class ExecutionState;
   class MemoryObject;
 
+  /// Allocates the memory objects. They are reference counted by their
+  /// holders and deleted when no longer used; the manager only keeps track
+  /// of the live ones.
   class MemoryManager {
+    friend class MemoryObject;
+
   private:
-    typedef std::vector<MemoryObject*> objects_ty;
+    typedef std::set<MemoryObject*> objects_ty;
     objects_ty objects;
 
+    void markFreed(MemoryObject *mo);
+
   public:
     MemoryManager() {}
     ~MemoryManager();
@@ -34,6 +42,12 @@ namespace klee {
     MemoryObject *allocateFixed(uint64_t address, uint64_t size,
                                 const llvm::Value *allocSite,
                                 const char* name);
+    /// Create an object at an address allocated elsewhere, e.g., for a
+    /// state received from another process. The address is not checked
+    /// against the other objects, which may belong to other states.
+    MemoryObject *allocateAt(uint64_t address, uint64_t size, bool isLocal,
+                             bool isGlobal, bool isFixed,
+                             const llvm::Value *allocSite);
     void deallocate(const MemoryObject *mo);
   };
 
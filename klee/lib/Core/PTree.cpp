@@ -72,6 +72,10 @@ PTreeNode* PTree::mergeCopy(Node *target, Node *other,
   return merged;
 }
 
+PTreeNode* PTree::graft(const data_type &data) {
+  return new Node(0, data);
+}
+
 PTreeNode* PTree::duplicate(Node *main, const data_type &duplicateData)
 {
   PTreeNode *dup = new Node(main, duplicateData);
@@ -12,6 +12,7 @@
 
 #include <klee/Expr.h>
 #include <klee/ForkTag.h>
+#include <klee/Internal/Support/MemoryAccounting.h>
 
 #include "llvm/ADT/SmallVector.h"
 
@@ -46,6 +47,9 @@ namespace klee {
     Node* mergeCopy(Node *target, Node *other,
                     const data_type &mergedData);
     Node* duplicate(Node *main, const data_type &duplicateData);
+    /// Create a parentless node for a state that did not fork from the
+    /// tree (e.g., one received from another worker).
+    Node* graft(const data_type &data);
 
     void terminate(Node *n);
 
@@ -66,6 +70,16 @@ namespace klee {
     bool active; ///< at least one node in a subtree is running
 
     ForkTag forkTag;
+
+    static void *operator new(size_t size) {
+      MemoryAccounting::allocate(MemoryAccounting::ProcessTree, size);
+      return ::operator new(size);
+    }
+    static void operator delete(void *p, size_t size) {
+      MemoryAccounting::release(MemoryAccounting::ProcessTree, size);
+      ::operator delete(p);
+    }
+
   private:
     PTreeNode(PTreeNode *_parent, ExecutionState *_data);
     ~PTreeNode();
@@ -33,6 +33,7 @@
 #include "llvm/Support/CFG.h"
 #include "llvm/Support/CommandLine.h"
 
+#include <algorithm>
 #include <cassert>
 #include <fstream>
 #include <climits>
@@ -388,22 +389,25 @@ ExecutionState &MergingSearcher::selectState() {
     }
   }
   
-  // build map of merge point -> state list
-  std::map<Instruction*, std::vector<ExecutionState*> > merges;
+  // build map of (merge point, merge fingerprint) -> state list; states
+  // with different fingerprints can never merge, so they are not paired
+  std::map<std::pair<Instruction*, uint64_t>,
+           std::vector<ExecutionState*> > merges;
   for (std::set<ExecutionState*>::const_iterator it = statesAtMerge.begin(),
          ie = statesAtMerge.end(); it != ie; ++it) {
     ExecutionState &state = **it;
     Instruction *mp = getMergePoint(state);
     
-    merges[mp].push_back(&state);
+    merges[std::make_pair(mp, state.getMergeFingerprint())].push_back(&state);
   }
   
   if (DebugLogMerge)
     std::cerr << "-- all at merge --\n";
-  for (std::map<Instruction*, std::vector<ExecutionState*> >::iterator
+  for (std::map<std::pair<Instruction*, uint64_t>,
+                std::vector<ExecutionState*> >::iterator
          it = merges.begin(), ie = merges.end(); it != ie; ++it) {
     if (DebugLogMerge) {
-      std::cerr << "\tmerge: " << it->first << " [";
+      std::cerr << "\tmerge: " << it->first.first << " [";
       for (std::vector<ExecutionState*>::iterator it2 = it->second.begin(),
              ie2 = it->second.end(); it2 != ie2; ++it2) {
         ExecutionState *state = *it2;
@@ -660,6 +664,10 @@ LazyMergingSearcher::LazyMergingSearcher(Executor &_executor, Searcher *_baseSea
 }
 
 LazyMergingSearcher::~LazyMergingSearcher() {
+  for (StatesTrace::iterator it = forwardTrace.begin(),
+                             ie = forwardTrace.end(); it != ie; ++it)
+    delete it->second;
+
   delete baseSearcher;
 }
 
@@ -742,15 +750,7 @@ inline void LazyMergingSearcher::addItemToTraces(ExecutionState *state,
   // If per-state traces collection had more items than the maximum,
   // remove the oldest item from the traces.
   if (nextEnd == si->begin) {
-    StatesTrace::iterator it1 = statesTrace.find(si->indexes[si->begin]);
-    if (it1 != statesTrace.end()) {
-      it1->second->erase(state);
-      if (it1->second->empty()) {
-        delete it1->second;
-        statesTrace.erase(it1);
-      }
-    }
-
+    eraseFromTrace(si->indexes[si->begin], state);
     si->begin = (si->begin + 1) % unsigned(stateIndexesSize);
   }
 
@@ -758,11 +758,7 @@ inline void LazyMergingSearcher::addItemToTraces(ExecutionState *state,
   si->end = nextEnd;
 
   // Add item to the main traces map
-  StatesTrace::iterator it = statesTrace.find(mergeIndex);
-  if (it == statesTrace.end()) {
-      it = statesTrace.insert(std::make_pair(mergeIndex, new StatesSet)).first;
-  }
-  it->second->insert(state);
+  insertIntoTrace(mergeIndex, state);
 
   verifyMaps();
 }
@@ -775,11 +771,8 @@ inline void LazyMergingSearcher::removeStateFromTraces(ExecutionState *state) {
     return;
 
   StateIndexes* si = sIt->second;
-  for (unsigned i = si->begin; i != si->end; i = (i+1) % stateIndexesSize) {
-    StatesTrace::iterator it = statesTrace.find(si->indexes[i]);
-    if (it != statesTrace.end())
-      it->second->erase(state);
-  }
+  for (unsigned i = si->begin; i != si->end; i = (i+1) % stateIndexesSize)
+    eraseFromTrace(si->indexes[i], state);
 
   delete si;
   statesIndexesMap.erase(sIt);
@@ -808,11 +801,7 @@ inline void LazyMergingSearcher::mergeStateTraces(ExecutionState *merged,
     for (unsigned i = oi->begin; i != oi->end; i = (i+1) % stateIndexesSize) {
       uint64_t idx = oi->indexes[i];
       mi->indexes[i] = idx;
-      StatesTrace::iterator it = statesTrace.find(idx);
-      if (it == statesTrace.end()) {
-          it = statesTrace.insert(std::make_pair(idx, new StatesSet)).first;
-      }
-      it->second->insert(merged);
+      insertIntoTrace(idx, merged);
     }
     mi->begin = oi->begin;
     mi->end = oi->end;
@@ -828,22 +817,13 @@ inline void LazyMergingSearcher::mergeStateTraces(ExecutionState *merged,
       } else {
         oc = oc ? oc - 1 : stateIndexesSize - 1;
         buf[s] = oi->indexes[oc];
-
-        StatesTrace::iterator it = statesTrace.find(buf[s]);
-        if (it == statesTrace.end()) {
-            it = statesTrace.insert(std::make_pair(buf[s], new StatesSet)).first;
-        }
-        it->second->insert(merged);
+        insertIntoTrace(buf[s], merged);
       }
     }
 
     while (mc != mi->begin) {
       mc = mc ? mc - 1 : stateIndexesSize - 1;
-      StatesTrace::iterator it = statesTrace.find(mi->indexes[mc]);
-      if (it != statesTrace.end()) {
-        it->second->erase(merged);
-        statesTrace.erase(it);
-      }
+      eraseFromTrace(mi->indexes[mc], merged);
     }
 
     delete[] mi->indexes;
@@ -855,6 +835,121 @@ inline void LazyMergingSearcher::mergeStateTraces(ExecutionState *merged,
   verifyMaps();
 }
 
+inline void LazyMergingSearcher::insertIntoTrace(uint64_t mergeIndex,
+                                                 ExecutionState *state) {
+  StatesTrace::iterator it = statesTrace.find(mergeIndex);
+  if (it == statesTrace.end()) {
+      it = statesTrace.insert(std::make_pair(mergeIndex, new StatesSet)).first;
+  }
+  if (it->second->insert(state))
+    updateForwardCandidates(mergeIndex);
+}
+
+inline void LazyMergingSearcher::eraseFromTrace(uint64_t mergeIndex,
+                                                ExecutionState *state) {
+  StatesTrace::iterator it = statesTrace.find(mergeIndex);
+  if (it == statesTrace.end() || !it->second->erase(state))
+    return;
+
+  if (it->second->empty()) {
+    delete it->second;
+    statesTrace.erase(it);
+  }
+  updateForwardCandidates(mergeIndex);
+}
+
+inline unsigned LazyMergingSearcher::countCandidates(ExecutionState *state,
+                                                     uint64_t mergeIndex) const {
+  if (state->mergeDisabled())
+    return 0;
+
+  StatesTrace::const_iterator it = statesTrace.find(mergeIndex);
+  if (it == statesTrace.end())
+    return 0;
+
+  return it->second->size() - it->second->count(state);
+}
+
+void LazyMergingSearcher::addStateToForward(ExecutionState *state) {
+  if (statesToForward.count(state))
+    return;
+
+  ForwardEntry entry;
+  entry.mergeIndex = state->getMergeIndex();
+  entry.candidates = countCandidates(state, entry.mergeIndex);
+
+  statesToForward.insert(std::make_pair(state, entry));
+  forwardQueue.insert(std::make_pair(entry.candidates, state));
+
+  StatesTrace::iterator it = forwardTrace.find(entry.mergeIndex);
+  if (it == forwardTrace.end()) {
+      it = forwardTrace.insert(std::make_pair(entry.mergeIndex,
+                                              new StatesSet)).first;
+  }
+  it->second->insert(state);
+}
+
+bool LazyMergingSearcher::removeStateToForward(ExecutionState *state) {
+  StatesToForward::iterator sIt = statesToForward.find(state);
+  if (sIt == statesToForward.end())
+    return false;
+
+  ForwardEntry &entry = sIt->second;
+  forwardQueue.erase(std::make_pair(entry.candidates, state));
+
+  StatesTrace::iterator it = forwardTrace.find(entry.mergeIndex);
+  assert(it != forwardTrace.end());
+  it->second->erase(state);
+  if (it->second->empty()) {
+    delete it->second;
+    forwardTrace.erase(it);
+  }
+
+  statesToForward.erase(sIt);
+  return true;
+}
+
+void LazyMergingSearcher::refileStateToForward(ExecutionState *state) {
+  // The merge index of a state only changes when the state is executed
+  if (removeStateToForward(state))
+    addStateToForward(state);
+}
+
+void LazyMergingSearcher::updateForwardCandidates(uint64_t mergeIndex) {
+  StatesTrace::iterator it = forwardTrace.find(mergeIndex);
+  if (it == forwardTrace.end())
+    return;
+
+  for (StatesSet::iterator sIt = it->second->begin(),
+                           sIe = it->second->end(); sIt != sIe; ++sIt) {
+    ExecutionState *state = *sIt;
+    ForwardEntry &entry = statesToForward.find(state)->second;
+    unsigned candidates = countCandidates(state, mergeIndex);
+    if (candidates != entry.candidates) {
+      forwardQueue.erase(std::make_pair(entry.candidates, state));
+      entry.candidates = candidates;
+      forwardQueue.insert(std::make_pair(entry.candidates, state));
+    }
+  }
+}
+
+bool LazyMergingSearcher::checkForwardCandidates() const {
+  if (forwardQueue.size() != statesToForward.size())
+    return false;
+
+  unsigned most = 0;
+  for (StatesToForward::const_iterator it = statesToForward.begin(),
+         ie = statesToForward.end(); it != ie; ++it) {
+    unsigned candidates = countCandidates(it->first, it->second.mergeIndex);
+    if (candidates != it->second.candidates ||
+        !forwardQueue.count(std::make_pair(candidates, it->first)))
+      return false;
+    most = std::max(most, candidates);
+  }
+
+  return forwardQueue.empty() || forwardQueue.rbegin()->first == most;
+}
+
 inline bool LazyMergingSearcher::canFastForwardState(const ExecutionState* state) const {
   if (state->mergeDisabled())
     return false;
@@ -878,74 +973,32 @@ inline bool LazyMergingSearcher::canFastForwardState(const ExecutionState* state
 
 ExecutionState &LazyMergingSearcher::selectState() {
   ExecutionState *state = NULL, *merged = NULL;
-  while (!statesToForward.empty()) {
+  while (!forwardQueue.empty()) {
     assert(state == NULL);
 
     // TODO: do not fast-forward state if there are other
     // states that could be merged with state first (i.e., select
     // smartly what state to fast-forward first).
-#if 0
-    state = *statesToForward.begin();
-    uint64_t mergeIndex = state->getMergeIndex();
-    StatesTrace::iterator traceIt = statesTrace.find(mergeIndex);
-    unsigned candidates = (traceIt == statesTrace.end() ? 0
-                  : traceIt->second->size() - traceIt->second->count(state));
 
-    if (candidates == 0) {
-      // State can no longer be fast-forwarded
-      statesToForward.erase(state);
+    // Drop the states that can no longer be fast-forwarded, perhaps they
+    // branched in a different direction than their merge targets
+    while (!forwardQueue.empty() && forwardQueue.begin()->first == 0) {
+      removeStateToForward(forwardQueue.begin()->second);
       stats::fastForwardsFail += 1;
-      continue;
-    }
-
-#else
-    uint64_t mergeIndex = 0;
-    unsigned candidates = 0;
-    StatesTrace::iterator traceIt;
-
-    /* Find the state that has maximum number of potential targets to merge */
-    for (StatesSet::iterator it = statesToForward.begin(),
-                        ie = statesToForward.end(); it != ie;) {
-      unsigned _candidates = 0;
-      uint64_t _mergeIndex;
-      StatesTrace::iterator _traceIt;
-      if (!(*it)->mergeDisabled()) {
-        _mergeIndex = (*it)->getMergeIndex();
-        _traceIt = statesTrace.find(_mergeIndex);
-        _candidates = (_traceIt == statesTrace.end() ? 0
-                       : _traceIt->second->size() - _traceIt->second->count(*it));
-      }
-
-      if (_candidates == 0) {
-          // State can no longer be fast-forwarded, perhaps it branched
-          // in a different direction that it's merge target
-
-          // XXX: StatesSet does not support erase by iterator!
-          // Moreover, erasing seems to invalidate iterators.
-          statesToForward.erase(*it);
-          stats::fastForwardsFail += 1;
-
-          // Restart iteration from the begining since our iterators
-          // are invalidated by calling erase
-          it = statesToForward.begin();
-
-      } else {
-          if (_candidates > candidates) {
-            state = *it;
-            mergeIndex = _mergeIndex;
-            candidates = _candidates;
-            traceIt = _traceIt;
-          }
-          ++it;
-      }
     }
 
-    if (state == NULL) {
+    if (forwardQueue.empty()) {
         // All states were removed from statesToForward
         break;
     }
 
-#endif
+    /* Pick the state that has maximum number of potential targets to merge */
+    state = forwardQueue.rbegin()->second;
+    uint64_t mergeIndex = state->getMergeIndex();
+    assert(statesToForward.find(state)->second.mergeIndex == mergeIndex);
+
+    StatesTrace::iterator traceIt = statesTrace.find(mergeIndex);
+    assert(traceIt != statesTrace.end());
 
     assert(!MaxStateMultiplicity || state->multiplicity < MaxStateMultiplicity);
     assert(!state->mergeDisabled());
@@ -982,16 +1035,18 @@ ExecutionState &LazyMergingSearcher::selectState() {
           }
 
           // Terminate merged state
-          statesToForward.erase(state);
+          removeStateToForward(state);
           executor.terminateState(*state, true);
 
           // Filter statesToForward
           if (merged != state1) {
-            if (statesToForward.erase(state1) && keepMergedInTrace)
-              statesToForward.insert(merged);
+            if (removeStateToForward(state1) && keepMergedInTrace)
+              addStateToForward(merged);
             executor.terminateState(*state1, true);
           } else if (!keepMergedInTrace) {
-            statesToForward.erase(merged);
+            removeStateToForward(merged);
+          } else {
+            refileStateToForward(merged);
           }
 
           state = NULL;
@@ -1021,7 +1076,7 @@ ExecutionState &LazyMergingSearcher::selectState() {
   state = &baseSearcher->selectState();
 
   if (canFastForwardState(state)) {
-    statesToForward.insert(state);
+    addStateToForward(state);
     stats::fastForwardsStart += 1;
     return selectState(); // recursive
   }
@@ -1054,6 +1109,10 @@ void LazyMergingSearcher::update(ExecutionState *current,
     */
   }
 
+  // The current state may have moved to a different merge index
+  if (current)
+    refileStateToForward(current);
+
 #warning Play with the following!
   // TODO: we could add every newly created state to fast-forward track,
   // that would be more aggressive. This can be done be removing the following
@@ -1065,7 +1124,7 @@ void LazyMergingSearcher::update(ExecutionState *current,
                                    ie = addedStates.end(); it != ie; ++it) {
       assert(!(*it)->isDuplicate);
       if (canFastForwardState(*it)) {
-        statesToForward.insert(*it);
+        addStateToForward(*it);
         stats::fastForwardsStart += 1;
       }
     }
@@ -1075,7 +1134,7 @@ void LazyMergingSearcher::update(ExecutionState *current,
                                  ie = removedStates.end(); it != ie; ++it) {
     ExecutionState *state = *it;
     assert(!state->isDuplicate);
-    statesToForward.erase(state);
+    removeStateToForward(state);
     removeStateFromTraces(state);
   }
 
@@ -1477,3 +1536,129 @@ void ForkCapSearcher::update(ExecutionState *current,
 
   baseSearcher->update(current, newAddedStates, newRemovedStates);
 }
+
+/***/
+
+WorkStealingSearcher::WorkStealingSearcher(Executor &executor,
+                                           unsigned shardCount,
+                                           bool weighted,
+                                           WeightedRandomSearcher::WeightType
+                                             type)
+  : shards(std::max(shardCount, 1U)),
+    turn(0) {
+  if (weighted) {
+    for (unsigned i = 0; i < shards.size(); ++i)
+      shards[i].weighted = new WeightedRandomSearcher(executor, type);
+  }
+}
+
+WorkStealingSearcher::~WorkStealingSearcher() {
+  for (unsigned i = 0; i < shards.size(); ++i)
+    delete shards[i].weighted;
+}
+
+unsigned WorkStealingSearcher::getSmallestShard() const {
+  unsigned smallest = 0;
+  for (unsigned i = 1; i < shards.size(); ++i)
+    if (shards[i].states.size() < shards[smallest].states.size())
+      smallest = i;
+  return smallest;
+}
+
+void WorkStealingSearcher::removeFromShard(Shard &shard, ExecutionState *es) {
+  if (es == shard.states.back()) {
+    shard.states.pop_back();
+  } else if (es == shard.states.front()) {
+    shard.states.pop_front();
+  } else {
+    std::deque<ExecutionState*>::iterator it =
+      std::find(shard.states.begin(), shard.states.end(), es);
+    assert(it != shard.states.end() && "invalid state removed");
+    shard.states.erase(it);
+  }
+}
+
+void WorkStealingSearcher::steal(unsigned thief) {
+  unsigned victim = thief;
+  for (unsigned i = 0; i < shards.size(); ++i)
+    if (shards[i].states.size() > shards[victim].states.size())
+      victim = i;
+
+  // Leave the last state of a shard to its owner
+  if (shards[victim].states.size() < 2)
+    return;
+
+  // The oldest states are the shallowest, with the most work below them
+  ExecutionState *es = shards[victim].states.front();
+  shards[victim].states.pop_front();
+  shards[thief].states.push_back(es);
+  owners[es] = thief;
+
+  if (shards[thief].weighted) {
+    shards[victim].weighted->removeState(es);
+    shards[thief].weighted->addState(es);
+  }
+}
+
+ExecutionState &WorkStealingSearcher::selectState() {
+  // Pass the turn to the next shard with work, stealing some if needed
+  for (unsigned i = 0; i < shards.size(); ++i) {
+    turn = (turn + 1) % shards.size();
+    if (shards[turn].states.empty())
+      steal(turn);
+    if (!shards[turn].states.empty())
+      break;
+  }
+
+  Shard &shard = shards[turn];
+  assert(!shard.states.empty() && "selecting from an empty searcher");
+
+  if (shard.weighted)
+    return shard.weighted->selectState();
+  return *shard.states.back();
+}
+
+void WorkStealingSearcher::update(ExecutionState *current,
+                                  const std::set<ExecutionState*> &addedStates,
+                                  const std::set<ExecutionState*> &removedStates) {
+  // Removing the current state below invalidates its iterator
+  std::map<ExecutionState*, unsigned>::iterator cit =
+    current ? owners.find(current) : owners.end();
+  bool currentOwned = cit != owners.end();
+  unsigned home = currentOwned ? cit->second : getSmallestShard();
+
+  if (addedStates.empty() && removedStates.empty()) {
+    // The common case, a step of the current state
+    if (currentOwned && shards[home].weighted)
+      shards[home].weighted->update(current, addedStates, removedStates);
+    return;
+  }
+
+  // Forks stay with their parent, other new states go where there is room
+  std::vector<std::set<ExecutionState*> > added(shards.size());
+  std::vector<std::set<ExecutionState*> > removed(shards.size());
+
+  for (std::set<ExecutionState*>::const_iterator it = addedStates.begin(),
+         ie = addedStates.end(); it != ie; ++it) {
+    owners[*it] = home;
+    shards[home].states.push_back(*it);
+    added[home].insert(*it);
+  }
+
+  for (std::set<ExecutionState*>::const_iterator it = removedStates.begin(),
+         ie = removedStates.end(); it != ie; ++it) {
+    std::map<ExecutionState*, unsigned>::iterator oit = owners.find(*it);
+    assert(oit != owners.end() && "invalid state removed");
+    removeFromShard(shards[oit->second], *it);
+    removed[oit->second].insert(*it);
+    owners.erase(oit);
+  }
+
+  if (shards[0].weighted) {
+    for (unsigned i = 0; i < shards.size(); ++i) {
+      bool owner = currentOwned && i == home;
+      if (owner || !added[i].empty() || !removed[i].empty())
+        shards[i].weighted->update(owner ? current : 0, added[i], removed[i]);
+    }
+  }
+}
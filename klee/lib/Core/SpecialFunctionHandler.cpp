@@ -162,12 +162,12 @@ SpecialFunctionHandler::SpecialFunctionHandler(Executor &_executor)
   : executor(_executor) {}
 
 
-void SpecialFunctionHandler::prepare() {
+void SpecialFunctionHandler::prepare(Module *module) {
   unsigned N = sizeof(handlerInfo)/sizeof(handlerInfo[0]);
 
   for (unsigned i=0; i<N; ++i) {
     HandlerInfo &hi = handlerInfo[i];
-    Function *f = executor.kmodule->module->getFunction(hi.name);
+    Function *f = module->getFunction(hi.name);
     
     // No need to create if the function doesn't exist, since it cannot
     // be called in that case.
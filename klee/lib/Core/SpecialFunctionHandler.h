@@ -45,8 +45,9 @@ namespace klee {
     /// Perform any modifications on the LLVM module before it is
     /// prepared for execution. At the moment this involves deleting
     /// unused function bodies and marking intrinsics with appropriate
-    /// flags for use in optimizations.
-    void prepare();
+    /// flags for use in optimizations. Does not need an executor, so that
+    /// the module can be prepared before one is created.
+    static void prepare(llvm::Module *module);
 
     /// Initialize the internal handler map after the module has been
     /// prepared for execution.
@@ -0,0 +1,1291 @@
+//===-- StateSerializer.cpp -----------------------------------------------===//
+//
+//                     The KLEE Symbolic Virtual Machine
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "StateSerializer.h"
+
+#include "Common.h"
+#include "Memory.h"
+#include "MemoryManager.h"
+#include "ObjectHolder.h"
+
+#include "klee/ExecutionState.h"
+#include "klee/Executor.h"
+#include "klee/util/BitArray.h"
+#include "klee/util/ExprSerializer.h"
+#include "klee/Internal/Module/Cell.h"
+#include "klee/Internal/Module/InstructionInfoTable.h"
+#include "klee/Internal/Module/KInstruction.h"
+#include "klee/Internal/Module/KModule.h"
+
+#include "llvm/Function.h"
+#include "llvm/Instructions.h"
+#include "llvm/Module.h"
+
+#include <cstring>
+
+using namespace llvm;
+using namespace klee;
+
+namespace {
+  const uint32_t BundleMagic = 0x4b53540a;
+  const uint32_t MemoryMagic = 0x4b534d0a;
+
+  const uint32_t NoID = ExprEncoder::NoRecord;
+
+  enum ObjectKind {
+    /// The object of a module global, which both ends already have.
+    GlobalObject,
+    PlainObject
+  };
+
+  enum ObjectFlags {
+    LocalFlag = 1,
+    GlobalFlag = 2,
+    FixedFlag = 4,
+    FakeFlag = 8,
+    UserSpecifiedFlag = 16
+  };
+
+  enum PageFlags {
+    ConcreteMaskFlag = 1,
+    FlushMaskFlag = 2,
+    KnownSymbolicsFlag = 4
+  };
+
+  /// Decoded object states are owned by nobody, so that the first write of
+  /// any state copies them, like after a fork.
+  const unsigned DecodedOwner = 1;
+
+  void writeDouble(SerialWriter &out, double v) {
+    uint64_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    out.write64(bits);
+  }
+
+  double readDouble(SerialReader &in) {
+    uint64_t bits = in.read64();
+    double v;
+    memcpy(&v, &bits, sizeof(v));
+    return v;
+  }
+
+  void writeFloat(SerialWriter &out, float v) {
+    uint32_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    out.write32(bits);
+  }
+
+  float readFloat(SerialReader &in) {
+    uint32_t bits = in.read32();
+    float v;
+    memcpy(&v, &bits, sizeof(v));
+    return v;
+  }
+
+  /// Read the length of a sequence, each element of which takes at least
+  /// one byte, so that garbage does not make us loop for long.
+  uint32_t readCount(SerialReader &in) {
+    uint32_t count = in.read32();
+    if (count > in.remaining()) {
+      in.setError();
+      return 0;
+    }
+    return count;
+  }
+
+  void append(std::string &data, const SerialWriter &out) {
+    if (!out.data.empty())
+      data.append((const char*) &out.data[0], out.data.size());
+  }
+}
+
+/***/
+
+struct StateSerializer::EncodingContext {
+  // Each table goes to its own buffer, so that the decoder can rebuild them
+  // in dependency order: expressions, objects, pages, object states, states
+  SerialWriter records, objects, pages, objectStates, body;
+  ExprEncoder exprs;
+
+  std::map<const MemoryObject*, uint32_t> objectIDs;
+  std::map<const ObjectPage*, uint32_t> pageIDs;
+  std::map<const ObjectState*, uint32_t> objectStateIDs;
+
+  /// The states encoded so far, whose constraints later states may share.
+  std::vector<const ExecutionState*> states;
+
+  /// If set, memory objects are only numbered and collected here.
+  std::vector< ref<const MemoryObject> > *localObjects;
+
+  bool failed;
+
+  EncodingContext() : exprs(records), localObjects(0), failed(false) {}
+};
+
+struct StateSerializer::DecodingContext {
+  SerialReader &in;
+  ExprDecoder exprs;
+
+  std::vector< ref<const MemoryObject> > objects;
+  std::vector<ObjectPage*> pages;
+  std::vector<ObjectHolder> objectStates;
+  std::vector<ExecutionState*> states;
+
+  DecodingContext(SerialReader &_in,
+                  std::map<uint64_t, const Array*> &arrays)
+    : in(_in), exprs(_in, arrays) {}
+
+  ~DecodingContext() {
+    // The object states that were bound hold their own references
+    for (std::vector<ObjectPage*>::iterator it = pages.begin(),
+           ie = pages.end(); it != ie; ++it) {
+      if (RefCountPolicy::dec(&(*it)->refCount))
+        delete *it;
+    }
+  }
+};
+
+/***/
+
+StateSerializer::StateSerializer(Executor &_executor)
+  : executor(_executor), tablesBuilt(false) {
+}
+
+void StateSerializer::buildTables() {
+  Module *m = executor.kmodule->module;
+
+  for (Module::global_iterator it = m->global_begin(), ie = m->global_end();
+       it != ie; ++it) {
+    valueIDs[it] = values.size();
+    values.push_back(it);
+  }
+  for (Module::alias_iterator it = m->alias_begin(), ie = m->alias_end();
+       it != ie; ++it) {
+    valueIDs[it] = values.size();
+    values.push_back(it);
+  }
+  for (Module::iterator f = m->begin(), fe = m->end(); f != fe; ++f) {
+    valueIDs[f] = values.size();
+    values.push_back(f);
+    for (Function::arg_iterator it = f->arg_begin(), ie = f->arg_end();
+         it != ie; ++it) {
+      valueIDs[it] = values.size();
+      values.push_back(it);
+    }
+    for (Function::iterator bb = f->begin(), bbe = f->end(); bb != bbe; ++bb) {
+      valueIDs[bb] = values.size();
+      values.push_back(bb);
+      for (BasicBlock::iterator it = bb->begin(), ie = bb->end();
+           it != ie; ++it) {
+        valueIDs[it] = values.size();
+        values.push_back(it);
+      }
+    }
+  }
+
+  std::vector<KFunction*> &functions = executor.kmodule->functions;
+  for (unsigned f = 0; f < functions.size(); ++f) {
+    KFunction *kf = functions[f];
+    functionIDs[kf] = f;
+    for (unsigned i = 0; i < kf->numInstructions; ++i) {
+      KInstruction *ki = kf->instructions[i];
+      instructionIDs[ki] = std::make_pair(f, i);
+    }
+  }
+
+  tablesBuilt = true;
+}
+
+/* Encoding */
+
+uint32_t StateSerializer::encodeValue(EncodingContext &ctx,
+                                      const Value *v) {
+  if (!v)
+    return NoID;
+
+  std::map<const Value*, uint32_t>::iterator it = valueIDs.find(v);
+  if (it == valueIDs.end()) {
+    ctx.failed = true;
+    return NoID;
+  }
+  return it->second;
+}
+
+void StateSerializer::encodeInstruction(EncodingContext &ctx,
+                                        SerialWriter &out,
+                                        const KInstruction *ki) {
+  std::map<const KInstruction*, std::pair<uint32_t, uint32_t> >::iterator
+    it = ki ? instructionIDs.find(ki) : instructionIDs.end();
+  if (it == instructionIDs.end()) {
+    if (ki)
+      ctx.failed = true;
+    out.write32(NoID);
+    out.write32(0);
+    return;
+  }
+  out.write32(it->second.first);
+  out.write32(it->second.second);
+}
+
+void StateSerializer::encodeHotValue(EncodingContext &ctx, SerialWriter &out,
+                                     const HotValue &hv) {
+  out.write32(encodeValue(ctx, hv.getValue()));
+  out.write32(hv.getOffset());
+  out.write32(hv.getSize());
+  out.write32(hv.getKind());
+}
+
+uint32_t StateSerializer::encodeObject(EncodingContext &ctx,
+                                       const MemoryObject *mo) {
+  if (!mo)
+    return NoID;
+
+  std::map<const MemoryObject*, uint32_t>::iterator it =
+    ctx.objectIDs.find(mo);
+  if (it != ctx.objectIDs.end())
+    return it->second;
+
+  const GlobalValue *gv = dyn_cast_or_null<GlobalValue>(mo->allocSite);
+  std::map<const GlobalValue*, MemoryObject*>::iterator git =
+    gv ? executor.globalObjects.find(gv) : executor.globalObjects.end();
+
+  SerialWriter &out = ctx.objects;
+  if (ctx.localObjects) {
+    ctx.localObjects->push_back(mo);
+  } else if (git != executor.globalObjects.end() && git->second == mo) {
+    out.write8(GlobalObject);
+    out.write64(mo->address);
+    out.write32(mo->size);
+    out.write32(encodeValue(ctx, gv));
+  } else {
+    std::vector<uint32_t> preferences;
+    for (unsigned i = 0; i < mo->cexPreferences.size(); ++i)
+      preferences.push_back(ctx.exprs.encode(mo->cexPreferences[i]));
+
+    out.write8(PlainObject);
+    out.write64(mo->address);
+    out.write32(mo->size);
+    out.writeString(mo->name);
+    out.write8((mo->isLocal ? LocalFlag : 0) |
+               (mo->isGlobal ? GlobalFlag : 0) |
+               (mo->isFixed ? FixedFlag : 0) |
+               (mo->fake_object ? FakeFlag : 0) |
+               (mo->isUserSpecified ? UserSpecifiedFlag : 0));
+    out.write32(encodeValue(ctx, mo->allocSite));
+    out.write32(preferences.size());
+    for (unsigned i = 0; i < preferences.size(); ++i)
+      out.write32(preferences[i]);
+  }
+
+  uint32_t id = ctx.objectIDs.size();
+  ctx.objectIDs[mo] = id;
+  return id;
+}
+
+uint32_t StateSerializer::encodePage(EncodingContext &ctx,
+                                     const ObjectPage *page) {
+  std::map<const ObjectPage*, uint32_t>::iterator it = ctx.pageIDs.find(page);
+  if (it != ctx.pageIDs.end())
+    return it->second;
+
+  std::vector<std::pair<uint32_t, uint32_t> > knownSymbolics;
+  if (page->knownSymbolics) {
+    for (unsigned i = 0; i < page->size; ++i) {
+      if (!page->knownSymbolics[i].isNull())
+        knownSymbolics.push_back(std::make_pair(i,
+            ctx.exprs.encode(page->knownSymbolics[i])));
+    }
+  }
+
+  SerialWriter &out = ctx.pages;
+  unsigned words = (page->size + 31) / 32;
+  out.write32(page->size);
+  out.write(page->concreteStore, page->size);
+  out.write8((page->concreteMask ? ConcreteMaskFlag : 0) |
+             (page->flushMask ? FlushMaskFlag : 0) |
+             (page->knownSymbolics ? KnownSymbolicsFlag : 0));
+  if (page->concreteMask) {
+    for (unsigned i = 0; i < words; ++i)
+      out.write32(page->concreteMask->getWord(i));
+  }
+  if (page->flushMask) {
+    for (unsigned i = 0; i < words; ++i)
+      out.write32(page->flushMask->getWord(i));
+  }
+  if (page->knownSymbolics) {
+    out.write32(knownSymbolics.size());
+    for (unsigned i = 0; i < knownSymbolics.size(); ++i) {
+      out.write32(knownSymbolics[i].first);
+      out.write32(knownSymbolics[i].second);
+    }
+  }
+
+  uint32_t id = ctx.pageIDs.size();
+  ctx.pageIDs[page] = id;
+  return id;
+}
+
+uint32_t StateSerializer::encodeObjectState(EncodingContext &ctx,
+                                            const ObjectState *os) {
+  std::map<const ObjectState*, uint32_t>::iterator it =
+    ctx.objectStateIDs.find(os);
+  if (it != ctx.objectStateIDs.end())
+    return it->second;
+
+  uint32_t object = encodeObject(ctx, os->object);
+  std::vector<uint32_t> pages;
+  for (unsigned i = 0; i < os->pages.size(); ++i)
+    pages.push_back(encodePage(ctx, os->pages[i]));
+  uint32_t root = ctx.exprs.encode(os->updates.root);
+  uint32_t head = ctx.exprs.encode(os->updates.head);
+
+  SerialWriter &out = ctx.objectStates;
+  out.write32(object);
+  out.write32(os->size);
+  out.write8(os->readOnly);
+  out.write8(os->isShared);
+  out.write32(root);
+  out.write32(head);
+  out.write32(pages.size());
+  for (unsigned i = 0; i < pages.size(); ++i)
+    out.write32(pages[i]);
+
+  uint32_t id = ctx.objectStateIDs.size();
+  ctx.objectStateIDs[os] = id;
+  return id;
+}
+
+void StateSerializer::encodeFrame(EncodingContext &ctx, const StackFrame &sf) {
+  SerialWriter &out = ctx.body;
+
+  encodeInstruction(ctx, out, sf.caller);
+  out.write32(functionIDs[sf.kf]);
+
+  out.write32(sf.allocas.size());
+  for (unsigned i = 0; i < sf.allocas.size(); ++i)
+    out.write32(encodeObject(ctx, sf.allocas[i].get()));
+  out.write32(encodeObject(ctx, sf.varargs));
+  out.write32(sf.minDistToUncoveredOnReturn);
+
+  out.write32(sf.execIndexStack.size());
+  for (unsigned i = 0; i < sf.execIndexStack.size(); ++i) {
+    out.write64(sf.execIndexStack[i].loopID);
+    out.write64(sf.execIndexStack[i].index);
+  }
+
+  writeFloat(out, sf.qceTotal);
+  writeFloat(out, sf.qceTotalBase);
+  out.write32(sf.qceMap.size());
+  for (QCEMap::const_iterator it = sf.qceMap.begin(), ie = sf.qceMap.end();
+       it != ie; ++it) {
+    encodeHotValue(ctx, out, it->first);
+    out.write32(it->second.stackFrame);
+    out.write32(it->second.vnumber);
+    out.write8(it->second.inVhAdd);
+    writeFloat(out, it->second.qce);
+    writeFloat(out, it->second.qceBase);
+  }
+  for (unsigned i = 0; i < (sf.kf->numRegisters + 31) / 32; ++i)
+    out.write32(sf.qceLocalsTrackMap.getWord(i));
+  out.write64(sf.qceLocalsTrackHash.getZExtValue());
+
+  for (unsigned i = 0; i < sf.kf->numRegisters; ++i)
+    out.write32(ctx.exprs.encode(sf.locals[i].value));
+}
+
+void StateSerializer::encodeThread(EncodingContext &ctx,
+                                   const ExecutionState &es, const Thread &t) {
+  SerialWriter &out = ctx.body;
+
+  out.write64(t.getTid());
+  out.write64(t.getPid());
+  encodeInstruction(ctx, out, t.pc);
+  encodeInstruction(ctx, out, t.prevPC);
+  out.write32(t.incomingBBIndex);
+  out.write8(t.enabled);
+  out.write64(t.waitingList);
+  // The indexes are hashes of the whole execution history, they cannot be
+  // recomputed from the state
+  out.write64(t.execIndex);
+  out.write64(t.mergeIndex);
+
+  out.write32(t.topoIndex.size());
+  for (unsigned i = 0; i < t.topoIndex.size(); ++i) {
+    out.write64(t.topoIndex[i].bbID);
+    out.write64(t.topoIndex[i].count);
+  }
+
+  out.write32(t.stack.size());
+  for (unsigned i = 0; i < t.stack.size(); ++i)
+    encodeFrame(ctx, t.stack[i]);
+
+  // The track map is keyed by object ids, find the objects in the address
+  // space of the thread
+  std::map<unsigned, ObjectPair> objectsById;
+  if (!t.qceMemoryTrackMap.empty())
+    es.processes.find(t.getPid())->second.addressSpace.getObjectsById(
+      objectsById);
+
+  // The track hash is recomputed from the map and the memory contents
+  out.write32(t.qceMemoryTrackMap.size());
+  for (QCEMemoryTrackMap::const_iterator it = t.qceMemoryTrackMap.begin(),
+         ie = t.qceMemoryTrackMap.end(); it != ie; ++it) {
+    std::map<unsigned, ObjectPair>::iterator oit =
+      objectsById.find(it->first.first);
+    if (oit == objectsById.end()) {
+      ctx.failed = true;
+      return;
+    }
+    out.write32(encodeObject(ctx, oit->second.first));
+    out.write64(it->first.second);
+    out.write32(it->second.size());
+    for (QCEMemoryTrackSet::const_iterator hit = it->second.begin(),
+           hie = it->second.end(); hit != hie; ++hit)
+      encodeHotValue(ctx, out, *hit);
+  }
+}
+
+void StateSerializer::encodeProcess(EncodingContext &ctx, const Process &p) {
+  SerialWriter &out = ctx.body;
+
+  out.write64(p.pid);
+  out.write64(p.ppid);
+
+  out.write32(p.forkPath.size());
+  for (unsigned i = 0; i < p.forkPath.size(); ++i)
+    out.write32(p.forkPath[i]);
+
+  out.write32(p.children.size());
+  for (std::set<process_id_t>::const_iterator it = p.children.begin(),
+         ie = p.children.end(); it != ie; ++it)
+    out.write64(*it);
+
+  out.write32(p.threads.size());
+  for (std::set<thread_uid_t>::const_iterator it = p.threads.begin(),
+         ie = p.threads.end(); it != ie; ++it) {
+    out.write64(it->first);
+    out.write64(it->second);
+  }
+
+  out.write32(p.addressSpace.mergeDisabledCount);
+  encodeAddressSpace(ctx, p.addressSpace);
+}
+
+void StateSerializer::encodeAddressSpace(EncodingContext &ctx,
+                                         const AddressSpace &as) {
+  SerialWriter &out = ctx.body;
+
+  out.write32(as.objects.size());
+  for (MemoryMap::iterator it = as.objects.begin(), ie = as.objects.end();
+       it != ie; ++it) {
+    out.write32(encodeObject(ctx, it->first));
+    out.write32(encodeObjectState(ctx, it->second));
+  }
+}
+
+void StateSerializer::encodeConstraints(EncodingContext &ctx,
+                                        const ExecutionState &es) {
+  SerialWriter &out = ctx.body;
+
+  // Share the longest constraint prefix with a state encoded before
+  const ConstraintManager &constraints = es.constraints();
+  uint32_t base = NoID;
+  size_t prefix = 0;
+  for (unsigned i = 0; i < ctx.states.size(); ++i) {
+    size_t common = constraints.commonPrefix(ctx.states[i]->constraints());
+    if (common > prefix) {
+      base = i;
+      prefix = common;
+    }
+  }
+  out.write32(base);
+  out.write32(prefix);
+  out.write32(constraints.size() - prefix);
+  size_t index = 0;
+  for (ConstraintManager::constraint_iterator it = constraints.begin(),
+         ie = constraints.end(); it != ie; ++it, ++index) {
+    if (index >= prefix)
+      out.write32(ctx.exprs.encode(*it));
+  }
+}
+
+void StateSerializer::encodeState(EncodingContext &ctx,
+                                  const ExecutionState &es) {
+  SerialWriter &out = ctx.body;
+
+  out.write32(es.fnAliases.size());
+  for (std::map<std::string, std::string>::const_iterator
+         it = es.fnAliases.begin(), ie = es.fnAliases.end(); it != ie; ++it) {
+    out.writeString(it->first);
+    out.writeString(it->second);
+  }
+
+  out.write8(es.fakeState);
+  out.write32(es.depth);
+  out.write64(es.multiplicity);
+  out.write64(es.multiplicityExact);
+  out.write8(es.forkDisabled);
+  writeDouble(out, es.queryCost);
+  writeDouble(out, es.weight);
+  out.write32(es.instsSinceCovNew);
+  out.write32(es.instsSinceFork);
+  out.write32(es.instsTotal);
+  out.write8(es.coveredNew);
+  out.write64(es.lastCoveredTime.seconds());
+  out.write32(es.lastCoveredTime.nanoseconds());
+
+  out.write32(es.coveredInstructions.getNumWords());
+  for (unsigned i = 0; i < es.coveredInstructions.getNumWords(); ++i)
+    out.write64(es.coveredInstructions.getWord(i));
+
+  out.write32(es.crtForkReason);
+  out.write32(encodeValue(ctx, es.crtSpecialFork));
+
+  out.write32(es.symbolics.size());
+  for (unsigned i = 0; i < es.symbolics.size(); ++i) {
+    out.write32(encodeObject(ctx, es.symbolics[i].first.get()));
+    out.write32(ctx.exprs.encode(es.symbolics[i].second));
+  }
+
+  encodeConstraints(ctx, es);
+
+  out.write64(es.wlistCounter);
+  out.write64(es.stateTime);
+  out.write64(es.addressPool.getStartAddress());
+  out.write64(es.addressPool.getSize());
+  out.write64(es.addressPool.currentAddress);
+  out.write32(es.preemptions);
+  out.write64(es.interleavedMergeIndex);
+
+  out.write32(es.waitingLists.size());
+  for (ExecutionState::wlists_ty::const_iterator it = es.waitingLists.begin(),
+         ie = es.waitingLists.end(); it != ie; ++it) {
+    out.write64(it->first);
+    out.write32(it->second.size());
+    for (std::set<thread_uid_t>::const_iterator tit = it->second.begin(),
+           tie = it->second.end(); tit != tie; ++tit) {
+      out.write64(tit->first);
+      out.write64(tit->second);
+    }
+  }
+
+  out.write32(es.processes.size());
+  for (ExecutionState::processes_ty::const_iterator
+         it = es.processes.begin(), ie = es.processes.end(); it != ie; ++it)
+    encodeProcess(ctx, it->second);
+
+  out.write32(es.threads.size());
+  for (ExecutionState::threads_ty::const_iterator
+         it = es.threads.begin(), ie = es.threads.end(); it != ie; ++it)
+    encodeThread(ctx, es, it->second);
+
+  out.write64(es.crtThread().getTid());
+  out.write64(es.crtThread().getPid());
+  out.write64(es.crtProcess().pid);
+}
+
+bool StateSerializer::encode(const std::vector<ExecutionState*> &states,
+                             std::string &data) {
+  if (!tablesBuilt)
+    buildTables();
+
+  EncodingContext ctx;
+  ctx.body.write32(states.size());
+  for (std::vector<ExecutionState*>::const_iterator it = states.begin(),
+         ie = states.end(); it != ie; ++it) {
+    encodeState(ctx, **it);
+    ctx.states.push_back(*it);
+  }
+  if (ctx.failed)
+    return false;
+  ctx.exprs.finish();
+
+  // Function pointers are host addresses, so the receiver must agree on all
+  // of them for the contents of the states to make sense
+  Module *m = executor.kmodule->module;
+  SerialWriter header;
+  header.write32(BundleMagic);
+  header.write32(values.size());
+  header.write32(m->size());
+  for (Module::iterator f = m->begin(), fe = m->end(); f != fe; ++f)
+    header.write64((uint64_t) (uintptr_t) &*f);
+
+  data.clear();
+  append(data, header);
+  append(data, ctx.records);
+
+  SerialWriter count;
+  count.write32(ctx.objectIDs.size());
+  append(data, count);
+  append(data, ctx.objects);
+
+  count.data.clear();
+  count.write32(ctx.pageIDs.size());
+  append(data, count);
+  append(data, ctx.pages);
+
+  count.data.clear();
+  count.write32(ctx.objectStateIDs.size());
+  append(data, count);
+  append(data, ctx.objectStates);
+
+  append(data, ctx.body);
+  return true;
+}
+
+/* Decoding */
+
+Value *StateSerializer::getValue(DecodingContext &ctx, uint32_t id) {
+  if (id == NoID)
+    return 0;
+  if (id >= values.size()) {
+    ctx.in.setError();
+    return 0;
+  }
+  return values[id];
+}
+
+const MemoryObject *StateSerializer::getObject(DecodingContext &ctx,
+                                               uint32_t id) {
+  if (id == NoID)
+    return 0;
+  if (id >= ctx.objects.size()) {
+    ctx.in.setError();
+    return 0;
+  }
+  return ctx.objects[id].get();
+}
+
+ref<Expr> StateSerializer::getExpr(DecodingContext &ctx, uint32_t id) {
+  if (!ctx.exprs.isValidExpr(id))
+    ctx.in.setError();
+  return ctx.exprs.getExpr(id);
+}
+
+KInstIterator StateSerializer::decodeInstruction(DecodingContext &ctx) {
+  uint32_t f = ctx.in.read32(), i = ctx.in.read32();
+  if (f == NoID)
+    return KInstIterator();
+
+  std::vector<KFunction*> &functions = executor.kmodule->functions;
+  if (f >= functions.size() || i >= functions[f]->numInstructions) {
+    ctx.in.setError();
+    return KInstIterator();
+  }
+  return KInstIterator(functions[f]->instructions + i);
+}
+
+HotValue StateSerializer::decodeHotValue(DecodingContext &ctx) {
+  Value *value = getValue(ctx, ctx.in.read32());
+  unsigned offset = ctx.in.read32(), size = ctx.in.read32();
+  HotValueKind kind = HotValueKind(ctx.in.read32());
+  return HotValue(kind, value, offset, size);
+}
+
+bool StateSerializer::decodeObject(DecodingContext &ctx) {
+  SerialReader &in = ctx.in;
+  uint8_t kind = in.read8();
+  uint64_t address = in.read64();
+  unsigned size = in.read32();
+
+  if (kind == GlobalObject) {
+    const GlobalValue *gv =
+      dyn_cast_or_null<GlobalValue>(getValue(ctx, in.read32()));
+    if (in.error() || !gv)
+      return false;
+
+    std::map<const GlobalValue*, MemoryObject*>::iterator it =
+      executor.globalObjects.find(gv);
+    if (it == executor.globalObjects.end() ||
+        it->second->address != address || it->second->size != size) {
+      klee_warning("discarding serialized states with a different global "
+                   "layout");
+      return false;
+    }
+    ctx.objects.push_back(it->second);
+    return true;
+  }
+
+  if (kind != PlainObject)
+    return false;
+
+  std::string name = in.readString();
+  uint8_t flags = in.read8();
+  const Value *allocSite = getValue(ctx, in.read32());
+  std::vector< ref<Expr> > preferences;
+  for (uint32_t i = 0, e = readCount(in); i < e && !in.error(); ++i) {
+    preferences.push_back(getExpr(ctx, in.read32()));
+    if (preferences.back().isNull())
+      return false;
+  }
+  if (in.error())
+    return false;
+
+  MemoryObject *mo = executor.memory->allocateAt(address, size,
+                                                 flags & LocalFlag,
+                                                 flags & GlobalFlag,
+                                                 flags & FixedFlag,
+                                                 allocSite);
+  mo->setName(name);
+  mo->fake_object = flags & FakeFlag;
+  mo->isUserSpecified = flags & UserSpecifiedFlag;
+  mo->cexPreferences = preferences;
+  ctx.objects.push_back(mo);
+  return true;
+}
+
+bool StateSerializer::decodePage(DecodingContext &ctx) {
+  SerialReader &in = ctx.in;
+  unsigned size = in.read32();
+  if (in.error() || size == 0 || size > ObjectPage::Size ||
+      size > in.remaining())
+    return false;
+
+  ObjectPage *page = new ObjectPage(size);
+  RefCountPolicy::inc(&page->refCount);
+  ctx.pages.push_back(page);
+
+  in.read(page->concreteStore, size);
+  uint8_t flags = in.read8();
+  unsigned words = (size + 31) / 32;
+  if (flags & ConcreteMaskFlag) {
+    page->concreteMask = new BitArray(size);
+    for (unsigned i = 0; i < words; ++i)
+      page->concreteMask->setWord(i, in.read32());
+  }
+  if (flags & FlushMaskFlag) {
+    page->flushMask = new BitArray(size);
+    for (unsigned i = 0; i < words; ++i)
+      page->flushMask->setWord(i, in.read32());
+  }
+  if (flags & KnownSymbolicsFlag) {
+    page->knownSymbolics = new ref<Expr>[size];
+    for (uint32_t i = 0, e = readCount(in); i < e && !in.error(); ++i) {
+      uint32_t offset = in.read32();
+      ref<Expr> value = getExpr(ctx, in.read32());
+      if (offset >= size || value.isNull())
+        return false;
+      page->knownSymbolics[offset] = value;
+    }
+  }
+  page->updateFootprint();
+  return !in.error();
+}
+
+bool StateSerializer::decodeObjectState(DecodingContext &ctx) {
+  SerialReader &in = ctx.in;
+  const MemoryObject *mo = getObject(ctx, in.read32());
+  unsigned size = in.read32();
+  bool readOnly = in.read8(), isShared = in.read8();
+  uint32_t root = in.read32(), head = in.read32();
+  uint32_t count = readCount(in);
+  if (in.error() || !mo || size != mo->size ||
+      !ctx.exprs.isValidArray(root) || !ctx.exprs.isValidUpdate(head) ||
+      count != (size + ObjectPage::Size - 1) / ObjectPage::Size)
+    return false;
+
+  std::vector<ObjectPage*> pages;
+  for (unsigned i = 0; i < count; ++i) {
+    uint32_t id = in.read32();
+    if (id >= ctx.pages.size() ||
+        ctx.pages[id]->size != std::min(size - i * ObjectPage::Size,
+                                        ObjectPage::Size))
+      return false;
+    pages.push_back(ctx.pages[id]);
+  }
+  if (in.error())
+    return false;
+
+  ObjectState *os = new ObjectState(mo, pages,
+                                    UpdateList(ctx.exprs.getArray(root),
+                                               ctx.exprs.getUpdate(head)));
+  os->readOnly = readOnly;
+  os->isShared = isShared;
+  os->copyOnWriteOwner = DecodedOwner;
+  ctx.objectStates.push_back(os);
+  return true;
+}
+
+bool StateSerializer::decodeFrame(DecodingContext &ctx, Thread &t) {
+  SerialReader &in = ctx.in;
+  std::vector<KFunction*> &functions = executor.kmodule->functions;
+
+  KInstIterator caller = decodeInstruction(ctx);
+  uint32_t f = in.read32();
+  if (in.error() || f >= functions.size())
+    return false;
+
+  // This recomputes the stack hash, which depends on host addresses
+  KFunction *kf = functions[f];
+  t.stack.push_back(StackFrame(caller, 0, kf,
+                               t.stack.empty() ? NULL : &t.stack.back()));
+  StackFrame &sf = t.stack.back();
+
+  for (uint32_t i = 0, e = readCount(in); i < e; ++i) {
+    const MemoryObject *mo = getObject(ctx, in.read32());
+    if (!mo)
+      return false;
+    sf.allocas.push_back(mo);
+  }
+  sf.varargs = const_cast<MemoryObject*>(getObject(ctx, in.read32()));
+  sf.minDistToUncoveredOnReturn = in.read32();
+
+  sf.execIndexStack.clear();
+  for (uint32_t i = 0, e = readCount(in); i < e; ++i) {
+    LoopExecIndex index;
+    index.loopID = in.read64();
+    index.index = in.read64();
+    sf.execIndexStack.push_back(index);
+  }
+
+  sf.qceTotal = readFloat(in);
+  sf.qceTotalBase = readFloat(in);
+  sf.qceMap.clear();
+  for (uint32_t i = 0, e = readCount(in); i < e && !in.error(); ++i) {
+    HotValue hv = decodeHotValue(ctx);
+    QCEFrameInfo &info = sf.qceMap[hv];
+    info.stackFrame = in.read32();
+    info.vnumber = in.read32();
+    info.inVhAdd = in.read8();
+    info.qce = readFloat(in);
+    info.qceBase = readFloat(in);
+  }
+  for (unsigned i = 0; i < (kf->numRegisters + 31) / 32; ++i)
+    sf.qceLocalsTrackMap.setWord(i, in.read32());
+  static_cast<APInt&>(sf.qceLocalsTrackHash) = APInt(64, in.read64());
+
+  for (unsigned i = 0; i < kf->numRegisters; ++i)
+    sf.locals[i].value = getExpr(ctx, in.read32());
+
+  return !in.error();
+}
+
+bool StateSerializer::decodeThread(DecodingContext &ctx, ExecutionState &es) {
+  SerialReader &in = ctx.in;
+  thread_id_t tid = in.read64();
+  process_id_t pid = in.read64();
+  thread_uid_t tuid(tid, pid);
+
+  ExecutionState::processes_ty::iterator pit = es.processes.find(pid);
+  if (in.error() || pit == es.processes.end() || es.threads.count(tuid))
+    return false;
+  const AddressSpace &as = pit->second.addressSpace;
+
+  Thread &t = es.threads.insert(std::make_pair(tuid,
+                                Thread(tid, pid, NULL))).first->second;
+  t.pc = decodeInstruction(ctx);
+  t.prevPC = decodeInstruction(ctx);
+  t.incomingBBIndex = in.read32();
+  t.enabled = in.read8();
+  t.waitingList = in.read64();
+  t.execIndex = in.read64();
+  t.mergeIndex = in.read64();
+
+  for (uint32_t i = 0, e = readCount(in); i < e; ++i) {
+    uint64_t bbID = in.read64();
+    t.topoIndex.push_back(TopoFrame(bbID, in.read64()));
+  }
+
+  for (uint32_t i = 0, e = readCount(in); i < e; ++i) {
+    if (!decodeFrame(ctx, t))
+      return false;
+  }
+
+  for (uint32_t i = 0, e = readCount(in); i < e && !in.error(); ++i) {
+    const MemoryObject *mo = getObject(ctx, in.read32());
+    uint64_t offset = in.read64();
+    const ObjectState *os = mo ? as.findObject(mo) : 0;
+    if (!os || offset >= os->size)
+      return false;
+
+    QCEMemoryTrackSet &hotValues =
+      t.qceMemoryTrackMap[QCEMemoryTrackIndex(mo->id, offset)];
+    for (uint32_t j = 0, je = readCount(in); j < je && !in.error(); ++j)
+      hotValues.insert(decodeHotValue(ctx));
+    t.qceMemoryTrackHash.addValueAt(APInt(32, os->read8c(offset)),
+                                    mo->id, offset);
+  }
+
+  return !in.error();
+}
+
+bool StateSerializer::decodeProcess(DecodingContext &ctx,
+                                    ExecutionState &es) {
+  SerialReader &in = ctx.in;
+  process_id_t pid = in.read64(), ppid = in.read64();
+  if (in.error() || es.processes.count(pid))
+    return false;
+
+  Process &p = es.processes.insert(std::make_pair(pid,
+                                   Process(pid, ppid))).first->second;
+
+  for (uint32_t i = 0, e = readCount(in); i < e; ++i)
+    p.forkPath.push_back(in.read32());
+  for (uint32_t i = 0, e = readCount(in); i < e; ++i)
+    p.children.insert(in.read64());
+  for (uint32_t i = 0, e = readCount(in); i < e; ++i) {
+    thread_id_t tid = in.read64();
+    p.threads.insert(thread_uid_t(tid, in.read64()));
+  }
+
+  AddressSpace &as = p.addressSpace;
+  as.mergeDisabledCount = (int) in.read32();
+  if (!decodeAddressSpace(ctx, as))
+    return false;
+  for (MemoryMap::iterator it = as.objects.begin(), ie = as.objects.end();
+       it != ie; ++it)
+    as.hash += AddressSpace::getObjectHash(it->first);
+
+  return !in.error();
+}
+
+bool StateSerializer::decodeAddressSpace(DecodingContext &ctx,
+                                         AddressSpace &as) {
+  SerialReader &in = ctx.in;
+  for (uint32_t i = 0, e = readCount(in); i < e && !in.error(); ++i) {
+    const MemoryObject *mo = getObject(ctx, in.read32());
+    uint32_t id = in.read32();
+    if (!mo || id >= ctx.objectStates.size() || as.objects.lookup(mo))
+      return false;
+    ObjectState *os = ctx.objectStates[id];
+    if (os->getObject() != mo)
+      return false;
+
+    as.objects = as.objects.insert(std::make_pair(mo, os));
+  }
+  as.cowKey = std::max(as.cowKey, DecodedOwner + 1);
+
+  return !in.error();
+}
+
+bool StateSerializer::decodeConstraints(DecodingContext &ctx,
+                                        ExecutionState &es) {
+  SerialReader &in = ctx.in;
+  uint32_t base = in.read32(), prefix = in.read32();
+  ConstraintManager::constraint_list_ty constraints;
+  if (base != NoID) {
+    if (base >= ctx.states.size() ||
+        prefix > ctx.states[base]->constraints().size())
+      return false;
+    constraints = ctx.states[base]->constraints().getList().prefix(prefix);
+  } else if (prefix) {
+    return false;
+  }
+  for (uint32_t i = 0, e = readCount(in); i < e && !in.error(); ++i) {
+    ref<Expr> constraint = getExpr(ctx, in.read32());
+    if (constraint.isNull())
+      return false;
+    constraints.push_back(constraint);
+  }
+  es.globalConstraints = ConstraintManager(constraints);
+
+  return !in.error();
+}
+
+bool StateSerializer::decodeState(DecodingContext &ctx, ExecutionState &es) {
+  SerialReader &in = ctx.in;
+
+  for (uint32_t i = 0, e = readCount(in); i < e; ++i) {
+    std::string fn = in.readString();
+    es.fnAliases[fn] = in.readString();
+  }
+
+  es.fakeState = in.read8();
+  es.depth = in.read32();
+  es.multiplicity = in.read64();
+  es.multiplicityExact = in.read64();
+  es.forkDisabled = in.read8();
+  es.queryCost = readDouble(in);
+  es.weight = readDouble(in);
+  es.instsSinceCovNew = in.read32();
+  es.instsSinceFork = in.read32();
+  es.instsTotal = in.read32();
+  es.coveredNew = in.read8();
+  uint64_t seconds = in.read64();
+  es.lastCoveredTime = sys::TimeValue(seconds, in.read32());
+
+  uint32_t numWords = readCount(in);
+  if (numWords > (executor.kmodule->infos->getMaxID() + 63) / 64)
+    return false;
+  for (uint32_t i = 0; i < numWords; ++i)
+    es.coveredInstructions.setWord(i, in.read64());
+
+  es.crtForkReason = (int) in.read32();
+  es.crtSpecialFork = dyn_cast_or_null<Instruction>(getValue(ctx,
+                                                             in.read32()));
+
+  for (uint32_t i = 0, e = readCount(in); i < e && !in.error(); ++i) {
+    const MemoryObject *mo = getObject(ctx, in.read32());
+    const Array *array = ctx.exprs.getArray(in.read32());
+    if (!mo || !array)
+      return false;
+    es.addSymbolic(mo, array);
+  }
+
+  if (!decodeConstraints(ctx, es))
+    return false;
+
+  es.wlistCounter = in.read64();
+  es.stateTime = in.read64();
+  uint64_t poolStart = in.read64(), poolSize = in.read64();
+  es.addressPool = AddressPool(poolStart, poolSize);
+  es.addressPool.currentAddress = in.read64();
+  if (!executor.states.empty() &&
+      poolStart != (*executor.states.begin())->addressPool.getStartAddress()) {
+    klee_warning("discarding serialized states with a different address "
+                 "pool");
+    return false;
+  }
+  es.preemptions = in.read32();
+  es.interleavedMergeIndex = in.read64();
+
+  for (uint32_t i = 0, e = readCount(in); i < e && !in.error(); ++i) {
+    std::set<thread_uid_t> &wlist = es.waitingLists[in.read64()];
+    for (uint32_t j = 0, je = readCount(in); j < je; ++j) {
+      thread_id_t tid = in.read64();
+      wlist.insert(thread_uid_t(tid, in.read64()));
+    }
+  }
+
+  for (uint32_t i = 0, e = readCount(in); i < e; ++i) {
+    if (!decodeProcess(ctx, es))
+      return false;
+  }
+  for (uint32_t i = 0, e = readCount(in); i < e; ++i) {
+    if (!decodeThread(ctx, es))
+      return false;
+  }
+
+  thread_id_t tid = in.read64();
+  process_id_t pid = in.read64();
+  es.crtThreadIt = es.threads.find(thread_uid_t(tid, pid));
+  es.crtProcessIt = es.processes.find(in.read64());
+  if (in.error() || es.crtThreadIt == es.threads.end() ||
+      es.crtProcessIt == es.processes.end())
+    return false;
+
+  // Rebuild the COW domain, as when branching
+  for (ExecutionState::processes_ty::iterator it = es.processes.begin(),
+         ie = es.processes.end(); it != ie; ++it) {
+    es.cowDomain.push_back(&it->second.addressSpace);
+    it->second.addressSpace.cowDomain = &es.cowDomain;
+  }
+
+  return true;
+}
+
+bool StateSerializer::decode(const std::string &data,
+                             std::vector<ExecutionState*> &states) {
+  if (!tablesBuilt)
+    buildTables();
+
+  SerialReader in((const unsigned char*) data.data(), data.size());
+  if (in.read32() != BundleMagic)
+    return false;
+
+  Module *m = executor.kmodule->module;
+  if (in.read32() != values.size() || in.read32() != m->size()) {
+    klee_warning("discarding serialized states of a different module");
+    return false;
+  }
+  for (Module::iterator f = m->begin(), fe = m->end(); f != fe; ++f) {
+    if (in.read64() != (uint64_t) (uintptr_t) &*f) {
+      klee_warning("discarding serialized states with a different function "
+                   "layout (is address space randomization disabled?)");
+      return false;
+    }
+  }
+
+  DecodingContext ctx(in, arrays);
+  if (!ctx.exprs.decodeRecords())
+    return false;
+
+  for (uint32_t i = 0, e = readCount(in); i < e; ++i) {
+    if (!decodeObject(ctx))
+      return false;
+  }
+  for (uint32_t i = 0, e = readCount(in); i < e; ++i) {
+    if (!decodePage(ctx))
+      return false;
+  }
+  for (uint32_t i = 0, e = readCount(in); i < e; ++i) {
+    if (!decodeObjectState(ctx))
+      return false;
+  }
+
+  bool ok = true;
+  for (uint32_t i = 0, e = readCount(in); i < e && ok; ++i) {
+    ExecutionState *es = new ExecutionState(&executor);
+    ok = decodeState(ctx, *es) && !in.error();
+    if (ok)
+      ctx.states.push_back(es);
+    else
+      delete es;
+  }
+
+  if (!ok || in.error() || in.remaining()) {
+    for (unsigned i = 0; i < ctx.states.size(); ++i)
+      delete ctx.states[i];
+    return false;
+  }
+
+  states.insert(states.end(), ctx.states.begin(), ctx.states.end());
+  return true;
+}
+
+/* Spilling */
+
+void StateSerializer::encodeMemory(const std::vector<ExecutionState*> &states,
+                                   std::string &data,
+                                   std::vector< ref<const MemoryObject> >
+                                     &objects,
+                                   std::vector<ObjectHolder> &objectStates,
+                                   std::vector< ref<ObjectPage> > &pages,
+                                   std::map<uint64_t, const Array*> &arrays) {
+  EncodingContext ctx;
+  objects.clear();
+  objectStates.clear();
+  pages.clear();
+  ctx.localObjects = &objects;
+
+  // Keep the object states that other states (or the read-only objects)
+  // still hold, and the pages those share with the rest, which are not
+  // freed by spilling anyway. They take the first ids.
+  std::map<const ObjectState*, unsigned> stateRefs;
+  for (std::vector<ExecutionState*>::const_iterator it = states.begin(),
+         ie = states.end(); it != ie; ++it) {
+    for (ExecutionState::processes_ty::const_iterator
+           pit = (*it)->processes.begin(), pie = (*it)->processes.end();
+         pit != pie; ++pit) {
+      const MemoryMap &memory = pit->second.addressSpace.objects;
+      for (MemoryMap::iterator oit = memory.begin(), oie = memory.end();
+           oit != oie; ++oit)
+        ++stateRefs[oit->second];
+    }
+  }
+
+  std::map<const ObjectPage*, unsigned> pageRefs;
+  for (std::map<const ObjectState*, unsigned>::iterator
+         it = stateRefs.begin(), ie = stateRefs.end(); it != ie; ++it) {
+    const ObjectState *os = it->first;
+    if (os->readOnly || os->refCount > it->second) {
+      uint32_t id = ctx.objectStateIDs.size();
+      ctx.objectStateIDs[os] = id;
+      objectStates.push_back(const_cast<ObjectState*>(os));
+    } else {
+      for (unsigned i = 0; i < os->pages.size(); ++i)
+        ++pageRefs[os->pages[i]];
+    }
+  }
+
+  for (std::map<const ObjectPage*, unsigned>::iterator
+         it = pageRefs.begin(), ie = pageRefs.end(); it != ie; ++it) {
+    ObjectPage *page = const_cast<ObjectPage*>(it->first);
+    if (page->refCount > it->second) {
+      uint32_t id = ctx.pageIDs.size();
+      ctx.pageIDs[page] = id;
+      pages.push_back(page);
+    }
+  }
+
+  ctx.body.write32(states.size());
+  for (std::vector<ExecutionState*>::const_iterator it = states.begin(),
+         ie = states.end(); it != ie; ++it) {
+    const ExecutionState &es = **it;
+    encodeConstraints(ctx, es);
+    ctx.body.write32(es.processes.size());
+    for (ExecutionState::processes_ty::const_iterator
+           pit = es.processes.begin(), pie = es.processes.end();
+         pit != pie; ++pit) {
+      ctx.body.write64(pit->first);
+      encodeAddressSpace(ctx, pit->second.addressSpace);
+    }
+    ctx.states.push_back(*it);
+  }
+  ctx.exprs.finish();
+
+  // The arrays are never freed, so the decoder can reuse them as they are
+  const std::map<const Array*, uint32_t> &encoded = ctx.exprs.getArrays();
+  for (std::map<const Array*, uint32_t>::const_iterator
+         it = encoded.begin(), ie = encoded.end(); it != ie; ++it)
+    arrays[(uint64_t) (uintptr_t) it->first] = it->first;
+
+  SerialWriter header;
+  header.write32(MemoryMagic);
+
+  data.clear();
+  append(data, header);
+  append(data, ctx.records);
+
+  SerialWriter count;
+  count.write32(ctx.pageIDs.size() - pages.size());
+  append(data, count);
+  append(data, ctx.pages);
+
+  count.data.clear();
+  count.write32(ctx.objectStateIDs.size() - objectStates.size());
+  append(data, count);
+  append(data, ctx.objectStates);
+
+  append(data, ctx.body);
+}
+
+bool StateSerializer::decodeMemory(const unsigned char *data, size_t size,
+                                   const std::vector<ExecutionState*> &states,
+                                   const std::vector< ref<const MemoryObject> >
+                                     &objects,
+                                   const std::vector<ObjectHolder>
+                                     &objectStates,
+                                   const std::vector< ref<ObjectPage> >
+                                     &pages,
+                                   std::map<uint64_t, const Array*> &arrays) {
+  SerialReader in(data, size);
+  if (in.read32() != MemoryMagic)
+    return false;
+
+  DecodingContext ctx(in, arrays);
+  ctx.objects = objects;
+  ctx.objectStates = objectStates;
+  for (unsigned i = 0; i < pages.size(); ++i) {
+    RefCountPolicy::inc(&pages[i]->refCount);
+    ctx.pages.push_back(pages[i].get());
+  }
+  if (!ctx.exprs.decodeRecords())
+    return false;
+
+  for (uint32_t i = 0, e = readCount(in); i < e; ++i) {
+    if (!decodePage(ctx))
+      return false;
+  }
+  for (uint32_t i = 0, e = readCount(in); i < e; ++i) {
+    if (!decodeObjectState(ctx))
+      return false;
+  }
+
+  if (readCount(in) != states.size())
+    return false;
+  for (std::vector<ExecutionState*>::const_iterator it = states.begin(),
+         ie = states.end(); it != ie; ++it) {
+    ExecutionState &es = **it;
+    if (!decodeConstraints(ctx, es) ||
+        readCount(in) != es.processes.size())
+      return false;
+    for (unsigned i = 0; i < es.processes.size(); ++i) {
+      ExecutionState::processes_ty::iterator pit =
+        es.processes.find(in.read64());
+      if (pit == es.processes.end() ||
+          !pit->second.addressSpace.objects.empty() ||
+          !decodeAddressSpace(ctx, pit->second.addressSpace))
+        return false;
+    }
+    ctx.states.push_back(&es);
+  }
+
+  return !in.error() && !in.remaining();
+}
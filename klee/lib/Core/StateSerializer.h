@@ -0,0 +1,150 @@
+//===-- StateSerializer.h ---------------------------------------*- C++ -*-===//
+//
+//                     The KLEE Symbolic Virtual Machine
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef KLEE_STATESERIALIZER_H
+#define KLEE_STATESERIALIZER_H
+
+#include "ObjectHolder.h"
+
+#include "klee/Internal/Module/KInstIterator.h"
+#include "klee/Internal/Module/QCE.h"
+#include "klee/util/Ref.h"
+
+#include <map>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+namespace llvm {
+  class Value;
+}
+
+namespace klee {
+  class AddressSpace;
+  class Array;
+  class ExecutionState;
+  class Executor;
+  class Expr;
+  struct KFunction;
+  struct KInstruction;
+  class MemoryObject;
+  class ObjectPage;
+  class ObjectState;
+  class Process;
+  class SerialWriter;
+  struct StackFrame;
+  class Thread;
+
+  /// Converts execution states to and from a self-contained binary form, so
+  /// that they can be moved between processes running the same module
+  /// (e.g., Cloud9 workers). States are encoded in batches, which share
+  /// their expressions, memory objects, object states and pages the way the
+  /// states themselves did.
+  ///
+  /// Host addresses are not translated: the receiver must lay out the
+  /// module functions and the address pool at the same addresses as the
+  /// sender, i.e., run the same binary with address space randomization
+  /// disabled. Batches that do not match the receiver are rejected whole.
+  class StateSerializer {
+    Executor &executor;
+
+    /// The values states may refer to: globals, aliases and then each
+    /// function with its arguments, blocks and instructions.
+    std::vector<llvm::Value*> values;
+    std::map<const llvm::Value*, uint32_t> valueIDs;
+
+    /// The (function, index) position of each instruction of the module.
+    std::map<const KInstruction*, std::pair<uint32_t, uint32_t> >
+      instructionIDs;
+    std::map<const KFunction*, uint32_t> functionIDs;
+
+    /// The arrays of the batches decoded so far, by their sender address.
+    std::map<uint64_t, const Array*> arrays;
+
+    bool tablesBuilt;
+
+    struct EncodingContext;
+    struct DecodingContext;
+
+    void buildTables();
+
+    uint32_t encodeValue(EncodingContext &ctx, const llvm::Value *v);
+    void encodeInstruction(EncodingContext &ctx, SerialWriter &out,
+                           const KInstruction *ki);
+    void encodeHotValue(EncodingContext &ctx, SerialWriter &out,
+                        const HotValue &hv);
+    uint32_t encodeObject(EncodingContext &ctx, const MemoryObject *mo);
+    uint32_t encodePage(EncodingContext &ctx, const ObjectPage *page);
+    uint32_t encodeObjectState(EncodingContext &ctx, const ObjectState *os);
+    void encodeAddressSpace(EncodingContext &ctx, const AddressSpace &as);
+    void encodeConstraints(EncodingContext &ctx, const ExecutionState &es);
+    void encodeFrame(EncodingContext &ctx, const StackFrame &sf);
+    void encodeThread(EncodingContext &ctx, const ExecutionState &es,
+                      const Thread &t);
+    void encodeProcess(EncodingContext &ctx, const Process &p);
+    void encodeState(EncodingContext &ctx, const ExecutionState &es);
+
+    llvm::Value *getValue(DecodingContext &ctx, uint32_t id);
+    const MemoryObject *getObject(DecodingContext &ctx, uint32_t id);
+    ref<Expr> getExpr(DecodingContext &ctx, uint32_t id);
+    KInstIterator decodeInstruction(DecodingContext &ctx);
+    HotValue decodeHotValue(DecodingContext &ctx);
+    bool decodeObject(DecodingContext &ctx);
+    bool decodePage(DecodingContext &ctx);
+    bool decodeObjectState(DecodingContext &ctx);
+    bool decodeAddressSpace(DecodingContext &ctx, AddressSpace &as);
+    bool decodeConstraints(DecodingContext &ctx, ExecutionState &es);
+    bool decodeFrame(DecodingContext &ctx, Thread &t);
+    bool decodeThread(DecodingContext &ctx, ExecutionState &es);
+    bool decodeProcess(DecodingContext &ctx, ExecutionState &es);
+    bool decodeState(DecodingContext &ctx, ExecutionState &es);
+
+  public:
+    explicit StateSerializer(Executor &_executor);
+
+    /// Encode \a states into \a data. Return false if some state refers to
+    /// something that cannot be encoded (e.g., a value outside the module).
+    bool encode(const std::vector<ExecutionState*> &states,
+                std::string &data);
+
+    /// Decode the states of \a data, in the order they were encoded. The
+    /// states are not registered with the executor. Return false if the
+    /// data is malformed or was produced for a different layout, in which
+    /// case no state is returned.
+    bool decode(const std::string &data,
+                std::vector<ExecutionState*> &states);
+
+    /// Encode the address spaces and constraints of \a states into \a data,
+    /// for decodeMemory() to restore them in this process. Memory objects
+    /// are not encoded but stored in \a objects, which the caller must keep
+    /// until the data is decoded. So are the object states that are
+    /// read-only or still used outside \a states, in \a objectStates, and
+    /// the pages such object states share with the encoded ones, in \a
+    /// pages: encoding them would free nothing. The arrays the data refers
+    /// to are added to \a arrays, by their address.
+    void encodeMemory(const std::vector<ExecutionState*> &states,
+                      std::string &data,
+                      std::vector< ref<const MemoryObject> > &objects,
+                      std::vector<ObjectHolder> &objectStates,
+                      std::vector< ref<ObjectPage> > &pages,
+                      std::map<uint64_t, const Array*> &arrays);
+
+    /// Restore the memory encoded by encodeMemory() into the same \a states,
+    /// whose address spaces must have been emptied since. Return false if
+    /// the data is malformed.
+    bool decodeMemory(const unsigned char *data, size_t size,
+                      const std::vector<ExecutionState*> &states,
+                      const std::vector< ref<const MemoryObject> > &objects,
+                      const std::vector<ObjectHolder> &objectStates,
+                      const std::vector< ref<ObjectPage> > &pages,
+                      std::map<uint64_t, const Array*> &arrays);
+  };
+}
+
+#endif
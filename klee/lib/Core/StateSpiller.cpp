@@ -0,0 +1,172 @@
+//===-- StateSpiller.cpp --------------------------------------------------===//
+//
+//                     The KLEE Symbolic Virtual Machine
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "StateSpiller.h"
+
+#include "Common.h"
+#include "CoreStats.h"
+#include "Memory.h"
+#include "StateSerializer.h"
+
+#include "klee/ExecutionState.h"
+#include "klee/Internal/Support/Timer.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+using namespace klee;
+
+StateSpiller::StateSpiller(StateSerializer &_serializer,
+                           const std::string &_path)
+  : serializer(_serializer), path(_path), fileSize(0) {
+  fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0) {
+    klee_warning("unable to create spill file %s: %s", path.c_str(),
+                 strerror(errno));
+    return;
+  }
+  // Nobody else needs to see it, and it goes away with us
+  unlink(path.c_str());
+}
+
+StateSpiller::~StateSpiller() {
+  std::vector<Batch*> spilled;
+  for (std::map<const ExecutionState*, Batch*>::iterator
+         it = batches.begin(), ie = batches.end(); it != ie; ++it) {
+    if (it->second->states.front() == it->first)
+      spilled.push_back(it->second);
+  }
+  for (unsigned i = 0; i < spilled.size(); ++i)
+    delete spilled[i];
+
+  if (fd >= 0)
+    close(fd);
+}
+
+bool StateSpiller::write(const std::string &data, uint64_t offset) {
+  const char *p = data.data();
+  size_t left = data.size();
+  while (left) {
+    ssize_t n = pwrite(fd, p, left, offset);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      klee_warning("unable to write spill file %s: %s", path.c_str(),
+                   strerror(errno));
+      return false;
+    }
+    p += n;
+    left -= n;
+    offset += n;
+  }
+  return true;
+}
+
+bool StateSpiller::spillBatch(const std::vector<ExecutionState*> &states) {
+  WallTimer timer;
+
+  Batch *batch = new Batch();
+  batch->states = states;
+
+  std::string data;
+  serializer.encodeMemory(states, data, batch->objects, batch->objectStates,
+                          batch->pages, batch->arrays);
+
+  // Batches start on a page boundary, so that they can be mapped back
+  uint64_t pageSize = sysconf(_SC_PAGESIZE);
+  batch->offset = fileSize;
+  batch->size = data.size();
+  if (!write(data, batch->offset)) {
+    delete batch;
+    return false;
+  }
+  fileSize = (batch->offset + batch->size + pageSize - 1) & ~(pageSize - 1);
+
+  for (std::vector<ExecutionState*>::const_iterator it = states.begin(),
+         ie = states.end(); it != ie; ++it) {
+    ExecutionState &es = **it;
+    // The address space hashes are left alone, they still describe the
+    // objects to restore
+    for (ExecutionState::processes_ty::iterator
+           pit = es.processes.begin(), pie = es.processes.end();
+         pit != pie; ++pit)
+      pit->second.addressSpace.objects = MemoryMap();
+    es.globalConstraints = ConstraintManager();
+    es.spilled = true;
+    batches[&es] = batch;
+  }
+
+  stats::statesSpilled += states.size();
+  stats::spilledBytes += data.size();
+  stats::spillTime += timer.check();
+  return true;
+}
+
+bool StateSpiller::spill(const std::vector<ExecutionState*> &states,
+                         unsigned batchSize) {
+  if (fd < 0)
+    return false;
+
+  batchSize = std::max(batchSize, 1U);
+  for (unsigned i = 0; i < states.size(); i += batchSize) {
+    std::vector<ExecutionState*> batch(states.begin() + i,
+        states.begin() + std::min<size_t>(i + batchSize, states.size()));
+    if (!spillBatch(batch))
+      return false;
+  }
+  return true;
+}
+
+void StateSpiller::restore(ExecutionState &state) {
+  std::map<const ExecutionState*, Batch*>::iterator it = batches.find(&state);
+  assert(it != batches.end() && "restoring a state that was not spilled");
+  Batch *batch = it->second;
+
+  WallTimer timer;
+
+  void *data = mmap(0, batch->size, PROT_READ, MAP_PRIVATE, fd,
+                    batch->offset);
+  if (data == MAP_FAILED)
+    klee_error("unable to map spill file %s: %s", path.c_str(),
+               strerror(errno));
+  bool ok = serializer.decodeMemory((const unsigned char*) data, batch->size,
+                                    batch->states, batch->objects,
+                                    batch->objectStates, batch->pages,
+                                    batch->arrays);
+  munmap(data, batch->size);
+  if (!ok)
+    klee_error("corrupted spill file %s", path.c_str());
+
+  for (std::vector<ExecutionState*>::iterator sit = batch->states.begin(),
+         sie = batch->states.end(); sit != sie; ++sit) {
+    (*sit)->spilled = false;
+    batches.erase(*sit);
+  }
+
+  // Give the disk space back
+  if (batches.empty()) {
+    if (ftruncate(fd, 0) == 0)
+      fileSize = 0;
+  } else {
+#ifdef FALLOC_FL_PUNCH_HOLE
+    fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, batch->offset,
+              batch->size);
+#endif
+  }
+
+  stats::statesRestored += batch->states.size();
+  stats::restoredBytes += batch->size;
+  stats::restoreTime += timer.check();
+  delete batch;
+}
@@ -0,0 +1,78 @@
+//===-- StateSpiller.h ------------------------------------------*- C++ -*-===//
+//
+//                     The KLEE Symbolic Virtual Machine
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef KLEE_STATESPILLER_H
+#define KLEE_STATESPILLER_H
+
+#include "ObjectHolder.h"
+
+#include "klee/util/Ref.h"
+
+#include <map>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+namespace klee {
+  class Array;
+  class ExecutionState;
+  class MemoryObject;
+  class ObjectPage;
+  class StateSerializer;
+
+  /// Moves the memory of cold states to a spill file, so that the executor
+  /// can stay under its memory cap without terminating them. Only the
+  /// address spaces and the constraints are spilled; the rest of a state,
+  /// which the searchers look at, stays in memory.
+  ///
+  /// States are spilled in batches that share their object states and
+  /// expressions on disk, and a batch is restored whole, mapped back from
+  /// the file, as soon as one of its states is needed. The object states
+  /// and pages that other states still use stay in memory with the batch.
+  class StateSpiller {
+    struct Batch {
+      uint64_t offset, size;
+      std::vector<ExecutionState*> states;
+      std::vector< ref<const MemoryObject> > objects;
+      std::vector<ObjectHolder> objectStates;
+      std::vector< ref<ObjectPage> > pages;
+      std::map<uint64_t, const Array*> arrays;
+    };
+
+    StateSerializer &serializer;
+    std::string path;
+    int fd;
+    /// The end of the last batch, rounded up to a page.
+    uint64_t fileSize;
+
+    std::map<const ExecutionState*, Batch*> batches;
+
+    bool spillBatch(const std::vector<ExecutionState*> &states);
+    bool write(const std::string &data, uint64_t offset);
+
+  public:
+    /// The spill file is created at \a path and unlinked right away.
+    StateSpiller(StateSerializer &_serializer, const std::string &_path);
+    ~StateSpiller();
+
+    /// Spill \a states, \a batchSize at a time. Return false if the spill
+    /// file could not be written, in which case the states that were not
+    /// spilled yet stay in memory.
+    bool spill(const std::vector<ExecutionState*> &states,
+               unsigned batchSize);
+
+    /// Bring back the memory of the spilled \a state, and of the rest of its
+    /// batch.
+    void restore(ExecutionState &state);
+
+    unsigned getNumSpilled() const { return batches.size(); }
+  };
+}
+
+#endif
@@ -16,7 +16,9 @@
 #include "klee/Internal/Module/InstructionInfoTable.h"
 #include "klee/Internal/Module/KModule.h"
 #include "klee/Internal/Module/KInstruction.h"
+#include "klee/Internal/Support/MemoryAccounting.h"
 #include "klee/Internal/Support/ModuleUtil.h"
+#include "klee/Internal/Support/SamplingProfiler.h"
 #include "klee/Internal/System/Time.h"
 
 #include "CallPathManager.h"
@@ -66,6 +68,13 @@ namespace {
                        cl::desc("Enable tracking of time for individual instructions"),
                        cl::init(false));
 
+  cl::opt<unsigned>
+  InstructionTimeSampling("instruction-time-sampling",
+                          cl::desc("Sample the instruction time every N microseconds of CPU time, "
+                                   "instead of measuring each instruction (0 = measure each "
+                                   "instruction, default: 1000)"),
+                          cl::init(1000));
+
   cl::opt<bool>
   OutputStats("output-stats",
               cl::desc("Write running stats trace file"),
@@ -197,6 +206,7 @@ StatsTracker::StatsTracker(Executor &_executor, std::string _objectFilename,
     numBranches(0),
     fullBranches(0),
     partialBranches(0),
+    lastSampleWallTime(startWallTime),
     updateMinDistToUncovered(_updateMinDistToUncovered) {
   KModule *km = executor.kmodule;
 
@@ -289,12 +299,19 @@ StatsTracker::StatsTracker(Executor &_executor, std::string _objectFilename,
     assert(istatsFile && "unable to open istats file");
 
     executor.addTimer(new WriteIStatsTimer(this), IStatsWriteInterval);
+
+    if (TrackInstructionTime && InstructionTimeSampling &&
+        !SamplingProfiler::start(InstructionTimeSampling))
+      klee_warning("unable to start the instruction profiler, "
+                   "timing each instruction instead");
   }
 
   executor.addTimer(new UpdateCoverageTimer(this), CoverageUpdateInterval);
 }
 
 StatsTracker::~StatsTracker() {  
+  SamplingProfiler::stop();
+
   if (statsFile)
     delete statsFile;
   if (allStatsFile)
@@ -305,15 +322,38 @@ StatsTracker::~StatsTracker() {
 
 void StatsTracker::done() {
   computeCodeCoverage();
+  if (SamplingProfiler::hasTicks())
+    chargeSamples();
   if (statsFile)
     writeStatsLine();
   if (OutputIStats)
     writeIStats();
 }
 
+/* Should be called while the statistics index is still at the instruction
+ * that ran when the ticks arrived */
+void StatsTracker::chargeSamples() {
+  uint64_t times[SamplingProfiler::NumActivities];
+
+  stats::instructionTime += SamplingProfiler::takeSamples(times);
+
+  // The wall time since the previous sample goes with it
+  double now = util::getWallTime();
+  stats::instructionRealTime += (uint64_t) ((now - lastSampleWallTime) * 1e6);
+  lastSampleWallTime = now;
+
+  stats::sampledInterpretationTime += times[SamplingProfiler::Interpretation];
+  stats::sampledSolverTime += times[SamplingProfiler::Solver];
+  stats::sampledMergeTime += times[SamplingProfiler::Merge];
+  stats::sampledSearcherTime += times[SamplingProfiler::Searcher];
+}
+
 void StatsTracker::stepInstruction(ExecutionState &es) {
 	if (OutputIStats) {
-		if (TrackInstructionTime) {
+		if (SamplingProfiler::isRunning()) {
+			if (SamplingProfiler::hasTicks())
+				chargeSamples();
+		} else if (TrackInstructionTime) {
 			static sys::TimeValue lastNowTime(0, 0), lastUserTime(0, 0);
 
 			if (lastUserTime.seconds() == 0 && lastUserTime.nanoseconds() == 0) {
@@ -351,7 +391,7 @@ void StatsTracker::stepInstruction(ExecutionState &es) {
 #if (LLVM_VERSION_MAJOR == 2 && LLVM_VERSION_MINOR < 7)
 				if (isa<DbgStopPointInst> (inst))
 #endif
-					es.coveredLines[&ii.file].insert(ii.line);
+					es.coveredInstructions.set(ii.id);
 				es.setCoveredNew();
 				es.instsSinceCovNew = 1;
 				++stats::locallyCoveredInstructions;
@@ -449,7 +489,13 @@ void StatsTracker::writeStatsHeader() {
              << "'MergesFail',"
              << "'FastForwardStart',"
              << "'FastForwardFail',"
-             << ")\n";
+             << "'SearcherTime',"
+             << "'MergesFiltered',";
+  for (unsigned i = 0; i < MemoryAccounting::NumCategories; ++i)
+    *statsFile << "'"
+               << MemoryAccounting::getName((MemoryAccounting::Category) i)
+               << "',";
+  *statsFile << ")\n";
   statsFile->flush();
 
   *allStatsFile << "("
@@ -473,6 +519,13 @@ double StatsTracker::elapsed() {
 }
 
 void StatsTracker::writeStatsLine() {
+  // The QCE maps cannot be accounted as they grow, measure them instead
+  size_t qceBytes = 0;
+  for (std::set<ExecutionState*>::iterator it = executor.states.begin(),
+         ie = executor.states.end(); it != ie; ++it)
+    qceBytes += (*it)->getQCEMapsFootprint();
+  MemoryAccounting::set(MemoryAccounting::QCEMaps, qceBytes);
+
   *statsFile << "(" << stats::instructions
              << "," << fullBranches
              << "," << partialBranches
@@ -482,7 +535,7 @@ void StatsTracker::writeStatsLine() {
              << "," << sys::Process::GetTotalMemoryUsage()
              << "," << stats::queries
              << "," << stats::queryConstructs
-             << "," << 0 // was numObjects
+             << "," << stats::allocations - stats::deallocations
              << "," << elapsed()
              << "," << stats::locallyCoveredInstructions
              << "," << stats::locallyUncoveredInstructions
@@ -497,7 +550,12 @@ void StatsTracker::writeStatsLine() {
              << "," << stats::mergesFail
              << "," << stats::fastForwardsStart
              << "," << stats::fastForwardsFail
-             << ")\n";
+             << "," << stats::searcherTime / 1000000.
+             << "," << stats::mergesFiltered;
+  for (unsigned i = 0; i < MemoryAccounting::NumCategories; ++i)
+    *statsFile << ","
+               << MemoryAccounting::getBytes((MemoryAccounting::Category) i);
+  *statsFile << ")\n";
   statsFile->flush();
 
   *allStatsFile << "(" << elapsed()
@@ -43,6 +43,9 @@ namespace klee {
     unsigned numBranches;
     unsigned fullBranches, partialBranches;
 
+    /// The wall time of the last profiler sample charged.
+    double lastSampleWallTime;
+
     CallPathManager callPathManager;    
 
     bool updateMinDistToUncovered;
@@ -55,6 +58,7 @@ namespace klee {
     void writeStatsHeader();
     void writeStatsLine();
     void writeIStats();
+    void chargeSamples();
 
     std::pair<std::pair<unsigned, unsigned>, unsigned> computeCodeCoverage(KFunction *kf);
 
@@ -36,10 +36,39 @@
 #include "klee/Internal/Module/Cell.h"
 #include "klee/Expr.h"
 
+#include "Memory.h"
+
 #include "llvm/Function.h"
 
 namespace klee {
 
+/* QCEFrameInfo Methods */
+
+QCEFrameInfo::QCEFrameInfo(int _stackFrame, int _vnumber)
+  : stackFrame(_stackFrame), vnumber(_vnumber), inVhAdd(false),
+    qce(0), qceBase(0), trackedOffset(0) {
+}
+
+QCEFrameInfo::QCEFrameInfo(const QCEFrameInfo &info)
+  : stackFrame(info.stackFrame), vnumber(info.vnumber),
+    inVhAdd(info.inVhAdd), qce(info.qce), qceBase(info.qceBase),
+    trackedObject(info.trackedObject), trackedOffset(info.trackedOffset) {
+}
+
+QCEFrameInfo &QCEFrameInfo::operator=(const QCEFrameInfo &info) {
+  stackFrame = info.stackFrame;
+  vnumber = info.vnumber;
+  inVhAdd = info.inVhAdd;
+  qce = info.qce;
+  qceBase = info.qceBase;
+  trackedObject = info.trackedObject;
+  trackedOffset = info.trackedOffset;
+  return *this;
+}
+
+QCEFrameInfo::~QCEFrameInfo() {
+}
+
 /* StackFrame Methods */
 
 StackFrame::StackFrame(KInstIterator _caller, uint64_t _callerExecIndex, KFunction *_kf,
@@ -50,7 +79,12 @@ StackFrame::StackFrame(KInstIterator _caller, uint64_t _callerExecIndex, KFuncti
     qceTotal(parentFrame ? parentFrame->qceTotal : 0),
     qceTotalBase(parentFrame ? parentFrame->qceTotalBase : 0),
     qceMap(parentFrame ? parentFrame->qceMap : QCEMap()),
-    qceLocalsTrackMap(_kf->numRegisters, false) {
+    qceLastInfo(0),
+    qceLocalsTrackMap(_kf->numRegisters, false),
+    stackHash(hashUpdate(hashUpdate(
+        parentFrame ? parentFrame->stackHash : hashInit(),
+        (uint64_t) (uintptr_t) (KInstruction*) _caller),
+        (uint64_t) (uintptr_t) _kf)) {
 
   execIndexStack[0].loopID = uint64_t(-1);
   execIndexStack[0].index = hashUpdate(_callerExecIndex, (uintptr_t) _kf);
@@ -72,8 +106,10 @@ StackFrame::StackFrame(const StackFrame &s)
     qceTotal(s.qceTotal),
     qceTotalBase(s.qceTotalBase),
     qceMap(s.qceMap),
+    qceLastInfo(s.qceLastInfo),
     qceLocalsTrackMap(s.qceLocalsTrackMap, s.kf->numRegisters),
-    qceLocalsTrackHash(s.qceLocalsTrackHash) {
+    qceLocalsTrackHash(s.qceLocalsTrackHash),
+    stackHash(s.stackHash) {
 
   locals = new Cell[s.kf->numRegisters];
   for (unsigned i=0; i<s.kf->numRegisters; i++)
@@ -93,8 +129,10 @@ StackFrame& StackFrame::operator=(const StackFrame &s) {
     qceTotal = s.qceTotal;
     qceTotalBase = s.qceTotalBase;
     qceMap = s.qceMap;
+    qceLastInfo = s.qceLastInfo;
     qceLocalsTrackMap = BitArray(s.qceLocalsTrackMap, s.kf->numRegisters);
     qceLocalsTrackHash = s.qceLocalsTrackHash;
+    stackHash = s.stackHash;
 
     if (locals)
       delete []locals;
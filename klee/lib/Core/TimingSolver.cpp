@@ -12,6 +12,7 @@
 #include "klee/ExecutionState.h"
 #include "klee/Solver.h"
 #include "klee/Statistics.h"
+#include "klee/Internal/Support/SamplingProfiler.h"
 
 #include "CoreStats.h"
 
@@ -62,6 +63,7 @@ bool TimingSolver::evaluate(const ExecutionState& state, ref<Expr> expr,
     return true;
   }
 
+  SamplingProfiler::ActivityScope activity(SamplingProfiler::Solver);
   sys::TimeValue now(0,0),user(0,0),delta(0,0),sys(0,0);
   sys::Process::GetTimeUsage(now,user,sys);
 
@@ -96,6 +98,7 @@ bool TimingSolver::mustBeTrue(const ExecutionState& state, ref<Expr> expr,
     return true;
   }
 
+  SamplingProfiler::ActivityScope activity(SamplingProfiler::Solver);
   sys::TimeValue now(0,0),user(0,0),delta(0,0),sys(0,0);
   sys::Process::GetTimeUsage(now,user,sys);
 
@@ -153,6 +156,7 @@ bool TimingSolver::getValue(const ExecutionState& state, ref<Expr> expr,
     return true;
   }
   
+  SamplingProfiler::ActivityScope activity(SamplingProfiler::Solver);
   sys::TimeValue now(0,0),user(0,0),delta(0,0),sys(0,0);
   sys::Process::GetTimeUsage(now,user,sys);
 
@@ -188,6 +192,7 @@ TimingSolver::getInitialValues(const ExecutionState& state,
   if (objects.empty())
     return true;
 
+  SamplingProfiler::ActivityScope activity(SamplingProfiler::Solver);
   sys::TimeValue now(0,0),user(0,0),delta(0,0),sys(0,0);
   sys::Process::GetTimeUsage(now,user,sys);
 
@@ -58,6 +58,15 @@ namespace {
   cl::opt<bool>
   UseRandomPathSearch("use-random-path");
 
+  cl::opt<unsigned>
+  UseWorkStealingSearch("use-work-stealing-search",
+            cl::desc("Split the states in N shards that take turns, explore their own forks first and steal the oldest states of the others when idle (0 = off)"),
+            cl::init(0));
+
+  cl::opt<bool>
+  WorkStealingWeighted("work-stealing-weighted",
+            cl::desc("Select within each shard of --use-work-stealing-search at random, weighted by --weight-type, instead of depth-first"));
+
   cl::opt<WeightedRandomSearcher::WeightType>
   WeightType("weight-type", cl::desc("Set the weight type for --use-non-uniform-random-search"),
              cl::values(clEnumValN(WeightedRandomSearcher::Depth, "none", "use (2^depth)"),
@@ -133,7 +142,10 @@ Searcher *klee::constructUserSearcher(Executor &executor, Searcher *original) {
   Searcher *searcher = original;
 
   if (!searcher) {
-	  if (UseRandomPathSearch) {
+	  if (UseWorkStealingSearch) {
+		searcher = new WorkStealingSearcher(executor, UseWorkStealingSearch,
+		                                    WorkStealingWeighted, WeightType);
+	  } else if (UseRandomPathSearch) {
 		searcher = new RandomPathSearcher(executor);
 	  } else if (UseNonUniformRandomSearch) {
 		searcher = new WeightedRandomSearcher(executor, WeightType);
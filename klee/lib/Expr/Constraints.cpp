@@ -26,6 +26,9 @@ namespace {
 
 using namespace klee;
 
+pthread_mutex_t ConstraintManager::SolverCacheLock::mutex =
+  PTHREAD_MUTEX_INITIALIZER;
+
 class ExprReplaceVisitor : public ExprVisitor {
 private:
   ref<Expr> src, dst;
@@ -80,9 +83,8 @@ private:
     if (ConstantExpr *ce = dyn_cast<ConstantExpr>(e)) {
       *r = SRange(ce->getWidth(), ce->getZExtValue()); return true;
     }
-    ranges_ty::const_iterator it = ranges.find(e);
-    if (it != ranges.end()) {
-      *r = it->second; return true;
+    if (const ranges_ty::value_type *p = ranges.lookup(e)) {
+      *r = p->second; return true;
     }
     return false;
   }
@@ -153,33 +155,72 @@ public:
 };
 
 ConstraintManager::ConstraintManager(const std::vector<ref<Expr> > &_constraints)
+    : constraints(_constraints.begin(), _constraints.end()) {
+  rehash();
+  if (SimplifyConstraints)
+    recomputeAllRanges();
+}
+
+ConstraintManager::ConstraintManager(const constraint_list_ty &_constraints)
     : constraints(_constraints) {
+  rehash();
+  if (SimplifyConstraints)
+    recomputeAllRanges();
+}
+
+void ConstraintManager::pushConstraint(ref<Expr> e) {
+  constraints.push_back(e);
+  hashValue = hashUpdate(hashValue, (uint64_t) e->hash());
+}
+
+void ConstraintManager::rehash() {
+  hashValue = hashInit();
+  for (constraint_list_ty::iterator
+         it = constraints.begin(), ie = constraints.end(); it != ie; ++it)
+    hashValue = hashUpdate(hashValue, (uint64_t) (*it)->hash());
+  hashStale = false;
+}
+
+void ConstraintManager::truncate(size_t n) {
+  constraints = constraints.prefix(n);
+  rehash();
+
   if (SimplifyConstraints)
     recomputeAllRanges();
+  else
+    ranges = ranges_ty();
 }
 
 bool ConstraintManager::rewriteConstraints(ExprVisitor &visitor,
                                            bool canBeFalse, bool *ok) {
-  ConstraintManager::constraints_ty old;
+  constraint_list_ty old;
   bool changed = false;
+  size_t index = 0;
 
+  hashStale = true;
   constraints.swap(old);
-  for (ConstraintManager::constraints_ty::iterator 
-         it = old.begin(), ie = old.end(); it != ie; ++it) {
-    ref<Expr> &ce = *it;
+  for (constraint_list_ty::iterator
+         it = old.begin(), ie = old.end(); it != ie; ++it, ++index) {
+    const ref<Expr> &ce = *it;
     ref<Expr> e = visitor.visit(ce);
 
     if (e!=ce) {
+      // Keep sharing the unchanged prefix with the old list
+      if (!changed)
+        constraints = old.prefix(index);
+      changed = true;
       if (!addConstraintInternal(e, canBeFalse)) { // enable further reductions
         if (ok) *ok = false;
         return true;
       }
-      changed = true;
-    } else {
-      constraints.push_back(ce);
+    } else if (changed) {
+      pushConstraint(ce);
     }
   }
 
+  if (!changed)
+    constraints.swap(old);
+
   if (ok) *ok = true;
   return changed;
 }
@@ -187,24 +228,32 @@ bool ConstraintManager::rewriteConstraints(ExprVisitor &visitor,
 void ConstraintManager::simplifyConstraints(const ref<Expr> &expr,
                                             bool canBeFalse, bool *ok) {
   if (ok) *ok = true;
-  constraints_ty old;
+  constraint_list_ty old;
+  bool changed = false;
+  size_t index = 0;
+
+  hashStale = true;
   constraints.swap(old);
 
-  ranges.clear();
+  ranges = ranges_ty();
   computeRanges(expr, ok);
   if (ok && !*ok)
     return;
 
   ExprReplaceVisitor3 visitor(ranges);
 
-  for (ConstraintManager::constraints_ty::iterator
-         it = old.begin(), ie = old.end(); it != ie; ++it) {
-    ref<Expr> &ce = *it;
+  for (constraint_list_ty::iterator
+         it = old.begin(), ie = old.end(); it != ie; ++it, ++index) {
+    const ref<Expr> &ce = *it;
 
     // Simplify assuming e and all previously added constraints
     ref<Expr> e = visitor.visit(ce);
 
     if (e != ce) {
+      // Keep sharing the unchanged prefix with the old list
+      if (!changed)
+        constraints = old.prefix(index);
+      changed = true;
       if (!addConstraintInternal(e, canBeFalse)) {
         if (ok) *ok = false;
         return;
@@ -214,12 +263,19 @@ void ConstraintManager::simplifyConstraints(const ref<Expr> &expr,
       if (ok && !*ok)
         return;
     } else {
-      constraints.push_back(ce);
+      if (changed)
+        pushConstraint(ce);
       computeRanges(ce, ok);
-      if (ok && !*ok)
+      if (ok && !*ok) {
+        if (!changed)
+          constraints = old.prefix(index + 1);
         return;
+      }
     }
   }
+
+  if (!changed)
+    constraints.swap(old);
 }
 
 void ConstraintManager::simplifyForValidConstraint(ref<Expr> e) {
@@ -235,7 +291,7 @@ ref<Expr> ConstraintManager::simplifyExpr(ref<Expr> e) const {
   } else {
     std::map< ref<Expr>, ref<Expr> > equalities;
 
-    for (ConstraintManager::constraints_ty::const_iterator
+    for (constraint_list_ty::iterator
            it = constraints.begin(), ie = constraints.end(); it != ie; ++it) {
       if (const EqExpr *ee = dyn_cast<EqExpr>(*it)) {
         if (isa<ConstantExpr>(ee->left)) {
@@ -269,7 +325,7 @@ bool ConstraintManager::addConstraintInternal(ref<Expr> e, bool canBeFalse) {
   switch (e->getKind()) {
   case Expr::Constant:
     if (canBeFalse) {
-      constraints.push_back(e);
+      pushConstraint(e);
       if (cast<ConstantExpr>(e)->isFalse())
         ok = false;
     } else {
@@ -293,7 +349,7 @@ bool ConstraintManager::addConstraintInternal(ref<Expr> e, bool canBeFalse) {
         ExprReplaceVisitor visitor(be->right, be->left);
         rewriteConstraints(visitor, canBeFalse, &ok);
       }
-      constraints.push_back(e);
+      pushConstraint(e);
       //computeRanges(e);
       break;
     }
@@ -305,7 +361,7 @@ bool ConstraintManager::addConstraintInternal(ref<Expr> e, bool canBeFalse) {
     } else {
       //computeRanges(e);
     }
-    constraints.push_back(e);
+    pushConstraint(e);
     break;
   }
   return ok;
@@ -314,26 +370,34 @@ bool ConstraintManager::addConstraintInternal(ref<Expr> e, bool canBeFalse) {
 void ConstraintManager::addConstraint(ref<Expr> e) {
   e = simplifyExpr(e);
   addConstraintInternal(e, false);
+  if (hashStale)
+    rehash();
 }
 
 bool ConstraintManager::checkAddConstraint(ref<Expr> e) {
   e = simplifyExpr(e);
-  return addConstraintInternal(e, true);
+  bool ok = addConstraintInternal(e, true);
+  if (hashStale)
+    rehash();
+  return ok;
 }
 
 bool ConstraintManager::intersectRange(const ref<Expr> &e, const SRange &r, bool *ok) {
-  std::pair<ranges_ty::iterator, bool> p = ranges.insert(std::make_pair(e, r));
-  if (p.second)
+  const ranges_ty::value_type *p = ranges.lookup(e);
+  if (!p) {
+    ranges = ranges.insert(std::make_pair(e, r));
     return true;
+  }
 
   // compute the intersection
-  SRange s = p.first->second.intersection(r);
-  if (p.first->second != s) {
+  SRange old = p->second;
+  SRange s = old.intersection(r);
+  if (old != s) {
     if (ok)
       *ok = !s.empty();
     else
       assert(!s.empty());
-    p.first->second = s;
+    ranges = ranges.replace(std::make_pair(e, s));
     return true;
   }
   return false;
@@ -438,9 +502,9 @@ bool ConstraintManager::computeRanges(const ref<Expr>& expr, bool *ok) {
 }
 
 void ConstraintManager::recomputeAllRanges() {
-  ranges.clear();
+  ranges = ranges_ty();
 
-  for (ConstraintManager::constraints_ty::iterator
+  for (constraint_list_ty::iterator
          it = constraints.begin(), ie = constraints.end(); it != ie; ++it) {
     computeRanges(*it, NULL);
   }
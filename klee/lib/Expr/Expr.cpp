@@ -16,8 +16,16 @@
 
 #include "klee/util/ExprPPrinter.h"
 
+#include "ExprStats.h"
+
+#include <boost/interprocess/detail/atomic.hpp>
+#include <tr1/unordered_map>
+
 #include <iostream>
 #include <sstream>
+#include <vector>
+
+#include <pthread.h>
 
 using namespace klee;
 using namespace llvm;
@@ -27,11 +35,142 @@ namespace {
   ConstArrayOpt("const-array-opt",
 	 cl::init(false),
 	 cl::desc("Enable various optimizations involving all-constant arrays."));
+
+  cl::opt<bool, true>
+  HashConsExprs("hash-cons-exprs",
+         cl::location(Expr::hashConsing),
+         cl::init(false),
+         cl::desc("Share structurally equal expressions (default=off)."));
+
+  cl::opt<bool, true>
+  AtomicRefCounts("atomic-refcounts",
+         cl::location(RefCountPolicy::atomic),
+         cl::init(false),
+         cl::desc("Update expression reference counts atomically, needed "
+                  "when expressions are shared between threads "
+                  "(default=off)."));
 }
 
 /***/
 
 unsigned Expr::count = 0;
+bool Expr::hashConsing = false;
+bool RefCountPolicy::atomic = false;
+
+/* Hash-consing */
+
+namespace {
+  /// The unique table maps expression hashes to the interned expressions.
+  /// It does not hold references: an expression removes itself when it is
+  /// destroyed.
+  typedef std::tr1::unordered_multimap<unsigned, Expr*> UniqueTable;
+
+  pthread_mutex_t uniqueTableMutex = PTHREAD_MUTEX_INITIALIZER;
+
+  void lockUniqueTable() { pthread_mutex_lock(&uniqueTableMutex); }
+  void unlockUniqueTable() { pthread_mutex_unlock(&uniqueTableMutex); }
+
+  UniqueTable *createUniqueTable() {
+    // A child forked while another thread holds the lock (e.g., a forked
+    // STP solver) would otherwise deadlock on its first expression
+    pthread_atfork(lockUniqueTable, unlockUniqueTable, unlockUniqueTable);
+    return new UniqueTable();
+  }
+
+  // Never destroyed, since expressions may outlive static destructors
+  UniqueTable &getUniqueTable() {
+    static UniqueTable *table = createUniqueTable();
+    return *table;
+  }
+
+  /// Take a reference to \a e unless its reference count already dropped to
+  /// zero, i.e., it is being destroyed by another thread.
+  bool tryRetain(Expr *e) {
+    if (!RefCountPolicy::isAtomic()) {
+      if (!e->refCount)
+        return false;
+      ++e->refCount;
+      return true;
+    }
+
+    uint32_t count = e->refCount;
+    while (count) {
+      uint32_t old = boost::interprocess::detail::atomic_cas32(&e->refCount,
+                                                               count + 1,
+                                                               count);
+      if (old == count)
+        return true;
+      count = old;
+    }
+    return false;
+  }
+}
+
+ref<Expr> Expr::createCachedExpr(Expr *e, size_t size) {
+  e->computeHash();
+  if (!hashConsing)
+    return e;
+
+  UniqueTable &table = getUniqueTable();
+  std::vector<Expr*> released;
+  Expr *found = 0;
+
+  pthread_mutex_lock(&uniqueTableMutex);
+  std::pair<UniqueTable::iterator, UniqueTable::iterator> range =
+    table.equal_range(e->hashValue);
+  for (UniqueTable::iterator it = range.first; it != range.second; ++it) {
+    Expr *candidate = it->second;
+    if (!tryRetain(candidate))
+      continue;
+    if (candidate->compare(*e) == 0) {
+      found = candidate;
+      break;
+    }
+    // Dropping the last reference must happen outside the lock
+    if (RefCountPolicy::dec(&candidate->refCount))
+      released.push_back(candidate);
+  }
+  if (!found)
+    table.insert(std::make_pair(e->hashValue, e));
+  pthread_mutex_unlock(&uniqueTableMutex);
+
+  for (std::vector<Expr*>::iterator it = released.begin(),
+         ie = released.end(); it != ie; ++it)
+    delete *it;
+
+  if (!found) {
+    ++stats::exprCacheMisses;
+    return e;
+  }
+
+  ++stats::exprCacheHits;
+  stats::exprCacheSavedBytes += size;
+  delete e;
+
+  // Hand over the reference taken by tryRetain()
+  ref<Expr> result(found);
+  RefCountPolicy::dec(&found->refCount);
+  return result;
+}
+
+Expr::~Expr() {
+  Expr::count--;
+
+  if (hashConsing) {
+    UniqueTable &table = getUniqueTable();
+
+    pthread_mutex_lock(&uniqueTableMutex);
+    std::pair<UniqueTable::iterator, UniqueTable::iterator> range =
+      table.equal_range(hashValue);
+    for (UniqueTable::iterator it = range.first; it != range.second; ++it) {
+      if (it->second == this) {
+        table.erase(it);
+        break;
+      }
+    }
+    pthread_mutex_unlock(&uniqueTableMutex);
+  }
+}
 
 ref<Expr> Expr::createTempRead(const Array *array, Expr::Width w) {
   UpdateList ul(array, 0);
@@ -187,7 +326,7 @@ unsigned ReadExpr::computeHash() {
 }
 
 unsigned NotExpr::computeHash() {
-  unsigned hashValue = expr->hash() * Expr::MAGIC_HASH_CONSTANT * Expr::Not;
+  hashValue = expr->hash() * Expr::MAGIC_HASH_CONSTANT * Expr::Not;
   return hashValue;
 }
 
@@ -0,0 +1,306 @@
+//===-- ExprSerializer.cpp ------------------------------------------------===//
+//
+//                     The KLEE Symbolic Virtual Machine
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "klee/util/ExprSerializer.h"
+
+#include "llvm/ADT/APInt.h"
+
+#include <cstring>
+
+using namespace klee;
+
+namespace {
+  enum RecordTag {
+    ArrayRecord,
+    UpdateRecord,
+    ExprRecord,
+    EndRecord
+  };
+}
+
+const uint32_t ExprEncoder::NoRecord;
+
+/***/
+
+void SerialReader::read(void *p, size_t n) {
+  if (failed || n > remaining()) {
+    failed = true;
+    pos = end;
+    memset(p, 0, n);
+    return;
+  }
+  memcpy(p, pos, n);
+  pos += n;
+}
+
+std::string SerialReader::readString() {
+  uint32_t n = read32();
+  if (failed || n > remaining()) {
+    failed = true;
+    pos = end;
+    return std::string();
+  }
+  std::string s((const char*) pos, n);
+  pos += n;
+  return s;
+}
+
+/***/
+
+uint32_t ExprEncoder::encode(const Array *array) {
+  if (!array)
+    return NoRecord;
+
+  std::map<const Array*, uint32_t>::iterator it = arrays.find(array);
+  if (it != arrays.end())
+    return it->second;
+
+  out.write8(ArrayRecord);
+  out.write64((uint64_t) (uintptr_t) array);
+  out.writeString(array->name);
+  out.write32(array->size);
+  out.write32(array->constantValues.size());
+  for (unsigned i = 0; i < array->constantValues.size(); ++i) {
+    const ref<ConstantExpr> &value = array->constantValues[i];
+    out.write32(value->getWidth());
+    out.write64(value->getZExtValue());
+  }
+
+  uint32_t id = arrays.size();
+  arrays[array] = id;
+  return id;
+}
+
+uint32_t ExprEncoder::encode(const UpdateNode *head) {
+  // Update lists can be long, so walk them iteratively, oldest first
+  std::vector<const UpdateNode*> pending;
+  for (const UpdateNode *un = head; un && !updates.count(un); un = un->next)
+    pending.push_back(un);
+
+  for (std::vector<const UpdateNode*>::reverse_iterator
+         it = pending.rbegin(), ie = pending.rend(); it != ie; ++it) {
+    const UpdateNode *un = *it;
+    uint32_t index = encode(un->index), value = encode(un->value);
+
+    out.write8(UpdateRecord);
+    out.write32(un->next ? updates[un->next] : NoRecord);
+    out.write32(index);
+    out.write32(value);
+
+    uint32_t id = updates.size();
+    updates[un] = id;
+  }
+
+  return head ? updates[head] : NoRecord;
+}
+
+uint32_t ExprEncoder::encode(const ref<Expr> &e) {
+  if (e.isNull())
+    return NoRecord;
+
+  std::map<const Expr*, uint32_t>::iterator it = exprs.find(e.get());
+  if (it != exprs.end())
+    return it->second;
+
+  if (ConstantExpr *CE = dyn_cast<ConstantExpr>(e)) {
+    const llvm::APInt &value = CE->getAPValue();
+    out.write8(ExprRecord);
+    out.write8(Expr::Constant);
+    out.write32(CE->getWidth());
+    out.write(value.getRawData(), value.getNumWords() * sizeof(uint64_t));
+  } else if (ReadExpr *RE = dyn_cast<ReadExpr>(e)) {
+    uint32_t array = encode(RE->updates.root);
+    uint32_t head = encode(RE->updates.head);
+    uint32_t index = encode(RE->index);
+    out.write8(ExprRecord);
+    out.write8(Expr::Read);
+    out.write32(RE->getWidth());
+    out.write32(array);
+    out.write32(head);
+    out.write32(index);
+  } else {
+    std::vector<uint32_t> kids;
+    for (unsigned i = 0; i < e->getNumKids(); ++i)
+      kids.push_back(encode(e->getKid(i)));
+
+    out.write8(ExprRecord);
+    out.write8(e->getKind());
+    out.write32(e->getWidth());
+    out.write8(kids.size());
+    for (unsigned i = 0; i < kids.size(); ++i)
+      out.write32(kids[i]);
+    if (ExtractExpr *EE = dyn_cast<ExtractExpr>(e))
+      out.write32(EE->offset);
+  }
+
+  uint32_t id = exprs.size();
+  exprs[e.get()] = id;
+  return id;
+}
+
+void ExprEncoder::finish() {
+  out.write8(EndRecord);
+}
+
+/***/
+
+ref<Expr> ExprDecoder::createConstant(const llvm::APInt &value) {
+  return ConstantExpr::alloc(value);
+}
+
+bool ExprDecoder::decodeArray() {
+  uint64_t address = in.read64();
+  std::string name = in.readString();
+  unsigned size = in.read32();
+  uint32_t count = in.read32();
+  if (count > in.remaining())
+    return false;
+  std::vector< ref<ConstantExpr> > values(count);
+  for (unsigned i = 0; i < values.size(); ++i) {
+    Expr::Width width = in.read32();
+    uint64_t value = in.read64();
+    if (in.error() || width == 0 || width > 64)
+      return false;
+    values[i] = ConstantExpr::alloc(value, width);
+  }
+  if (in.error())
+    return false;
+
+  // Reuse the array, e.g., STPBuilder caches its STP counterpart. Expressions
+  // decoded earlier may still refer to a known array, so a different one at
+  // the same address cannot replace it.
+  const Array *&array = knownArrays[address];
+  if (array) {
+    if (array->name != name || array->size != size ||
+        array->constantValues != values)
+      return false;
+  } else {
+    array = values.empty() ? new Array(name, size) :
+      new Array(name, size, &values[0], &values[0] + values.size());
+  }
+  arrays.push_back(array);
+  return true;
+}
+
+bool ExprDecoder::decodeUpdate() {
+  uint32_t next = in.read32(), index = in.read32(), value = in.read32();
+  if (in.error() || !isValidUpdate(next) ||
+      index >= exprs.size() || value >= exprs.size())
+    return false;
+
+  UpdateList list(0, getUpdate(next));
+  list.extend(exprs[index], exprs[value]);
+  updates.push_back(list);
+  return true;
+}
+
+bool ExprDecoder::decodeExpr() {
+  Expr::Kind kind = (Expr::Kind) in.read8();
+  Expr::Width width = in.read32();
+  if (in.error())
+    return false;
+
+  if (kind == Expr::Constant) {
+    std::vector<uint64_t> words((width + 63) / 64);
+    if (words.empty() || words.size() * sizeof(uint64_t) > in.remaining())
+      return false;
+    in.read(&words[0], words.size() * sizeof(uint64_t));
+    exprs.push_back(createConstant(llvm::APInt(width, words.size(),
+                                               &words[0])));
+    return true;
+  }
+
+  if (kind == Expr::Read) {
+    uint32_t array = in.read32(), head = in.read32(), index = in.read32();
+    if (in.error() || array >= arrays.size() || !isValidUpdate(head) ||
+        index >= exprs.size())
+      return false;
+    exprs.push_back(ReadExpr::alloc(UpdateList(arrays[array],
+                                               getUpdate(head)),
+                                    exprs[index]));
+    return true;
+  }
+
+  ref<Expr> kids[3];
+  unsigned numKids = in.read8();
+  if (numKids > 3)
+    return false;
+  for (unsigned i = 0; i < numKids; ++i) {
+    uint32_t id = in.read32();
+    if (id >= exprs.size())
+      return false;
+    kids[i] = exprs[id];
+  }
+  if (in.error())
+    return false;
+
+  ref<Expr> e;
+  switch (kind) {
+  case Expr::NotOptimized: e = NotOptimizedExpr::alloc(kids[0]); break;
+  case Expr::Select: e = SelectExpr::alloc(kids[0], kids[1], kids[2]); break;
+  case Expr::Concat: e = ConcatExpr::alloc(kids[0], kids[1]); break;
+  case Expr::Extract:
+    e = ExtractExpr::alloc(kids[0], in.read32(), width);
+    break;
+  case Expr::ZExt: e = ZExtExpr::alloc(kids[0], width); break;
+  case Expr::SExt: e = SExtExpr::alloc(kids[0], width); break;
+  case Expr::Not: e = NotExpr::alloc(kids[0]); break;
+
+#define BINARY_EXPR_CASE(T) \
+  case Expr::T: e = T ## Expr::alloc(kids[0], kids[1]); break;
+
+  BINARY_EXPR_CASE(Add);
+  BINARY_EXPR_CASE(Sub);
+  BINARY_EXPR_CASE(Mul);
+  BINARY_EXPR_CASE(UDiv);
+  BINARY_EXPR_CASE(SDiv);
+  BINARY_EXPR_CASE(URem);
+  BINARY_EXPR_CASE(SRem);
+  BINARY_EXPR_CASE(And);
+  BINARY_EXPR_CASE(Or);
+  BINARY_EXPR_CASE(Xor);
+  BINARY_EXPR_CASE(Shl);
+  BINARY_EXPR_CASE(LShr);
+  BINARY_EXPR_CASE(AShr);
+  BINARY_EXPR_CASE(Eq);
+  BINARY_EXPR_CASE(Ne);
+  BINARY_EXPR_CASE(Ult);
+  BINARY_EXPR_CASE(Ule);
+  BINARY_EXPR_CASE(Ugt);
+  BINARY_EXPR_CASE(Uge);
+  BINARY_EXPR_CASE(Slt);
+  BINARY_EXPR_CASE(Sle);
+  BINARY_EXPR_CASE(Sgt);
+  BINARY_EXPR_CASE(Sge);
+
+#undef BINARY_EXPR_CASE
+
+  default:
+    return false;
+  }
+  exprs.push_back(e);
+  return !in.error();
+}
+
+bool ExprDecoder::decodeRecords() {
+  for (;;) {
+    bool ok;
+    switch (in.read8()) {
+    case ArrayRecord: ok = decodeArray(); break;
+    case UpdateRecord: ok = decodeUpdate(); break;
+    case ExprRecord: ok = decodeExpr(); break;
+    case EndRecord: return !in.error();
+    default: ok = false; break;
+    }
+    if (!ok || in.error()) {
+      in.setError();
+      return false;
+    }
+  }
+}
@@ -0,0 +1,16 @@
+//===-- ExprStats.cpp -----------------------------------------------------===//
+//
+//                     The KLEE Symbolic Virtual Machine
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "ExprStats.h"
+
+using namespace klee;
+
+Statistic stats::exprCacheHits("ExprCacheHits", "EChits");
+Statistic stats::exprCacheMisses("ExprCacheMisses", "ECmisses");
+Statistic stats::exprCacheSavedBytes("ExprCacheSavedBytes", "ECsaved");
@@ -0,0 +1,31 @@
+//===-- ExprStats.h ---------------------------------------------*- C++ -*-===//
+//
+//                     The KLEE Symbolic Virtual Machine
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef KLEE_EXPRSTATS_H
+#define KLEE_EXPRSTATS_H
+
+#include "klee/Statistic.h"
+
+namespace klee {
+namespace stats {
+
+  /// The number of allocated expressions replaced by an existing, equal
+  /// one when hash-consing is enabled.
+  extern Statistic exprCacheHits;
+
+  /// The number of allocated expressions added to the unique table.
+  extern Statistic exprCacheMisses;
+
+  /// The bytes of duplicate expressions freed by hash-consing.
+  extern Statistic exprCacheSavedBytes;
+
+}
+}
+
+#endif
@@ -27,7 +27,7 @@ UpdateNode::UpdateNode(const UpdateNode *_next,
          "Update value should be 8-bit wide.");
   computeHash();
   if (next) {
-    ++next->refCount;
+    RefCountPolicy::inc(&next->refCount);
     size = 1 + next->size;
   }
   else size = 1;
@@ -59,20 +59,27 @@ unsigned UpdateNode::computeHash() {
 UpdateList::UpdateList(const Array *_root, const UpdateNode *_head)
   : root(_root),
     head(_head) {
-  if (head) ++head->refCount;
+  if (head) RefCountPolicy::inc(&head->refCount);
 }
 
 UpdateList::UpdateList(const UpdateList &b)
   : root(b.root),
     head(b.head) {
-  if (head) ++head->refCount;
+  if (head) RefCountPolicy::inc(&head->refCount);
 }
 
 UpdateList::~UpdateList() {
   // We need to be careful and avoid recursion here. We do this in
   // cooperation with the private dtor of UpdateNode which does not
   // recursively free its tail.
-  while (head && --head->refCount==0) {
+  release(head);
+}
+
+/// Drop a reference to \a head, and free the nodes that were only
+/// reachable through it. The lists may be shared with other threads (e.g.,
+/// the test case emission threads), so the counts follow RefCountPolicy.
+void UpdateList::release(const UpdateNode *head) {
+  while (head && RefCountPolicy::dec(&head->refCount)) {
     const UpdateNode *n = head->next;
     delete head;
     head = n;
@@ -80,17 +87,19 @@ UpdateList::~UpdateList() {
 }
 
 UpdateList &UpdateList::operator=(const UpdateList &b) {
-  if (b.head) ++b.head->refCount;
-  if (head && --head->refCount==0) delete head;
+  if (b.head) RefCountPolicy::inc(&b.head->refCount);
+  release(head);
   root = b.root;
   head = b.head;
   return *this;
 }
 
 void UpdateList::extend(const ref<Expr> &index, const ref<Expr> &value) {
-  if (head) --head->refCount;
-  head = new UpdateNode(head, index, value);
-  ++head->refCount;
+  // The new node takes over the reference to the old head
+  const UpdateNode *next = head;
+  head = new UpdateNode(next, index, value);
+  RefCountPolicy::inc(&head->refCount);
+  if (next) RefCountPolicy::dec(&next->refCount);
 }
 
 int UpdateList::compare(const UpdateList &b) const {
@@ -128,11 +128,34 @@ bool InstructionInfoTable::ltfunc::operator()(const Function *f1,
   return f1->getNameStr() < f2->getNameStr();
 }
 
-InstructionInfoTable::InstructionInfoTable(Module *m) 
+InstructionInfoTable::InstructionInfoTable(Module *m,
+                                 const std::vector<unsigned> *assemblyLines)
   : dummyString(""), dummyInfo(0, dummyString, 0, 0) {
   unsigned id = 0;
   std::map<const Instruction*, unsigned> lineTable;
-  buildInstructionToLineMap(m, lineTable);
+  if (assemblyLines) {
+    std::vector<unsigned>::const_iterator lit = assemblyLines->begin(),
+      lie = assemblyLines->end();
+    bool matches = true;
+    for (Module::iterator fnIt = m->begin(), fn_ie = m->end();
+         fnIt != fn_ie && matches; ++fnIt) {
+      for (inst_iterator it = inst_begin(fnIt), ie = inst_end(fnIt);
+           it != ie; ++it, ++lit) {
+        if (lit == lie) {
+          matches = false;
+          break;
+        }
+        lineTable.insert(std::make_pair(&*it, *lit));
+      }
+    }
+    // The lines do not belong to this module
+    if (!matches || lit != lie) {
+      lineTable.clear();
+      assemblyLines = 0;
+    }
+  }
+  if (!assemblyLines)
+    buildInstructionToLineMap(m, lineTable);
 
   // Sort the list of functions, in order to get consistent IDs
   std::vector<Function*> functions;
@@ -207,6 +230,22 @@ InstructionInfoTable::InstructionInfoTable(Module *m)
       } while (!worklist.empty());
     }
   }
+
+  infosByID.resize(id, &dummyInfo);
+  for (std::map<const Instruction*, InstructionInfo>::const_iterator
+         it = infos.begin(), ie = infos.end(); it != ie; ++it)
+    infosByID[it->second.id] = &it->second;
+}
+
+void InstructionInfoTable::getAssemblyLines(Module *m,
+                                            std::vector<unsigned> &lines) const {
+  lines.clear();
+  for (Module::iterator fnIt = m->begin(), fn_ie = m->end();
+       fnIt != fn_ie; ++fnIt) {
+    for (inst_iterator it = inst_begin(fnIt), ie = inst_end(fnIt);
+         it != ie; ++it)
+      lines.push_back(getInfo(&*it).assemblyLine);
+  }
 }
 
 InstructionInfoTable::~InstructionInfoTable() {
@@ -227,6 +266,11 @@ const std::string *InstructionInfoTable::internString(std::string s) {
   }
 }
 
+const InstructionInfo &
+InstructionInfoTable::getInfoByID(unsigned id) const {
+  return id < infosByID.size() ? *infosByID[id] : dummyInfo;
+}
+
 unsigned InstructionInfoTable::getMaxID() const {
   return infos.size();
 }
@@ -12,6 +12,7 @@
 
 #include "klee/Internal/Module/KModule.h"
 
+#include "ModuleCache.h"
 #include "Passes.h"
 
 #include "klee/Interpreter.h"
@@ -45,6 +46,7 @@
 #include "llvm/Transforms/IPO.h"
 #include "llvm/Analysis/Verifier.h"
 #include "llvm/ADT/APInt.h"
+#include "llvm/ADT/DenseMap.h"
 
 #include <sstream>
 #include <fstream>
@@ -122,6 +124,11 @@ namespace {
   ForceInline("force-inline",
       cl::desc("Enable inlining, even if other optimizations are disabled"),
       cl::init(true));
+
+  cl::opt<std::string>
+  ModuleCacheDir("module-cache-dir",
+      cl::desc("Cache the prepared modules in this directory, for the next runs "
+               "on the same program (default=off)"));
 }
 
 void KModule::readVulnerablePoints(std::istream &is) {
@@ -282,6 +289,7 @@ KModule::~KModule() {
 
 namespace llvm {
 extern void Optimize(Module*);
+extern std::string getOptimizeOptions();
 }
 
 // what a hack
@@ -372,8 +380,24 @@ static void forceImport(Module *m, const char *name, const Type *retType, ...) {
   }
 }
 
-void KModule::prepare(const Interpreter::ModuleOptions &opts,
-                      InterpreterHandler *ih, bool requireMergeAnalysis) {
+/// Describe the options that change what transform() does to a module.
+static std::string getPrepareOptions(const Interpreter::ModuleOptions &opts) {
+  std::ostringstream result;
+  result << "check-div-zero=" << opts.CheckDivZero
+         << " optimize=" << opts.Optimize;
+  if (opts.Optimize)
+    result << getOptimizeOptions();
+  result << " switch-type=" << (int) SwitchType
+         << " force-inline=" << (bool) ForceInline
+         << " enable-exec-index=" << (bool) EnableExecIndex
+         << " enable-qce=" << (bool) EnableQCE;
+  for (cl::list<std::string>::iterator it = MergeAtExit.begin(),
+         ie = MergeAtExit.end(); it != ie; ++it)
+    result << " merge-at-exit=" << *it;
+  return result.str();
+}
+
+void KModule::transform(const Interpreter::ModuleOptions &opts) {
   if (!MergeAtExit.empty()) {
     Function *mergeFn = module->getFunction("klee_merge");
     if (!mergeFn) {
@@ -421,27 +445,6 @@ void KModule::prepare(const Interpreter::ModuleOptions &opts,
     }
   }
 
-  if (VulnerableSites != "") {
-    std::ifstream fs(VulnerableSites.c_str());
-    assert(!fs.fail());
-
-    readVulnerablePoints(fs);
-  }
-
-  if (CoverableModules != "") {
-    std::ifstream fs(CoverableModules.c_str());
-    assert(!fs.fail());
-
-    readCoverableFiles(fs);
-  }
-
-  if (InitialCoverage != "") {
-    std::ifstream fs(InitialCoverage.c_str());
-    assert(!fs.fail());
-
-    readInitialCoverage(fs);
-  }
-
   // Inject checks prior to optimization... we also perform the
   // invariant transformations that we will end up doing later so that
   // optimize is seeing what is as close as possible to the final
@@ -568,7 +571,132 @@ void KModule::prepare(const Interpreter::ModuleOptions &opts,
     pm4.run(*module);
   }
 #endif
+}
+
+void KModule::prepare(const Interpreter::ModuleOptions &opts,
+                      bool requireMergeAnalysis) {
+  if (VulnerableSites != "") {
+    std::ifstream fs(VulnerableSites.c_str());
+    assert(!fs.fail());
+
+    readVulnerablePoints(fs);
+  }
+
+  if (CoverableModules != "") {
+    std::ifstream fs(CoverableModules.c_str());
+    assert(!fs.fail());
+
+    readCoverableFiles(fs);
+  }
+
+  if (InitialCoverage != "") {
+    std::ifstream fs(InitialCoverage.c_str());
+    assert(!fs.fail());
+
+    readInitialCoverage(fs);
+  }
+
+  // Reuse the module prepared by an earlier run on the same input and
+  // options, if there is one
+  ModuleCache *cache = 0;
+  std::string cacheKey;
+  std::vector<unsigned> assemblyLines;
+  Module *cached = 0;
+  if (ModuleCacheDir != "") {
+    cache = new ModuleCache(ModuleCacheDir);
+    llvm::sys::Path path(opts.LibraryDir);
+    path.appendComponent("libkleeRuntimeIntrinsic.bca");
+    cacheKey = cache->getKey(module, getPrepareOptions(opts),
+                             std::vector<std::string>(1, path.str()));
+    cached = cache->load(cacheKey, assemblyLines);
+  }
+
+  if (cached) {
+    klee_message("using cached module %s", cacheKey.c_str());
+    delete module;
+    module = cached;
+  } else {
+    transform(opts);
+  }
+
+  dbgStopPointFn = module->getFunction("llvm.dbg.stoppoint");
+  kleeMergeFn = module->getFunction("klee_merge");
+
+  /* Build shadow structures */
+
+  infos = new InstructionInfoTable(module, cached ? &assemblyLines : 0);
+
+  if (cache) {
+    if (!cached) {
+      infos->getAssemblyLines(module, assemblyLines);
+      cache->store(cacheKey, module, assemblyLines);
+    }
+    delete cache;
+  }
+
+  std::map<std::string, Function*> fnList;
+  
+  for (Module::iterator it = module->begin(), ie = module->end();
+         it != ie; ++it) {
+    if (it->isDeclaration())
+      continue;
+
+    fnList[it->getNameStr()] = it;
+  }
+
+  for (std::map<std::string, Function*>::iterator it = fnList.begin();
+      it != fnList.end(); it++) {
+    Function *fn = it->second;
+    
+    KFunction *kf = new KFunction(fn, this);
+
+    for (unsigned i=0; i<kf->numInstructions; ++i) {
+      KInstruction *ki = kf->instructions[i];
+      ki->info = &infos->getInfo(ki->inst);
+
+      if (ki->inst->getOpcode() == Instruction::Call) {
+        KCallInstruction* kCallI = dyn_cast<KCallInstruction>(ki);
+        kCallI->vulnerable = isVulnerablePoint(ki);
+      }
+
+      Path sourceFile(ki->info->file);
+#if (LLVM_VERSION_MAJOR == 2 && LLVM_VERSION_MINOR < 7)
+      program_point_t pPoint = std::make_pair(sourceFile.getLast(),
+          ki->info->line);
+#else
+      program_point_t pPoint = std::make_pair(llvm::sys::path::filename(StringRef(sourceFile.str())),
+          ki->info->line);
+#endif
 
+      ki->originallyCovered = coveredLines.count(pPoint) > 0;
+    }
+
+    kf->trackCoverage = isFunctionCoverable(kf);
+
+    functions.push_back(kf);
+    functionMap.insert(std::make_pair(fn, kf));
+  }
+
+  /* Compute various interesting properties */
+
+  for (std::vector<KFunction*>::iterator it = functions.begin(), 
+         ie = functions.end(); it != ie; ++it) {
+    KFunction *kf = *it;
+    if (functionEscapes(kf->function))
+      escapingFunctions.insert(kf->function);
+  }
+
+  if (DebugPrintEscapingFunctions && !escapingFunctions.empty()) {
+    llvm::errs() << "KLEE: escaping functions: [";
+    for (std::set<Function*>::iterator it = escapingFunctions.begin(), 
+         ie = escapingFunctions.end(); it != ie; ++it) {
+      llvm::errs() << (*it)->getName() << ", ";
+    }
+    llvm::errs() << "]\n";
+  }
+}
+
+void KModule::writeOutputs(InterpreterHandler *ih) {
   // Write out the .ll assembly file. We truncate long lines to work
   // around a kcachegrind parsing bug (it puts them on new lines), so
   // that source browsing works.
@@ -653,74 +781,6 @@ void KModule::prepare(const Interpreter::ModuleOptions &opts,
     delete rfs;
     delete f;
   }
-
-  dbgStopPointFn = module->getFunction("llvm.dbg.stoppoint");
-  kleeMergeFn = module->getFunction("klee_merge");
-
-  /* Build shadow structures */
-
-  infos = new InstructionInfoTable(module);
-
-  std::map<std::string, Function*> fnList;
-  
-  for (Module::iterator it = module->begin(), ie = module->end();
-         it != ie; ++it) {
-    if (it->isDeclaration())
-      continue;
-
-    fnList[it->getNameStr()] = it;
-  }
-
-  for (std::map<std::string, Function*>::iterator it = fnList.begin();
-      it != fnList.end(); it++) {
-    Function *fn = it->second;
-    
-    KFunction *kf = new KFunction(fn, this);
-
-    for (unsigned i=0; i<kf->numInstructions; ++i) {
-      KInstruction *ki = kf->instructions[i];
-      ki->info = &infos->getInfo(ki->inst);
-
-      if (ki->inst->getOpcode() == Instruction::Call) {
-        KCallInstruction* kCallI = dyn_cast<KCallInstruction>(ki);
-        kCallI->vulnerable = isVulnerablePoint(ki);
-      }
-
-      Path sourceFile(ki->info->file);
-#if (LLVM_VERSION_MAJOR == 2 && LLVM_VERSION_MINOR < 7)
-      program_point_t pPoint = std::make_pair(sourceFile.getLast(),
-          ki->info->line);
-#else
-      program_point_t pPoint = std::make_pair(llvm::sys::path::filename(StringRef(sourceFile.str())),
-          ki->info->line);
-#endif
-
-      ki->originallyCovered = coveredLines.count(pPoint) > 0;
-    }
-
-    kf->trackCoverage = isFunctionCoverable(kf);
-
-    functions.push_back(kf);
-    functionMap.insert(std::make_pair(fn, kf));
-  }
-
-  /* Compute various interesting properties */
-
-  for (std::vector<KFunction*>::iterator it = functions.begin(), 
-         ie = functions.end(); it != ie; ++it) {
-    KFunction *kf = *it;
-    if (functionEscapes(kf->function))
-      escapingFunctions.insert(kf->function);
-  }
-
-  if (DebugPrintEscapingFunctions && !escapingFunctions.empty()) {
-    llvm::errs() << "KLEE: escaping functions: [";
-    for (std::set<Function*>::iterator it = escapingFunctions.begin(), 
-         ie = escapingFunctions.end(); it != ie; ++it) {
-      llvm::errs() << (*it)->getName() << ", ";
-    }
-    llvm::errs() << "]\n";
-  }
 }
 
 KConstant* KModule::getKConstant(Constant *c) {
@@ -770,6 +830,32 @@ static int getOperandNum(Value *v,
   }
 }
 
+/// Link \a info to the annotation \a prev of the previous annotated
+/// instruction of its basic block, and collect the items a frame updated
+/// at prev has to look at again.
+static void computeQceDelta(KQCEInfo *info, KQCEInfo *prev) {
+  info->prev = prev;
+  info->changed.clear();
+
+  if (!prev || prev->total != info->total) {
+    // The threshold moves with the total, every item may cross it
+    for (unsigned i = 0; i < info->vars.size(); ++i)
+      info->changed.push_back(&info->vars[i]);
+    return;
+  }
+
+  DenseMap<HotValue, double> prevQce;
+  for (unsigned i = 0; i < prev->vars.size(); ++i)
+    prevQce[prev->vars[i].hotValue] = prev->vars[i].qce;
+
+  for (unsigned i = 0; i < info->vars.size(); ++i) {
+    KQCEInfoItem &item = info->vars[i];
+    DenseMap<HotValue, double>::iterator it = prevQce.find(item.hotValue);
+    if (it == prevQce.end() || it->second != item.qce)
+      info->changed.push_back(&item);
+  }
+}
+
 KFunction::KFunction(llvm::Function *_function,
                      KModule *km) 
   : function(_function),
@@ -803,6 +889,7 @@ KFunction::KFunction(llvm::Function *_function,
   unsigned i = 0;
   for (llvm::Function::iterator bbit = function->begin(), 
          bbie = function->end(); bbit != bbie; ++bbit) {
+    KQCEInfo *prevQceInfo = 0;
     for (llvm::BasicBlock::iterator it = bbit->begin(), ie = bbit->end();
          it != ie; ++it) {
       KInstruction *ki;
@@ -907,6 +994,8 @@ KFunction::KFunction(llvm::Function *_function,
           item.vnumber =
             getOperandNum(item.hotValue.getValue(), registerMap, km, ki);
         }
+        computeQceDelta(ki->qceInfo, prevQceInfo);
+        prevQceInfo = ki->qceInfo;
       } else {
         ki->qceInfo = 0;
       }
@@ -0,0 +1,184 @@
+//===-- ModuleCache.cpp ---------------------------------------------------===//
+//
+//                     The KLEE Symbolic Virtual Machine
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "ModuleCache.h"
+
+#include "../Core/Common.h"
+
+#include "llvm/LLVMContext.h"
+#include "llvm/Module.h"
+#include "llvm/ADT/OwningPtr.h"
+#include "llvm/Bitcode/ReaderWriter.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/system_error.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+using namespace llvm;
+using namespace klee;
+
+// Bump when the preparation passes change, so that older entries are no
+// longer used
+#define MODULE_CACHE_VERSION 1
+
+#define ASSEMBLY_LINES_MAGIC 0x4b4c4e31
+
+namespace {
+  /// 64-bit FNV-1a.
+  class Hasher {
+    uint64_t hash;
+
+  public:
+    Hasher() : hash(14695981039346656037ULL) {}
+
+    void update(const char *data, size_t size) {
+      for (size_t i = 0; i < size; ++i) {
+        hash ^= (unsigned char) data[i];
+        hash *= 1099511628211ULL;
+      }
+    }
+    void update(const std::string &s) {
+      update(s.data(), s.size());
+      // Keep the boundaries of consecutive strings in the hash
+      uint64_t size = s.size();
+      update((const char*) &size, sizeof(size));
+    }
+
+    uint64_t get() const { return hash; }
+  };
+}
+
+ModuleCache::ModuleCache(const std::string &_dir) : dir(_dir) {
+  if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST)
+    klee_warning("unable to create module cache %s: %s", dir.c_str(),
+                 strerror(errno));
+}
+
+std::string ModuleCache::getPath(const std::string &key,
+                                 const char *suffix) const {
+  return dir + "/" + key + suffix;
+}
+
+std::string ModuleCache::getKey(Module *m, const std::string &options,
+                                const std::vector<std::string> &files) const {
+  std::string bitcode;
+  raw_string_ostream os(bitcode);
+  WriteBitcodeToFile(m, os);
+  os.flush();
+
+  Hasher hasher;
+  hasher.update(bitcode);
+  hasher.update(options);
+  for (std::vector<std::string>::const_iterator it = files.begin(),
+         ie = files.end(); it != ie; ++it) {
+    std::ifstream f(it->c_str(), std::ios::in | std::ios::binary);
+    std::ostringstream contents;
+    contents << f.rdbuf();
+    hasher.update(*it);
+    hasher.update(contents.str());
+  }
+
+  char key[64];
+  snprintf(key, sizeof(key), "v%d-%016llx-%llu", MODULE_CACHE_VERSION,
+           (unsigned long long) hasher.get(),
+           (unsigned long long) bitcode.size());
+  return key;
+}
+
+Module *ModuleCache::load(const std::string &key,
+                          std::vector<unsigned> &assemblyLines) const {
+  // The module is stored last, so once it is there the lines are complete
+  OwningPtr<MemoryBuffer> buffer;
+  if (MemoryBuffer::getFile(getPath(key, ".bc").c_str(), buffer))
+    return 0;
+
+  std::ifstream lines(getPath(key, ".lines").c_str(),
+                      std::ios::in | std::ios::binary);
+  uint32_t magic = 0, count = 0;
+  lines.read((char*) &magic, sizeof(magic));
+  lines.read((char*) &count, sizeof(count));
+  if (!lines.good() || magic != ASSEMBLY_LINES_MAGIC)
+    return 0;
+  assemblyLines.resize(count);
+  if (count)
+    lines.read((char*) &assemblyLines[0], count * sizeof(unsigned));
+  if (!lines.good())
+    return 0;
+
+  std::string error;
+  Module *m = ParseBitcodeFile(buffer.get(), getGlobalContext(), &error);
+  if (!m) {
+    klee_warning("ignoring corrupted module cache entry %s: %s", key.c_str(),
+                 error.c_str());
+    return 0;
+  }
+
+  return m;
+}
+
+void ModuleCache::store(const std::string &key, Module *m,
+                        const std::vector<unsigned> &assemblyLines) const {
+  // Concurrent runs may store the same entry, write to private files and
+  // rename them in place. The module goes last, as it is what load() checks
+  // for first.
+  std::ostringstream suffix;
+  suffix << ".tmp" << getpid();
+  std::string bcPath = getPath(key, ".bc");
+  std::string linesPath = getPath(key, ".lines");
+  std::string bcTmpPath = bcPath + suffix.str();
+  std::string linesTmpPath = linesPath + suffix.str();
+
+  {
+    std::ofstream lines(linesTmpPath.c_str(),
+                        std::ios::out | std::ios::trunc | std::ios::binary);
+    uint32_t magic = ASSEMBLY_LINES_MAGIC, count = assemblyLines.size();
+    lines.write((const char*) &magic, sizeof(magic));
+    lines.write((const char*) &count, sizeof(count));
+    if (count)
+      lines.write((const char*) &assemblyLines[0], count * sizeof(unsigned));
+    if (!lines.good()) {
+      klee_warning("unable to write module cache entry %s", key.c_str());
+      unlink(linesTmpPath.c_str());
+      return;
+    }
+  }
+
+  {
+    std::string error;
+    raw_fd_ostream bc(bcTmpPath.c_str(), error, raw_fd_ostream::F_Binary);
+    if (error.empty()) {
+      WriteBitcodeToFile(m, bc);
+      bc.close();
+    }
+    if (!error.empty() || bc.has_error()) {
+      klee_warning("unable to write module cache entry %s", key.c_str());
+      bc.clear_error();
+      unlink(bcTmpPath.c_str());
+      unlink(linesTmpPath.c_str());
+      return;
+    }
+  }
+
+  if (rename(linesTmpPath.c_str(), linesPath.c_str()) != 0 ||
+      rename(bcTmpPath.c_str(), bcPath.c_str()) != 0) {
+    klee_warning("unable to store module cache entry %s: %s", key.c_str(),
+                 strerror(errno));
+    unlink(bcTmpPath.c_str());
+    unlink(linesTmpPath.c_str());
+  }
+}
@@ -0,0 +1,53 @@
+//===-- ModuleCache.h -------------------------------------------*- C++ -*-===//
+//
+//                     The KLEE Symbolic Virtual Machine
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef KLEE_MODULECACHE_H
+#define KLEE_MODULECACHE_H
+
+#include <string>
+#include <vector>
+
+namespace llvm {
+  class Module;
+}
+
+namespace klee {
+  /// An on-disk cache of prepared modules, so that runs on the same program
+  /// with the same options skip the preparation passes. An entry is keyed by
+  /// a hash of the input module bitcode, of the options that affect the
+  /// preparation and of the files it links in. It holds the prepared module
+  /// bitcode and the assembly line of each instruction, which is otherwise
+  /// computed by printing the whole module.
+  class ModuleCache {
+    std::string dir;
+
+    std::string getPath(const std::string &key, const char *suffix) const;
+
+  public:
+    explicit ModuleCache(const std::string &_dir);
+
+    /// Compute the key of module \a m prepared with \a options, linking in
+    /// \a files.
+    std::string getKey(llvm::Module *m, const std::string &options,
+                       const std::vector<std::string> &files) const;
+
+    /// Load the module of entry \a key, or return null if there is none.
+    /// The assembly lines of its instructions are stored in \a
+    /// assemblyLines, in module order.
+    llvm::Module *load(const std::string &key,
+                       std::vector<unsigned> &assemblyLines) const;
+
+    /// Store module \a m as entry \a key. Failures are only warned about,
+    /// the next run prepares the module again.
+    void store(const std::string &key, llvm::Module *m,
+               const std::vector<unsigned> &assemblyLines) const;
+  };
+}
+
+#endif
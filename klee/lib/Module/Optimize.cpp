@@ -33,6 +33,7 @@
 #include "llvm/Support/PassNameParser.h"
 #include "llvm/Support/PluginLoader.h"
 #include <iostream>
+#include <string>
 using namespace llvm;
 
 #if 0
@@ -281,4 +282,16 @@ void Optimize(Module* M) {
   Passes.run(*M);
 }
 
+/// getOptimizeOptions - Describe the options that change what Optimize does
+/// to a module.
+std::string getOptimizeOptions() {
+  std::string result;
+  if (DisableInline) result += " -disable-inlining";
+  if (DisableOptimizations) result += " -disable-opt";
+  if (DisableInternalize) result += " -disable-internalize";
+  if (Strip) result += " -strip-all";
+  if (StripDebug) result += " -strip-debug";
+  return result;
+}
+
 }
@@ -17,12 +17,14 @@
 #include "llvm/Module.h"
 #include "llvm/Pass.h"
 #include "llvm/CallGraphSCCPass.h"
+#include "llvm/ADT/DenseMap.h"
 #include "llvm/Analysis/LoopPass.h"
 #include "llvm/CodeGen/IntrinsicLowering.h"
 
 namespace llvm {
   class Function;
   class Instruction;
+  class MDNode;
   class Module;
   class TargetData;
   class TargetLowering;
@@ -207,13 +209,42 @@ public:
   virtual bool runOnLoop(llvm::Loop *L, llvm::LPPassManager &LPM);
 };
 
-class QCEAnalyzerPass : public llvm::FunctionPass {
+/// The QCE summary of each function: the annotation of its entry, which
+/// gives the query count estimates of the function arguments and of the
+/// globals it uses.
+typedef llvm::DenseMap<const llvm::Function*, const llvm::MDNode*>
+          QCESummaryMap;
+
+/// QCEAnalyzerPass - Annotates the instructions of each function with query
+/// count estimates (QCE). Functions are analyzed bottom-up on the call
+/// graph, so that call sites can use the summaries of their callees.
+///
+/// The analyzed functions are listed in the klee.qce module metadata. When
+/// a module is loaded back with its annotations, they are not analyzed
+/// again.
+class QCEAnalyzerPass : public llvm::ModulePass {
   llvm::TargetData *m_targetData;
 
 public:
   static char ID;
   QCEAnalyzerPass(llvm::TargetData *TD = 0);
 
+  virtual void getAnalysisUsage(llvm::AnalysisUsage &Info) const;
+  bool runOnModule(llvm::Module &M);
+};
+
+/// QCEFunctionAnalyzerPass - The per-function part of QCEAnalyzerPass. It
+/// expects the entry block to have been split off already, and the
+/// functions it calls to have their summaries in \a summaries.
+class QCEFunctionAnalyzerPass : public llvm::FunctionPass {
+  llvm::TargetData *m_targetData;
+  const QCESummaryMap *m_summaries;
+
+public:
+  static char ID;
+  QCEFunctionAnalyzerPass(llvm::TargetData *TD = 0,
+                          const QCESummaryMap *summaries = 0);
+
   virtual void getAnalysisUsage(llvm::AnalysisUsage &Info) const;
   bool runOnFunction(llvm::Function &F);
 };
@@ -1,8 +1,12 @@
 #include "Passes.h"
 
 #include "llvm/Module.h"
+#include "llvm/PassManager.h"
+#include "llvm/Analysis/CallGraph.h"
 #include "llvm/Analysis/LoopInfo.h"
 #include "llvm/Analysis/Dominators.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
 #include "llvm/Transforms/Scalar.h"
 #include "llvm/Target/TargetData.h"
 #include "llvm/ADT/DenseSet.h"
@@ -11,6 +15,7 @@
 #include "llvm/ADT/ImmutableMap.h"
 #include "llvm/ADT/PostOrderIterator.h"
 #include "llvm/ADT/PointerIntPair.h"
+#include "llvm/ADT/SCCIterator.h"
 #include "llvm/Support/DataFlow.h"
 #include "llvm/Support/CFG.h"
 #include "llvm/Support/CommandLine.h"
@@ -35,8 +40,13 @@
 #define QC_SUM_MULT_NOM    2
 #define QC_SUM_MULT_DENOM  3
 
+// Bump when the annotations change, so that modules annotated by an older
+// analysis are analyzed again
+#define QCE_SUMMARY_VERSION 1
+
 namespace llvm {
   void initializeQCEAnalyzerPassPass(PassRegistry&);
+  void initializeQCEFunctionAnalyzerPassPass(PassRegistry&);
 }
 
 using namespace llvm;
@@ -52,10 +62,16 @@ typedef DenseMap<HotValue, SmallVector<HotValue, 4> > HotValueArgMap;
 static const APInt apZero(QCE_BWIDTH, 0);
 
 QCEAnalyzerPass::QCEAnalyzerPass(TargetData *TD)
-      : FunctionPass(ID), m_targetData(TD) {
+      : ModulePass(ID), m_targetData(TD) {
   initializeQCEAnalyzerPassPass(*PassRegistry::getPassRegistry());
 }
 
+QCEFunctionAnalyzerPass::QCEFunctionAnalyzerPass(TargetData *TD,
+                                                 const QCESummaryMap *summaries)
+      : FunctionPass(ID), m_targetData(TD), m_summaries(summaries) {
+  initializeQCEFunctionAnalyzerPassPass(*PassRegistry::getPassRegistry());
+}
+
 static bool isIgnored(const Value *hotValueDep) {
   if (const ConstantExpr *C = dyn_cast<ConstantExpr>(hotValueDep)) {
     if (C->getOpcode() == Instruction::BitCast) {
@@ -213,7 +229,8 @@ static void gatherCallSiteDeps(const CallSite CS,
                                APInt *totalUses, HotValueDeps *deps,
                                HotValueArgMap *argMap,
                                const VisitedBBs &visitedBBs,
-                               TargetData *TD) {
+                               TargetData *TD,
+                               const QCESummaryMap &summaries) {
   const Function *F = CS.getCalledFunction();
   if (!F) {
     const ConstantExpr *CE = dyn_cast<ConstantExpr>(CS.getCalledValue());
@@ -227,11 +244,12 @@ static void gatherCallSiteDeps(const CallSite CS,
   if (F->isDeclaration())
     return;
 
-  const MDNode *MD = F->getEntryBlock().begin()->getMetadata("qce");
-  if (!MD)
-    return; // XXX
+  QCESummaryMap::const_iterator summaryIt = summaries.find(F);
+  if (summaryIt == summaries.end())
+    return; // XXX: a recursive call, the callee is not summarized yet
 
-  assert(MD && MD->getNumOperands() > 0);
+  const MDNode *MD = summaryIt->second;
+  assert(MD->getNumOperands() > 0);
 
   *totalUses = cast<ConstantInt>(MD->getOperand(0))->getValue();
 
@@ -324,21 +342,34 @@ static void addAnnotationAM(Instruction *I, const HotValueArgMap &argMap,
   I->setMetadata(mdName, MDNode::get(Ctx, Args));
 }
 
+/// Estimate how many times the body of \a L runs per entry into the loop.
+static unsigned estimateTripCount(const Loop *L, ScalarEvolution &SE) {
+  if (unsigned tripCount = L->getSmallConstantTripCount())
+    return tripCount;
+
+  // The trip count may be symbolic but still bounded, e.g., by the range of
+  // a narrow induction variable or by a constant guard on the exit
+  const SCEV *maxBackedgeCount = SE.getMaxBackedgeTakenCount(L);
+  if (const SCEVConstant *C = dyn_cast<SCEVConstant>(maxBackedgeCount)) {
+    const APInt &max = C->getValue()->getValue();
+    if (max.ult(DEFAULT_LOOP_TRIP_COUNT))
+      return max.getZExtValue() + 1;
+  }
+
+  return DEFAULT_LOOP_TRIP_COUNT;
+}
+
 /* Compute query count information for a function described by CGNode,
    annotate the function accordingly. */
-bool QCEAnalyzerPass::runOnFunction(Function &F) {
+bool QCEFunctionAnalyzerPass::runOnFunction(Function &F) {
   if (F.isDeclaration()) {
     return false;
   }
   BasicBlock *entryBB = &F.getEntryBlock();
 
-  // Split entryBB to have an empty entry block (so that it would contain
-  // only function-level annotations)
-#warning Does this work correctly with LoopInfo and DominatorTree ?
-  entryBB->splitBasicBlock(entryBB->begin());
-
   LoopInfo &loopInfo = getAnalysis<LoopInfo>();
   DominatorTree &DT = getAnalysis<DominatorTree>();
+  ScalarEvolution &SE = getAnalysis<ScalarEvolution>();
 
   // Use count after BB for all hot values
   //UseCountInfo::Factory useCountInfoFactory;
@@ -377,10 +408,7 @@ bool QCEAnalyzerPass::runOnFunction(Function &F) {
     const Loop *topLevelLoop = 0;
     const Loop *bbLoop = loopInfo.getLoopFor(BB);
     for (const Loop *L = bbLoop; L; topLevelLoop = L, L = L->getParentLoop()) {
-      unsigned tripCount = L->getSmallConstantTripCount();
-      if (!tripCount)
-        tripCount = DEFAULT_LOOP_TRIP_COUNT;
-      bbExecCount *= APInt(QCE_BWIDTH, tripCount);
+      bbExecCount *= APInt(QCE_BWIDTH, estimateTripCount(L, SE));
     }
 
     // Initially set useCountInfo for the current BB to be a maximum of
@@ -545,7 +573,7 @@ bool QCEAnalyzerPass::runOnFunction(Function &F) {
       if (CallSite CS = CallSite(I)) {
         HotValueArgMap argMap;
         gatherCallSiteDeps(CS, &instTotalUseCount, &hotValueDeps, &argMap,
-                           visitedBBs, m_targetData);
+                           visitedBBs, m_targetData, *m_summaries);
         if (!argMap.empty())
           addAnnotationAM(I, argMap);
       } else {
@@ -744,20 +772,123 @@ bool QCEAnalyzerPass::runOnFunction(Function &F) {
   return true;
 }
 
-void QCEAnalyzerPass::getAnalysisUsage(AnalysisUsage &Info) const {
-  Info.addRequired<CallGraph>();
+void QCEFunctionAnalyzerPass::getAnalysisUsage(AnalysisUsage &Info) const {
   Info.addRequired<DominatorTree>();
   Info.addRequired<LoopInfo>();
-  Info.addPreserved<CallGraph>();
+  Info.addRequired<ScalarEvolution>();
   Info.setPreservesCFG();
 }
 
+/// Drop the annotations of an older analysis from \a F.
+static void stripAnnotations(Function &F) {
+  for (Function::iterator bbIt = F.begin(), bbE = F.end();
+       bbIt != bbE; ++bbIt) {
+    for (BasicBlock::iterator it = bbIt->begin(), ie = bbIt->end();
+         it != ie; ++it) {
+      it->setMetadata("qce", NULL);
+      it->setMetadata("qce_am", NULL);
+    }
+  }
+}
+
+bool QCEAnalyzerPass::runOnModule(Module &M) {
+  LLVMContext &Ctx = M.getContext();
+  const Type *versionTy = Type::getInt32Ty(Ctx);
+
+  // Collect the summaries the module already has
+  QCESummaryMap summaries;
+  NamedMDNode *analyzedMD = M.getOrInsertNamedMetadata("klee.qce");
+  for (unsigned i = 0, e = analyzedMD->getNumOperands(); i != e; ++i) {
+    MDNode *N = analyzedMD->getOperand(i);
+    if (N->getNumOperands() != 2)
+      continue;
+    ConstantInt *version = dyn_cast_or_null<ConstantInt>(N->getOperand(0));
+    Function *F = dyn_cast_or_null<Function>(N->getOperand(1));
+    if (!version || version->getZExtValue() != QCE_SUMMARY_VERSION ||
+        !F || F->isDeclaration())
+      continue;
+    if (const MDNode *MD = F->getEntryBlock().begin()->getMetadata("qce"))
+      summaries[F] = MD;
+  }
+
+  // Analyze the rest bottom-up, callees before their callers. Within a
+  // recursive cycle, a function sees the summaries of the members analyzed
+  // before it, which themselves lack the calls to the later ones.
+  std::vector<Function*> order;
+  SmallPtrSet<Function*, 256> ordered;
+  CallGraph &CG = getAnalysis<CallGraph>();
+  for (scc_iterator<CallGraph*> sccIt = scc_begin(&CG), sccE = scc_end(&CG);
+       sccIt != sccE; ++sccIt) {
+    foreach (CallGraphNode *node, *sccIt) {
+      Function *F = node->getFunction();
+      if (F && ordered.insert(F))
+        order.push_back(F);
+    }
+  }
+  // Then the functions the call graph does not reach
+  for (Module::iterator it = M.begin(), ie = M.end(); it != ie; ++it) {
+    if (ordered.insert(it))
+      order.push_back(it);
+  }
+
+  std::vector<Function*> pending;
+  foreach (Function *F, order) {
+    if (F->isDeclaration() || summaries.count(F))
+      continue;
+
+    stripAnnotations(*F);
+
+    // Split the entry block to have an empty entry block (so that it would
+    // contain only function-level annotations). This is done before the
+    // function is analyzed, so that the analyses see the final CFG.
+    BasicBlock *entryBB = &F->getEntryBlock();
+    entryBB->splitBasicBlock(entryBB->begin());
+
+    pending.push_back(F);
+  }
+
+  if (pending.empty())
+    return false;
+
+  FunctionPassManager FPM(&M);
+  FPM.add(new QCEFunctionAnalyzerPass(m_targetData, &summaries));
+  FPM.doInitialization();
+  foreach (Function *F, pending) {
+    FPM.run(*F);
+    if (const MDNode *MD = F->getEntryBlock().begin()->getMetadata("qce"))
+      summaries[F] = MD;
+  }
+  FPM.doFinalization();
+
+  // Record the analyzed functions
+  analyzedMD->dropAllReferences();
+  foreach (QCESummaryMap::value_type &p, summaries) {
+    Value *args[2] = { ConstantInt::get(versionTy, QCE_SUMMARY_VERSION),
+                       const_cast<Function*>(p.first) };
+    analyzedMD->addOperand(MDNode::get(Ctx, args, 2));
+  }
+
+  return true;
+}
+
+void QCEAnalyzerPass::getAnalysisUsage(AnalysisUsage &Info) const {
+  Info.addRequired<CallGraph>();
+  Info.addPreserved<CallGraph>();
+}
+
 char QCEAnalyzerPass::ID = 0;
+char QCEFunctionAnalyzerPass::ID = 0;
 
 INITIALIZE_PASS_BEGIN(QCEAnalyzerPass, "qce-analyzer",
                     "QCE analysis", false, false)
 INITIALIZE_AG_DEPENDENCY(CallGraph)
-INITIALIZE_PASS_DEPENDENCY(DominatorTree)
-INITIALIZE_PASS_DEPENDENCY(LoopInfo)
 INITIALIZE_PASS_END(QCEAnalyzerPass, "qce-analyzer",
                     "QCE analysis", false, false)
+
+INITIALIZE_PASS_BEGIN(QCEFunctionAnalyzerPass, "qce-function-analyzer",
+                    "QCE analysis of a function", false, false)
+INITIALIZE_PASS_DEPENDENCY(DominatorTree)
+INITIALIZE_PASS_DEPENDENCY(LoopInfo)
+INITIALIZE_PASS_DEPENDENCY(ScalarEvolution)
+INITIALIZE_PASS_END(QCEFunctionAnalyzerPass, "qce-function-analyzer",
+                    "QCE analysis of a function", false, false)
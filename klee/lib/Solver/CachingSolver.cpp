@@ -14,13 +14,30 @@
 #include "klee/Expr.h"
 #include "klee/IncompleteSolver.h"
 #include "klee/SolverImpl.h"
+#include "klee/Internal/Support/MemoryAccounting.h"
 
 #include "SolverStats.h"
 
+#include "llvm/Support/CommandLine.h"
+
+#include <boost/interprocess/detail/atomic.hpp>
 #include <tr1/unordered_map>
+#include <deque>
 #include <pthread.h>
 
 using namespace klee;
+using namespace llvm;
+
+namespace {
+  cl::opt<unsigned>
+  MaxQueryCacheSize("max-query-cache-size",
+                    cl::init(1 << 20),
+                    cl::desc("Maximum number of entries of the query cache, "
+                             "0 for no limit (default=1048576)"));
+}
+
+// The cache is split into shards, each behind its own reader/writer lock
+#define CACHE_SHARDS 16
 
 class CachingSolver : public SolverImpl {
 private:
@@ -35,42 +52,77 @@ private:
   
   struct CacheEntry {
     CacheEntry(const ConstraintManager &c, ref<Expr> q)
-      : constraints(c), query(q) {}
+      : constraints(c.getList()), query(q),
+        hashValue(hashUpdate(c.hash(), (uint64_t) q->hash())) {}
 
     CacheEntry(const CacheEntry &ce)
-      : constraints(ce.constraints), query(ce.query) {}
+      : constraints(ce.constraints), query(ce.query),
+        hashValue(ce.hashValue) {}
     
-    ConstraintManager constraints;
+    ConstraintManager::constraint_list_ty constraints;
     ref<Expr> query;
+    uint64_t hashValue;
 
     bool operator==(const CacheEntry &b) const {
-      return constraints==b.constraints && *query.get()==*b.query.get();
+      return hashValue==b.hashValue && constraints==b.constraints &&
+        *query.get()==*b.query.get();
     }
   };
   
   struct CacheEntryHash {
-    unsigned operator()(const CacheEntry &ce) const {
-      unsigned result = ce.query->hash();
-      
-      for (ConstraintManager::constraint_iterator it = ce.constraints.begin();
-           it != ce.constraints.end(); ++it)
-        result ^= (*it)->hash();
-      
-      return result;
+    size_t operator()(const CacheEntry &ce) const {
+      return ce.hashValue;
     }
   };
 
+  struct CacheValue {
+    IncompleteSolver::PartialValidity result;
+    /// Set by lookups, cleared by the eviction sweep (second chance).
+    uint32_t referenced;
+
+    CacheValue(IncompleteSolver::PartialValidity _result)
+      : result(_result), referenced(0) {}
+  };
+
   typedef std::tr1::unordered_map<CacheEntry, 
-                                  IncompleteSolver::PartialValidity, 
-                                  CacheEntryHash> cache_map;
+                                  CacheValue,
+                                  CacheEntryHash,
+                                  std::equal_to<CacheEntry>,
+                                  AccountingAllocator<
+                                    std::pair<const CacheEntry, CacheValue>,
+                                    MemoryAccounting::SolverCaches> >
+    cache_map;
+
+  struct Shard {
+    pthread_rwlock_t lock;
+    cache_map cache;
+    /// Entries in insertion order, swept to evict
+    std::deque<CacheEntry,
+               AccountingAllocator<CacheEntry,
+                                   MemoryAccounting::SolverCaches> > order;
+  };
   
   Solver *solver;
-  cache_map cache;
-  pthread_mutex_t mutex;
+  Shard shards[CACHE_SHARDS];
+
+  Shard &getShard(const CacheEntry &ce) {
+    return shards[(ce.hashValue >> 32) % CACHE_SHARDS];
+  }
+
+  unsigned evict(Shard &shard);
 
 public:
-  CachingSolver(Solver *s) : solver(s) { pthread_mutex_init(&mutex, NULL); }
-  ~CachingSolver() { cache.clear(); pthread_mutex_destroy(&mutex); delete solver; }
+  CachingSolver(Solver *s) : solver(s) {
+    for (unsigned i = 0; i < CACHE_SHARDS; ++i)
+      pthread_rwlock_init(&shards[i].lock, NULL);
+  }
+  ~CachingSolver() {
+    for (unsigned i = 0; i < CACHE_SHARDS; ++i) {
+      shards[i].cache.clear();
+      pthread_rwlock_destroy(&shards[i].lock);
+    }
+    delete solver;
+  }
 
   bool computeValidity(const Query&, Solver::Validity &result);
   bool computeTruth(const Query&, bool &isValid);
@@ -113,22 +165,47 @@ bool CachingSolver::cacheLookup(const Query& query,
   ref<Expr> canonicalQuery = canonicalizeQuery(query.expr, negationUsed);
 
   CacheEntry ce(query.constraints, canonicalQuery);
+  Shard &shard = getShard(ce);
 
-  pthread_mutex_lock(&mutex);
-  cache_map::iterator it = cache.find(ce);
+  pthread_rwlock_rdlock(&shard.lock);
+  cache_map::iterator it = shard.cache.find(ce);
   
-  if (it != cache.end()) {
+  if (it != shard.cache.end()) {
     result = (negationUsed ?
-              IncompleteSolver::negatePartialValidity(it->second) :
-              it->second);
-    pthread_mutex_unlock(&mutex);
+              IncompleteSolver::negatePartialValidity(it->second.result) :
+              it->second.result);
+    if (!it->second.referenced)
+      boost::interprocess::detail::atomic_write32(&it->second.referenced, 1);
+    pthread_rwlock_unlock(&shard.lock);
     return true;
   }
   
-  pthread_mutex_unlock(&mutex);
+  pthread_rwlock_unlock(&shard.lock);
   return false;
 }
 
+/// Drop the oldest entries of \a shard that were not looked up since the
+/// last sweep, until it is back within its share of the limit. The shard
+/// must be locked for writing. Returns the number of entries dropped, for
+/// the caller to account once the lock is released.
+unsigned CachingSolver::evict(Shard &shard) {
+  size_t limit = (MaxQueryCacheSize + CACHE_SHARDS - 1) / CACHE_SHARDS;
+  unsigned evicted = 0;
+
+  while (shard.cache.size() > limit) {
+    cache_map::iterator it = shard.cache.find(shard.order.front());
+    if (it->second.referenced) {
+      it->second.referenced = 0;
+      shard.order.push_back(shard.order.front());
+    } else {
+      shard.cache.erase(it);
+      ++evicted;
+    }
+    shard.order.pop_front();
+  }
+  return evicted;
+}
+
 /// Inserts the given query, result pair into the cache.
 void CachingSolver::cacheInsert(const Query& query,
                                 IncompleteSolver::PartialValidity result) {
@@ -139,9 +216,26 @@ void CachingSolver::cacheInsert(const Query& query,
   IncompleteSolver::PartialValidity cachedResult = 
     (negationUsed ? IncompleteSolver::negatePartialValidity(result) : result);
 
-  pthread_mutex_lock(&mutex);
-  cache.insert(std::make_pair(ce, cachedResult));
-  pthread_mutex_unlock(&mutex);
+  Shard &shard = getShard(ce);
+  unsigned evicted = 0;
+
+  pthread_rwlock_wrlock(&shard.lock);
+  std::pair<cache_map::iterator, bool> res =
+    shard.cache.insert(std::make_pair(ce, CacheValue(cachedResult)));
+  if (res.second) {
+    if (MaxQueryCacheSize) {
+      shard.order.push_back(ce);
+      evicted = evict(shard);
+    }
+  } else {
+    // Refine the previous, partial result
+    res.first->second.result = cachedResult;
+  }
+  pthread_rwlock_unlock(&shard.lock);
+
+  // Like the other statistics, counted on the calling thread
+  if (evicted)
+    stats::queryCacheEvictions += evicted;
 }
 
 bool CachingSolver::computeValidity(const Query& query,
@@ -17,6 +17,7 @@
 #include "klee/util/ExprUtil.h"
 #include "klee/util/ExprVisitor.h"
 #include "klee/Internal/ADT/MapOfSets.h"
+#include "klee/Internal/Support/MemoryAccounting.h"
 
 #include "SolverStats.h"
 
@@ -39,6 +40,13 @@ namespace {
   cl::opt<bool>
   CexCacheExperimental("cex-cache-exp", cl::init(false));
 
+  cl::opt<unsigned>
+  MaxCexCacheSize("max-cex-cache-size",
+                  cl::init(1 << 18),
+                  cl::desc("Number of constraint sets after which the "
+                           "counterexample cache is flushed, 0 for no limit "
+                           "(default=262144)"));
+
 }
 
 ///
@@ -46,38 +54,47 @@ namespace {
 typedef std::set< ref<Expr> > KeyType;
 
 struct AssignmentLessThan {
-  bool operator()(const Assignment *a, const Assignment *b) {
+  bool operator()(const ref<Assignment> &a, const ref<Assignment> &b) const {
     return a->bindings < b->bindings;
   }
 };
 
 
 class CexCachingSolver : public SolverImpl {
-  typedef std::set<Assignment*, AssignmentLessThan> assignmentsTable_ty;
+  typedef std::set<ref<Assignment>, AssignmentLessThan> assignmentsTable_ty;
 
   Solver *solver;
   
-  MapOfSets<ref<Expr>, Assignment*> cache;
+  // Assignments are reference counted, so that the ones handed out stay
+  // valid when another thread flushes the cache
+  MapOfSets<ref<Expr>, ref<Assignment> > cache;
+  unsigned cacheSize;
+  /// An estimate of the memory held by the cache and the memo table,
+  /// charged to MemoryAccounting::SolverCaches.
+  size_t cacheBytes;
   // memo table
   assignmentsTable_ty assignmentsTable;
 
-  pthread_mutex_t mutex;
+  // Lookups only read the cache and can proceed in parallel
+  pthread_rwlock_t lock;
 
   bool searchForAssignment(KeyType &key, 
-                           Assignment *&result);
+                           ref<Assignment> &result);
   
-  bool lookupAssignment(const Query& query, KeyType &key, Assignment *&result);
+  bool lookupAssignment(const Query& query, KeyType &key,
+                        ref<Assignment> &result);
 
-  bool lookupAssignment(const Query& query, Assignment *&result) {
+  bool lookupAssignment(const Query& query, ref<Assignment> &result) {
     KeyType key;
     return lookupAssignment(query, key, result);
   }
 
-  bool getAssignment(const Query& query, Assignment *&result);
+  bool getAssignment(const Query& query, ref<Assignment> &result);
   
 public:
-  CexCachingSolver(Solver *_solver) : solver(_solver) {
-    pthread_mutex_init(&mutex, NULL);
+  CexCachingSolver(Solver *_solver)
+    : solver(_solver), cacheSize(0), cacheBytes(0) {
+    pthread_rwlock_init(&lock, NULL);
   }
   ~CexCachingSolver();
   
@@ -96,22 +113,25 @@ public:
 
 class _Lock {
 private:
-  pthread_mutex_t *_mutex;
+  pthread_rwlock_t *_lock;
 public:
-  _Lock(pthread_mutex_t *mutex): _mutex(mutex) {
-    pthread_mutex_lock(_mutex);
+  _Lock(pthread_rwlock_t *lock, bool write): _lock(lock) {
+    if (write)
+      pthread_rwlock_wrlock(_lock);
+    else
+      pthread_rwlock_rdlock(_lock);
   }
-  ~_Lock() { pthread_mutex_unlock(_mutex); }
+  ~_Lock() { pthread_rwlock_unlock(_lock); }
 };
 
 ///
 
 struct NullAssignment {
-  bool operator()(Assignment *a) const { return !a; }
+  bool operator()(const ref<Assignment> &a) const { return a.isNull(); }
 };
 
 struct NonNullAssignment {
-  bool operator()(Assignment *a) const { return a!=0; }
+  bool operator()(const ref<Assignment> &a) const { return !a.isNull(); }
 };
 
 struct NullOrSatisfyingAssignment {
@@ -119,8 +139,8 @@ struct NullOrSatisfyingAssignment {
   
   NullOrSatisfyingAssignment(KeyType &_key) : key(_key) {}
 
-  bool operator()(Assignment *a) const { 
-    return !a || a->satisfies(key.begin(), key.end()); 
+  bool operator()(const ref<Assignment> &a) const { 
+    return a.isNull() || a->satisfies(key.begin(), key.end()); 
   }
 };
 
@@ -131,9 +151,10 @@ struct NullOrSatisfyingAssignment {
 /// either a satisfying assignment (for a satisfiable query), or 0 (for an
 /// unsatisfiable query).
 /// \return - True if a cached result was found.
-bool CexCachingSolver::searchForAssignment(KeyType &key, Assignment *&result) {
-  _Lock _lock(&mutex);
-  Assignment * const *lookup = cache.lookup(key);
+bool CexCachingSolver::searchForAssignment(KeyType &key,
+                                           ref<Assignment> &result) {
+  _Lock _lock(&lock, false);
+  ref<Assignment> *lookup = cache.lookup(key);
   if (lookup) {
     result = *lookup;
     return true;
@@ -142,7 +163,7 @@ bool CexCachingSolver::searchForAssignment(KeyType &key, Assignment *&result) {
   if (CexCacheTryAll) {
     // Look for a satisfying assignment for a superset, which is trivially an
     // assignment for any subset.
-    Assignment **lookup = cache.findSuperset(key, NonNullAssignment());
+    ref<Assignment> *lookup = cache.findSuperset(key, NonNullAssignment());
     
     // Otherwise, look for a subset which is unsatisfiable, see below.
     if (!lookup) 
@@ -158,7 +179,7 @@ bool CexCachingSolver::searchForAssignment(KeyType &key, Assignment *&result) {
     // of them satisfies the query.
     for (assignmentsTable_ty::iterator it = assignmentsTable.begin(), 
            ie = assignmentsTable.end(); it != ie; ++it) {
-      Assignment *a = *it;
+      const ref<Assignment> &a = *it;
       if (a->satisfies(key.begin(), key.end())) {
         result = a;
         return true;
@@ -169,7 +190,7 @@ bool CexCachingSolver::searchForAssignment(KeyType &key, Assignment *&result) {
 
     // Look for a satisfying assignment for a superset, which is trivially an
     // assignment for any subset.
-    Assignment **lookup = cache.findSuperset(key, NonNullAssignment());
+    ref<Assignment> *lookup = cache.findSuperset(key, NonNullAssignment());
 
     // Otherwise, look for a subset which is unsatisfiable -- if the subset is
     // unsatisfiable then no additional constraints can produce a valid
@@ -199,12 +220,12 @@ bool CexCachingSolver::searchForAssignment(KeyType &key, Assignment *&result) {
 /// \return True if a cached result was found.
 bool CexCachingSolver::lookupAssignment(const Query &query, 
                                         KeyType &key,
-                                        Assignment *&result) {
+                                        ref<Assignment> &result) {
   key = KeyType(query.constraints.begin(), query.constraints.end());
   ref<Expr> neg = Expr::createIsZero(query.expr);
   if (ConstantExpr *CE = dyn_cast<ConstantExpr>(neg)) {
     if (CE->isFalse()) {
-      result = (Assignment*) 0;
+      result = ref<Assignment>();
       return true;
     }
   } else {
@@ -214,7 +235,8 @@ bool CexCachingSolver::lookupAssignment(const Query &query,
   return searchForAssignment(key, result);
 }
 
-bool CexCachingSolver::getAssignment(const Query& query, Assignment *&result) {
+bool CexCachingSolver::getAssignment(const Query& query,
+                                     ref<Assignment> &result) {
   KeyType key;
   if (lookupAssignment(query, key, result))
     return true;
@@ -228,29 +250,55 @@ bool CexCachingSolver::getAssignment(const Query& query, Assignment *&result) {
                                           hasSolution))
     return false;
     
-  Assignment *binding;
-  if (hasSolution) {
+  ref<Assignment> binding;
+  if (hasSolution)
     binding = new Assignment(objects, values);
-  } else {
-    binding = (Assignment*) 0;
-  }
 
-  _Lock _lock(&mutex);
-  if (hasSolution) {
-    // Memoize the result.
-    std::pair<assignmentsTable_ty::iterator, bool>
-      res = assignmentsTable.insert(binding);
-    if (!res.second) {
-      delete binding;
-      binding = *res.first;
+  bool flushed = false;
+  {
+    _Lock _lock(&lock, true);
+    if (MaxCexCacheSize && cacheSize >= MaxCexCacheSize) {
+      // Bound the memory use by starting over
+      cache.clear();
+      assignmentsTable.clear();
+      cacheSize = 0;
+      MemoryAccounting::release(MemoryAccounting::SolverCaches, cacheBytes);
+      cacheBytes = 0;
+      flushed = true;
     }
+
+    if (hasSolution) {
+      // Memoize the result.
+      std::pair<assignmentsTable_ty::iterator, bool>
+        res = assignmentsTable.insert(binding);
+      if (!res.second) {
+        binding = *res.first;
+      } else {
+        // A tree node each, in the table and in the bindings
+        size_t bytes = sizeof(Assignment) + 4 * sizeof(void*);
+        for (Assignment::bindings_ty::iterator it = binding->bindings.begin(),
+               ie = binding->bindings.end(); it != ie; ++it)
+          bytes += 4 * sizeof(void*) + sizeof(*it) + it->second.capacity();
+        MemoryAccounting::allocate(MemoryAccounting::SolverCaches, bytes);
+        cacheBytes += bytes;
+      }
     
-    if (DebugCexCacheCheckBinding)
-      assert(binding->satisfies(key.begin(), key.end()));
-  }
+      if (DebugCexCacheCheckBinding)
+        assert(binding->satisfies(key.begin(), key.end()));
+    }
   
-  result = binding;
-  cache.insert(key, binding);
+    result = binding;
+    cache.insert(key, binding);
+    ++cacheSize;
+    // At most a trie node per key element
+    size_t bytes = key.size() * (4 * sizeof(void*) + sizeof(ref<Expr>));
+    MemoryAccounting::allocate(MemoryAccounting::SolverCaches, bytes);
+    cacheBytes += bytes;
+  }
+
+  // Counted once the lock is released, on the calling thread
+  if (flushed)
+    ++stats::cexCacheFlushes;
 
   return true;
 }
@@ -258,21 +306,19 @@ bool CexCachingSolver::getAssignment(const Query& query, Assignment *&result) {
 ///
 
 CexCachingSolver::~CexCachingSolver() {
-  pthread_mutex_destroy(&mutex);
+  pthread_rwlock_destroy(&lock);
   cache.clear();
+  MemoryAccounting::release(MemoryAccounting::SolverCaches, cacheBytes);
   delete solver;
-  for (assignmentsTable_ty::iterator it = assignmentsTable.begin(), 
-         ie = assignmentsTable.end(); it != ie; ++it)
-    delete *it;
 }
 
 bool CexCachingSolver::computeValidity(const Query& query,
                                        Solver::Validity &result) {
   TimerStatIncrementer t(stats::cexCacheTime);
-  Assignment *a;
+  ref<Assignment> a;
   if (!getAssignment(query.withFalse(), a))
     return false;
-  assert(a && "computeValidity() must have assignment");
+  assert(!a.isNull() && "computeValidity() must have assignment");
   ref<Expr> q = a->evaluate(query.expr);
   assert(isa<ConstantExpr>(q) && 
          "assignment evaluation did not result in constant");
@@ -280,11 +326,11 @@ bool CexCachingSolver::computeValidity(const Query& query,
   if (cast<ConstantExpr>(q)->isTrue()) {
     if (!getAssignment(query, a))
       return false;
-    result = !a ? Solver::True : Solver::Unknown;
+    result = a.isNull() ? Solver::True : Solver::Unknown;
   } else {
     if (!getAssignment(query.negateExpr(), a))
       return false;
-    result = !a ? Solver::False : Solver::Unknown;
+    result = a.isNull() ? Solver::False : Solver::Unknown;
   }
   
   return true;
@@ -303,16 +349,16 @@ bool CexCachingSolver::computeTruth(const Query& query,
   // really seem to be worth the overhead.
 
   if (CexCacheExperimental) {
-    Assignment *a;
-    if (lookupAssignment(query.negateExpr(), a) && !a)
+    ref<Assignment> a;
+    if (lookupAssignment(query.negateExpr(), a) && a.isNull())
       return false;
   }
 
-  Assignment *a;
+  ref<Assignment> a;
   if (!getAssignment(query, a))
     return false;
 
-  isValid = !a;
+  isValid = a.isNull();
 
   return true;
 }
@@ -321,10 +367,10 @@ bool CexCachingSolver::computeValue(const Query& query,
                                     ref<Expr> &result) {
   TimerStatIncrementer t(stats::cexCacheTime);
 
-  Assignment *a;
+  ref<Assignment> a;
   if (!getAssignment(query.withFalse(), a))
     return false;
-  assert(a && "computeValue() must have assignment");
+  assert(!a.isNull() && "computeValue() must have assignment");
   result = a->evaluate(query.expr);  
   assert(isa<ConstantExpr>(result) && 
          "assignment evaluation did not result in constant");
@@ -339,12 +385,12 @@ CexCachingSolver::computeInitialValues(const Query& query,
                                          &values,
                                        bool &hasSolution) {
   TimerStatIncrementer t(stats::cexCacheTime);
-  Assignment *a;
+  ref<Assignment> a;
   if (!getAssignment(query, a))
     return false;
-  hasSolution = !!a;
+  hasSolution = !a.isNull();
   
-  if (!a)
+  if (a.isNull())
     return true;
 
   // FIXME: We should use smarter assignment for result so we don't
@@ -1,115 +1,145 @@
+//===-- HLParallelSolver.cpp ----------------------------------------------===//
+//
+//                     The KLEE Symbolic Virtual Machine
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
 #include "klee/Solver.h"
 
 #include "klee/Expr.h"
 #include "klee/Constraints.h"
 #include "klee/SolverImpl.h"
+#include "klee/Statistics.h"
+#include "klee/util/Assignment.h"
 #include "klee/util/ExprHashMap.h"
-#include "klee/util/ExprVisitor.h"
 #include "klee/util/ExprUtil.h"
-#include "klee/util/Assignment.h"
+
+#include "IndependentSolver.h"
+#include "SolverStats.h"
 
 #include <pthread.h>
-#include <vector>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
 #include <deque>
+#include <iostream>
+#include <vector>
 
+// Upper bound on the case split conditions of a query, the actual number is
+// also limited by the size of the thread pool
 #define SUBQUERY_CONDITIONS_MAX 8
 
-//#define __DISABLE_MAIN_SOLVER
-//#define __DISABLE_SUBSOLVERS
-
 using namespace klee;
 
-namespace klee {
-
-#if 0
+namespace {
+
+/// A portfolio solver: every query is handed to the underlying solver as is
+/// and, concurrently, as a set of smaller subqueries. When the constraints
+/// fall apart into independent factors, each factor is solved on its own;
+/// otherwise the query is split into cases on the conditions of its select
+/// expressions, which is where state merging leaves its disjunctions. The
+/// first conclusive answer wins and the remaining work is cancelled.
+///
+/// The workers call the underlying solver concurrently, so it has to be a
+/// forked STP solver: the validity checker of the parent process is never
+/// touched in that mode.
 class HLParallelSolver : public SolverImpl {
 private:
-  Solver *solver;
+  /// How the answers of a group of subqueries combine into an answer for
+  /// the whole query.
+  enum GroupKind {
+    /// Exhaustive cases: one of them having a solution is enough, the
+    /// query has none when all of them have none.
+    AnyCase,
+    /// Independent factors: the query has a solution when all of them have
+    /// one, one factor without a solution is enough to conclude it has none.
+    AllFactors
+  };
 
-public:
-  HLParallelSolver(Solver *_solver, unsigned subsolversCount);
-  ~HLParallelSolver();
+  struct Group {
+    GroupKind kind;
+    unsigned pending;
+    bool failed;
+    /// The solution assembled from the factors solved so far.
+    std::vector< std::vector<unsigned char> > values;
 
-  bool computeTruth(const Query &query, bool &isValid);
-  bool computeValidity(const Query &query, Solver::Validity &validity);
-  bool computeValue(const Query &query, ref<Expr> &value);
-  bool computeInitialValues(const Query &query,
-                            const std::vector<const Array*> &objects,
-                            std::vector< std::vector<unsigned char> > &values,
-                            bool &hasSolution);
+    Group(GroupKind _kind) : kind(_kind), pending(0), failed(false) {}
+  };
 
-  void cancelPendingJobs() { assert(0); }
+  struct Job {
+    Group *group;
+    ConstraintManager constraints;
+    ref<Expr> expr;
+    std::vector<const Array*> objects;
+    /// Index of each of the objects in the objects of the query.
+    std::vector<unsigned> indices;
+    /// The bytes owned by the job, for factors.
+    IndependentElementSet factor;
+
+    Job(Group *_group, const ConstraintManager &_constraints,
+        ref<Expr> _expr)
+      : group(_group), constraints(_constraints), expr(_expr) {
+      ++group->pending;
+    }
+  };
 
-protected:
-  static void *mainSolverThread(void *arg);
-  static void *subqueryGeneratorThread(void *arg);
-  static void *subsolverThread(void *arg);
+  Solver *solver;
+  unsigned threadCount;
+  /// Milliseconds the query runs alone before its subqueries are queued.
+  unsigned subqueryDelay;
+  std::vector<pthread_t> threads;
 
-  enum QueryType {
-    TruthQuery, ValidityQuery, ValueQuery, InitialValuesQuery, ExitRequest
-  };
+  pthread_mutex_t mutex;
+  pthread_cond_t jobReadyCond;
+  pthread_cond_t jobDoneCond;
 
-  struct QueryInfo {
-    // Query description
-    QueryType type;
-    const ConstraintManager constraints;
-    const Query query;
-    const std::vector<const Array*> objects;
-
-    // Query results
-    bool solved;
-    bool isValid;
-    Solver::Validity validity;
-    std::vector< std::vector<unsigned char> > initialValues;
-    ref<Expr> value;
-
-    bool mainSolverActive;
-    bool mainSolverDone;
-
-    int  subsolversActive;
-    bool subsolversDone;
-
-    std::vector<ref<Expr> > subqueryConditions;
-    uint64_t subqueryIndex;
-
-    bool subqueriesAreComplete;
-    bool seenInvalidSubquery;
-    bool seenSatSubquery;
-
-    QueryInfo(QueryType _type)
-        : type(_type), query(constraints, 0),
-          solved(false), mainSolverActive(false), mainSolverDone(false),
-          subsolversActive(0), subsolversDone(false),
-          subqueryIndex(ULLONG_MAX) {
-      assert(type == ExitRequest);
-    }
+  // Everything below is guarded by the mutex
+  std::deque<Job*> queue;
+  unsigned activeJobs;
+  bool shutdown;
 
-    QueryInfo(QueryType _type, const Query &_query,
-              const std::vector<const Array*> &_objects =
-                                   std::vector<const Array*>())
-        : type(_type), constraints(_query.constraints),
-          query(constraints, _query.expr), objects(_objects),
-          solved(false), mainSolverActive(false), mainSolverDone(false),
-          subsolversActive(0), subsolversDone(false),
-          subqueryIndex(ULLONG_MAX), subqueriesAreComplete(true),
-          seenInvalidSubquery(false), seenSatSubquery(false) {}
+  // The outcome of the query being solved
+  unsigned finishedJobs;
+  bool decided;
+  bool hasSolution;
+  Group *winner;
+  std::vector< std::vector<unsigned char> > values;
+  /// The statistics of the finished jobs. The statistics are not thread
+  /// safe, so the workers collect theirs and the calling thread applies
+  /// them.
+  StatisticRecord workerStats;
 
+  static void *workerThread(void *arg);
 
-    bool isDone() { return solved || (mainSolverDone && subsolversDone &&
-                                      !subsolversActive); }
-    bool isActive() { return mainSolverActive || subsolversActive; }
+  void finishJob(Job *job, bool success, bool jobHasSolution,
+                 std::vector< std::vector<unsigned char> > &jobValues);
 
-    void gatherSubqueryConditionsFor(const ref<Expr>& expr);
-  };
+  void addFactorJobs(const Query &query,
+                     const std::vector<const Array*> &objects,
+                     std::vector<Group*> &groups, std::vector<Job*> &jobs);
+  void addCaseJobs(const Query &query,
+                   const std::vector<const Array*> &objects,
+                   std::vector<Group*> &groups, std::vector<Job*> &jobs);
 
-  std::deque<QueryInfo*> queriesInfo;
+public:
+  HLParallelSolver(Solver *_solver, unsigned _threadCount,
+                   unsigned _subqueryDelay);
+  ~HLParallelSolver();
 
-  std::vector<pthread_t> threads;
+  bool computeTruth(const Query&, bool &isValid);
+  bool computeValue(const Query&, ref<Expr> &result);
+  bool computeInitialValues(const Query& query,
+                            const std::vector<const Array*> &objects,
+                            std::vector< std::vector<unsigned char> > &values,
+                            bool &hasSolution);
 
-  pthread_mutex_t mutex;
-  pthread_cond_t queryReadyCond;
-  pthread_cond_t subqueryReadyCond;
-  pthread_cond_t queryDoneCond;
+  void cancelPendingJobs() { solver->impl->cancelPendingJobs(); }
 };
 
 #define _CHECKED(smt) \
@@ -118,373 +148,235 @@ protected:
     assert(res == 0); \
   } while (0)
 
-HLParallelSolver::HLParallelSolver(Solver *_solver, unsigned subsolversCount)
-    : solver(_solver) {
-  if (subsolversCount == 0)
-    subsolversCount = 2;
+/// Return the time \a ms milliseconds from now, for pthread_cond_timedwait.
+static struct timespec getDeadline(unsigned ms) {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  struct timespec deadline;
+  deadline.tv_sec = now.tv_sec + ms / 1000;
+  deadline.tv_nsec = (now.tv_usec + (ms % 1000) * 1000) * 1000;
+  if (deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec += 1;
+    deadline.tv_nsec -= 1000000000;
+  }
+  return deadline;
+}
+
+HLParallelSolver::HLParallelSolver(Solver *_solver, unsigned _threadCount,
+                                   unsigned _subqueryDelay)
+  : solver(_solver), threadCount(_threadCount),
+    subqueryDelay(_subqueryDelay), activeJobs(0),
+    shutdown(false), finishedJobs(0), decided(false), hasSolution(false),
+    winner(0) {
+  if (threadCount == 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    threadCount = cpus > 2 ? cpus : 2;
+  }
+
+  // The workers copy expression and update list references concurrently
+  RefCountPolicy::atomic = true;
+  if (!RefCountPolicy::isAtomic()) {
+    std::cerr << "KLEE: ERROR: the parallel solver needs atomic reference "
+              << "counts (built with KLEE_REFCOUNT_PLAIN)\n";
+    exit(1);
+  }
 
   _CHECKED(pthread_mutex_init(&mutex, NULL));
-  _CHECKED(pthread_cond_init(&queryReadyCond, NULL));
-  _CHECKED(pthread_cond_init(&subqueryReadyCond, NULL));
-  _CHECKED(pthread_cond_init(&queryDoneCond, NULL));
-
-  threads.resize(subsolversCount + 2);
-  //threads.resize(2);
-  _CHECKED(pthread_create(&threads[0], NULL, mainSolverThread, this));
-  _CHECKED(pthread_create(&threads[1], NULL, subqueryGeneratorThread, this));
-  for (unsigned i = 0; i < subsolversCount; ++i)
-    _CHECKED(pthread_create(&threads[i+2], NULL, subsolverThread, this));
+  _CHECKED(pthread_cond_init(&jobReadyCond, NULL));
+  _CHECKED(pthread_cond_init(&jobDoneCond, NULL));
+
+  threads.resize(threadCount);
+  for (unsigned i = 0; i < threadCount; ++i)
+    _CHECKED(pthread_create(&threads[i], NULL, workerThread, this));
 }
 
 HLParallelSolver::~HLParallelSolver() {
   pthread_mutex_lock(&mutex);
-  QueryInfo *queryInfo = new QueryInfo(ExitRequest);
-  queriesInfo.push_back(queryInfo);
-  pthread_cond_broadcast(&queryReadyCond);
+  shutdown = true;
+  pthread_cond_broadcast(&jobReadyCond);
   pthread_mutex_unlock(&mutex);
 
   for (unsigned i = 0; i < threads.size(); ++i)
     pthread_join(threads[i], NULL);
 
-  queryInfo->mainSolverDone = true;
-  queryInfo->subsolversDone = true;
-
-  while (!queriesInfo.empty()) {
-    assert(!queriesInfo.front()->isActive());
-    assert(queriesInfo.front()->isDone());
-    delete queriesInfo.front();
-    queriesInfo.pop_front();
-  }
-
-  _CHECKED(pthread_cond_destroy(&queryDoneCond));
-  _CHECKED(pthread_cond_destroy(&subqueryReadyCond));
-  _CHECKED(pthread_cond_destroy(&queryReadyCond));
+  _CHECKED(pthread_cond_destroy(&jobDoneCond));
+  _CHECKED(pthread_cond_destroy(&jobReadyCond));
   _CHECKED(pthread_mutex_destroy(&mutex));
+
+  delete solver;
 }
 
-void *HLParallelSolver::mainSolverThread(void *arg) {
+void *HLParallelSolver::workerThread(void *arg) {
   HLParallelSolver *pSolver = static_cast<HLParallelSolver*>(arg);
 
-  bool solved;
-  ref<Expr> value;
-  bool hasSolution;
-  bool isValid;
-  Solver::Validity validity;
-  std::vector< std::vector<unsigned char> > initialValues;
+  StatisticRecord jobStats;
+  theStatisticManager->setThreadRecord(&jobStats);
 
   pthread_mutex_lock(&pSolver->mutex);
   while (true) {
-    while(pSolver->queriesInfo.empty() || pSolver->queriesInfo.back()->solved
-                        || pSolver->queriesInfo.back()->mainSolverDone)
-      pthread_cond_wait(&pSolver->queryReadyCond, &pSolver->mutex);
+    while (!pSolver->shutdown && pSolver->queue.empty())
+      pthread_cond_wait(&pSolver->jobReadyCond, &pSolver->mutex);
 
-    QueryInfo *queryInfo = pSolver->queriesInfo.back();
-    if (queryInfo->type == ExitRequest)
+    if (pSolver->shutdown)
       break;
 
-    assert(!queryInfo->mainSolverActive);
-    assert(!queryInfo->mainSolverDone);
-    queryInfo->mainSolverActive = true;
-    solved = false;
-
-#ifdef __DISABLE_MAIN_SOLVER
-#warning Main solver is disabled!
-    // Wait for generator thread to finish
-    while (queryInfo->subqueryIndex == ULLONG_MAX) {
-      pthread_mutex_unlock(&pSolver->mutex);
-      pthread_yield();
-      pthread_mutex_lock(&pSolver->mutex);
-    }
-    // If generator produced subqueries, mark ourselfs as done
-    if (queryInfo->subqueryIndex != ULLONG_MAX-1) {
-      // XXX
-      queryInfo->mainSolverActive = false;
-      if (!queryInfo->isDone()) {
-        queryInfo->mainSolverDone = true;
-        if (queryInfo->isDone()) {
-          pthread_cond_signal(&pSolver->queryDoneCond);
-        }
-      }
-      continue;
-    }
-    // Otherwise, we have to solve the query anyway
-#endif
-
+    Job *job = pSolver->queue.front();
+    pSolver->queue.pop_front();
+    ++pSolver->activeJobs;
     pthread_mutex_unlock(&pSolver->mutex);
 
-    switch (queryInfo->type) {
-    case ValidityQuery:
-      solved = pSolver->solver->impl->computeValidity(
-          queryInfo->query, validity);
-      break;
-
-    case TruthQuery:
-      solved = pSolver->solver->impl->computeTruth(
-          queryInfo->query, isValid);
-      break;
-
-    case ValueQuery:
-      solved = pSolver->solver->impl->computeValue(
-          queryInfo->query, value);
-      break;
-
-    case InitialValuesQuery:
-      solved = pSolver->solver->impl->computeInitialValues(
-          queryInfo->query.asOneExpr(), queryInfo->objects,
-          initialValues, hasSolution);
-      break;
-
-    case ExitRequest:
-      assert(false);
-      break;
-    }
+    std::vector< std::vector<unsigned char> > values;
+    bool hasSolution = false;
+    bool success = pSolver->solver->impl->computeInitialValues(
+        Query(job->constraints, job->expr), job->objects, values,
+        hasSolution);
 
     pthread_mutex_lock(&pSolver->mutex);
-    queryInfo->mainSolverActive = false;
-
-    if (!queryInfo->isDone()) {
-      queryInfo->mainSolverDone = true;
-      // The solver is still interested in our results for this query
-
-      switch (queryInfo->type) {
-      case ValidityQuery: queryInfo->validity = validity; break;
-      case TruthQuery: queryInfo->isValid = isValid; break;
-      case ValueQuery: queryInfo->value = value; break;
-      case InitialValuesQuery:
-        queryInfo->initialValues.swap(initialValues);
-        queryInfo->isValid = !hasSolution;
-        break;
-      case ExitRequest: assert(false); break;
-      }
-
-      queryInfo->solved = solved;
-
-      if (queryInfo->isDone()) {
-        pSolver->solver->impl->cancelPendingJobs();
-        pthread_cond_signal(&pSolver->queryDoneCond);
-      }
-    }
+    --pSolver->activeJobs;
+    pSolver->workerStats += jobStats;
+    jobStats.zero();
+    if (!pSolver->decided)
+      pSolver->finishJob(job, success, hasSolution, values);
+    pthread_cond_broadcast(&pSolver->jobDoneCond);
   }
   pthread_mutex_unlock(&pSolver->mutex);
 
+  theStatisticManager->setThreadRecord(0);
   return NULL;
 }
 
-class SubqueryBuilderVisitor : public ExprVisitor {
-private:
-  const std::vector<ref<Expr> > &conditions;
-  const uint64_t index;
+void HLParallelSolver::finishJob(Job *job, bool success, bool jobHasSolution,
+                     std::vector< std::vector<unsigned char> > &jobValues) {
+  Group *group = job->group;
+  ++finishedJobs;
+  --group->pending;
 
-public:
-  SubqueryBuilderVisitor(const std::vector<ref<Expr> > &_conditions,
-                         uint64_t _index)
-    : conditions(_conditions), index(_index) {}
-
-  Action _visitExpr(const Expr &e) {
-    if (e.getWidth() == Expr::Bool) {
-      for (unsigned int i = 0; i < conditions.size(); ++i) {
-        if (conditions[i] == ref<Expr>(const_cast<Expr*>(&e))) {
-          return Action::changeTo(ConstantExpr::create(
-              (index & (1ul<<i)) ? 1 : 0, 1));
-        }
-      }
-    }
-    return Action::doChildren();
+  if (!success) {
+    // Canceled or timed out, the group can no longer conclude
+    group->failed = true;
+    return;
   }
 
-  Action visitExpr(const Expr &e) { return _visitExpr(e); }
-  Action visitExprPost(const Expr &e) { return _visitExpr(e); }
-
-};
-
-void HLParallelSolver::QueryInfo::gatherSubqueryConditionsFor(
-                                          const ref<Expr>& expr) {
-  if (subqueryConditions.size() >= SUBQUERY_CONDITIONS_MAX)
+  if (jobHasSolution == (group->kind == AnyCase)) {
+    // A case with a solution, or a factor without one
+    decided = true;
+    hasSolution = jobHasSolution;
+    winner = group;
+    if (hasSolution)
+      values.swap(jobValues);
     return;
-  std::vector< ref<Expr> > stack;
-  ExprHashSet visited;
-
-  {
-    // just in case, if we query one of the merge conditions...
-    ConstraintManager::merge_conditions_ty::iterator it =
-        constraints.mergeConditions.find(expr);
-    if (it != constraints.mergeConditions.end()) {
-      subqueryConditions.push_back(*it);
-      if (subqueryConditions.size() >= SUBQUERY_CONDITIONS_MAX)
-        return;
+  }
+
+  if (group->kind == AllFactors) {
+    for (unsigned i = 0; i < job->objects.size(); ++i) {
+      const Array *array = job->objects[i];
+      std::vector<unsigned char> &dest = group->values[job->indices[i]];
+      for (unsigned offset = 0; offset < array->size; ++offset)
+        if (job->factor.contains(array, offset))
+          dest[offset] = jobValues[i][offset];
     }
   }
 
-  if (!isa<ConstantExpr>(expr)) {
-    visited.insert(expr);
-    stack.push_back(expr);
+  if (group->pending == 0 && !group->failed) {
+    decided = true;
+    hasSolution = group->kind == AllFactors;
+    winner = group;
+    if (hasSolution)
+      values.swap(group->values);
   }
+}
 
-  while (!stack.empty()) {
-    ref<Expr> top = stack.back();
-    stack.pop_back();
+void HLParallelSolver::addFactorJobs(const Query &query,
+                                     const std::vector<const Array*> &objects,
+                                     std::vector<Group*> &groups,
+                                     std::vector<Job*> &jobs) {
+  std::vector<IndependentElementSet> factors;
+  getIndependentFactors(query, factors);
+  if (factors.size() < 2)
+    return;
 
-    // Range analysis could help when the top is boolean (comparison
-    // expressions and logical operations) or for a first child of SelectExpr.
-    bool couldBeHelpful = false;//top->getWidth() == Expr::Bool;
-    bool isSelect = isa<SelectExpr>(top);
-
-    if (!isa<ConstantExpr>(top)) {
-      Expr *e = top.get();
-      for (unsigned i = 0; i <e->getNumKids(); ++i) {
-        ref<Expr> k = e->getKid(i);
-        if (isa<ConstantExpr>(k))
-          continue;
-        if (couldBeHelpful || (isSelect && i == 0)) {
-          ConstraintManager::merge_conditions_ty::iterator it =
-              constraints.mergeConditions.find(k);
-          if (it != constraints.mergeConditions.end()) {
-            subqueryConditions.push_back(*it);
-            if (subqueryConditions.size() >= SUBQUERY_CONDITIONS_MAX)
-              return;
-          }
-        }
-        if (visited.insert(k).second) {
-          stack.push_back(k);
-        }
+  Group *group = new Group(AllFactors);
+  groups.push_back(group);
+  for (unsigned i = 0; i < objects.size(); ++i)
+    group->values.push_back(std::vector<unsigned char>(objects[i]->size, 0));
+
+  // The query expression belongs to the first factor, the others only need
+  // to be satisfiable
+  bool exprInFactor = !isa<ConstantExpr>(query.expr);
+  for (unsigned i = 0; i < factors.size(); ++i) {
+    IndependentElementSet &factor = factors[i];
+    ref<Expr> expr = query.expr;
+    if (exprInFactor && i != 0)
+      expr = ConstantExpr::alloc(0, Expr::Bool);
+
+    Job *job = new Job(group, ConstraintManager(factor.exprs), expr);
+    jobs.push_back(job);
+
+    std::vector<const Array*> arrays;
+    factor.getArrays(arrays);
+    for (unsigned j = 0; j < objects.size(); ++j) {
+      if (std::find(arrays.begin(), arrays.end(), objects[j]) !=
+          arrays.end()) {
+        job->objects.push_back(objects[j]);
+        job->indices.push_back(j);
       }
     }
+    factor.exprs.clear();
+    job->factor = factor;
   }
 }
 
-void *HLParallelSolver::subqueryGeneratorThread(void *arg) {
-  HLParallelSolver *pSolver = static_cast<HLParallelSolver*>(arg);
+void HLParallelSolver::addCaseJobs(const Query &query,
+                                   const std::vector<const Array*> &objects,
+                                   std::vector<Group*> &groups,
+                                   std::vector<Job*> &jobs) {
+  // Keep the number of cases within twice the thread count
+  unsigned limit = 0;
+  while (limit < SUBQUERY_CONDITIONS_MAX && (2u << limit) <= 2 * threadCount)
+    ++limit;
 
-  pthread_mutex_lock(&pSolver->mutex);
-  while (true) {
-    while(pSolver->queriesInfo.empty() || pSolver->queriesInfo.back()->solved
-                || pSolver->queriesInfo.back()->subqueryIndex != ULLONG_MAX)
-      pthread_cond_wait(&pSolver->queryReadyCond, &pSolver->mutex);
-
-    QueryInfo *queryInfo = pSolver->queriesInfo.back();
-    if (queryInfo->type == ExitRequest) {
-      queryInfo->subqueryIndex = 0;
-      pthread_cond_broadcast(&pSolver->subqueryReadyCond);
-      break;
-    }
-
-    assert(!queryInfo->subsolversActive);
-    assert(!queryInfo->subsolversDone);
-    assert(queryInfo->subqueryIndex == ULLONG_MAX);
-    assert(queryInfo->subqueryConditions.empty());
-    queryInfo->subsolversActive = 1;
-
-#ifdef __DISABLE_SUBSOLVERS
-#warning Subsolvers are disabled!
-    if (!queryInfo->isDone()) {
-      queryInfo->subsolversActive = 0;
-      queryInfo->subsolversDone = true;
-      queryInfo->subqueryIndex = ULLONG_MAX-1;
-      if (queryInfo->isDone()) {
-        pthread_cond_signal(&pSolver->queryDoneCond);
-      }
-    } else {
-      queryInfo->subsolversActive = 0;
-    }
-    continue;
-#endif
-
-    if (!queryInfo->constraints.mergeConditions.empty()) {
-      pthread_mutex_unlock(&pSolver->mutex);
+  std::vector< ref<Expr> > conditions;
+  std::vector< ref<Expr> > stack;
+  ExprHashSet visited, seen;
 
-    // Calculate subqueryConditions
-    // XXX: here we use ad-hoc synchronization for
-    // accessing subqueryConditions: it can be written only when
-    // subqueryIndex == ULLONG_MAX but it can be read only when otherwise
+  if (!isa<ConstantExpr>(query.expr) && visited.insert(query.expr).second)
+    stack.push_back(query.expr);
+  for (ConstraintManager::const_iterator it = query.constraints.begin(),
+         ie = query.constraints.end(); it != ie; ++it)
+    if (visited.insert(*it).second)
+      stack.push_back(*it);
 
-      queryInfo->gatherSubqueryConditionsFor(queryInfo->query.expr);
+  while (!stack.empty() && conditions.size() < limit) {
+    ref<Expr> top = stack.back();
+    stack.pop_back();
 
-      for (ConstraintManager::const_iterator it = queryInfo->constraints.begin(),
-                         ie = queryInfo->constraints.end(); it != ie; ++it) {
-        if (queryInfo->isDone() ||
-                 queryInfo->subqueryConditions.size() >= SUBQUERY_CONDITIONS_MAX)
-          break;
-        queryInfo->gatherSubqueryConditionsFor(*it);
+    if (SelectExpr *se = dyn_cast<SelectExpr>(top)) {
+      if (!isa<ConstantExpr>(se->cond) && seen.insert(se->cond).second) {
+        conditions.push_back(se->cond);
+        continue;
       }
-
-      assert(queryInfo->subqueryConditions.size() <= SUBQUERY_CONDITIONS_MAX);
-
-      pthread_mutex_lock(&pSolver->mutex);
     }
 
-    queryInfo->subqueryIndex = 0;
-
-    if (!queryInfo->isDone()) {
-      queryInfo->subsolversActive = 0;
-      std::cerr << "Generated " << queryInfo->subqueryConditions.size()
-                << " useful subquery conditions" << std::endl;
-      if (!queryInfo->subqueryConditions.empty()) {
-        if (queryInfo->type == ValueQuery) {
-          findSymbolicObjects(queryInfo->query.expr,
-                  const_cast<std::vector<const Array*>& >(queryInfo->objects));
-        }
-        pthread_cond_broadcast(&pSolver->subqueryReadyCond);
-      } else {
-        queryInfo->subsolversDone = true;
-        queryInfo->subqueryIndex = ULLONG_MAX-1;
-        if (queryInfo->isDone()) {
-          pSolver->solver->impl->cancelPendingJobs();
-          pthread_cond_signal(&pSolver->queryDoneCond);
-        }
-      }
-    } else {
-      queryInfo->subsolversActive = 0;
+    Expr *e = top.get();
+    for (unsigned i = 0; i < e->getNumKids(); ++i) {
+      ref<Expr> k = e->getKid(i);
+      if (!isa<ConstantExpr>(k) && visited.insert(k).second)
+        stack.push_back(k);
     }
   }
-  pthread_mutex_unlock(&pSolver->mutex);
-  return NULL;
-}
-
-void *HLParallelSolver::subsolverThread(void *arg) {
-  HLParallelSolver *pSolver = static_cast<HLParallelSolver*>(arg);
 
-  bool solved;
-  ref<Expr> value;
-  bool isValid;
-  bool isUnsat;
-  bool hasSolution;
-  std::vector< std::vector<unsigned char> > initialValues;
-
-  bool notDone;
-  bool madeSatSubquery;
-  bool madeInvalidSubquery;
-  bool seenSatSubquery;
-  bool seenInvalidSubquery;
-
-  pthread_mutex_lock(&pSolver->mutex);
-  while (true) {
-    while(pSolver->queriesInfo.empty() || pSolver->queriesInfo.back()->solved ||
-          pSolver->queriesInfo.back()->subqueryIndex >=
-            (1ul << pSolver->queriesInfo.back()->subqueryConditions.size()))
-      pthread_cond_wait(&pSolver->subqueryReadyCond, &pSolver->mutex);
-
-    QueryInfo *queryInfo = pSolver->queriesInfo.back();
-    if (queryInfo->type == ExitRequest)
-      break;
-
-    assert(!queryInfo->subsolversDone);
-    assert(!queryInfo->subqueryConditions.empty());
-    queryInfo->subsolversActive += 1;
-    uint64_t subqueryIndex = queryInfo->subqueryIndex++;
+  if (conditions.empty())
+    return;
 
-    madeSatSubquery = madeInvalidSubquery = false;
-    seenSatSubquery = queryInfo->seenSatSubquery;
-    seenInvalidSubquery = queryInfo->seenInvalidSubquery;
-    pthread_mutex_unlock(&pSolver->mutex);
+  Group *group = new Group(AnyCase);
+  groups.push_back(group);
 
-    /*
-    SubqueryBuilderVisitor visitor(queryInfo->subqueryConditions, subqueryIndex);
-    */
-    ConstraintManager cm(queryInfo->constraints);
+  for (uint64_t index = 0; index < (1ull << conditions.size()); ++index) {
+    ConstraintManager cm(query.constraints);
     bool infeasible = false;
-    for (unsigned i = 0; i < queryInfo->subqueryConditions.size(); ++i) {
-      ref<Expr> e = queryInfo->subqueryConditions[i];
-      if (!(subqueryIndex & (1ul << i)))
+    for (unsigned i = 0; i < conditions.size(); ++i) {
+      ref<Expr> e = conditions[i];
+      if (!(index & (1ull << i)))
         e = Expr::createIsZero(e);
       if (!cm.checkAddConstraint(e)) {
         infeasible = true;
@@ -492,342 +384,145 @@ void *HLParallelSolver::subsolverThread(void *arg) {
       }
     }
 
-    //ref<Expr> expr = visitor.visit(queryInfo->query.expr);
-    ref<Expr> expr = queryInfo->query.expr;
-    if (!infeasible)
-        expr = cm.simplifyExpr(expr);
-
-    do {
-      solved = notDone = false;
-      switch (queryInfo->type) {
-      case ValidityQuery:
-        assert(!seenSatSubquery || !seenInvalidSubquery);
-        assert(queryInfo->query.expr->getWidth() == Expr::Bool);
-        solved = isUnsat = isValid = true;
-        if (infeasible) {
-          madeSatSubquery = madeInvalidSubquery = true;
-          break;
-        }
-
-        if (!madeSatSubquery) {
-          madeSatSubquery = true;
-          if (!seenSatSubquery) {
-            // Look for false value
-            if (ConstantExpr *ce = dyn_cast<ConstantExpr>(expr)) {
-              if (ce->isFalse()) {
-                solved = true;
-                isUnsat = true;
-                break;
-              }
-            }
-            //ref<Expr> expr1 =
-            //    OrExpr::create(Expr::createIsZero(expr), Expr::createIsZero(cond));
-            solved = pSolver->solver->impl->computeTruth(
-                Query(cm, Expr::createIsZero(expr)).asOneExpr(), isUnsat);
-            break;
-          }
-        }
-
-        madeInvalidSubquery = true;
-        if (seenInvalidSubquery)
-          break;
-
-        /* fallthrough */
-
-      case TruthQuery:
-        assert(queryInfo->query.expr->getWidth() == Expr::Bool);
-        if (infeasible) {
-          solved = isValid = true;
-          break;
-        }
-        if (ConstantExpr *ce = dyn_cast<ConstantExpr>(expr)) {
-          if (ce->isTrue()) {
-            solved = true;
-            isValid = true;
-            break;
-          }
-        }
-        //expr = OrExpr::create(expr, Expr::createIsZero(cond));
-        solved = pSolver->solver->impl->computeTruth(
-            Query(cm, expr).asOneExpr(), isValid);
-        break;
-
-      case InitialValuesQuery:
-        assert(queryInfo->query.expr->getWidth() == Expr::Bool);
-        if (infeasible) {
-          solved = isValid = true;
-          break;
-        }
-        if (ConstantExpr *ce = dyn_cast<ConstantExpr>(expr)) {
-          if (ce->isTrue()) {
-            solved = true;
-            isValid = true;
-            break;
-          }
-        }
-        //expr = OrExpr::create(expr, Expr::createIsZero(cond));
-        solved = pSolver->solver->impl->computeInitialValues(
-            Query(cm, expr).asOneExpr(), queryInfo->objects,
-            initialValues, hasSolution);
-        isValid = !hasSolution;
-        break;
-
-      case ValueQuery:
-        value = ref<Expr>(0);
-        if (infeasible) {
-          solved = true;
-          break;
-        }
-        if (isa<ConstantExpr>(expr)) {
-          solved = pSolver->solver->impl->computeTruth(
-              Query(cm, ConstantExpr::create(1,1)).asOneExpr(), isValid);
-          if (solved && !isValid)
-            value = expr;
-        } else {
-          solved = pSolver->solver->impl->computeInitialValues(
-              Query(cm, ConstantExpr::create(1,1)).asOneExpr(),
-              queryInfo->objects,
-              initialValues, hasSolution);
-          if (solved && hasSolution) {
-            Assignment a(queryInfo->objects, initialValues);
-            value = a.evaluate(queryInfo->query.expr);
-          }
-        }
-        break;
-
-      case ExitRequest:
-        assert(false);
-        break;
-      }
-
-      pthread_mutex_lock(&pSolver->mutex);
-
-      if (!queryInfo->isDone()) {
-        queryInfo->subsolversActive -= 1;
-
-        // The following is actually buggy: we can't set subsolversDone
-        // here as we are not sure whether all subsulvers actually terminated
-        // or not. We compensate by also verifying subsolversActive in isDone().
-        if (subqueryIndex+1 ==
-                (1ul << queryInfo->subqueryConditions.size())) {
-          if (queryInfo->type != ValidityQuery ||
-                (madeSatSubquery && madeInvalidSubquery))
-            queryInfo->subsolversDone = true;
-        }
-
-        if (!solved)
-          queryInfo->subqueriesAreComplete = false;
-
-        // Assuming C1||C2||... = true, we have the following:
-        // Q = (Q && C1) || (Q || C2) || ...
-        // Also,
-        // !Q = (!Q && C1) || (!Q && C2) || ... =
-        //    !((Q || !C1) && (Q || !C2) && ...)
-        switch (queryInfo->type) {
-          case ValidityQuery:
-            if (solved) {
-              queryInfo->seenSatSubquery |= !isUnsat;
-              queryInfo->seenInvalidSubquery |= !isValid;
-              seenSatSubquery = queryInfo->seenSatSubquery;
-              seenInvalidSubquery = queryInfo->seenInvalidSubquery;
-              if (queryInfo->seenSatSubquery && queryInfo->seenInvalidSubquery) {
-                // Q is neither VALID nor UNSAT
-                std::cerr << "\n\n***Subsolver got solution faster!\n\n" << std::endl;
-                queryInfo->solved = true;
-                queryInfo->validity = Solver::Unknown;
-              } else if (queryInfo->subsolversDone &&
-                         queryInfo->subqueriesAreComplete &&
-                         !queryInfo->subsolversActive &&
-                         madeInvalidSubquery) {
-                std::cerr << "\n\n***Subsolver got INVALID solution faster!\n\n" << std::endl;
-                queryInfo->solved = true;
-                if (!queryInfo->seenInvalidSubquery) {
-                  assert(queryInfo->seenSatSubquery);
-                  queryInfo->validity = Solver::True;
-                } else {
-                  assert(!queryInfo->seenSatSubquery);
-                  queryInfo->validity = Solver::False;
-                }
-              } else if (queryInfo->subsolversDone &&
-                         !queryInfo->subqueriesAreComplete &&
-                         madeInvalidSubquery) {
-                std::cerr << "\n\nSubsolver finished without giving a solution\n\n" << std::endl;
-              }
-            }
-            break;
-          case TruthQuery:
-          case InitialValuesQuery:
-            if (solved) {
-              if (!isValid) {
-                // hasSolution means we got a solution for which Q||!C is false.
-                // For this solution,
-                // !Q = (!Q && C1) || (!Q && C2) || ... =
-                //    !((Q || !C1) && (Q || !C2) && ...) = true
-                // Consequently, !Q is SAT hence Q is INVALID
-                std::cerr << "\n\n***Subsolver got solution faster!\n\n" << std::endl;
-                queryInfo->solved = true;
-                queryInfo->isValid = false;
-                if (queryInfo->type == InitialValuesQuery)
-                  queryInfo->initialValues.swap(initialValues);
-              } else if (queryInfo->subsolversDone &&
-                         queryInfo->subqueriesAreComplete &&
-                         !queryInfo->subsolversActive) {
-                // For all C we got Q || !C is provably true. Consequently,
-                // !Q = (!Q && C1) || (!Q && C2) || ... =
-                //    !((Q || !C1) && (Q || !C2) && ...) = !true
-                // consequently, !Q is UNSAT hence Q is VALID
-                std::cerr << "\n\n***Subsolver got INVALID solution faster!\n\n" << std::endl;
-                queryInfo->solved = true;
-                queryInfo->isValid = true;
-              } else if (queryInfo->subsolversDone &&
-                         !queryInfo->subsolversActive) {
-                std::cerr << "\n\n***Subsolver terminated without giving solution\n\n" << std::endl;
-              }
-            }
-            break;
-          case ValueQuery:
-            if (solved) {
-              if(!value.isNull()) {
-                //std::cerr << "\n\n***Subsolver got solution faster!\n\n" << std::endl;
-                queryInfo->solved = true;
-                queryInfo->value = value;
-              } else if (queryInfo->subsolversDone &&
-                         !queryInfo->subsolversActive) {
-                // We should get a solution by enumerating everything!
-                assert(!queryInfo->subqueriesAreComplete);
-              }
-            }
-            break;
-          default:
-            assert(0);
-        }
-
-        if (queryInfo->isDone()) {
-          pSolver->solver->impl->cancelPendingJobs();
-          pthread_cond_signal(&pSolver->queryDoneCond);
-        } else if (queryInfo->type == ValidityQuery && !madeInvalidSubquery) {
-          /* Validity query requires two subqueries for each index */
-          assert(madeSatSubquery);
-          queryInfo->subsolversActive += 1;
-          notDone = true;
-          pthread_mutex_unlock(&pSolver->mutex);
-        }
-      } else {
-        queryInfo->subsolversActive -= 1;
-      }
-    } while(notDone);
-
-    if (queryInfo->type == ExitRequest)
-      break;
-  }
-  pthread_mutex_unlock(&pSolver->mutex);
-  return NULL;
-}
-
-bool HLParallelSolver::computeValidity(const Query &query, Solver::Validity &validity) {
-  QueryInfo *queryInfo = new QueryInfo(ValidityQuery, query);
-
-  pthread_mutex_lock(&mutex);
-  queriesInfo.push_back(queryInfo);
-  pthread_cond_broadcast(&queryReadyCond);
-
-  pthread_cond_wait(&queryDoneCond, &mutex);
-  assert(queryInfo->isDone());
-
-  validity = queryInfo->validity;
-  bool result = queryInfo->solved;
-
-  while (!queriesInfo.empty() && !queriesInfo.front()->isActive()) {
-    delete queriesInfo.front();
-    queriesInfo.pop_front();
+    // A case contradicting the constraints, or in which the expression
+    // always holds, has no solution
+    if (infeasible)
+      continue;
+    ref<Expr> expr = cm.simplifyExpr(query.expr);
+    if (ConstantExpr *CE = dyn_cast<ConstantExpr>(expr))
+      if (CE->isTrue())
+        continue;
+
+    Job *job = new Job(group, cm, expr);
+    job->objects = objects;
+    jobs.push_back(job);
   }
-
-  pthread_mutex_unlock(&mutex);
-
-  return result;
 }
 
-bool HLParallelSolver::computeInitialValues(const Query &query,
+bool HLParallelSolver::computeInitialValues(const Query& query,
                           const std::vector<const Array*> &objects,
-                          std::vector< std::vector<unsigned char> > &values,
-                          bool &hasSolution) {
-  QueryInfo *queryInfo = new QueryInfo(InitialValuesQuery, query, objects);
+                          std::vector< std::vector<unsigned char> > &result,
+                          bool &resultHasSolution) {
+  std::vector<Group*> groups;
+  std::vector<Job*> jobs;
+
+  Group *mainGroup = new Group(AnyCase);
+  groups.push_back(mainGroup);
+  jobs.push_back(new Job(mainGroup, query.constraints, query.expr));
+  jobs.back()->objects = objects;
+
+  addFactorJobs(query, objects, groups, jobs);
+  if (groups.size() == 1)
+    addCaseJobs(query, objects, groups, jobs);
+
+  // Drop the groups that could not generate any case
+  for (std::vector<Group*>::iterator it = groups.begin();
+       it != groups.end();) {
+    if ((*it)->pending == 0) {
+      delete *it;
+      it = groups.erase(it);
+    } else {
+      ++it;
+    }
+  }
 
   pthread_mutex_lock(&mutex);
-  queriesInfo.push_back(queryInfo);
-  pthread_cond_broadcast(&queryReadyCond);
-
-  pthread_cond_wait(&queryDoneCond, &mutex);
-  assert(queryInfo->isDone());
-
-  hasSolution = !queryInfo->isValid;
-  if (hasSolution)
-    values.swap(queryInfo->initialValues);
-  bool result = queryInfo->solved;
-
-  while (!queriesInfo.empty() && !queriesInfo.front()->isActive()) {
-    delete queriesInfo.front();
-    queriesInfo.pop_front();
+  finishedJobs = 0;
+  decided = false;
+  winner = 0;
+  values.clear();
+
+  // Most queries are easy, so the query may get a head start before the
+  // subqueries compete with it
+  unsigned queued = 1;
+  queue.push_back(jobs[0]);
+  pthread_cond_broadcast(&jobReadyCond);
+  if (subqueryDelay && jobs.size() > 1) {
+    struct timespec deadline = getDeadline(subqueryDelay);
+    while (!decided && finishedJobs < queued &&
+           pthread_cond_timedwait(&jobDoneCond, &mutex, &deadline) == 0)
+      ;
+  }
+  if (!decided && jobs.size() > 1) {
+    queue.insert(queue.end(), jobs.begin() + 1, jobs.end());
+    queued = jobs.size();
+    stats::parallelSubqueries += jobs.size() - 1;
+    pthread_cond_broadcast(&jobReadyCond);
   }
 
-  pthread_mutex_unlock(&mutex);
-
-  return result;
-}
-
-bool HLParallelSolver::computeTruth(const Query &query, bool &isValid) {
-  QueryInfo *queryInfo = new QueryInfo(TruthQuery, query);
+  while (!decided && finishedJobs < queued)
+    pthread_cond_wait(&jobDoneCond, &mutex);
 
-  pthread_mutex_lock(&mutex);
-  queriesInfo.push_back(queryInfo);
-  pthread_cond_broadcast(&queryReadyCond);
+  bool success = decided;
+  decided = true;
 
-  pthread_cond_wait(&queryDoneCond, &mutex);
-  assert(queryInfo->isDone());
+  // Nobody needs the jobs still queued, and the running ones are killed
+  // through the solver. A job may have been picked up just before the
+  // cancellation, so keep canceling until all of them returned.
+  queue.clear();
+  while (activeJobs) {
+    solver->impl->cancelPendingJobs();
+    struct timespec deadline = getDeadline(10);
+    pthread_cond_timedwait(&jobDoneCond, &mutex, &deadline);
+  }
 
-  isValid = queryInfo->isValid;
-  bool result = queryInfo->solved;
+  // All the jobs returned
+  theStatisticManager->addStatistics(workerStats);
+  workerStats.zero();
 
-  while (!queriesInfo.empty() && !queriesInfo.front()->isActive()) {
-    delete queriesInfo.front();
-    queriesInfo.pop_front();
+  if (success) {
+    resultHasSolution = hasSolution;
+    if (hasSolution)
+      result.swap(values);
+    if (winner != mainGroup)
+      ++stats::parallelSubqueryWins;
   }
-
   pthread_mutex_unlock(&mutex);
 
-  return result;
+  for (std::vector<Job*>::iterator it = jobs.begin(), ie = jobs.end();
+       it != ie; ++it)
+    delete *it;
+  for (std::vector<Group*>::iterator it = groups.begin(), ie = groups.end();
+       it != ie; ++it)
+    delete *it;
+
+  return success;
 }
 
-bool HLParallelSolver::computeValue(const Query &query, ref<Expr> &value) {
-  QueryInfo *queryInfo = new QueryInfo(ValueQuery, query);
+bool HLParallelSolver::computeTruth(const Query& query, bool &isValid) {
+  std::vector<const Array*> objects;
+  std::vector< std::vector<unsigned char> > values;
+  bool hasSolution;
 
-  pthread_mutex_lock(&mutex);
-  queriesInfo.push_back(queryInfo);
-  pthread_cond_broadcast(&queryReadyCond);
+  if (!computeInitialValues(query, objects, values, hasSolution))
+    return false;
 
-  pthread_cond_wait(&queryDoneCond, &mutex);
-  assert(queryInfo->isDone());
+  isValid = !hasSolution;
+  return true;
+}
 
-  bool result = queryInfo->solved;
-  if (result) {
-    assert(!queryInfo->value.isNull());
-    value = queryInfo->value;
-  }
+bool HLParallelSolver::computeValue(const Query& query, ref<Expr> &result) {
+  std::vector<const Array*> objects;
+  std::vector< std::vector<unsigned char> > values;
+  bool hasSolution;
 
-  while (!queriesInfo.empty() && !queriesInfo.front()->isActive()) {
-    delete queriesInfo.front();
-    queriesInfo.pop_front();
-  }
+  // Find the object used in the expression, and compute an assignment
+  // for them.
+  findSymbolicObjects(query.expr, objects);
+  if (!computeInitialValues(query.withFalse(), objects, values, hasSolution))
+    return false;
+  assert(hasSolution && "state has invalid constraint set");
 
-  pthread_mutex_unlock(&mutex);
+  // Evaluate the expression with the computed assignment.
+  Assignment a(objects, values);
+  result = a.evaluate(query.expr);
 
-  return result;
+  return true;
 }
-#endif
 
-Solver *createHLParallelSolver(Solver* _solver, unsigned subsolversCount) {
-  //return new Solver(new HLParallelSolver(_solver, subsolversCount));
-  return NULL;
 }
 
-} // namespace klee
+Solver *klee::createHLParallelSolver(Solver *solver, unsigned threadCount,
+                                     unsigned subqueryDelay) {
+  return new Solver(new HLParallelSolver(solver, threadCount, subqueryDelay));
+}
@@ -7,6 +7,8 @@
 //
 //===----------------------------------------------------------------------===//
 
+#include "IndependentSolver.h"
+
 #include "klee/Solver.h"
 
 #include "klee/Expr.h"
@@ -15,6 +17,7 @@
 
 #include "klee/util/ExprUtil.h"
 
+#include <algorithm>
 #include <map>
 #include <vector>
 #include <ostream>
@@ -23,262 +26,262 @@
 using namespace klee;
 using namespace llvm;
 
-template<class T>
-class DenseSet {
-  typedef std::set<T> set_ty;
-  set_ty s;
+namespace {
 
-public:
-  DenseSet() {}
+/// A factor of an independence partition. Factors are shared between the
+/// copies of an index and copied before they change.
+struct IndependenceFactor {
+  uint32_t refCount;
+  IndependentElementSet set;
+  /// The constraints of the factor with their positions, in their original
+  /// order.
+  std::vector< std::pair<unsigned, ref<Expr> > > members;
 
-  void add(T x) {
-    s.insert(x);
-  }
-  void add(T start, T end) {
-    for (; start<end; start++)
-      s.insert(start);
+  IndependenceFactor() : refCount(0) {}
+  IndependenceFactor(const IndependenceFactor &f)
+    : refCount(0), set(f.set), members(f.members) {}
+};
+
+/// The partition of a constraint set into independent factors. It is kept
+/// with the constraint manager and extended as constraints get appended, so
+/// that a query only has to look at the reads of its own expression.
+///
+/// Copies of the manager share the index, and the interpreter and the
+/// solver threads may query it concurrently, so lookups never modify it.
+/// An index is only extended by the manager owning it alone; a shared one
+/// is copied first, which copies the tables of factor references but
+/// leaves the factors themselves shared until they change.
+class IndependenceIndex : public ConstraintManager::SolverCache {
+  size_t count;
+  std::vector< ref<IndependenceFactor> > factors;
+  /// The factors reading from each array, sorted.
+  typedef std::map<const Array*, std::vector<unsigned> > readers_ty;
+  readers_ty readers;
+
+  IndependenceFactor &getMutableFactor(unsigned f) {
+    if (factors[f]->refCount > 1)
+      factors[f] = new IndependenceFactor(*factors[f]);
+    return *factors[f];
   }
 
-  // returns true iff set is changed by addition
-  bool add(const DenseSet &b) {
-    bool modified = false;
-    for (typename set_ty::const_iterator it = b.s.begin(), ie = b.s.end(); 
-         it != ie; ++it) {
-      if (modified || !s.count(*it)) {
-        modified = true;
-        s.insert(*it);
-      }
-    }
-    return modified;
+  void addReader(const Array *array, unsigned f) {
+    std::vector<unsigned> &list = readers[array];
+    std::vector<unsigned>::iterator it =
+      std::lower_bound(list.begin(), list.end(), f);
+    if (it == list.end() || *it != f)
+      list.insert(it, f);
   }
 
-  bool intersects(const DenseSet &b) {
-    for (typename set_ty::iterator it = s.begin(), ie = s.end(); 
-         it != ie; ++it)
-      if (b.s.count(*it))
-        return true;
-    return false;
+  void removeReader(const Array *array, unsigned f) {
+    readers_ty::iterator ri = readers.find(array);
+    assert(ri != readers.end());
+    std::vector<unsigned> &list = ri->second;
+    std::vector<unsigned>::iterator it =
+      std::lower_bound(list.begin(), list.end(), f);
+    assert(it != list.end() && *it == f);
+    list.erase(it);
+    if (list.empty())
+      readers.erase(ri);
   }
 
-  void print(std::ostream &os) const {
-    bool first = true;
-    os << "{";
-    for (typename set_ty::iterator it = s.begin(), ie = s.end(); 
-         it != ie; ++it) {
-      if (first) {
-        first = false;
-      } else {
-        os << ",";
+  /// Drop factor \a f, moving the last factor into its slot.
+  void removeFactor(unsigned f) {
+    std::vector<const Array*> arrays;
+    factors[f]->set.getArrays(arrays);
+    for (unsigned i = 0; i < arrays.size(); ++i)
+      removeReader(arrays[i], f);
+
+    unsigned last = factors.size() - 1;
+    if (f != last) {
+      arrays.clear();
+      factors[last]->set.getArrays(arrays);
+      for (unsigned i = 0; i < arrays.size(); ++i) {
+        removeReader(arrays[i], last);
+        addReader(arrays[i], f);
       }
-      os << *it;
+      factors[f] = factors[last];
     }
-    os << "}";
+    factors.pop_back();
   }
-};
-
-template<class T>
-inline std::ostream &operator<<(std::ostream &os, const DenseSet<T> &dis) {
-  dis.print(os);
-  return os;
-}
-
-class IndependentElementSet {
-  typedef std::map<const Array*, DenseSet<unsigned> > elements_ty;
-  elements_ty elements;
-  std::set<const Array*> wholeObjects;
 
 public:
-  IndependentElementSet() {}
-  IndependentElementSet(ref<Expr> e) {
-    std::vector< ref<ReadExpr> > reads;
-    findReads(e, /* visitUpdates= */ true, reads);
-    for (unsigned i = 0; i != reads.size(); ++i) {
-      ReadExpr *re = reads[i].get();
-      const Array *array = re->updates.root;
-      
-      // Reads of a constant array don't alias.
-      if (re->updates.root->isConstantArray() &&
-          !re->updates.head)
+  IndependenceIndex() : count(0) {}
+
+  size_t size() const { return count; }
+  unsigned getFactorCount() const { return factors.size(); }
+
+  /// Collect the factors intersecting \a set.
+  void getIntersecting(const IndependentElementSet &set,
+                       std::vector<unsigned> &result) const {
+    std::vector<const Array*> arrays;
+    set.getArrays(arrays);
+    for (std::vector<const Array*>::iterator it = arrays.begin(),
+           ie = arrays.end(); it != ie; ++it) {
+      readers_ty::const_iterator ri = readers.find(*it);
+      if (ri == readers.end())
         continue;
 
-      if (!wholeObjects.count(array)) {
-        if (ConstantExpr *CE = dyn_cast<ConstantExpr>(re->index)) {
-          DenseSet<unsigned> &dis = elements[array];
-          dis.add((unsigned) CE->getZExtValue(32));
-        } else {
-          elements_ty::iterator it2 = elements.find(array);
-          if (it2!=elements.end())
-            elements.erase(it2);
-          wholeObjects.insert(array);
-        }
-      }
+      const std::vector<unsigned> &list = ri->second;
+      for (unsigned i = 0; i < list.size(); ++i)
+        if (std::find(result.begin(), result.end(), list[i]) ==
+              result.end() &&
+            set.intersects(factors[list[i]]->set))
+          result.push_back(list[i]);
     }
   }
-  IndependentElementSet(const IndependentElementSet &ies) : 
-    elements(ies.elements),
-    wholeObjects(ies.wholeObjects) {}    
-
-  IndependentElementSet &operator=(const IndependentElementSet &ies) {
-    elements = ies.elements;
-    wholeObjects = ies.wholeObjects;
-    return *this;
-  }
 
-  void print(std::ostream &os) const {
-    os << "{";
-    bool first = true;
-    for (std::set<const Array*>::iterator it = wholeObjects.begin(), 
-           ie = wholeObjects.end(); it != ie; ++it) {
-      const Array *array = *it;
-
-      if (first) {
-        first = false;
-      } else {
-        os << ", ";
-      }
+  void add(ref<Expr> e) {
+    unsigned position = count++;
+    IndependentElementSet set(e);
+
+    std::vector<unsigned> hits;
+    getIntersecting(set, hits);
+
+    // Merge the intersecting factors into the largest one
+    unsigned target;
+    if (hits.empty()) {
+      target = factors.size();
+      factors.push_back(new IndependenceFactor());
+    } else {
+      std::sort(hits.begin(), hits.end());
+      target = hits[0];
+      for (unsigned i = 1; i < hits.size(); ++i)
+        if (factors[hits[i]]->members.size() >
+            factors[target]->members.size())
+          target = hits[i];
+    }
 
-      os << "MO" << array->name;
+    IndependenceFactor &factor = getMutableFactor(target);
+    std::vector<const Array*> arrays;
+    set.getArrays(arrays);
+    std::vector< ref<IndependenceFactor> > merged;
+    for (unsigned i = 0; i < hits.size(); ++i) {
+      if (hits[i] == target)
+        continue;
+      const IndependenceFactor &other = *factors[hits[i]];
+      merged.push_back(factors[hits[i]]);
+      factor.set.add(other.set);
+      other.set.getArrays(arrays);
+
+      std::vector< std::pair<unsigned, ref<Expr> > > members;
+      members.reserve(factor.members.size() + other.members.size());
+      std::merge(factor.members.begin(), factor.members.end(),
+                 other.members.begin(), other.members.end(),
+                 std::back_inserter(members), MemberLess());
+      factor.members.swap(members);
     }
-    for (elements_ty::const_iterator it = elements.begin(), ie = elements.end();
-         it != ie; ++it) {
-      const Array *array = it->first;
-      const DenseSet<unsigned> &dis = it->second;
-
-      if (first) {
-        first = false;
-      } else {
-        os << ", ";
-      }
+    factor.set.add(set);
+    factor.members.push_back(std::make_pair(position, e));
 
-      os << "MO" << array->name << " : " << dis;
+    for (unsigned i = 0; i < arrays.size(); ++i)
+      addReader(arrays[i], target);
+
+    // Remove the merged factors, from the last slot down, so that the
+    // slots still to remove do not move
+    for (unsigned i = hits.size(); i--;) {
+      if (hits[i] == target)
+        continue;
+      if (target == factors.size() - 1)
+        target = hits[i];
+      removeFactor(hits[i]);
     }
-    os << "}";
   }
 
-  // more efficient when this is the smaller set
-  bool intersects(const IndependentElementSet &b) {
-    for (std::set<const Array*>::iterator it = wholeObjects.begin(), 
-           ie = wholeObjects.end(); it != ie; ++it) {
-      const Array *array = *it;
-      if (b.wholeObjects.count(array) || 
-          b.elements.find(array) != b.elements.end())
-        return true;
-    }
-    for (elements_ty::iterator it = elements.begin(), ie = elements.end();
-         it != ie; ++it) {
-      const Array *array = it->first;
-      if (b.wholeObjects.count(array))
-        return true;
-      elements_ty::const_iterator it2 = b.elements.find(array);
-      if (it2 != b.elements.end()) {
-        if (it->second.intersects(it2->second))
-          return true;
-      }
-    }
-    return false;
+  /// Return the constraints of the factors \a fs, in their original order.
+  void getConstraints(const std::vector<unsigned> &fs,
+                      std::vector< ref<Expr> > &result) const {
+    std::vector< std::pair<unsigned, ref<Expr> > > members;
+    for (std::vector<unsigned>::const_iterator it = fs.begin(),
+           ie = fs.end(); it != ie; ++it)
+      members.insert(members.end(), factors[*it]->members.begin(),
+                     factors[*it]->members.end());
+    std::sort(members.begin(), members.end(), MemberLess());
+
+    for (unsigned i = 0; i < members.size(); ++i)
+      result.push_back(members[i].second);
   }
 
-  // returns true iff set is changed by addition
-  bool add(const IndependentElementSet &b) {
-    bool modified = false;
-    for (std::set<const Array*>::const_iterator it = b.wholeObjects.begin(), 
-           ie = b.wholeObjects.end(); it != ie; ++it) {
-      const Array *array = *it;
-      elements_ty::iterator it2 = elements.find(array);
-      if (it2!=elements.end()) {
-        modified = true;
-        elements.erase(it2);
-        wholeObjects.insert(array);
-      } else {
-        if (!wholeObjects.count(array)) {
-          modified = true;
-          wholeObjects.insert(array);
-        }
-      }
-    }
-    for (elements_ty::const_iterator it = b.elements.begin(), 
-           ie = b.elements.end(); it != ie; ++it) {
-      const Array *array = it->first;
-      if (!wholeObjects.count(array)) {
-        elements_ty::iterator it2 = elements.find(array);
-        if (it2==elements.end()) {
-          modified = true;
-          elements.insert(*it);
-        } else {
-          if (it2->second.add(it->second))
-            modified = true;
-        }
-      }
-    }
-    return modified;
+  const IndependentElementSet &getSet(unsigned f) const {
+    return factors[f]->set;
   }
+
+private:
+  struct MemberLess {
+    bool operator()(const std::pair<unsigned, ref<Expr> > &a,
+                    const std::pair<unsigned, ref<Expr> > &b) const {
+      return a.first < b.first;
+    }
+  };
 };
 
-inline std::ostream &operator<<(std::ostream &os, const IndependentElementSet &ies) {
-  ies.print(os);
-  return os;
 }
 
-static 
-IndependentElementSet getIndependentConstraints(
-                                const Query& query,
-                                std::vector< ref<Expr> > &result) {
-  IndependentElementSet eltsClosure(query.expr);
-  std::vector< std::pair<ref<Expr>, IndependentElementSet> > worklist;
-  //std::vector< std::pair<ref<Expr>, IndependentElementSet> > resultList;
-
-  for (ConstraintManager::const_iterator it = query.constraints.begin(), 
-         ie = query.constraints.end(); it != ie; ++it)
-    worklist.push_back(std::make_pair(*it, IndependentElementSet(*it)));
-
-  // XXX This should be more efficient (in terms of low level copy stuff).
-  bool done = false;
-  do {
-    done = true;
-    std::vector< std::pair<ref<Expr>, IndependentElementSet> > newWorklist;
-    for (std::vector< std::pair<ref<Expr>, IndependentElementSet> >::iterator
-           it = worklist.begin(), ie = worklist.end(); it != ie; ++it) {
-      if (it->second.intersects(eltsClosure)) {
-        if (eltsClosure.add(it->second))
-          done = false;
-        result.push_back(it->first);
-        //resultList.push_back(*it);
-      } else {
-        newWorklist.push_back(*it);
-      }
-    }
-    worklist.swap(newWorklist);
-  } while (!done);
-
-  /*
-  for (ConstraintManager::merge_conditions_ty::iterator
-              mi = query.constraints.mergeConditions.begin(),
-              me = query.constraints.mergeConditions.end(); mi != me; ++mi) {
-    IndependentElementSet ms(*mi);
-    for (std::vector< std::pair<ref<Expr>, IndependentElementSet > >::iterator
-              it = resultList.begin(), ie = resultList.end(); it != ie; ++it) {
-      if (it->second.intersects(ms))
-        mergeConditions.insert(*mi);
-    }
+/// Return the independence index of \a constraints, bringing the cached one
+/// up to date. The caller holds a SolverCacheLock while it uses the index.
+static const IndependenceIndex *getIndependenceIndex(
+                                const ConstraintManager &constraints) {
+  size_t covered = 0;
+  IndependenceIndex *index =
+    static_cast<IndependenceIndex*>(constraints.getSolverCache(covered));
+
+  if (index && covered == index->size() && covered == constraints.size())
+    return index;
+
+  if (!index || covered < index->size()) {
+    // Existing constraints were rewritten, start over
+    index = new IndependenceIndex();
+  } else if (index->refCount > 1) {
+    // Shared with a copy of the manager, which keeps the original
+    index = new IndependenceIndex(*index);
+    index->refCount = 0;
   }
-  */
-
-  if (0) {
-    std::set< ref<Expr> > reqset(result.begin(), result.end());
-    std::cerr << "--\n";
-    std::cerr << "Q: " << query.expr << "\n";
-    std::cerr << "\telts: " << IndependentElementSet(query.expr) << "\n";
-    int i = 0;
-  for (ConstraintManager::const_iterator it = query.constraints.begin(), 
-         ie = query.constraints.end(); it != ie; ++it) {
-      std::cerr << "C" << i++ << ": " << *it;
-      std::cerr << " " << (reqset.count(*it) ? "(required)" : "(independent)") << "\n";
-      std::cerr << "\telts: " << IndependentElementSet(*it) << "\n";
-    }
-    std::cerr << "elts closure: " << eltsClosure << "\n";
+
+  ConstraintManager::const_iterator it = constraints.begin(),
+    ie = constraints.end();
+  for (size_t i = 0; i < index->size(); ++i)
+    ++it;
+  for (; it != ie; ++it)
+    index->add(*it);
+
+  constraints.setSolverCache(index);
+  return index;
+}
+
+static void getIndependentConstraints(const Query& query,
+                                      std::vector< ref<Expr> > &result) {
+  ConstraintManager::SolverCacheLock lock;
+  const IndependenceIndex *index = getIndependenceIndex(query.constraints);
+
+  std::vector<unsigned> hits;
+  index->getIntersecting(IndependentElementSet(query.expr), hits);
+  index->getConstraints(hits, result);
+}
+
+void klee::getIndependentFactors(const Query &query,
+                                 std::vector<IndependentElementSet> &factors) {
+  ConstraintManager::SolverCacheLock lock;
+  const IndependenceIndex *index = getIndependenceIndex(query.constraints);
+
+  // The factors of the query expression merge into the first one
+  std::vector<unsigned> exprFactors;
+  if (!isa<ConstantExpr>(query.expr)) {
+    IndependentElementSet exprSet(query.expr);
+    index->getIntersecting(exprSet, exprFactors);
+    for (std::vector<unsigned>::iterator it = exprFactors.begin(),
+           ie = exprFactors.end(); it != ie; ++it)
+      exprSet.add(index->getSet(*it));
+    index->getConstraints(exprFactors, exprSet.exprs);
+    factors.push_back(exprSet);
   }
 
-  return eltsClosure;
+  for (unsigned f = 0; f < index->getFactorCount(); ++f) {
+    if (std::find(exprFactors.begin(), exprFactors.end(), f) !=
+          exprFactors.end())
+      continue;
+
+    factors.push_back(index->getSet(f));
+    index->getConstraints(std::vector<unsigned>(1, f), factors.back().exprs);
+  }
 }
 
 class IndependentSolver : public SolverImpl {
@@ -296,10 +299,7 @@ public:
   bool computeInitialValues(const Query& query,
                             const std::vector<const Array*> &objects,
                             std::vector< std::vector<unsigned char> > &values,
-                            bool &hasSolution) {
-    return solver->impl->computeInitialValues(query, objects, values,
-                                              hasSolution);
-  }
+                            bool &hasSolution);
 
   void cancelPendingJobs() { solver->impl->cancelPendingJobs(); }
 };
@@ -307,8 +307,7 @@ public:
 bool IndependentSolver::computeValidity(const Query& query,
                                         Solver::Validity &result) {
   std::vector< ref<Expr> > required;
-  IndependentElementSet eltsClosure =
-    getIndependentConstraints(query, required);
+  getIndependentConstraints(query, required);
   ConstraintManager tmp(required, query.constraints.ranges);
   return solver->impl->computeValidity(Query(tmp, query.expr), 
                                        result);
@@ -316,8 +315,7 @@ bool IndependentSolver::computeValidity(const Query& query,
 
 bool IndependentSolver::computeTruth(const Query& query, bool &isValid) {
   std::vector< ref<Expr> > required;
-  IndependentElementSet eltsClosure =
-    getIndependentConstraints(query, required);
+  getIndependentConstraints(query, required);
   ConstraintManager tmp(required, query.constraints.ranges);
   return solver->impl->computeTruth(Query(tmp, query.expr), 
                                     isValid);
@@ -325,12 +323,76 @@ bool IndependentSolver::computeTruth(const Query& query, bool &isValid) {
 
 bool IndependentSolver::computeValue(const Query& query, ref<Expr> &result) {
   std::vector< ref<Expr> > required;
-  IndependentElementSet eltsClosure =
-    getIndependentConstraints(query, required);
+  getIndependentConstraints(query, required);
   ConstraintManager tmp(required, query.constraints.ranges);
   return solver->impl->computeValue(Query(tmp, query.expr), result);
 }
 
+bool IndependentSolver::computeInitialValues(const Query& query,
+                            const std::vector<const Array*> &objects,
+                            std::vector< std::vector<unsigned char> > &values,
+                            bool &hasSolution) {
+  std::vector<IndependentElementSet> factors;
+  getIndependentFactors(query, factors);
+
+  ConstantExpr *CE = dyn_cast<ConstantExpr>(query.expr);
+  if (factors.size() < 2 || (CE && CE->isTrue()))
+    return solver->impl->computeInitialValues(query, objects, values,
+                                              hasSolution);
+
+  // Bytes no constraint refers to can take any value
+  std::vector< std::vector<unsigned char> > result;
+  result.reserve(objects.size());
+  for (unsigned i = 0; i < objects.size(); ++i)
+    result.push_back(std::vector<unsigned char>(objects[i]->size, 0));
+
+  // Solve each factor for the objects it refers to, a non-constant query
+  // expression belongs to the first one. Factors that neither hold the
+  // expression nor refer to a requested object are assumed satisfiable, as
+  // for the other queries.
+  for (unsigned i = 0; i < factors.size(); ++i) {
+    const IndependentElementSet &factor = factors[i];
+    bool holdsExpr = i == 0 && !CE;
+
+    std::vector<const Array*> arrays;
+    factor.getArrays(arrays);
+    std::vector<const Array*> factorObjects;
+    std::vector<unsigned> indices;
+    for (unsigned j = 0; j < objects.size(); ++j) {
+      if (std::find(arrays.begin(), arrays.end(), objects[j]) !=
+          arrays.end()) {
+        factorObjects.push_back(objects[j]);
+        indices.push_back(j);
+      }
+    }
+    if (factorObjects.empty() && !holdsExpr)
+      continue;
+
+    ConstraintManager tmp(factor.exprs);
+    ref<Expr> expr = query.expr;
+    if (!holdsExpr)
+      expr = ConstantExpr::alloc(0, Expr::Bool);
+    std::vector< std::vector<unsigned char> > factorValues;
+    if (!solver->impl->computeInitialValues(Query(tmp, expr), factorObjects,
+                                            factorValues, hasSolution))
+      return false;
+    if (!hasSolution)
+      return true;
+
+    for (unsigned j = 0; j < factorObjects.size(); ++j) {
+      const Array *array = factorObjects[j];
+      std::vector<unsigned char> &dest = result[indices[j]];
+      for (unsigned offset = 0; offset < array->size; ++offset)
+        if (factor.contains(array, offset))
+          dest[offset] = factorValues[j][offset];
+    }
+  }
+
+  values.swap(result);
+  hasSolution = true;
+  return true;
+}
+
 Solver *klee::createIndependentSolver(Solver *s) {
   return new Solver(new IndependentSolver(s));
 }
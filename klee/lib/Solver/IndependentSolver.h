@@ -0,0 +1,299 @@
+//===-- IndependentSolver.h -------------------------------------*- C++ -*-===//
+//
+//                     The KLEE Symbolic Virtual Machine
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef KLEE_INDEPENDENTSOLVER_H
+#define KLEE_INDEPENDENTSOLVER_H
+
+#include "klee/Expr.h"
+#include "klee/Solver.h"
+#include "klee/util/ExprUtil.h"
+
+#include <algorithm>
+#include <map>
+#include <ostream>
+#include <set>
+#include <vector>
+
+namespace klee {
+
+/// A set of small unsigned integers (byte offsets), stored as the sorted
+/// list of its non-empty 64-bit words.
+template<class T>
+class DenseSet {
+  typedef std::vector< std::pair<T, uint64_t> > words_ty;
+  words_ty words;
+
+  struct WordLess {
+    bool operator()(const std::pair<T, uint64_t> &a, T b) const {
+      return a.first < b;
+    }
+  };
+
+  uint64_t &getWord(T index) {
+    typename words_ty::iterator it =
+      std::lower_bound(words.begin(), words.end(), index, WordLess());
+    if (it == words.end() || it->first != index)
+      it = words.insert(it, std::make_pair(index, (uint64_t) 0));
+    return it->second;
+  }
+
+public:
+  DenseSet() {}
+
+  void add(T x) {
+    getWord(x / 64) |= 1ULL << (x % 64);
+  }
+  void add(T start, T end) {
+    for (; start<end; start++)
+      add(start);
+  }
+
+  // returns true iff set is changed by addition
+  bool add(const DenseSet &b) {
+    words_ty result;
+    result.reserve(words.size() + b.words.size());
+    bool modified = false;
+    typename words_ty::const_iterator ai = words.begin(), ae = words.end();
+    typename words_ty::const_iterator bi = b.words.begin(), be = b.words.end();
+    while (ai != ae || bi != be) {
+      if (bi == be || (ai != ae && ai->first < bi->first)) {
+        result.push_back(*ai++);
+      } else if (ai == ae || bi->first < ai->first) {
+        modified = true;
+        result.push_back(*bi++);
+      } else {
+        if (bi->second & ~ai->second)
+          modified = true;
+        result.push_back(std::make_pair(ai->first, ai->second | bi->second));
+        ++ai, ++bi;
+      }
+    }
+    if (modified)
+      words.swap(result);
+    return modified;
+  }
+
+  bool count(T x) const {
+    typename words_ty::const_iterator it =
+      std::lower_bound(words.begin(), words.end(), x / 64, WordLess());
+    return it != words.end() && it->first == x / 64 &&
+      (it->second & (1ULL << (x % 64)));
+  }
+
+  bool intersects(const DenseSet &b) const {
+    typename words_ty::const_iterator ai = words.begin(), ae = words.end();
+    typename words_ty::const_iterator bi = b.words.begin(), be = b.words.end();
+    while (ai != ae && bi != be) {
+      if (ai->first < bi->first) {
+        ++ai;
+      } else if (bi->first < ai->first) {
+        ++bi;
+      } else {
+        if (ai->second & bi->second)
+          return true;
+        ++ai, ++bi;
+      }
+    }
+    return false;
+  }
+
+  void print(std::ostream &os) const {
+    bool first = true;
+    os << "{";
+    for (typename words_ty::const_iterator it = words.begin(),
+           ie = words.end(); it != ie; ++it) {
+      for (unsigned bit = 0; bit < 64; ++bit) {
+        if (!(it->second & (1ULL << bit)))
+          continue;
+        if (first) {
+          first = false;
+        } else {
+          os << ",";
+        }
+        os << it->first * 64 + bit;
+      }
+    }
+    os << "}";
+  }
+};
+
+template<class T>
+inline std::ostream &operator<<(std::ostream &os, const DenseSet<T> &dis) {
+  dis.print(os);
+  return os;
+}
+
+class IndependentElementSet {
+  typedef std::map<const Array*, DenseSet<unsigned> > elements_ty;
+  elements_ty elements;
+  std::set<const Array*> wholeObjects;
+
+public:
+  /// The constraints making up this set, when it is used as a factor.
+  std::vector< ref<Expr> > exprs;
+
+  IndependentElementSet() {}
+  IndependentElementSet(ref<Expr> e) {
+    std::vector< ref<ReadExpr> > reads;
+    findReads(e, /* visitUpdates= */ true, reads);
+    for (unsigned i = 0; i != reads.size(); ++i) {
+      ReadExpr *re = reads[i].get();
+      const Array *array = re->updates.root;
+      
+      // Reads of a constant array don't alias.
+      if (re->updates.root->isConstantArray() &&
+          !re->updates.head)
+        continue;
+
+      if (!wholeObjects.count(array)) {
+        if (ConstantExpr *CE = dyn_cast<ConstantExpr>(re->index)) {
+          DenseSet<unsigned> &dis = elements[array];
+          dis.add((unsigned) CE->getZExtValue(32));
+        } else {
+          elements_ty::iterator it2 = elements.find(array);
+          if (it2!=elements.end())
+            elements.erase(it2);
+          wholeObjects.insert(array);
+        }
+      }
+    }
+  }
+  IndependentElementSet(const IndependentElementSet &ies) : 
+    elements(ies.elements),
+    wholeObjects(ies.wholeObjects),
+    exprs(ies.exprs) {}
+
+  IndependentElementSet &operator=(const IndependentElementSet &ies) {
+    exprs = ies.exprs;
+    elements = ies.elements;
+    wholeObjects = ies.wholeObjects;
+    return *this;
+  }
+
+  /// Append the arrays this set refers to, whole or in part, to \a result.
+  void getArrays(std::vector<const Array*> &result) const {
+    result.insert(result.end(), wholeObjects.begin(), wholeObjects.end());
+    for (elements_ty::const_iterator it = elements.begin(),
+           ie = elements.end(); it != ie; ++it)
+      result.push_back(it->first);
+  }
+
+  bool contains(const Array *array, unsigned index) const {
+    if (wholeObjects.count(array))
+      return true;
+    elements_ty::const_iterator it = elements.find(array);
+    return it != elements.end() && it->second.count(index);
+  }
+
+  void print(std::ostream &os) const {
+    os << "{";
+    bool first = true;
+    for (std::set<const Array*>::iterator it = wholeObjects.begin(), 
+           ie = wholeObjects.end(); it != ie; ++it) {
+      const Array *array = *it;
+
+      if (first) {
+        first = false;
+      } else {
+        os << ", ";
+      }
+
+      os << "MO" << array->name;
+    }
+    for (elements_ty::const_iterator it = elements.begin(), ie = elements.end();
+         it != ie; ++it) {
+      const Array *array = it->first;
+      const DenseSet<unsigned> &dis = it->second;
+
+      if (first) {
+        first = false;
+      } else {
+        os << ", ";
+      }
+
+      os << "MO" << array->name << " : " << dis;
+    }
+    os << "}";
+  }
+
+  // more efficient when this is the smaller set
+  bool intersects(const IndependentElementSet &b) const {
+    for (std::set<const Array*>::iterator it = wholeObjects.begin(), 
+           ie = wholeObjects.end(); it != ie; ++it) {
+      const Array *array = *it;
+      if (b.wholeObjects.count(array) || 
+          b.elements.find(array) != b.elements.end())
+        return true;
+    }
+    for (elements_ty::const_iterator it = elements.begin(), ie = elements.end();
+         it != ie; ++it) {
+      const Array *array = it->first;
+      if (b.wholeObjects.count(array))
+        return true;
+      elements_ty::const_iterator it2 = b.elements.find(array);
+      if (it2 != b.elements.end()) {
+        if (it->second.intersects(it2->second))
+          return true;
+      }
+    }
+    return false;
+  }
+
+  // returns true iff set is changed by addition
+  bool add(const IndependentElementSet &b) {
+    bool modified = false;
+    exprs.insert(exprs.end(), b.exprs.begin(), b.exprs.end());
+    for (std::set<const Array*>::const_iterator it = b.wholeObjects.begin(), 
+           ie = b.wholeObjects.end(); it != ie; ++it) {
+      const Array *array = *it;
+      elements_ty::iterator it2 = elements.find(array);
+      if (it2!=elements.end()) {
+        modified = true;
+        elements.erase(it2);
+        wholeObjects.insert(array);
+      } else {
+        if (!wholeObjects.count(array)) {
+          modified = true;
+          wholeObjects.insert(array);
+        }
+      }
+    }
+    for (elements_ty::const_iterator it = b.elements.begin(), 
+           ie = b.elements.end(); it != ie; ++it) {
+      const Array *array = it->first;
+      if (!wholeObjects.count(array)) {
+        elements_ty::iterator it2 = elements.find(array);
+        if (it2==elements.end()) {
+          modified = true;
+          elements.insert(*it);
+        } else {
+          if (it2->second.add(it->second))
+            modified = true;
+        }
+      }
+    }
+    return modified;
+  }
+};
+
+inline std::ostream &operator<<(std::ostream &os, const IndependentElementSet &ies) {
+  ies.print(os);
+  return os;
+}
+
+/// Partition the constraints of \a query into factors whose element sets do
+/// not intersect. Each factor lists its constraints in \c exprs. The element
+/// set of a non-constant query expression is merged in as well, so that its
+/// factor comes first in \a factors.
+void getIndependentFactors(const Query &query,
+                           std::vector<IndependentElementSet> &factors);
+
+}
+
+#endif /* KLEE_INDEPENDENTSOLVER_H */
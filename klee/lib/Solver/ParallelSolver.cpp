@@ -557,9 +557,10 @@ bool ParallelSolver::computeInitialValues(const Query& query,
 
 #endif
 
-Solver *createParallelSolver(unsigned solverCount, unsigned mainSolverTimeout, bool optimizeDivides, STPSolver *solver) {
-  //return new Solver(new ParallelSolver(solverCount, mainSolverTimeout, optimizeDivides, solver));
-  return NULL;
+Solver *createParallelSolver(unsigned solverCount, unsigned mainSolverTimeout, STPSolver *solver) {
+  // The low-level solver above is disabled, fall back to the thread pool of
+  // the high-level one
+  return createHLParallelSolver(solver, solverCount, mainSolverTimeout);
 }
 
 }
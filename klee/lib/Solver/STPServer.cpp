@@ -0,0 +1,602 @@
+//===-- STPServer.cpp -----------------------------------------------------===//
+//
+//                     The KLEE Symbolic Virtual Machine
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "STPServer.h"
+
+#include "STPBuilder.h"
+#include "SolverStats.h"
+
+#include "klee/util/ExprSerializer.h"
+
+#include "llvm/ADT/APInt.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <string>
+
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+using namespace klee;
+
+namespace {
+
+/// Reply codes of a server.
+enum {
+  QueryInvalid = 0,
+  QueryValid = 1,
+  QueryTimedOut = 2,
+  QueryCanceled = 3
+};
+
+/// The last byte of a reply, telling what became of the server.
+enum {
+  ServerKept = 0,
+  /// The server dropped its asserted constraints.
+  ServerReset = 1,
+  /// The query was aborted, and the server exited.
+  ServerExited = 2
+};
+
+bool readAll(int fd, void *p, size_t n) {
+  unsigned char *pos = (unsigned char*) p;
+  while (n > 0) {
+    ssize_t res = ::read(fd, pos, n);
+    if (res < 0 && errno == EINTR)
+      continue;
+    if (res <= 0)
+      return false;
+    pos += res;
+    n -= res;
+  }
+  return true;
+}
+
+bool writeAll(int fd, const void *p, size_t n) {
+  const unsigned char *pos = (const unsigned char*) p;
+  while (n > 0) {
+    // Do not die of SIGPIPE when the other end is gone
+    ssize_t res = ::send(fd, pos, n, MSG_NOSIGNAL);
+    if (res < 0 && errno == EINTR)
+      continue;
+    if (res <= 0)
+      return false;
+    pos += res;
+    n -= res;
+  }
+  return true;
+}
+
+/// Send a server, as its pid and (unless the pid is negative) the socket to
+/// it, over the unix socket \a fd.
+bool sendServer(int fd, pid_t pid, int serverFd) {
+  struct iovec iov;
+  iov.iov_base = &pid;
+  iov.iov_len = sizeof(pid);
+
+  char control[CMSG_SPACE(sizeof(int))];
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (pid > 0) {
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &serverFd, sizeof(int));
+  }
+
+  ssize_t res;
+  do {
+    res = ::sendmsg(fd, &msg, MSG_NOSIGNAL);
+  } while (res < 0 && errno == EINTR);
+  return res == sizeof(pid);
+}
+
+bool receiveServer(int fd, pid_t &pid, int &serverFd) {
+  struct iovec iov;
+  iov.iov_base = &pid;
+  iov.iov_len = sizeof(pid);
+
+  char control[CMSG_SPACE(sizeof(int))];
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  ssize_t res;
+  do {
+    res = ::recvmsg(fd, &msg, 0);
+  } while (res < 0 && errno == EINTR);
+  if (res != sizeof(pid))
+    return false;
+  if (pid <= 0)
+    return true;
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (!cmsg || cmsg->cmsg_level != SOL_SOCKET ||
+      cmsg->cmsg_type != SCM_RIGHTS)
+    return false;
+  memcpy(&serverFd, CMSG_DATA(cmsg), sizeof(int));
+  return true;
+}
+
+/// A validity checker and the state built on top of it, replaced as a whole
+/// once it can no longer be trusted or has grown for too long.
+class SolverContext {
+  VC vc;
+
+public:
+  STPBuilder *builder;
+  /// The arrays decoded so far, which cache their STP expression.
+  std::map<uint64_t, const Array*> knownArrays;
+  /// The number of asserted constraints.
+  unsigned levels;
+  unsigned queries;
+
+  SolverContext(bool optimizeDivides)
+    : vc(vc_createValidityChecker()), levels(0), queries(0) {
+#ifdef HAVE_EXT_STP
+    vc_setInterfaceFlags(vc, EXPRDELETE, 0);
+#endif
+    builder = new STPBuilder(vc, optimizeDivides);
+  }
+
+  ~SolverContext() {
+    delete builder;
+    for (std::map<uint64_t, const Array*>::iterator it = knownArrays.begin(),
+           ie = knownArrays.end(); it != ie; ++it)
+      delete it->second;
+    vc_Destroy(vc);
+  }
+
+  VC get() const { return vc; }
+};
+
+/// The state shared between a server and its signal handlers. A query is
+/// only aborted while it is armed, i.e., within vc_query().
+volatile sig_atomic_t serverFd = -1;
+volatile sig_atomic_t queryArmed = 0;
+volatile sig_atomic_t currentRequest = 0;
+volatile sig_atomic_t canceledRequest = 0;
+
+/// Reply \a status and exit. STP (or malloc) may be interrupted anywhere,
+/// so nothing but async-signal-safe calls can follow, and the server cannot
+/// go on.
+void abortQuery(uint8_t status) {
+  uint8_t reply[2] = { status, ServerExited };
+  ssize_t res = ::send(serverFd, reply, sizeof(reply), MSG_NOSIGNAL);
+  (void) res;
+  _exit(0);
+}
+
+void serverCancelHandler(int signal, siginfo_t *info, void *context) {
+  // The request may not be read yet, remember the cancellation for then
+  if (info->si_value.sival_int > canceledRequest)
+    canceledRequest = info->si_value.sival_int;
+  if (queryArmed && canceledRequest >= currentRequest)
+    abortQuery(QueryCanceled);
+}
+
+void serverTimeoutHandler(int signal) {
+  if (queryArmed)
+    abortQuery(QueryTimedOut);
+}
+
+/// Answer a single request with the given context, and write the reply to
+/// \a out.
+void serveQuery(SerialReader &in, SolverContext &context, unsigned keep,
+                unsigned timeout, SerialWriter &out) {
+  VC vc = context.get();
+  STPBuilder *builder = context.builder;
+
+  ExprDecoder decoder(in, context.knownArrays);
+  if (!decoder.decodeRecords())
+    _exit(1);
+
+  // Every constraint has its own context level
+  assert(keep <= context.levels && "keeping constraints never asserted");
+  for (; context.levels > keep; --context.levels)
+    vc_pop(vc);
+  for (unsigned i = 0, e = in.read32(); i != e; ++i, ++context.levels) {
+    vc_push(vc);
+    vc_assertFormula(vc, builder->construct(decoder.getExpr(in.read32())));
+  }
+
+  vc_push(vc);
+  ExprHandle stp_e = builder->construct(decoder.getExpr(in.read32()));
+
+  std::vector<const Array*> objects(in.read32());
+  for (unsigned i = 0; i < objects.size(); ++i)
+    objects[i] = decoder.getArray(in.read32());
+
+  // A cancellation that came before the query was armed is seen here
+  queryArmed = 1;
+  if (canceledRequest >= currentRequest)
+    abortQuery(QueryCanceled);
+  if (timeout)
+    ::alarm(timeout);
+  int status = vc_query(vc, stp_e) ? QueryValid : QueryInvalid;
+  queryArmed = 0;
+  ::alarm(0);
+
+  out.write8(status);
+  if (status == QueryInvalid) {
+    for (std::vector<const Array*>::const_iterator
+           it = objects.begin(), ie = objects.end(); it != ie; ++it) {
+      const Array *array = *it;
+      for (unsigned offset = 0; offset < array->size; offset++) {
+        ExprHandle counter =
+          vc_getCounterExample(vc, builder->getInitialRead(array, offset));
+        out.write8(getBVUnsigned(counter));
+      }
+    }
+  }
+
+  vc_pop(vc);
+}
+
+/// The server loop. A request is its length, followed by its sequence
+/// number, the number of asserted constraints to keep, the timeout in
+/// seconds, the record table of an ExprEncoder, and the ids of the
+/// constraints to push, of the query expression and of the arrays to compute
+/// values for. The reply is a byte with the outcome of the query, followed
+/// by the values when it is not valid, and by a byte telling what became of
+/// the server.
+///
+/// An aborted (timed out or canceled) query ends the server, which the pool
+/// replaces. Otherwise the server starts over with a fresh context every
+/// \a resetInterval queries.
+void serve(int fd, bool optimizeDivides, unsigned resetInterval) {
+  serverFd = fd;
+  SolverContext *context = new SolverContext(optimizeDivides);
+  std::vector<unsigned char> request;
+
+  for (;;) {
+    uint64_t length;
+    if (!readAll(fd, &length, sizeof(length)))
+      _exit(0);
+    request.resize(length);
+    if (!readAll(fd, &request[0], length))
+      _exit(0);
+
+    SerialReader in(&request[0], length);
+    currentRequest = in.read32();
+    unsigned keep = in.read32();
+    unsigned timeout = in.read32();
+
+    SerialWriter out;
+    serveQuery(in, *context, keep, timeout, out);
+
+    ++context->queries;
+    bool reset = resetInterval && context->queries >= resetInterval;
+    out.write8(reset ? ServerReset : ServerKept);
+
+    if (!writeAll(fd, &out.data[0], out.data.size()))
+      _exit(0);
+
+    if (reset) {
+      delete context;
+      context = new SolverContext(optimizeDivides);
+    }
+  }
+}
+
+/// The helper loop, forking a server for every byte read from \a fd and
+/// sending it back.
+void runHelper(int fd, bool optimizeDivides, unsigned resetInterval) {
+  // Let the servers be reaped as they exit
+  ::signal(SIGCHLD, SIG_IGN);
+
+  // Installed before any server is forked, so that an early cancellation
+  // does not kill the server
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_sigaction = serverCancelHandler;
+  action.sa_flags = SA_SIGINFO;
+  sigaction(SIGUSR1, &action, NULL);
+  ::signal(SIGALRM, serverTimeoutHandler);
+
+  for (;;) {
+    char c;
+    if (!readAll(fd, &c, sizeof(c)))
+      _exit(0);
+
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+      if (!sendServer(fd, -1, -1))
+        _exit(0);
+      continue;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+      close(fd);
+      close(fds[0]);
+      serve(fds[1], optimizeDivides, resetInterval);
+    }
+    close(fds[1]);
+
+    bool sent = sendServer(fd, pid, fds[0]);
+    // Only the pool keeps the other end, so that the server sees the end of
+    // its input when the pool is done with it
+    close(fds[0]);
+    if (!sent)
+      _exit(0);
+  }
+}
+
+}
+
+/***/
+
+STPServerPool::STPServerPool(bool optimizeDivides, unsigned count,
+                             unsigned resetInterval)
+  : helperFd(-1), helperPid(-1) {
+  pthread_mutex_init(&mutex, NULL);
+
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+    fprintf(stderr, "error: socketpair() for STP helper failed\n");
+    return;
+  }
+
+  fflush(stdout);
+  fflush(stderr);
+
+  helperPid = fork();
+  if (helperPid == -1) {
+    fprintf(stderr, "error: fork failed (for STP helper) - errno = %d\n",
+            errno);
+    close(fds[0]);
+    close(fds[1]);
+    return;
+  }
+
+  if (helperPid == 0) {
+    close(fds[0]);
+    runHelper(fds[1], optimizeDivides, resetInterval);
+  }
+
+  close(fds[1]);
+  helperFd = fds[0];
+
+  for (unsigned i = 0; i < count; ++i) {
+    Server *server = new Server();
+    spawn(server);
+    servers.push_back(server);
+  }
+}
+
+STPServerPool::~STPServerPool() {
+  for (std::vector<Server*>::iterator it = servers.begin(),
+         ie = servers.end(); it != ie; ++it) {
+    stop(*it);
+    delete *it;
+  }
+
+  // The helper exits when it sees the end of its input
+  if (helperPid > 0) {
+    close(helperFd);
+    pid_t res;
+    do {
+      res = waitpid(helperPid, 0, 0);
+    } while (res < 0 && errno == EINTR);
+  }
+
+  pthread_mutex_destroy(&mutex);
+}
+
+bool STPServerPool::spawn(Server *server) {
+  pid_t pid = -1;
+  int fd = -1;
+  char c = 0;
+  if (helperFd < 0 || !writeAll(helperFd, &c, sizeof(c)) ||
+      !receiveServer(helperFd, pid, fd)) {
+    fprintf(stderr, "error: STP helper is gone\n");
+    return false;
+  }
+  if (pid <= 0) {
+    fprintf(stderr, "error: fork failed (for STP server)\n");
+    return false;
+  }
+
+  server->pid = pid;
+  server->fd = fd;
+  server->asserted.clear();
+  ++stats::stpServerForks;
+
+  return true;
+}
+
+void STPServerPool::stop(Server *server) {
+  if (server->pid < 0)
+    return;
+
+  // A live server exits when it sees the end of its input, make sure a
+  // wedged one does too. The helper reaps it.
+  close(server->fd);
+  ::kill(server->pid, SIGKILL);
+
+  server->pid = -1;
+  server->fd = -1;
+  server->asserted.clear();
+}
+
+STPServerPool::Server *STPServerPool::acquire(const Query &query) {
+  pthread_mutex_lock(&mutex);
+
+  // Prefer the idle server sharing the most constraints with the query
+  Server *best = 0;
+  size_t bestShared = 0;
+  for (std::vector<Server*>::iterator it = servers.begin(),
+         ie = servers.end(); it != ie; ++it) {
+    Server *server = *it;
+    if (server->busy)
+      continue;
+
+    size_t shared = server->asserted.commonPrefix(query.constraints.getList());
+    if (!best || shared > bestShared) {
+      best = server;
+      bestShared = shared;
+    }
+  }
+
+  if (!best) {
+    best = new Server();
+    servers.push_back(best);
+  }
+
+  if (best->pid < 0 && !spawn(best)) {
+    pthread_mutex_unlock(&mutex);
+    return 0;
+  }
+
+  best->busy = true;
+  ++best->request;
+  pthread_mutex_unlock(&mutex);
+
+  return best;
+}
+
+void STPServerPool::release(Server *server, bool restart) {
+  pthread_mutex_lock(&mutex);
+
+  if (restart)
+    stop(server);
+
+  server->busy = false;
+  pthread_mutex_unlock(&mutex);
+}
+
+bool
+STPServerPool::computeInitialValues(const Query &query,
+                                    const std::vector<const Array*> &objects,
+                                    std::vector< std::vector<unsigned char> >
+                                      &values,
+                                    bool &hasSolution, double timeout) {
+  Server *server = acquire(query);
+  if (!server)
+    return false;
+
+  // Keep the asserted constraints shared with the query. Lists that were
+  // built separately may still share their leading constraints.
+  const ConstraintManager::constraint_list_ty &constraints =
+    query.constraints.getList();
+  size_t keep = server->asserted.commonPrefix(constraints);
+  ConstraintManager::const_iterator it = constraints.begin(),
+    ie = constraints.end();
+  ConstraintManager::const_iterator ait = server->asserted.begin(),
+    aie = server->asserted.end();
+  for (size_t i = 0; i < keep; ++i, ++it, ++ait) ;
+  for (; it != ie && ait != aie && it->get() == ait->get(); ++it, ++ait)
+    ++keep;
+  stats::queryConstraintsReused += keep;
+
+  SerialWriter out;
+  out.write64(0);
+  out.write32(server->request);
+  out.write32(keep);
+  out.write32(timeout ? std::max(1, (int) timeout) : 0);
+
+  ExprEncoder encoder(out);
+  std::vector<uint32_t> pushed;
+  for (; it != ie; ++it)
+    pushed.push_back(encoder.encode(*it));
+  uint32_t expr = encoder.encode(query.expr);
+  std::vector<uint32_t> arrays;
+  unsigned sum = 0;
+  for (std::vector<const Array*>::const_iterator
+         oi = objects.begin(), oe = objects.end(); oi != oe; ++oi) {
+    arrays.push_back(encoder.encode(*oi));
+    sum += (*oi)->size;
+  }
+  encoder.finish();
+
+  out.write32(pushed.size());
+  for (unsigned i = 0; i < pushed.size(); ++i)
+    out.write32(pushed[i]);
+  out.write32(expr);
+  out.write32(arrays.size());
+  for (unsigned i = 0; i < arrays.size(); ++i)
+    out.write32(arrays[i]);
+
+  uint64_t length = out.data.size() - sizeof(uint64_t);
+  memcpy(&out.data[0], &length, sizeof(length));
+
+  // A server that fails is restarted from scratch, so this only holds
+  // when the query goes through
+  server->asserted = constraints;
+
+  uint8_t status, outcome;
+  std::vector<unsigned char> data(sum);
+  if (!writeAll(server->fd, &out.data[0], out.data.size()) ||
+      !readAll(server->fd, &status, sizeof(status)) ||
+      (status == QueryInvalid && sum && !readAll(server->fd, &data[0], sum)) ||
+      !readAll(server->fd, &outcome, sizeof(outcome))) {
+    fprintf(stderr, "error: STP server did not return successfully\n");
+    release(server, true);
+    return false;
+  }
+  if (outcome == ServerReset)
+    server->asserted.clear();
+  release(server, outcome == ServerExited);
+
+  if (status == QueryTimedOut) {
+    fprintf(stderr, "error: STP timed out\n");
+    return false;
+  } else if (status == QueryCanceled) {
+    return false;
+  }
+
+  hasSolution = status == QueryInvalid;
+  if (hasSolution) {
+    values = std::vector< std::vector<unsigned char> >(objects.size());
+    unsigned char *pos = data.empty() ? 0 : &data[0];
+    for (unsigned i = 0; i < objects.size(); ++i) {
+      values[i].insert(values[i].begin(), pos, pos + objects[i]->size);
+      pos += objects[i]->size;
+    }
+  }
+
+  return true;
+}
+
+void STPServerPool::cancelPendingJobs() {
+  pthread_mutex_lock(&mutex);
+
+  for (std::vector<Server*>::iterator it = servers.begin(),
+         ie = servers.end(); it != ie; ++it) {
+    Server *server = *it;
+    if (server->busy && server->pid > 0) {
+      // Tell the server which request to abort, in case it already moved
+      // on to the next one
+      union sigval value;
+      value.sival_int = server->request;
+      int res = ::sigqueue(server->pid, SIGUSR1, value);
+      if (res == -1) {
+        assert(errno == ESRCH);
+      }
+    }
+  }
+
+  pthread_mutex_unlock(&mutex);
+}
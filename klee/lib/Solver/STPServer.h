@@ -0,0 +1,80 @@
+//===-- STPServer.h ---------------------------------------------*- C++ -*-===//
+//
+//                     The KLEE Symbolic Virtual Machine
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef KLEE_STPSERVER_H
+#define KLEE_STPSERVER_H
+
+#include "klee/Constraints.h"
+#include "klee/Expr.h"
+#include "klee/Solver.h"
+
+#include <pthread.h>
+#include <sys/types.h>
+
+#include <vector>
+
+namespace klee {
+
+/// A pool of long-lived solver processes, fed serialised queries over a
+/// socket, instead of forking the whole interpreter for every query. The
+/// servers are forked by a small helper process, itself forked when the
+/// pool is created, so that replacing a server does not fork the (by then
+/// large) interpreter.
+///
+/// Each server keeps an assertion stack with one STP context level per
+/// constraint. A query only sends the constraints past the longest prefix
+/// (by identity) it shares with the constraints already asserted in the
+/// server, so consecutive queries from the same path only push the new
+/// suffix.
+class STPServerPool {
+  struct Server {
+    pid_t pid;
+    int fd;
+    bool busy;
+    /// The sequence number of the last request sent to the server, used to
+    /// cancel it.
+    int request;
+    /// The constraints currently asserted in the server.
+    ConstraintManager::constraint_list_ty asserted;
+
+    Server() : pid(-1), fd(-1), busy(false), request(0) {}
+  };
+
+  /// The socket to the helper process forking the servers.
+  int helperFd;
+  pid_t helperPid;
+
+  pthread_mutex_t mutex;
+  std::vector<Server*> servers;
+
+  bool spawn(Server *server);
+  void stop(Server *server);
+  Server *acquire(const Query &query);
+  void release(Server *server, bool restart);
+
+public:
+  /// Start \a count servers. More are started on demand, when all of them
+  /// are busy. Every server starts over with a fresh STP context after
+  /// \a resetInterval queries (0 for never), to bound its memory use.
+  STPServerPool(bool optimizeDivides, unsigned count, unsigned resetInterval);
+  ~STPServerPool();
+
+  bool computeInitialValues(const Query &query,
+                            const std::vector<const Array*> &objects,
+                            std::vector< std::vector<unsigned char> > &values,
+                            bool &hasSolution, double timeout);
+
+  /// Abort the queries currently being solved. The servers answer them as
+  /// unknown and exit, and are replaced on the next query.
+  void cancelPendingJobs();
+};
+
+}
+
+#endif
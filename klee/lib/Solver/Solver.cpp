@@ -12,6 +12,7 @@
 
 #include "SolverStats.h"
 #include "STPBuilder.h"
+#include "STPServer.h"
 
 #include "klee/Constraints.h"
 #include "klee/Expr.h"
@@ -27,6 +28,7 @@
 #else
 #include "llvm/Support/Process.h"
 #endif
+#include "llvm/Support/CommandLine.h"
 
 #include "cloud9/instrum/Timing.h"
 #include "cloud9/instrum/InstrumentationManager.h"
@@ -59,6 +61,23 @@ using cloud9::instrum::Timer;
 
 #define SHARED_MEM_SIZE	(1<<20)
 
+namespace {
+  cl::opt<unsigned>
+  STPServers("stp-servers",
+             cl::init(1),
+             cl::desc("Number of persistent STP server processes started "
+                      "with --use-forked-stp, more are started when they "
+                      "are all busy; 0 forks a process per query "
+                      "(default=1)"));
+
+  cl::opt<unsigned>
+  STPServerResetInterval("stp-server-reset-interval",
+                         cl::init(1000),
+                         cl::desc("Number of queries after which an STP "
+                                  "server starts over with a fresh context, "
+                                  "0 for never (default=1000)"));
+}
+
 const ConstraintManager Query::emptyConstraintManager;
 
 Query Query::asOneExpr() const {
@@ -463,6 +482,10 @@ private:
 
   pthread_key_t shmSegmentKey;
 
+  /// The persistent solver processes used instead of forking per query,
+  /// if any.
+  STPServerPool *servers;
+
 public:
   STPSolverImpl(STPSolver *_solver, bool _useForkedSTP, bool _optimizeDivides,
       bool _enabledLogging);
@@ -496,7 +519,8 @@ STPSolverImpl::STPSolverImpl(STPSolver *_solver, bool _useForkedSTP,
     builder(new STPBuilder(vc, _optimizeDivides)),
     timeout(0.0),
     useForkedSTP(_useForkedSTP),
-    enableLogging(_enabledLogging)
+    enableLogging(_enabledLogging),
+    servers(0)
 {
   assert(vc && "unable to create validity checker");
   assert(builder && "unable to create STPBuilder");
@@ -524,9 +548,15 @@ STPSolverImpl::STPSolverImpl(STPSolver *_solver, bool _useForkedSTP,
   }
 
   pthread_key_create(&shmSegmentKey, (void (*)(void*)) shmdt);
+
+  // Fork the server helper now, while the process is still small
+  if (useForkedSTP && STPServers)
+    servers = new STPServerPool(_optimizeDivides, STPServers,
+                                STPServerResetInterval);
 }
 
 STPSolverImpl::~STPSolverImpl() {
+  delete servers;
   delete builder;
 
   //shmdt(defaultShMem);
@@ -595,7 +625,7 @@ void STPSolver::cancelPendingJobs() {
 
 char *STPSolverImpl::getConstraintLog(const Query &query) {
   vc_push(vc);
-  for (std::vector< ref<Expr> >::const_iterator it = query.constraints.begin(), 
+  for (ConstraintManager::const_iterator it = query.constraints.begin(), 
          ie = query.constraints.end(); it != ie; ++it)
     vc_assertFormula(vc, builder->construct(*it));
   assert(query.expr == ConstantExpr::alloc(0, Expr::Bool) &&
@@ -657,6 +687,28 @@ STPSolverImpl::computeInitialValues(const Query& query,
   ++stats::queries;
   ++stats::queryCounterexamples;
 
+  if (servers) {
+    Timer timer;
+    if (enableLogging) timer.start();
+
+    if (!servers->computeInitialValues(query, objects, values, hasSolution,
+                                       timeout))
+      return false;
+
+    if (enableLogging) {
+      timer.stop();
+      cloud9::instrum::theInstrManager.recordEventAttribute(cloud9::instrum::SMTSolve,
+          cloud9::instrum::SolvingResult, (int)hasSolution);
+      cloud9::instrum::theInstrManager.recordEvent(cloud9::instrum::SMTSolve, timer);
+    }
+
+    if (hasSolution)
+      ++stats::queriesInvalid;
+    else
+      ++stats::queriesValid;
+    return true;
+  }
+
   unsigned char *pos = (unsigned char*) pthread_getspecific(shmSegmentKey);
   if (pos == NULL) {
     int shmID = shmget(IPC_PRIVATE, SHARED_MEM_SIZE, IPC_CREAT | 0700);
@@ -889,6 +941,11 @@ void STPSolverImpl::cancelPendingJobs() {
   if (!useForkedSTP)
     return; // Really nothing to do, a single instance is running at a time
 
+  if (servers) {
+    servers->cancelPendingJobs();
+    return;
+  }
+
   pthread_mutex_lock(&mutex);
 
   for (std::set<pid_t>::iterator it = solverInstances.begin();
@@ -11,13 +11,19 @@
 
 using namespace klee;
 
+Statistic stats::cexCacheFlushes("CexCacheFlushes", "CCflush");
 Statistic stats::cexCacheTime("CexCacheTime", "CCtime", true);
+Statistic stats::parallelSubqueries("ParallelSubqueries", "PSq");
+Statistic stats::parallelSubqueryWins("ParallelSubqueryWins", "PSqW");
 Statistic stats::queries("Queries", "Q");
 Statistic stats::queriesInvalid("QueriesInvalid", "Qiv");
 Statistic stats::queriesValid("QueriesValid", "Qv");
 Statistic stats::queryCacheHits("QueryCacheHits", "QChits") ;
+Statistic stats::queryCacheEvictions("QueryCacheEvictions", "QCevict");
 Statistic stats::queryCacheMisses("QueryCacheMisses", "QCmisses");
+Statistic stats::queryConstraintsReused("QueryConstraintsReused", "QCreuse");
 Statistic stats::queryConstructTime("QueryConstructTime", "QBtime", true);
 Statistic stats::queryConstructs("QueriesConstructs", "QB");
 Statistic stats::queryCounterexamples("QueriesCEX", "Qcex");
 Statistic stats::queryTime("QueryTime", "Qtime", true);
+Statistic stats::stpServerForks("STPServerForks", "STPfork");
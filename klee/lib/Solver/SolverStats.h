@@ -15,16 +15,22 @@
 namespace klee {
 namespace stats {
 
+  extern Statistic cexCacheFlushes;
   extern Statistic cexCacheTime;
+  extern Statistic parallelSubqueries;
+  extern Statistic parallelSubqueryWins;
   extern Statistic queries;
   extern Statistic queriesInvalid;
   extern Statistic queriesValid;
   extern Statistic queryCacheHits;
+  extern Statistic queryCacheEvictions;
   extern Statistic queryCacheMisses;
+  extern Statistic queryConstraintsReused;
   extern Statistic queryConstructTime;
   extern Statistic queryConstructs;
   extern Statistic queryCounterexamples;
   extern Statistic queryTime;
+  extern Statistic stpServerForks;
 
 }
 }
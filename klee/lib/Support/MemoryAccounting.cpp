@@ -0,0 +1,26 @@
+//===-- MemoryAccounting.cpp ----------------------------------------------===//
+//
+//                     The KLEE Symbolic Virtual Machine
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "klee/Internal/Support/MemoryAccounting.h"
+
+using namespace klee;
+
+volatile int64_t MemoryAccounting::bytes[MemoryAccounting::NumCategories];
+
+const char *MemoryAccounting::getName(Category category) {
+  switch (category) {
+  case Exprs: return "MemExprs";
+  case ObjectStates: return "MemObjectStates";
+  case Constraints: return "MemConstraints";
+  case QCEMaps: return "MemQCEMaps";
+  case SolverCaches: return "MemSolverCaches";
+  case ProcessTree: return "MemProcessTree";
+  default: return "MemUnknown";
+  }
+}
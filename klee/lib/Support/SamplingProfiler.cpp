@@ -0,0 +1,100 @@
+//===-- SamplingProfiler.cpp ----------------------------------------------===//
+//
+//                     The KLEE Symbolic Virtual Machine
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "klee/Internal/Support/SamplingProfiler.h"
+
+#include <cstring>
+#include <sys/resource.h>
+#include <sys/time.h>
+
+using namespace klee;
+
+volatile sig_atomic_t SamplingProfiler::current = Interpretation;
+volatile sig_atomic_t SamplingProfiler::pending = 0;
+uint64_t SamplingProfiler::interval = 0;
+uint64_t SamplingProfiler::lastUserTime = 0;
+
+// The ticks by activity, updated atomically since the signal may be
+// delivered to any thread
+static volatile unsigned activityTicks[SamplingProfiler::NumActivities];
+
+static uint64_t getUserMicroseconds() {
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0)
+    return 0;
+  return (uint64_t) usage.ru_utime.tv_sec * 1000000 + usage.ru_utime.tv_usec;
+}
+
+void SamplingProfiler::handleTick(int signal) {
+  sig_atomic_t activity = current;
+  if (activity < 0 || activity >= NumActivities)
+    activity = Interpretation;
+
+  __sync_fetch_and_add(&activityTicks[activity], 1);
+  pending = 1;
+}
+
+bool SamplingProfiler::start(uint64_t microseconds) {
+  if (microseconds == 0 || isRunning())
+    return false;
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = handleTick;
+  // Do not fail the system calls the signal interrupts (e.g., socket reads)
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  if (sigaction(SIGPROF, &action, 0) != 0)
+    return false;
+
+  struct itimerval timer;
+  timer.it_interval.tv_sec = microseconds / 1000000;
+  timer.it_interval.tv_usec = microseconds % 1000000;
+  timer.it_value = timer.it_interval;
+  if (setitimer(ITIMER_PROF, &timer, 0) != 0) {
+    signal(SIGPROF, SIG_DFL);
+    return false;
+  }
+
+  interval = microseconds;
+  lastUserTime = getUserMicroseconds();
+  return true;
+}
+
+void SamplingProfiler::stop() {
+  if (!isRunning())
+    return;
+
+  struct itimerval timer;
+  memset(&timer, 0, sizeof(timer));
+  setitimer(ITIMER_PROF, &timer, 0);
+  signal(SIGPROF, SIG_IGN);
+
+  interval = 0;
+}
+
+uint64_t SamplingProfiler::takeSamples(uint64_t times[NumActivities]) {
+  unsigned ticks[NumActivities];
+  unsigned totalTicks = 0;
+
+  pending = 0;
+  for (unsigned i = 0; i < NumActivities; ++i) {
+    ticks[i] = __sync_lock_test_and_set(&activityTicks[i], 0);
+    totalTicks += ticks[i];
+  }
+
+  uint64_t now = getUserMicroseconds();
+  uint64_t total = (now > lastUserTime) ? now - lastUserTime : 0;
+  lastUserTime = now;
+
+  for (unsigned i = 0; i < NumActivities; ++i)
+    times[i] = totalTicks ? total * ticks[i] / totalTicks : 0;
+
+  return total;
+}
@@ -40,6 +40,8 @@
 #include <unistd.h>
 #include <sys/wait.h>
 #include <sys/types.h>
+#include <sys/prctl.h>
+#include <signal.h>
 
 #if (LLVM_VERSION_MAJOR == 2 && LLVM_VERSION_MINOR < 7)
 #include "llvm/ModuleProvider.h"
@@ -79,6 +81,7 @@
 #include "klee/Internal/System/Time.h"
 #include "klee/Internal/Support/ModuleUtil.h"
 #include "klee/Init.h"
+#include "klee/KleeHandler.h"
 
 #include "cloud9/Logger.h"
 #include "cloud9/ExecutionTree.h"
@@ -104,6 +107,11 @@ cl::opt<bool>
 cl::opt<std::string> ReplayPath("c9-replay-path", cl::desc(
 		"Instead of executing jobs, just do a replay of a path. No load balancer involved."));
 
+cl::opt<unsigned> LocalWorkers("c9-local-workers",
+		cl::desc("Number of workers to fork once the program is loaded. They share "
+				"its memory and use consecutive local ports, from --c9-local-port on"),
+		cl::init(1));
+
 }
 
 static bool Interrupted = false;
@@ -267,8 +275,39 @@ int main(int argc, char **argv, char **envp) {
 	char **pEnvp;
 	klee::readProgramArguments(pArgc, pArgv, pEnvp, envp);
 
+	// Run the executor preparation (instrumentation, QCE analysis, info
+	// tables) once, before forking, so that the siblings share the prepared
+	// module pages until they write them, and lay out the module at the same
+	// addresses (see --transfer-states). The interpreter, its solvers and the
+	// output files are only created after the fork, in every worker.
+	klee::KModule *kmodule = JobManager::prepareModule(mainModule);
+
+	std::vector<int> siblings;
+	unsigned siblingIndex = 0;
+
+	if (LocalWorkers > 1 && !StandAlone && ReplayPath.size() == 0) {
+		for (unsigned i = 1; i < LocalWorkers; i++) {
+			int pid = fork();
+			if (pid < 0) {
+				CLOUD9_EXIT("Unable to fork sibling worker " << i);
+			} else if (pid == 0) {
+				siblingIndex = i;
+				siblings.clear();
+				// Do not outlive the first worker, which the watchdog controls
+				prctl(PR_SET_PDEATHSIG, SIGKILL);
+				break;
+			}
+			siblings.push_back(pid);
+		}
+
+		if (siblingIndex > 0) {
+			LocalPort += siblingIndex;
+			klee::KleeHandler::setSiblingIndex(siblingIndex);
+		}
+	}
+
 	// Create the job manager
-	theJobManager = new JobManager(mainModule, "main", pArgc, pArgv, envp);
+	theJobManager = new JobManager(kmodule, "main", pArgc, pArgv, envp);
 
 	if (ReplayPath.size() > 0) {
       CLOUD9_INFO("Running in replay mode. No load balancer involved.");
@@ -306,5 +345,11 @@ int main(int argc, char **argv, char **envp) {
 	delete theJobManager;
 	theJobManager = NULL;
 
+	for (unsigned i = 0; i < siblings.size(); i++) {
+		int status;
+		while (waitpid(siblings[i], &status, 0) < 0 && errno == EINTR)
+			;
+	}
+
 	return 0;
 }
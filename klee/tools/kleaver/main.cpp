@@ -264,7 +264,23 @@ static bool EvaluateInputAST(const char *Filename,
       << "invalid queries = " 
       << *theStatisticManager->getStatisticByName("QueriesInvalid") << "\n"
       << "query cex = " 
-      << *theStatisticManager->getStatisticByName("QueriesCEX") << "\n";
+      << *theStatisticManager->getStatisticByName("QueriesCEX") << "\n"
+      << "query cache hits = "
+      << *theStatisticManager->getStatisticByName("QueryCacheHits") << "\n"
+      << "query cache misses = "
+      << *theStatisticManager->getStatisticByName("QueryCacheMisses") << "\n";
+  }
+
+  if (Expr::hashConsing) {
+    std::cout
+      << "--\n"
+      << "expression cache hits = "
+      << *theStatisticManager->getStatisticByName("ExprCacheHits") << "\n"
+      << "expression cache misses = "
+      << *theStatisticManager->getStatisticByName("ExprCacheMisses") << "\n"
+      << "expression bytes saved = "
+      << *theStatisticManager->getStatisticByName("ExprCacheSavedBytes")
+      << "\n";
   }
 
   return success;
@@ -193,8 +193,59 @@ static void run_monitored(char *executable, int argc, char **argv) {
   }
 }
 
+/* Replays the test case loaded in input */
+static void replay_test(char *executable, const char *input_fname,
+                        int first) {
+  int prg_argc;
+  char ** prg_argv;  
+  unsigned i;
+
+  obj_index = 0;
+  prg_argc = input->numArgs;
+  prg_argv = input->args;
+  prg_argv[0] = executable;
+  klee_init_env(&prg_argc, &prg_argv);
+
+  if (!first)
+    fprintf(stderr, "\n");
+  fprintf(stderr, "%s: TEST CASE: %s\n", progname, input_fname);
+  fprintf(stderr, "%s: ARGS: ", progname);
+  for (i=0; i != (unsigned) prg_argc; ++i) {
+    char *s = prg_argv[i];
+    if (s[0]=='A' && s[1] && !s[2]) s[1] = '\0';
+    fprintf(stderr, "\"%s\" ", prg_argv[i]); 
+  }
+  fprintf(stderr, "\n");
+
+  /* Run the test case machinery in a subprocess, eventually this parent
+     process should be a script or something which shells out to the actual
+     execution tool. */
+  int pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    _exit(66);
+  } else if (pid == 0) {
+    /* Create the input files, pipes, etc., and run the process. */
+    replay_create_files(&__exe_fs);
+    run_monitored(executable, prg_argc, prg_argv);
+    _exit(0);
+  } else {
+    /* Wait for the test case. */
+    int res, status;
+
+    do {
+      res = waitpid(pid, &status, 0);
+    } while (res < 0 && errno == EINTR);
+    
+    if (res < 0) {
+      perror("waitpid");
+      _exit(66);
+    }
+  }
+}
+
 static void usage(void) {
-  fprintf(stderr, "Usage: %s <executable> { <ktest-files> }\n", progname);
+  fprintf(stderr, "Usage: %s <executable> { <ktest-files> | <test-bundles> }\n", progname);
   fprintf(stderr, "   or: %s --create-files-only <ktest-file>\n", progname);
   fprintf(stderr, "\n");
   fprintf(stderr, "Set KLEE_REPLAY_TIMEOUT environment variable to set a timeout (in seconds).\n");
@@ -248,9 +299,42 @@ int main(int argc, char** argv) {
   fclose(f);
 
   int idx = 0;
+  int first = 1;
   for (idx = 2; idx != argc; ++idx) {
     char* input_fname = argv[idx];
-    unsigned i;
+
+    if (kTestBundle_isBundleFile(input_fname)) {
+      KTestBundle *bundle = kTestBundle_open(input_fname);
+      unsigned i;
+
+      if (!bundle) {
+        fprintf(stderr, "%s: error: test bundle %s not valid.\n", progname,
+                input_fname);
+        exit(1);
+      }
+
+      for (i = 0; i != kTestBundle_numEntries(bundle); ++i) {
+        char test_name[1024];
+
+        if (strcmp(kTestBundle_getEntrySuffix(bundle, i), "ktest"))
+          continue;
+
+        snprintf(test_name, sizeof(test_name), "%s:test%06d.ktest",
+                 input_fname, kTestBundle_getEntryID(bundle, i));
+        input = kTestBundle_getTest(bundle, i);
+        if (!input) {
+          fprintf(stderr, "%s: error: input file %s not valid.\n", progname,
+                  test_name);
+          exit(1);
+        }
+
+        replay_test(executable, test_name, first);
+        first = 0;
+      }
+
+      kTestBundle_close(bundle);
+      continue;
+    }
     
     input = kTest_fromFile(input_fname);
     if (!input) {
@@ -258,49 +342,9 @@ int main(int argc, char** argv) {
               input_fname);
       exit(1);
     }
-    
-    obj_index = 0;
-    prg_argc = input->numArgs;
-    prg_argv = input->args;
-    prg_argv[0] = argv[1];
-    klee_init_env(&prg_argc, &prg_argv);
 
-    if (idx > 2)
-      fprintf(stderr, "\n");
-    fprintf(stderr, "%s: TEST CASE: %s\n", progname, input_fname);
-    fprintf(stderr, "%s: ARGS: ", progname);
-    for (i=0; i != (unsigned) prg_argc; ++i) {
-      char *s = prg_argv[i];
-      if (s[0]=='A' && s[1] && !s[2]) s[1] = '\0';
-      fprintf(stderr, "\"%s\" ", prg_argv[i]); 
-    }
-    fprintf(stderr, "\n");
-
-    /* Run the test case machinery in a subprocess, eventually this parent
-       process should be a script or something which shells out to the actual
-       execution tool. */
-    int pid = fork();
-    if (pid < 0) {
-      perror("fork");
-      _exit(66);
-    } else if (pid == 0) {
-      /* Create the input files, pipes, etc., and run the process. */
-      replay_create_files(&__exe_fs);
-      run_monitored(executable, prg_argc, prg_argv);
-      _exit(0);
-    } else {
-      /* Wait for the test case. */
-      int res, status;
-
-      do {
-        res = waitpid(pid, &status, 0);
-      } while (res < 0 && errno == EINTR);
-      
-      if (res < 0) {
-        perror("waitpid");
-        _exit(66);
-      }
-    }
+    replay_test(executable, input_fname, first);
+    first = 0;
   }
 
   return 0;
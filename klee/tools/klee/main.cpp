@@ -364,6 +364,8 @@ int main(int argc, char **argv, char **envp) {
   const Module *finalModule = 
     interpreter->setModule(mainModule, mOpts);
   externalsAndGlobalsCheck(finalModule);
+  // The module may have been replaced by a cached one
+  mainFn = finalModule->getFunction("main");
 
   if (ReplayPathFile != "") {
     interpreter->setReplayPath(&replayPath);
@@ -480,6 +482,7 @@ int main(int argc, char **argv, char **envp) {
   strcpy(format_tdiff(buf, t[1] - t[0]), "\n");
   infoFile << buf;
 
+  handler->flushTestCases();
   delete interpreter;
 
   uint64_t queries = 
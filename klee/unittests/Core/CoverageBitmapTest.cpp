@@ -0,0 +1,83 @@
+//===-- CoverageBitmapTest.cpp --------------------------------------------===//
+//
+//                     The KLEE Symbolic Virtual Machine
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "gtest/gtest.h"
+
+#include "klee/Internal/ADT/CoverageBitmap.h"
+
+#include <vector>
+
+using namespace klee;
+
+namespace {
+
+TEST(CoverageBitmapTest, SetAndTest) {
+  CoverageBitmap b;
+  EXPECT_TRUE(b.empty());
+  EXPECT_FALSE(b.test(5));
+
+  EXPECT_TRUE(b.set(5));
+  EXPECT_FALSE(b.set(5));
+  EXPECT_TRUE(b.set(200));
+  EXPECT_TRUE(b.test(5));
+  EXPECT_TRUE(b.test(200));
+  EXPECT_FALSE(b.test(6));
+  EXPECT_FALSE(b.test(100000));
+
+  std::vector<unsigned> ids;
+  b.getIDs(ids);
+  ASSERT_EQ(2U, ids.size());
+  EXPECT_EQ(5U, ids[0]);
+  EXPECT_EQ(200U, ids[1]);
+}
+
+TEST(CoverageBitmapTest, CopyOnWrite) {
+  CoverageBitmap a;
+  a.set(1);
+
+  CoverageBitmap b(a);
+  EXPECT_TRUE(b.test(1));
+
+  // Covering something new detaches the copy only
+  b.set(70);
+  EXPECT_TRUE(b.test(70));
+  EXPECT_FALSE(a.test(70));
+
+  b.clear();
+  EXPECT_TRUE(b.empty());
+  EXPECT_TRUE(a.test(1));
+}
+
+TEST(CoverageBitmapTest, Merge) {
+  CoverageBitmap a, b;
+  a.set(3);
+  b.set(3);
+  b.set(130);
+
+  a.merge(b);
+  EXPECT_TRUE(a.test(3));
+  EXPECT_TRUE(a.test(130));
+  EXPECT_EQ(3U, a.getNumWords());
+
+  // Merging a subset leaves the set unchanged
+  CoverageBitmap c;
+  c.set(130);
+  a.merge(c);
+  std::vector<unsigned> ids;
+  a.getIDs(ids);
+  EXPECT_EQ(2U, ids.size());
+
+  CoverageBitmap d;
+  d.merge(a);
+  EXPECT_TRUE(d.test(130));
+  d.set(4);
+  EXPECT_FALSE(a.test(4));
+}
+
+}
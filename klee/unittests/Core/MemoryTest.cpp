@@ -0,0 +1,225 @@
+//===-- MemoryTest.cpp ----------------------------------------------------===//
+//
+//                     The KLEE Symbolic Virtual Machine
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include <iostream>
+#include "gtest/gtest.h"
+
+#include "klee/Expr.h"
+#include "klee/Internal/Support/Timer.h"
+
+#include "../../lib/Core/Context.h"
+#include "../../lib/Core/Memory.h"
+
+#include <vector>
+
+using namespace klee;
+
+namespace {
+
+typedef std::vector<std::pair<unsigned, unsigned> > ranges_ty;
+
+void initContext() {
+  static bool initialized = false;
+  if (!initialized) {
+    Context::initialize(true, Expr::Int64);
+    initialized = true;
+  }
+}
+
+// The reference implementation: compare the objects byte by byte
+unsigned countDifferentBytes(const ObjectState &a, const ObjectState &b) {
+  unsigned count = 0;
+  for (unsigned i = 0; i < a.size; i++) {
+    if (a.read8(i) != b.read8(i))
+      count++;
+  }
+  return count;
+}
+
+unsigned countRangeBytes(const ranges_ty &ranges) {
+  unsigned count = 0;
+  for (ranges_ty::const_iterator it = ranges.begin(), ie = ranges.end();
+       it != ie; ++it)
+    count += it->second - it->first;
+  return count;
+}
+
+TEST(MemoryTest, IdenticalObjects) {
+  initContext();
+  MemoryObject *mo = new MemoryObject(0x1000, 100, false, false, false, 0);
+  ObjectState a(mo);
+  a.initializeToZero();
+  ObjectState b(a);
+
+  ranges_ty ranges;
+  a.getDifferentRanges(a, ranges);
+  EXPECT_TRUE(ranges.empty());
+  a.getDifferentRanges(b, ranges);
+  EXPECT_TRUE(ranges.empty());
+}
+
+TEST(MemoryTest, ConcreteDifferences) {
+  initContext();
+  MemoryObject *mo = new MemoryObject(0x1000, 100, false, false, false, 0);
+  ObjectState a(mo);
+  a.initializeToZero();
+  ObjectState b(a);
+
+  b.write8(3, 1);
+  b.write32(30, 0x01010101); // Crosses a mask word boundary
+  b.write8(99, 1);
+
+  ranges_ty ranges;
+  a.getDifferentRanges(b, ranges);
+  ASSERT_EQ(3U, ranges.size());
+  EXPECT_TRUE(std::make_pair(3U, 4U) == ranges[0]);
+  EXPECT_TRUE(std::make_pair(30U, 34U) == ranges[1]);
+  EXPECT_TRUE(std::make_pair(99U, 100U) == ranges[2]);
+}
+
+TEST(MemoryTest, SymbolicDifferences) {
+  initContext();
+  MemoryObject *mo = new MemoryObject(0x1000, 64, false, false, false, 0);
+  ObjectState a(mo);
+  a.initializeToZero();
+
+  Array *array = new Array("arr", 64);
+  ref<Expr> sym = Expr::createTempRead(array, 8);
+  a.write(10, sym);
+
+  ObjectState b(a);
+  b.write(40, sym);
+
+  ranges_ty ranges;
+  a.getDifferentRanges(b, ranges);
+  ASSERT_EQ(1U, ranges.size());
+  EXPECT_TRUE(std::make_pair(40U, 41U) == ranges[0]);
+
+  b.write8(10, 0);
+  ranges.clear();
+  a.getDifferentRanges(b, ranges);
+  ASSERT_EQ(2U, ranges.size());
+  EXPECT_TRUE(std::make_pair(10U, 11U) == ranges[0]);
+  EXPECT_EQ(countDifferentBytes(a, b), countRangeBytes(ranges));
+}
+
+TEST(MemoryTest, PageCopyOnWrite) {
+  initContext();
+  const unsigned size = 3 * ObjectPage::Size + 100;
+  MemoryObject *mo = new MemoryObject(0x1000, size, false, false, false, 0);
+  ObjectState a(mo);
+  a.initializeToZero();
+  a.write8(ObjectPage::Size + 1, 7);
+
+  ObjectState b(a);
+  b.write8(ObjectPage::Size + 1, 8);
+  b.write8(size - 1, 9);
+
+  // Writes to the copy leave the original alone
+  EXPECT_EQ(7U, a.read8c(ObjectPage::Size + 1));
+  EXPECT_EQ(0U, a.read8c(size - 1));
+  EXPECT_EQ(8U, b.read8c(ObjectPage::Size + 1));
+  EXPECT_EQ(9U, b.read8c(size - 1));
+
+  ranges_ty ranges;
+  a.getDifferentRanges(b, ranges);
+  ASSERT_EQ(2U, ranges.size());
+  EXPECT_TRUE(std::make_pair(ObjectPage::Size + 1, ObjectPage::Size + 2) ==
+              ranges[0]);
+  EXPECT_TRUE(std::make_pair(size - 1, size) == ranges[1]);
+
+  // So do symbolic writes, which flush the whole object
+  Array *array = new Array("arr", 64);
+  ref<Expr> index = ZExtExpr::create(Expr::createTempRead(array, 8),
+                                     Expr::Int32);
+  b.write(index, ConstantExpr::create(1, Expr::Int8));
+  EXPECT_EQ(0U, a.read8c(2 * ObjectPage::Size));
+  EXPECT_EQ(unsigned(-1), b.read8c(2 * ObjectPage::Size));
+}
+
+TEST(MemoryTest, SharedPagesSymbolicWrite) {
+  initContext();
+  const unsigned size = 2 * ObjectPage::Size + 100;
+  MemoryObject *mo = new MemoryObject(0x1000, size, false, false, false, 0);
+  ObjectState a(mo);
+  a.initializeToZero();
+
+  // Flush the object before the fork, so that the symbolic write to the
+  // copy only extends its update list and leaves the shared pages alone
+  Array *array = new Array("arr", 64);
+  ref<Expr> index = ZExtExpr::create(Expr::createTempRead(array, 8),
+                                     Expr::Int32);
+  a.write(index, ConstantExpr::create(1, Expr::Int8));
+
+  ObjectState b(a);
+  Array *otherArray = new Array("other", 64);
+  ref<Expr> otherIndex = ZExtExpr::create(Expr::createTempRead(otherArray, 8),
+                                          Expr::Int32);
+  b.write(otherIndex, ConstantExpr::create(2, Expr::Int8));
+
+  ranges_ty ranges;
+  a.getDifferentRanges(b, ranges);
+  EXPECT_EQ(size, countDifferentBytes(a, b));
+  EXPECT_EQ(countDifferentBytes(a, b), countRangeBytes(ranges));
+
+  // Merge the copy in the way the executor does, its write must survive
+  Array *condArray = new Array("cond", 1);
+  ref<Expr> inB = Expr::createIsZero(Expr::createTempRead(condArray, 8));
+  for (ranges_ty::const_iterator it = ranges.begin(), ie = ranges.end();
+       it != ie; ++it) {
+    for (unsigned i = it->first; i < it->second; ++i)
+      a.write(i, SelectExpr::create(inB, b.read8(i), a.read8(i)));
+  }
+
+  for (unsigned i = 0; i < size; i += ObjectPage::Size / 2) {
+    ref<Expr> merged = a.read8(i);
+    ASSERT_TRUE(isa<SelectExpr>(merged));
+    EXPECT_EQ(b.read8(i), cast<SelectExpr>(merged)->trueExpr);
+  }
+}
+
+TEST(MemoryTest, DiffBenchmark) {
+  initContext();
+  const unsigned size = 64 * 1024;
+  const unsigned rounds = 20;
+  MemoryObject *mo = new MemoryObject(0x1000, size, false, false, false, 0);
+  ObjectState a(mo);
+  a.initializeToZero();
+
+  Array *array = new Array("arr", 64);
+  for (unsigned i = 0; i < 64; i++)
+    a.write(i * 512, Expr::createTempRead(array, 8));
+
+  ObjectState b(a);
+  for (unsigned i = 0; i < size; i += 1024)
+    b.write64(i + 8, 0xdeadbeefcafebabeULL);
+
+  unsigned expected = 0;
+  WallTimer byteTimer;
+  for (unsigned r = 0; r < rounds; r++)
+    expected = countDifferentBytes(a, b);
+  uint64_t byteTime = byteTimer.check();
+
+  ranges_ty ranges;
+  WallTimer rangeTimer;
+  for (unsigned r = 0; r < rounds; r++) {
+    ranges.clear();
+    a.getDifferentRanges(b, ranges);
+  }
+  uint64_t rangeTime = rangeTimer.check();
+
+  EXPECT_EQ(expected, countRangeBytes(ranges));
+  EXPECT_EQ(size / 1024, ranges.size());
+
+  std::cerr << "Diffing " << size << " bytes: byte-wise "
+            << byteTime / rounds << "us, bulk "
+            << rangeTime / rounds << "us per object\n";
+}
+
+}
@@ -0,0 +1,200 @@
+//===-- SearcherTest.cpp --------------------------------------------------===//
+//
+//                     The KLEE Symbolic Virtual Machine
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include <iostream>
+#include "gtest/gtest.h"
+
+#include "klee/ExecutionState.h"
+#include "klee/Executor.h"
+#include "klee/Interpreter.h"
+#include "klee/Searcher.h"
+#include "klee/Internal/Support/Timer.h"
+
+#include <cstdlib>
+#include <map>
+#include <set>
+#include <vector>
+
+using namespace klee;
+
+namespace {
+
+class NullHandler : public InterpreterHandler {
+public:
+  std::ostream &getInfoStream() const { return std::cerr; }
+  std::string getOutputFilename(const std::string &filename) {
+    return "/dev/null";
+  }
+  std::ostream *openOutputFile(const std::string &filename) { return 0; }
+  void incPathsExplored() {}
+  void processTestCase(const ExecutionState &state, const char *err,
+                       const char *suffix) {}
+};
+
+Executor &getExecutor() {
+  static NullHandler handler;
+  static Interpreter *interpreter =
+    Interpreter::create(Interpreter::InterpreterOptions(), &handler);
+  return *static_cast<Executor*>(interpreter);
+}
+
+ExecutionState *createState(uint64_t symbolicsHash, uint64_t mergeIndex) {
+  ExecutionState *es = new ExecutionState(&getExecutor(),
+                                          std::vector<ref<Expr> >());
+  es->multiplicity = 1;
+  es->symbolicsHash = symbolicsHash;
+  es->interleavedMergeIndex = mergeIndex;
+  return es;
+}
+
+// Drives a searcher the way the executor does, over bare states that walk
+// a program of mergePoints merge indexes along one of paths paths. States
+// on the same path share their traces, so the lazy merging searcher keeps
+// fast-forwarding them. Every state has its own symbolics hash, so the
+// merge attempts are rejected by the fingerprint check without touching
+// the (empty) states. If \a checked is given, its fast-forward queue is
+// checked against a recount after every step. Returns the time per step, in
+// microseconds.
+double runSearcher(Searcher *searcher, unsigned liveStates, unsigned steps,
+                   LazyMergingSearcher *checked = 0) {
+  const unsigned paths = 4, mergePoints = 1000, forkInterval = 16;
+
+  std::vector<ExecutionState*> live;
+  std::map<ExecutionState*, unsigned> position;
+  std::set<ExecutionState*> added, removed;
+
+  srand(1);
+  for (unsigned i = 0; i < liveStates; ++i) {
+    unsigned pos = rand() % mergePoints;
+    ExecutionState *es = createState(live.size(), pos * paths + i % paths + 1);
+    position[es] = pos;
+    live.push_back(es);
+    added.insert(es);
+  }
+  searcher->update(0, added, removed);
+  added.clear();
+
+  uint64_t nextHash = live.size();
+  WallTimer timer;
+  for (unsigned step = 0; step < steps; ++step) {
+    ExecutionState *es = &searcher->selectState();
+
+    // Execute up to the next merge point
+    unsigned pos = position[es] = (position[es] + 1) % mergePoints;
+    unsigned path = (es->interleavedMergeIndex - 1) % paths;
+    es->interleavedMergeIndex = pos * paths + path + 1;
+
+    // Fork, and let some other state terminate to keep the count steady
+    if (step % forkInterval == 0) {
+      ExecutionState *forked = createState(nextHash++,
+                                           es->interleavedMergeIndex);
+      position[forked] = pos;
+      added.insert(forked);
+
+      unsigned victim = rand() % live.size();
+      if (live[victim] != es) {
+        removed.insert(live[victim]);
+        live[victim] = forked;
+      } else {
+        live.push_back(forked);
+      }
+    }
+
+    searcher->update(es, added, removed);
+    if (checked && !checked->checkForwardCandidates()) {
+      ADD_FAILURE() << "fast-forward queue out of date at step " << step;
+      checked = 0;
+    }
+
+    for (std::set<ExecutionState*>::iterator it = removed.begin(),
+           ie = removed.end(); it != ie; ++it) {
+      position.erase(*it);
+      delete *it;
+    }
+    added.clear();
+    removed.clear();
+  }
+  double time = (double) timer.check() / steps;
+
+  searcher->update(0, added, std::set<ExecutionState*>(live.begin(),
+                                                       live.end()));
+  for (unsigned i = 0; i < live.size(); ++i)
+    delete live[i];
+
+  return time;
+}
+
+std::set<ExecutionState*> single(ExecutionState *es) {
+  std::set<ExecutionState*> result;
+  result.insert(es);
+  return result;
+}
+
+TEST(SearcherTest, WorkStealing) {
+  WorkStealingSearcher searcher(getExecutor(), 2, false,
+                                WeightedRandomSearcher::Depth);
+  std::set<ExecutionState*> none, selected;
+
+  // Forks stay in the shard of their parent, new states go to the other
+  ExecutionState *a = createState(0, 0), *forked = createState(1, 0);
+  ExecutionState *b = createState(2, 0);
+  searcher.update(0, single(a), none);
+  searcher.update(a, single(forked), none);
+  searcher.update(0, single(b), none);
+
+  // The shards take turns, each at its newest state
+  selected.insert(&searcher.selectState());
+  selected.insert(&searcher.selectState());
+  EXPECT_EQ(2U, selected.size());
+  EXPECT_TRUE(selected.count(forked) && selected.count(b));
+
+  // Once the current state of a shard is gone, the shard steals the
+  // oldest state of the other one, which keeps its last
+  searcher.update(b, none, single(b));
+  delete b;
+  selected.clear();
+  selected.insert(&searcher.selectState());
+  selected.insert(&searcher.selectState());
+  EXPECT_EQ(2U, selected.size());
+  EXPECT_TRUE(selected.count(a) && selected.count(forked));
+
+  std::set<ExecutionState*> rest;
+  rest.insert(a);
+  rest.insert(forked);
+  searcher.update(0, none, rest);
+  EXPECT_TRUE(searcher.empty());
+  delete a;
+  delete forked;
+}
+
+TEST(SearcherTest, LazyMergingForwardQueue) {
+  LazyMergingSearcher *lazy =
+    new LazyMergingSearcher(getExecutor(), new DFSSearcher());
+  runSearcher(lazy, 1000, 20000, lazy);
+  delete lazy;
+}
+
+// Only run on request (--gtest_also_run_disabled_tests), it checks nothing
+TEST(SearcherTest, DISABLED_LazyMergingBenchmark) {
+  const unsigned liveStates = 10000, steps = 200000;
+
+  DFSSearcher base;
+  double baseTime = runSearcher(&base, liveStates, steps);
+
+  LazyMergingSearcher *lazy =
+    new LazyMergingSearcher(getExecutor(), new DFSSearcher());
+  double lazyTime = runSearcher(lazy, liveStates, steps);
+  delete lazy;
+
+  std::cerr << "Searcher overhead with " << liveStates << " live states: "
+            << "DFS " << baseTime << "us, lazy merging over DFS "
+            << lazyTime << "us per instruction\n";
+}
+
+}
@@ -0,0 +1,165 @@
+//===-- SnapshotTest.cpp --------------------------------------------------===//
+//
+//                     The KLEE Symbolic Virtual Machine
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include <iostream>
+#include "gtest/gtest.h"
+
+#include "klee/ExecutionState.h"
+#include "klee/Executor.h"
+#include "klee/Interpreter.h"
+#include "klee/Solver.h"
+#include "../../lib/Core/Memory.h"
+
+#include <deque>
+#include <pthread.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace klee;
+
+namespace {
+
+class NullHandler : public InterpreterHandler {
+public:
+  std::ostream &getInfoStream() const { return std::cerr; }
+  std::string getOutputFilename(const std::string &filename) {
+    return "/dev/null";
+  }
+  std::ostream *openOutputFile(const std::string &filename) { return 0; }
+  void incPathsExplored() {}
+  void processTestCase(const ExecutionState &state, const char *err,
+                       const char *suffix) {}
+};
+
+typedef std::vector< std::pair<std::string,
+                               std::vector<unsigned char> > > solution_ty;
+
+/// Solves snapshots on a thread of its own, as the test case emission
+/// threads do.
+struct Emitter {
+  Executor *executor;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  std::deque<SymbolicSnapshot*> pending;
+  bool done;
+
+  std::vector<bool> successes;
+  std::vector<solution_ty> solutions;
+
+  static void *run(void *arg) {
+    Emitter *emitter = static_cast<Emitter*>(arg);
+    for (;;) {
+      pthread_mutex_lock(&emitter->lock);
+      while (emitter->pending.empty() && !emitter->done)
+        pthread_cond_wait(&emitter->cond, &emitter->lock);
+      if (emitter->pending.empty()) {
+        pthread_mutex_unlock(&emitter->lock);
+        return 0;
+      }
+      SymbolicSnapshot *snapshot = emitter->pending.front();
+      emitter->pending.pop_front();
+      pthread_mutex_unlock(&emitter->lock);
+
+      solution_ty solution;
+      bool success = emitter->executor->getSymbolicSolution(*snapshot,
+                                                            solution);
+      delete snapshot;
+
+      emitter->successes.push_back(success);
+      emitter->solutions.push_back(solution);
+    }
+  }
+};
+
+TEST(SnapshotTest, EmitWhileForking) {
+  const unsigned forks = 100, bound = 200;
+
+  bool savedAtomic = RefCountPolicy::atomic;
+  RefCountPolicy::atomic = true;
+
+  NullHandler handler;
+  Executor *executor = static_cast<Executor*>(
+    Interpreter::create(Interpreter::InterpreterOptions(), &handler));
+
+  ExecutionState *state = new ExecutionState(executor,
+                                             std::vector<ref<Expr> >());
+  MemoryObject *mo = new MemoryObject(0x1000, 1, false, false, false, 0);
+  mo->name = "input";
+  Array *array = new Array("input", 1);
+  state->addSymbolic(mo, array);
+  ref<Expr> input = Expr::createTempRead(array, 8);
+  state->addConstraint(UltExpr::create(input,
+                                       klee::ConstantExpr::alloc(bound, 8)));
+
+  // Only builds up the independence index of the queried constraints
+  Solver *solver = createIndependentSolver(createDummySolver());
+
+  Emitter emitter;
+  emitter.executor = executor;
+  pthread_mutex_init(&emitter.lock, 0);
+  pthread_cond_init(&emitter.cond, 0);
+  emitter.done = false;
+  pthread_t thread;
+  ASSERT_EQ(0, pthread_create(&thread, 0, &Emitter::run, &emitter));
+
+  std::vector<ConstraintManager*> siblings;
+  for (unsigned i = 0; i < forks; ++i) {
+    state->addConstraint(UgtExpr::create(input,
+                                         klee::ConstantExpr::alloc(i, 8)));
+
+    bool result;
+    solver->mayBeTrue(Query(state->constraints(), input), result);
+
+    SymbolicSnapshot *snapshot = new SymbolicSnapshot();
+    executor->getSymbolicSnapshot(*state, *snapshot);
+    size_t covered;
+    EXPECT_TRUE(snapshot->constraints.getSolverCache(covered) == 0);
+
+    pthread_mutex_lock(&emitter.lock);
+    emitter.pending.push_back(snapshot);
+    pthread_cond_signal(&emitter.cond);
+    pthread_mutex_unlock(&emitter.lock);
+
+    // Fork, and keep extending both sides while the snapshot is solved
+    ConstraintManager *sibling = new ConstraintManager(state->constraints());
+    sibling->addConstraint(
+      UleExpr::create(input, klee::ConstantExpr::alloc(bound - 1, 8)));
+    solver->mayBeTrue(Query(*sibling, input), result);
+    siblings.push_back(sibling);
+  }
+
+  pthread_mutex_lock(&emitter.lock);
+  emitter.done = true;
+  pthread_cond_signal(&emitter.cond);
+  pthread_mutex_unlock(&emitter.lock);
+  pthread_join(thread, 0);
+
+  ASSERT_EQ(forks, emitter.solutions.size());
+  for (unsigned i = 0; i < forks; ++i) {
+    ASSERT_TRUE(emitter.successes[i]);
+    ASSERT_EQ(1U, emitter.solutions[i].size());
+    EXPECT_EQ("input", emitter.solutions[i][0].first);
+    ASSERT_EQ(1U, emitter.solutions[i][0].second.size());
+    unsigned value = emitter.solutions[i][0].second[0];
+    EXPECT_GT(value, i);
+    EXPECT_LT(value, bound);
+  }
+
+  for (unsigned i = 0; i < siblings.size(); ++i)
+    delete siblings[i];
+  delete solver;
+  delete state;
+  pthread_cond_destroy(&emitter.cond);
+  pthread_mutex_destroy(&emitter.lock);
+
+  RefCountPolicy::atomic = savedAtomic;
+}
+
+}
@@ -0,0 +1,145 @@
+//===-- SpillTest.cpp -----------------------------------------------------===//
+//
+//                     The KLEE Symbolic Virtual Machine
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include <iostream>
+#include "gtest/gtest.h"
+
+#include "klee/ExecutionState.h"
+#include "klee/Executor.h"
+#include "klee/Interpreter.h"
+#include "klee/Internal/Support/MemoryAccounting.h"
+#include "../../lib/Core/AddressSpace.h"
+#include "../../lib/Core/Memory.h"
+#include "../../lib/Core/StateSerializer.h"
+#include "../../lib/Core/StateSpiller.h"
+
+#include <cstdlib>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+using namespace klee;
+
+namespace {
+
+class NullHandler : public InterpreterHandler {
+public:
+  std::ostream &getInfoStream() const { return std::cerr; }
+  std::string getOutputFilename(const std::string &filename) {
+    return "/dev/null";
+  }
+  std::ostream *openOutputFile(const std::string &filename) { return 0; }
+  void incPathsExplored() {}
+  void processTestCase(const ExecutionState &state, const char *err,
+                       const char *suffix) {}
+};
+
+std::vector< ref<Expr> > getConstraints(const ExecutionState &state) {
+  return std::vector< ref<Expr> >(state.constraints().begin(),
+                                  state.constraints().end());
+}
+
+TEST(SpillTest, RestoreBatch) {
+  NullHandler handler;
+  Executor *executor = static_cast<Executor*>(
+    Interpreter::create(Interpreter::InterpreterOptions(), &handler));
+
+  ExecutionState *first = new ExecutionState(executor,
+                                             std::vector<ref<Expr> >());
+  const unsigned size = 4 * ObjectPage::Size;
+  MemoryObject *concrete = new MemoryObject(0x10000, size, false, false,
+                                            false, 0);
+  ObjectState *os = new ObjectState(concrete);
+  os->initializeToZero();
+  first->addressSpace().bindObject(concrete, os);
+
+  MemoryObject *symbolic = new MemoryObject(0x20000, 8, false, false, false,
+                                            0);
+  Array *array = new Array("input", 8);
+  first->addressSpace().bindObject(symbolic, new ObjectState(symbolic, array));
+  ref<Expr> input = Expr::createTempRead(array, 8);
+  first->addConstraint(UltExpr::create(input,
+                                       klee::ConstantExpr::alloc(100, 8)));
+
+  // The second state shares all but one page with the first one, and the
+  // third, which stays in memory, shares the rest
+  ExecutionState *second = first->branch();
+  ExecutionState *third = first->branch();
+  second->addConstraint(UgtExpr::create(input,
+                                        klee::ConstantExpr::alloc(10, 8)));
+  AddressSpace &secondSpace = second->addressSpace();
+  secondSpace.getWriteable(concrete, secondSpace.findObject(concrete))
+    ->write8(ObjectPage::Size, 2);
+  AddressSpace &thirdSpace = third->addressSpace();
+  thirdSpace.getWriteable(concrete, thirdSpace.findObject(concrete))
+    ->write8(0, 3);
+
+  std::vector< ref<Expr> > firstConstraints = getConstraints(*first);
+  std::vector< ref<Expr> > secondConstraints = getConstraints(*second);
+  const ObjectState *sharedSymbolic =
+    third->addressSpace().findObject(symbolic);
+  uint64_t objectBytes =
+    MemoryAccounting::getBytes(MemoryAccounting::ObjectStates);
+
+  char path[] = "/tmp/klee-spill-test.XXXXXX";
+  int fd = mkstemp(path);
+  ASSERT_GE(fd, 0);
+  close(fd);
+
+  StateSerializer serializer(*executor);
+  StateSpiller spiller(serializer, path);
+  std::vector<ExecutionState*> batch;
+  batch.push_back(first);
+  batch.push_back(second);
+  ASSERT_TRUE(spiller.spill(batch, 2));
+  EXPECT_EQ(2U, spiller.getNumSpilled());
+  EXPECT_TRUE(first->spilled && second->spilled && !third->spilled);
+  EXPECT_TRUE(first->addressSpace().findObject(concrete) == 0);
+  EXPECT_EQ(0U, second->constraints().size());
+  EXPECT_LT(MemoryAccounting::getBytes(MemoryAccounting::ObjectStates),
+            objectBytes);
+
+  // Restoring one state brings back its whole batch
+  spiller.restore(*second);
+  EXPECT_EQ(0U, spiller.getNumSpilled());
+  EXPECT_FALSE(first->spilled || second->spilled);
+  EXPECT_TRUE(firstConstraints == getConstraints(*first));
+  EXPECT_TRUE(secondConstraints == getConstraints(*second));
+
+  // The objects are bound at the same addresses
+  ObjectPair op;
+  ASSERT_TRUE(first->addressSpace().resolveOne(
+    klee::ConstantExpr::alloc(0x10000 + ObjectPage::Size, Expr::Int64), op));
+  EXPECT_EQ((const MemoryObject*) concrete, op.first);
+  ASSERT_TRUE(second->addressSpace().resolveOne(
+    klee::ConstantExpr::alloc(0x20000 + 4, Expr::Int64), op));
+  EXPECT_EQ((const MemoryObject*) symbolic, op.first);
+
+  const ObjectState *firstOS = first->addressSpace().findObject(concrete);
+  const ObjectState *secondOS = second->addressSpace().findObject(concrete);
+  ASSERT_TRUE(firstOS != 0 && secondOS != 0);
+  EXPECT_EQ(0U, firstOS->read8c(0));
+  EXPECT_EQ(0U, firstOS->read8c(ObjectPage::Size));
+  EXPECT_EQ(2U, secondOS->read8c(ObjectPage::Size));
+  EXPECT_EQ(input, second->addressSpace().findObject(symbolic)->read8(0));
+
+  // What the batch shared is shared again, and what it shared with the
+  // third state was kept, so no page is duplicated
+  EXPECT_EQ(objectBytes,
+            MemoryAccounting::getBytes(MemoryAccounting::ObjectStates));
+  EXPECT_EQ(sharedSymbolic, first->addressSpace().findObject(symbolic));
+  EXPECT_EQ(sharedSymbolic, second->addressSpace().findObject(symbolic));
+  EXPECT_EQ(3U, third->addressSpace().findObject(concrete)->read8c(0));
+
+  delete first;
+  delete second;
+  delete third;
+}
+
+}
@@ -0,0 +1,160 @@
+//===-- StateSerializerTest.cpp -------------------------------------------===//
+//
+//                     The KLEE Symbolic Virtual Machine
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include <iostream>
+#include "gtest/gtest.h"
+
+#include "klee/ExecutionState.h"
+#include "klee/Executor.h"
+#include "klee/Interpreter.h"
+#include "klee/Internal/Module/Cell.h"
+#include "klee/Internal/Module/KModule.h"
+#include "cloud9/worker/KleeCommon.h"
+#include "../../lib/Core/AddressSpace.h"
+#include "../../lib/Core/Memory.h"
+#include "../../lib/Core/StateSerializer.h"
+
+#include "llvm/BasicBlock.h"
+#include "llvm/Constants.h"
+#include "llvm/DerivedTypes.h"
+#include "llvm/Function.h"
+#include "llvm/Instructions.h"
+#include "llvm/LLVMContext.h"
+#include "llvm/Module.h"
+
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace klee;
+
+namespace {
+
+class NullHandler : public InterpreterHandler {
+public:
+  std::ostream &getInfoStream() const { return std::cerr; }
+  std::string getOutputFilename(const std::string &filename) {
+    return "/dev/null";
+  }
+  std::ostream *openOutputFile(const std::string &filename) { return 0; }
+  void incPathsExplored() {}
+  void processTestCase(const ExecutionState &state, const char *err,
+                       const char *suffix) {}
+};
+
+// Decoded expressions refer to copies of the arrays, which only compare
+// equal by name
+std::string toString(ref<Expr> e) {
+  std::ostringstream os;
+  e->print(os);
+  return os.str();
+}
+
+// An executor running a module that only has "int main() { return 0; }"
+Executor *createExecutor(InterpreterHandler *handler) {
+  llvm::LLVMContext &context = llvm::getGlobalContext();
+  llvm::Module *module = new llvm::Module("serializer-test", context);
+  const llvm::Type *i32 = llvm::Type::getInt32Ty(context);
+  llvm::Function *main =
+    llvm::Function::Create(llvm::FunctionType::get(i32, false),
+                           llvm::GlobalValue::ExternalLinkage, "main",
+                           module);
+  llvm::BasicBlock *entry = llvm::BasicBlock::Create(context, "entry", main);
+  llvm::ReturnInst::Create(context, llvm::ConstantInt::get(i32, 0), entry);
+
+  Executor *executor = static_cast<Executor*>(
+    Interpreter::create(Interpreter::InterpreterOptions(), handler));
+  executor->setModule(module, Interpreter::ModuleOptions(getKleeLibraryPath(),
+                                                         false, false));
+  return executor;
+}
+
+TEST(StateSerializerTest, RoundTrip) {
+  NullHandler handler;
+  Executor *executor = createExecutor(&handler);
+  KModule *kmodule = executor->getModule();
+  KFunction *kf = kmodule->functionMap[kmodule->module->getFunction("main")];
+  ASSERT_TRUE(kf != 0);
+  ASSERT_LT(0U, kf->numRegisters);
+
+  ExecutionState *state = new ExecutionState(executor, kf);
+
+  MemoryObject *input = new MemoryObject(0x10000, 4, false, false, false, 0);
+  input->name = "input";
+  Array *array = new Array("input", 4);
+  state->addressSpace().bindObject(input, new ObjectState(input, array));
+  state->addSymbolic(input, array);
+
+  MemoryObject *buffer = new MemoryObject(0x20000, 2 * ObjectPage::Size,
+                                          false, false, false, 0);
+  ObjectState *os = new ObjectState(buffer);
+  os->initializeToZero();
+  os->write8(ObjectPage::Size + 1, 42);
+  ref<Expr> byte = Expr::createTempRead(array, 8);
+  os->write(ObjectPage::Size + 2, byte);
+  state->addressSpace().bindObject(buffer, os);
+
+  state->addConstraint(UltExpr::create(byte,
+                                       klee::ConstantExpr::alloc(10, 8)));
+  state->stack().back().locals[kf->numRegisters - 1].value =
+    AddExpr::create(byte, klee::ConstantExpr::alloc(1, 8));
+
+  StateSerializer serializer(*executor);
+  std::vector<ExecutionState*> states(1, state);
+  std::string data;
+  ASSERT_TRUE(serializer.encode(states, data));
+
+  StateSerializer receiver(*executor);
+  std::vector<ExecutionState*> decoded;
+  ASSERT_TRUE(receiver.decode(data, decoded));
+  ASSERT_EQ(1U, decoded.size());
+  ExecutionState *copy = decoded[0];
+
+  // The stack
+  ASSERT_EQ(1U, copy->stack().size());
+  EXPECT_EQ(kf, copy->stack().back().kf);
+  EXPECT_TRUE(copy->pc() == state->pc());
+  ref<Expr> local = copy->stack().back().locals[kf->numRegisters - 1].value;
+  ASSERT_FALSE(local.isNull());
+  EXPECT_EQ(toString(state->stack().back().locals[kf->numRegisters - 1].value),
+            toString(local));
+
+  // The constraints
+  ASSERT_EQ(1U, copy->constraints().size());
+  EXPECT_EQ(toString(*state->constraints().begin()),
+            toString(*copy->constraints().begin()));
+
+  // The symbolics, bound in the address space
+  ASSERT_EQ(1U, copy->symbolics.size());
+  const MemoryObject *copyInput = copy->symbolics[0].first.get();
+  const Array *copyArray = copy->symbolics[0].second;
+  EXPECT_EQ(input->address, copyInput->address);
+  EXPECT_EQ(input->size, copyInput->size);
+  EXPECT_EQ("input", copyInput->name);
+  EXPECT_EQ(array->name, copyArray->name);
+  EXPECT_EQ(array->size, copyArray->size);
+  ASSERT_TRUE(copy->addressSpace().findObject(copyInput) != 0);
+
+  // The address space
+  ObjectPair op;
+  ASSERT_TRUE(copy->addressSpace().resolveOne(
+    klee::ConstantExpr::alloc(0x20000 + ObjectPage::Size, Expr::Int64), op));
+  EXPECT_EQ(buffer->address, op.first->address);
+  EXPECT_EQ(buffer->size, op.first->size);
+  EXPECT_EQ(0U, op.second->read8c(0));
+  EXPECT_EQ(42U, op.second->read8c(ObjectPage::Size + 1));
+  EXPECT_EQ(toString(byte), toString(op.second->read8(ObjectPage::Size + 2)));
+  ref<Expr> read = copy->addressSpace().findObject(copyInput)->read8(0);
+  EXPECT_EQ(copyArray, cast<ReadExpr>(read)->updates.root);
+
+  delete copy;
+  delete state;
+}
+
+}
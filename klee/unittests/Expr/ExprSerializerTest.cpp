@@ -0,0 +1,114 @@
+//===-- ExprSerializerTest.cpp --------------------------------------------===//
+//
+//                     The KLEE Symbolic Virtual Machine
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "gtest/gtest.h"
+
+#include "klee/Expr.h"
+#include "klee/util/ExprSerializer.h"
+
+using namespace klee;
+
+namespace {
+
+TEST(ExprSerializerTest, RoundTrip) {
+  Array *array = new Array("arr", 16);
+  UpdateList ul(array, 0);
+  ul.extend(ConstantExpr::alloc(3, Expr::Int32), ConstantExpr::alloc(7, 8));
+  ref<Expr> read = ReadExpr::create(ul, ConstantExpr::alloc(1, Expr::Int32));
+  ref<Expr> sum = AddExpr::create(ZExtExpr::create(read, Expr::Int32),
+                                  ConstantExpr::alloc(0x12345678,
+                                                      Expr::Int32));
+  ref<Expr> cond = UltExpr::create(sum, ExtractExpr::create(
+      ConcatExpr::create(sum, sum), 16, Expr::Int32));
+
+  SerialWriter out;
+  ExprEncoder encoder(out);
+  uint32_t sumID = encoder.encode(sum);
+  uint32_t condID = encoder.encode(cond);
+  // Shared nodes are only written once
+  EXPECT_EQ(sumID, encoder.encode(sum));
+  encoder.finish();
+
+  std::map<uint64_t, const Array*> knownArrays;
+  knownArrays[(uintptr_t) array] = array;
+
+  SerialReader in(&out.data[0], out.data.size());
+  ExprDecoder decoder(in, knownArrays);
+  ASSERT_TRUE(decoder.decodeRecords());
+  EXPECT_EQ(0U, in.remaining());
+
+  EXPECT_EQ(sum, decoder.getExpr(sumID));
+  EXPECT_EQ(cond, decoder.getExpr(condID));
+  EXPECT_TRUE(decoder.getExpr(ExprEncoder::NoRecord).isNull());
+}
+
+TEST(ExprSerializerTest, NewArrays) {
+  Array *array = new Array("arr", 4);
+  ref<Expr> read = Expr::createTempRead(array, Expr::Int32);
+
+  SerialWriter out;
+  ExprEncoder encoder(out);
+  uint32_t id = encoder.encode(read);
+  encoder.finish();
+
+  std::map<uint64_t, const Array*> knownArrays;
+  SerialReader in(&out.data[0], out.data.size());
+  ExprDecoder decoder(in, knownArrays);
+  ASSERT_TRUE(decoder.decodeRecords());
+
+  // The decoder creates its own array and remembers it for later tables
+  ref<Expr> decoded = decoder.getExpr(id);
+  ASSERT_FALSE(decoded.isNull());
+  EXPECT_EQ(1U, knownArrays.size());
+  const Array *copy = knownArrays[(uintptr_t) array];
+  ASSERT_TRUE(copy != 0);
+  EXPECT_NE((const Array*) array, copy);
+  EXPECT_EQ(array->name, copy->name);
+  EXPECT_EQ(array->size, copy->size);
+}
+
+TEST(ExprSerializerTest, MismatchedArray) {
+  Array *array = new Array("arr", 4);
+  ref<Expr> read = Expr::createTempRead(array, Expr::Int32);
+
+  SerialWriter out;
+  ExprEncoder encoder(out);
+  encoder.encode(read);
+  encoder.finish();
+
+  // Another array was known at the same address, it stays bound to it
+  Array *other = new Array("other", 8);
+  std::map<uint64_t, const Array*> knownArrays;
+  knownArrays[(uintptr_t) array] = other;
+
+  SerialReader in(&out.data[0], out.data.size());
+  ExprDecoder decoder(in, knownArrays);
+  EXPECT_FALSE(decoder.decodeRecords());
+  EXPECT_EQ(1U, knownArrays.size());
+  EXPECT_EQ((const Array*) other, knownArrays[(uintptr_t) array]);
+}
+
+TEST(ExprSerializerTest, Truncated) {
+  ref<Expr> e = AddExpr::create(Expr::createTempRead(new Array("arr", 4),
+                                                     Expr::Int32),
+                                ConstantExpr::alloc(1, Expr::Int32));
+
+  SerialWriter out;
+  ExprEncoder encoder(out);
+  encoder.encode(e);
+  encoder.finish();
+
+  std::map<uint64_t, const Array*> knownArrays;
+  SerialReader in(&out.data[0], out.data.size() - 1);
+  ExprDecoder decoder(in, knownArrays);
+  EXPECT_FALSE(decoder.decodeRecords());
+  EXPECT_TRUE(in.error());
+}
+
+}
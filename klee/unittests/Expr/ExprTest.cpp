@@ -110,4 +110,28 @@ TEST(ExprTest, ExtractConcat) {
   EXPECT_EQ(Expr::Extract, concat2->getKid(1)->getKind());
 }
 
+TEST(ExprTest, HashConsing) {
+  Expr::hashConsing = true;
+  {
+    Array *array = new Array("arr4", 256);
+    ref<Expr> read32 = Expr::createTempRead(array, 32);
+    ref<Expr> c7 = getConstant(7, 32);
+
+    ref<Expr> add1 = AddExpr::create(read32, c7);
+    ref<Expr> add2 = AddExpr::create(Expr::createTempRead(array, 32),
+                                     getConstant(7, 32));
+    EXPECT_EQ(add1.get(), add2.get());
+
+    ref<Expr> sel1 = SelectExpr::create(EqExpr::create(read32, c7),
+                                        add1, read32);
+    ref<Expr> sel2 = SelectExpr::create(EqExpr::create(read32, c7),
+                                        add2, read32);
+    EXPECT_EQ(sel1.get(), sel2.get());
+
+    ref<Expr> sub = SubExpr::create(read32, c7);
+    EXPECT_NE(add1.get(), sub.get());
+  }
+  Expr::hashConsing = false;
+}
+
 }
@@ -0,0 +1,92 @@
+//===-- RefTest.cpp -------------------------------------------------------===//
+//
+//                     The KLEE Symbolic Virtual Machine
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include <iostream>
+#include "gtest/gtest.h"
+
+#include "klee/Expr.h"
+#include "klee/Internal/Support/Timer.h"
+
+#include <vector>
+
+using namespace klee;
+
+namespace {
+
+// Pass by value, as the interpreter does with most expressions
+unsigned touch(ref<Expr> e, unsigned depth) {
+  return depth ? touch(e, depth - 1) : e->getWidth();
+}
+
+uint64_t copyRefs(const ref<Expr> &e, unsigned rounds) {
+  WallTimer timer;
+  unsigned total = 0;
+  for (unsigned i = 0; i < rounds; i++) {
+    std::vector< ref<Expr> > copies(16, e);
+    total += touch(copies[i % 16], 8);
+  }
+  EXPECT_EQ(rounds * e->getWidth(), total);
+  return timer.check();
+}
+
+class RefCountTest : public ::testing::Test {
+protected:
+  bool savedAtomic;
+
+  virtual void SetUp() { savedAtomic = RefCountPolicy::atomic; }
+  virtual void TearDown() { RefCountPolicy::atomic = savedAtomic; }
+};
+
+TEST_F(RefCountTest, PlainCounts) {
+  RefCountPolicy::atomic = false;
+  ref<Expr> e = ConstantExpr::alloc(42, Expr::Int32);
+  EXPECT_EQ(1U, e->refCount);
+  {
+    ref<Expr> copy(e);
+    EXPECT_EQ(2U, e->refCount);
+  }
+  EXPECT_EQ(1U, e->refCount);
+}
+
+TEST_F(RefCountTest, AtomicCounts) {
+  RefCountPolicy::atomic = true;
+  ref<Expr> e = ConstantExpr::alloc(42, Expr::Int32);
+  EXPECT_EQ(1U, e->refCount);
+  {
+    ref<Expr> copy(e);
+    EXPECT_EQ(2U, e->refCount);
+  }
+  EXPECT_EQ(1U, e->refCount);
+}
+
+TEST_F(RefCountTest, SwitchPolicy) {
+  // Counts stay consistent across a policy change while single-threaded
+  RefCountPolicy::atomic = false;
+  ref<Expr> e = ConstantExpr::alloc(42, Expr::Int32);
+  ref<Expr> copy(e);
+  RefCountPolicy::atomic = true;
+  copy = ConstantExpr::alloc(7, Expr::Int32);
+  EXPECT_EQ(1U, e->refCount);
+}
+
+TEST_F(RefCountTest, CopyBenchmark) {
+  const unsigned rounds = 1000000;
+  Array *array = new Array("arr", 256);
+  ref<Expr> e = Expr::createTempRead(array, 32);
+
+  RefCountPolicy::atomic = false;
+  uint64_t plainTime = copyRefs(e, rounds);
+  RefCountPolicy::atomic = true;
+  uint64_t atomicTime = copyRefs(e, rounds);
+
+  std::cerr << "Copying refs " << rounds << " times: plain "
+            << plainTime << "us, atomic " << atomicTime << "us\n";
+}
+
+}
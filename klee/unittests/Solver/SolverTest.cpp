@@ -123,6 +123,43 @@ void testOpcode(Solver &solver, bool tryBool = true, bool tryZero = true,
   }
 }
 
+void testFactors(Solver &solver) {
+  // Two independent bytes of one array, and a second array
+  static uint64_t id = 0;
+  Array *a = new Array("factora" + llvm::utostr(++id), 2);
+  Array *b = new Array("factorb" + llvm::utostr(id), 1);
+  ref<Expr> a0 = ReadExpr::create(UpdateList(a, 0),
+                                  ConstantExpr::alloc(0, Expr::Int32));
+  ref<Expr> a1 = ReadExpr::create(UpdateList(a, 0),
+                                  ConstantExpr::alloc(1, Expr::Int32));
+  ref<Expr> b0 = ReadExpr::create(UpdateList(b, 0),
+                                  ConstantExpr::alloc(0, Expr::Int32));
+
+  ConstraintManager constraints;
+  constraints.addConstraint(EqExpr::create(a0, getConstant(3, Expr::Int8)));
+  constraints.addConstraint(EqExpr::create(a1, getConstant(4, Expr::Int8)));
+  constraints.addConstraint(UltExpr::create(getConstant(4, Expr::Int8), b0));
+
+  std::vector<const Array*> objects;
+  objects.push_back(a);
+  objects.push_back(b);
+  std::vector< std::vector<unsigned char> > values;
+  ASSERT_TRUE(solver.getInitialValues(Query(constraints,
+                                            ConstantExpr::alloc(0, Expr::Bool)),
+                                      objects, values));
+  EXPECT_EQ(3, values[0][0]);
+  EXPECT_EQ(4, values[0][1]);
+  EXPECT_LT(4, values[1][0]);
+
+  // One unsatisfiable factor makes the whole query unsatisfiable
+  ref<Expr> b0IsSmall = UltExpr::create(b0, getConstant(3, Expr::Int8));
+  bool isValid;
+  ASSERT_TRUE(solver.mustBeTrue(Query(constraints,
+                                      Expr::createIsZero(b0IsSmall)),
+                                isValid));
+  EXPECT_TRUE(isValid);
+}
+
 TEST(SolverTest, Evaluation) {
   STPSolver *stpSolver = new STPSolver(true); 
   Solver *solver = stpSolver;
@@ -163,4 +200,67 @@ TEST(SolverTest, Evaluation) {
   delete solver;
 }
 
+TEST(SolverTest, HLParallelEvaluation) {
+  Solver *solver = new STPSolver(true, false, false);
+  solver = createHLParallelSolver(solver, 2);
+
+  testOpcode<SelectExpr>(*solver);
+  testOpcode<AddExpr>(*solver);
+  testOpcode<EqExpr>(*solver);
+  testOpcode<UltExpr>(*solver);
+
+  delete solver;
+}
+
+TEST(SolverTest, IndependentFactors) {
+  Solver *solver = new STPSolver(true, false, false);
+  solver = createIndependentSolver(solver);
+
+  testFactors(*solver);
+
+  delete solver;
+}
+
+TEST(SolverTest, IndependentForkedConstraints) {
+  Solver *solver = new STPSolver(true, false, false);
+  solver = createIndependentSolver(solver);
+
+  Array *a = new Array("forka", 1);
+  Array *b = new Array("forkb", 1);
+  ref<Expr> a0 = ReadExpr::create(UpdateList(a, 0),
+                                  ConstantExpr::alloc(0, Expr::Int32));
+  ref<Expr> b0 = ReadExpr::create(UpdateList(b, 0),
+                                  ConstantExpr::alloc(0, Expr::Int32));
+  ref<Expr> bIsSmall = UltExpr::create(b0, getConstant(201, Expr::Int8));
+
+  ConstraintManager constraints;
+  constraints.addConstraint(UltExpr::create(a0, getConstant(3, Expr::Int8)));
+  constraints.addConstraint(UltExpr::create(getConstant(200, Expr::Int8), b0));
+
+  bool isValid;
+  ASSERT_TRUE(solver->mustBeTrue(Query(constraints, bIsSmall), isValid));
+  EXPECT_FALSE(isValid);
+
+  // Joining the factors in a copy makes its constraints unsatisfiable, the
+  // original keeps its factors
+  ConstraintManager forked(constraints);
+  forked.addConstraint(EqExpr::create(a0, b0));
+  ASSERT_TRUE(solver->mustBeTrue(Query(forked, bIsSmall), isValid));
+  EXPECT_TRUE(isValid);
+
+  ASSERT_TRUE(solver->mustBeTrue(Query(constraints, bIsSmall), isValid));
+  EXPECT_FALSE(isValid);
+
+  delete solver;
+}
+
+TEST(SolverTest, HLParallelFactors) {
+  Solver *solver = new STPSolver(true, false, false);
+  solver = createHLParallelSolver(solver, 2);
+
+  testFactors(*solver);
+
+  delete solver;
+}
+
 }